@@ -0,0 +1,84 @@
+/**
+ * Measure the signing throughput of a card key on one core: RSA private operations or P-256 signatures per second.
+ * The throughput is the one of the fastest batch of signatures, which isn't slowed down by the other processes.
+ * Batches are signed for MIN_SECONDS, and up to MAX_SECONDS while the throughput is below the minimum, so a busy host
+ * gets a chance to be idle.
+ *
+ * Usage: key_benchmark <key file> [minimum signatures per second]
+ * The exit status is 1 when the throughput is below the minimum.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "private_key.h"
+
+using namespace std;
+
+#define BATCH_SIGNATURES  5
+#define MIN_SECONDS       1
+#define MAX_SECONDS       10
+
+int main(int argc, char *argv[]) {
+  if ((argc != 2) && (argc != 3)) {
+    cerr << "usage: " << argv[0] << " <key file> [minimum signatures per second]" << endl;
+    return 1;
+  }
+  double minimum = (argc == 3) ? strtod(argv[2], nullptr) : 0;
+
+  PrivateKey key;
+  try {
+    key = PrivateKey::loadFile(argv[1]);
+  }
+  catch (exception &e) {
+    cerr << argv[1] << ": " << e.what() << endl;
+    return 1;
+  }
+
+  // The input of a signature is the output of the previous one, so the signatures can't be optimized away
+  unsigned char input[512];
+  unsigned char output[512];
+  memset(input, 0x5A, sizeof(input));
+  input[0] = 0;
+  unsigned char r[P256PrivateKey::SIZE];
+  unsigned char s[P256PrivateKey::SIZE];
+
+  long long batches = 0;
+  long long best = MAX_SECONDS * 1000000000LL;
+  long long total = 0;
+  while ((total < MIN_SECONDS * 1000000000LL) ||
+         ((BATCH_SIGNATURES * 1e9 / best < minimum) && (total < MAX_SECONDS * 1000000000LL))) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < BATCH_SIGNATURES; i++) {
+      if (key.rsa) {
+        key.rsa->privateOperation(input, output);
+        memcpy(input + 1, output + 1, key.rsa->size() - 1);
+      }
+      else {
+        key.ecc->sign(input, P256PrivateKey::SIZE, r, s);
+        memcpy(input, s, P256PrivateKey::SIZE);
+      }
+    }
+    long long elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    best = (elapsed < best) ? elapsed : best;
+    total += elapsed;
+    batches++;
+  }
+
+  double throughput = BATCH_SIGNATURES * 1e9 / best;
+  double mean = batches * BATCH_SIGNATURES * 1e9 / total;
+  if (key.rsa) {
+    printf("RSA-%zu: ", key.rsa->bits());
+  }
+  else {
+    printf("P-256: ");
+  }
+  printf("%.0f signatures/s (%.0f/s on average over %lld signatures)\n", throughput, mean, batches * BATCH_SIGNATURES);
+  if (throughput < minimum) {
+    cerr << argv[1] << ": " << throughput << " signatures/s, below the minimum of " << minimum << endl;
+    return 1;
+  }
+  return 0;
+}
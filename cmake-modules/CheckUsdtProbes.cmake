@@ -0,0 +1,22 @@
+# Check that a binary holds the ELF notes of the USDT probes of the stub (see include/usdt_probes.h)
+#
+#   cmake -DREADELF=<readelf> -DBINARY=<library or executable> -P CheckUsdtProbes.cmake
+
+set(USDT_PROVIDER winscard_stub)
+set(USDT_PROBES call_entry call_return card_execute_entry card_execute_return)
+
+execute_process(COMMAND ${READELF} -n ${BINARY}
+        RESULT_VARIABLE READELF_RESULT
+        OUTPUT_VARIABLE NOTES
+        ERROR_VARIABLE READELF_ERROR)
+if(NOT READELF_RESULT EQUAL 0)
+    message(FATAL_ERROR "${READELF} -n ${BINARY} failed: ${READELF_ERROR}")
+endif()
+
+foreach(PROBE ${USDT_PROBES})
+    string(REGEX MATCH "Provider: ${USDT_PROVIDER}[ \t\r\n]+Name: ${PROBE}[ \t\r\n]" FOUND "${NOTES}")
+    if(NOT FOUND)
+        message(FATAL_ERROR "${BINARY} has no USDT note of the probe ${USDT_PROVIDER}:${PROBE}")
+    endif()
+endforeach()
+message(STATUS "${BINARY} has the USDT probes of ${USDT_PROVIDER}: ${USDT_PROBES}")
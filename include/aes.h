@@ -0,0 +1,90 @@
+/**
+ * AES block cipher, CBC mode and CMAC, used by the card applications which compute cryptograms and by the secure
+ * channels
+ */
+#ifndef AES_H
+#define AES_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * AES with an expanded key (128, 192 or 256 bits). The key is expanded once by the constructor, so an operation only
+ * costs the rounds; the object never allocates and can be kept in a card template or on the stack.
+ *
+ * The AES instructions of the processor (AES-NI) are used when the CPU has them, which is checked once per process,
+ * otherwise the rounds compute the S-box in GF(2^8) instead of looking it up, so that neither implementation indexes
+ * memory with the key or the data.
+ */
+class Aes {
+public:
+  static const size_t BLOCK_SIZE = 16;
+
+  /**
+   * @param key_lg 16, 24 or 32
+   * @param hardware use the AES instructions of the processor when it has them
+   * @throw invalid_argument for another key length
+   */
+  Aes(const unsigned char *key, size_t key_lg, bool hardware = true);
+
+  /**
+   * @return true when the processor has the AES instructions
+   */
+  static bool hardwareSupported();
+
+  /**
+   * @return true when this object uses the AES instructions
+   */
+  bool isHardware() const { return hardware; };
+
+  /**
+   * Encrypt one block, in and out may alias
+   */
+  void encrypt(const unsigned char *in, unsigned char *out) const;
+
+  /**
+   * Decrypt one block, in and out may alias
+   */
+  void decrypt(const unsigned char *in, unsigned char *out) const;
+
+  /**
+   * CBC encryption of complete blocks. The IV is replaced by the last ciphertext block, so the calls can be chained.
+   * in and out may alias.
+   */
+  void encryptCbc(unsigned char *iv, const unsigned char *in, unsigned char *out, size_t blocks) const;
+
+  /**
+   * CBC decryption of complete blocks. The IV is replaced by the last ciphertext block, so the calls can be chained.
+   * in and out may alias.
+   */
+  void decryptCbc(unsigned char *iv, const unsigned char *in, unsigned char *out, size_t blocks) const;
+
+  /**
+   * AES-CMAC (NIST SP 800-38B) of the data
+   * @param mac BLOCK_SIZE bytes
+   */
+  void cmac(const unsigned char *data, size_t data_lg, unsigned char *mac) const;
+
+  /**
+   * AES-CMAC of the concatenation of a prefix and of the data, without copying them
+   * @param mac BLOCK_SIZE bytes
+   */
+  void cmac(const unsigned char *prefix, size_t prefix_lg, const unsigned char *data, size_t data_lg,
+            unsigned char *mac) const;
+
+private:
+  /**
+   * CBC-MAC of complete blocks into the state
+   */
+  void chain(unsigned char *state, const unsigned char *data, size_t blocks) const;
+
+  // Round keys in byte order, the decryption keys are in reverse order with InvMixColumns applied (equivalent
+  // inverse cipher), which is the layout of both the software and the AES-NI implementations
+  unsigned char encryptionKeys[15 * BLOCK_SIZE];
+  unsigned char decryptionKeys[15 * BLOCK_SIZE];
+  unsigned char subkeys[2][BLOCK_SIZE];   // CMAC subkeys K1 and K2
+  unsigned int rounds;
+  bool hardware;
+};
+
+#endif //AES_H
@@ -0,0 +1,138 @@
+/**
+ * Recording of the calls of the PC/SC API in a binary trace file
+ */
+#ifndef APDU_TRACE_H
+#define APDU_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Functions of the PC/SC API in the trace records, followed by the functions of the stub
+ */
+enum class TraceFunction : uint16_t {
+  EstablishContext = 1,
+  ReleaseContext,
+  IsValidContext,
+  Connect,
+  Reconnect,
+  Disconnect,
+  BeginTransaction,
+  EndTransaction,
+  Status,
+  GetStatusChange,
+  Control,
+  Transmit,
+  ListReaderGroups,
+  ListReaders,
+  FreeMemory,
+  Cancel,
+  GetAttrib,
+  SetAttrib,
+  AttachReader,
+  AttachReaderWithLatency,
+  ConfigureReaderLatency,
+  GetReaderElapsedTime,
+  InsertSmartCardInReader,
+  RemoveSmartCardFromReader,
+  RegisterSmartCard,
+  ConfigureReaderT1,
+  GetReaderT1Counters,
+  GetCardManagerCounters,
+  ConfigureResponseCache,
+  GetResponseCacheCounters,
+  GetStats,
+  GetStatsBucketBound,
+  GetReaderStats,
+  StartMetricsPage,
+  StopMetricsPage,
+  DumpMetrics,
+  StartMetricsDumpOnSignal,
+  StopMetricsDumpOnSignal,
+  StartTrace,
+  StopTrace,
+  StartCapture,
+  StopCapture
+};
+
+/**
+ * Name of a function of the trace records, "unknown" for an unknown identifier
+ */
+const char *traceFunctionName(uint16_t function);
+
+/**
+ * Decoded record of a trace. The input and output reference the bytes of the trace.
+ */
+struct TraceRecord {
+  uint16_t function;          // TraceFunction
+  uint32_t thread;            // sequence number of the recording thread, from 1
+  uint64_t timestamp;         // nanoseconds between the start of the trace and the call
+  uint64_t duration;          // nanoseconds
+  uint64_t handle;            // context, or card handle for SCardConnect and the calls on a card
+  uint32_t result;            // return code
+  const unsigned char *input;     // command of SCardTransmit, sent bytes of SCardControl, reader of SCardConnect
+  size_t inputLg;
+  const unsigned char *output;    // response of SCardTransmit
+  size_t outputLg;
+};
+
+/**
+ * Append-only binary trace of the calls of the PC/SC API. A trace file is a sequence of sessions, one for each start
+ * of the recording, which are a header followed by the records of the calls. All the integers are little-endian.
+ *
+ *   header: "WSTRACE1" | start of the session (u64, nanoseconds since the Unix epoch)
+ *   record: length (u32, of the whole record) | function (u16) | flags (u16, 0) | thread (u32) | timestamp (u64) |
+ *           duration (u64) | handle (u64) | result (u32) | input length (u32) | input | output
+ *
+ * The records are written in the background by an AsyncFileWriter, so a call only pays for the encoding of its record
+ * and an uncontended lock.
+ */
+class ApduTrace {
+public:
+  static const size_t HEADER_SIZE = 16;
+  static const size_t RECORD_HEADER_SIZE = 44;
+
+  /**
+   * Start recording in a file, the session is appended to the records already in the file
+   * @throw logic_error when a trace is already recorded
+   * @throw runtime_error when the file can't be opened
+   */
+  static void start(const std::string &path);
+
+  /**
+   * Stop recording, write the records of all the threads and close the file. Nothing happens when no trace is recorded.
+   */
+  static void stop();
+
+  static bool recording();
+
+  /**
+   * Clock of the timestamps and durations, in nanoseconds
+   */
+  static uint64_t now();
+
+  /**
+   * Append a record to the buffer of the calling thread
+   * @param start clock at the beginning of the call
+   */
+  static void record(TraceFunction function, uint64_t start, uint64_t handle, long result,
+                     const unsigned char *input = nullptr, size_t input_lg = 0,
+                     const unsigned char *output = nullptr, size_t output_lg = 0);
+
+  /**
+   * Decode the header of a session
+   * @param start out: start of the session in nanoseconds since the Unix epoch
+   * @return false when the data isn't a header
+   */
+  static bool decodeHeader(const unsigned char *data, size_t data_lg, uint64_t *start);
+
+  /**
+   * Decode a record
+   * @param record_lg out: length of the record in the data
+   * @return false when the data doesn't hold a complete record
+   */
+  static bool decodeRecord(const unsigned char *data, size_t data_lg, TraceRecord *record, size_t *record_lg);
+};
+
+#endif //APDU_TRACE_H
@@ -0,0 +1,102 @@
+/**
+ * Append-only file written in the background from per-thread buffers
+ */
+#ifndef ASYNC_FILE_WRITER_H
+#define ASYNC_FILE_WRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Writer of the records of a file (trace, capture). The calling threads append the records to their own buffer, which a
+ * background thread swaps and writes to the file every 20 ms or when a buffer fills up, so a record only costs a copy
+ * and an uncontended lock. The buffer of a thread grows when the flusher doesn't keep up, no record is dropped.
+ *
+ * The records of a thread are written in order, the records of different threads are interleaved by batches.
+ */
+class AsyncFileWriter {
+public:
+  /**
+   * @throw logic_error when there are already MAX_WRITERS writers
+   */
+  AsyncFileWriter();
+
+  AsyncFileWriter(const AsyncFileWriter &other) = delete;
+
+  AsyncFileWriter &operator=(const AsyncFileWriter &other) = delete;
+
+  ~AsyncFileWriter();
+
+  /**
+   * Open the file in append mode and write its header
+   * @throw logic_error when the file is already open
+   * @throw runtime_error when the file can't be opened or written
+   */
+  void start(const std::string &path, const unsigned char *header, size_t header_lg);
+
+  /**
+   * Write the records of all the threads and close the file. Nothing happens when the file isn't open.
+   */
+  void stop();
+
+  bool active() const { return enabled.load(std::memory_order_relaxed); };
+
+  /**
+   * Append a record made of several parts to the buffer of the calling thread
+   * @return false when the file isn't open
+   */
+  bool append(const unsigned char *const *parts, const size_t *part_lgs, size_t part_count);
+
+  static const size_t MAX_WRITERS = 4;
+
+private:
+  /**
+   * Records of a thread. The thread appends to records, the flusher swaps them with its empty buffer and writes them
+   * outside of the lock, so the lock is only contended during the swap.
+   */
+  struct ThreadBuffer {
+    std::mutex lock;
+    std::vector<unsigned char> records;
+    std::vector<unsigned char> flushing;   // owned by the flusher
+    bool exited;
+  };
+
+  /**
+   * Buffers of a thread, one per writer, flagged when the thread exits so that the flusher releases them
+   */
+  struct ThreadRegistration {
+    ~ThreadRegistration();
+
+    std::shared_ptr<ThreadBuffer> buffers[MAX_WRITERS];
+  };
+
+  ThreadBuffer &threadBuffer();
+
+  void run();
+
+  void flush();
+
+  static std::atomic<size_t> writerCount;
+
+  size_t id;                         // index of the buffer of the writer in the thread registrations
+  std::atomic<bool> enabled;
+  std::mutex control;                // start and stop
+  std::mutex registry;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  std::vector<std::shared_ptr<ThreadBuffer>> snapshot;   // buffers of the current flush
+  FILE *file;
+  std::thread flusher;
+  std::mutex wake;
+  std::condition_variable signal;
+  bool stopping;
+  bool pending;                      // a buffer reached the flush threshold
+};
+
+#endif //ASYNC_FILE_WRITER_H
@@ -0,0 +1,160 @@
+/**
+ * Counters and latency histograms of the calls of the PC/SC API and of the APDUs of the readers
+ */
+#ifndef CALL_STATS_H
+#define CALL_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "apdu_trace.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CALL_STATS_TSC
+#endif
+
+/**
+ * Calls, errors and latencies of the functions of the PC/SC API and of the stub (SCardEstablishContext to
+ * SCardStopCapture), indexed by TraceFunction - 1. Each thread counts in its own cache-line aligned shard, without
+ * atomic read-modify-write, and the shards are merged by snapshot(), with the shards of the exited threads. The call
+ * is timed with the time stamp counter where there is one, converted to nanoseconds with a rate calibrated against the
+ * steady clock at the first call.
+ *
+ * The latency histogram is log-linear (HDR-style): the durations below SUB_BUCKETS nanoseconds have a bucket each,
+ * above, each power of 2 is split in SUB_BUCKETS buckets, so a bucket is within 1/SUB_BUCKETS of its values. The
+ * durations of 2^(MAX_MAGNITUDE + 1) nanoseconds and more are counted in the last bucket.
+ */
+class CallStats {
+public:
+  static const size_t FUNCTIONS = 42;
+  static const size_t SUB_BUCKETS = 16;
+  static const unsigned int MAX_MAGNITUDE = 36;
+  static const size_t BUCKETS = SUB_BUCKETS + (MAX_MAGNITUDE - 3) * SUB_BUCKETS;
+
+  struct FunctionStats {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t totalNanoseconds;
+    uint64_t maxNanoseconds;
+    uint64_t latency[BUCKETS];
+  };
+
+  /**
+   * Clock of the calls
+   */
+  static uint64_t ticks() {
+#ifdef CALL_STATS_TSC
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+  };
+
+  /**
+   * Count a call in the shard of the calling thread
+   * @param start ticks() at the beginning of the call
+   */
+  static void record(TraceFunction function, uint64_t start, bool error);
+
+  /**
+   * Merge the shards of all the threads
+   * @param stats FUNCTIONS entries
+   */
+  static void snapshot(FunctionStats *stats);
+
+  static size_t bucketOf(uint64_t nanoseconds);
+
+  /**
+   * Smallest duration of a bucket, in nanoseconds
+   */
+  static uint64_t bucketLowerBound(size_t bucket);
+};
+
+/**
+ * Delays from the events of the readers (attachment of a reader, insertion and removal of a card) to the return of the
+ * SCardGetStatusChange call which waited for them, in the buckets of CallStats. The event and the wakeup are on
+ * different threads, they are timed with the steady clock.
+ */
+class WakeupStats {
+public:
+  struct Counters {
+    uint64_t wakeups;
+    uint64_t totalNanoseconds;
+    uint64_t maxNanoseconds;
+    uint64_t latency[CallStats::BUCKETS];
+  };
+
+  /**
+   * Clock of the events, in nanoseconds
+   */
+  static uint64_t now();
+
+  /**
+   * Count the wakeup of a waiter
+   * @param raised now() when the event was raised
+   */
+  static void record(uint64_t raised);
+
+  static void snapshot(Counters *counters);
+};
+
+/**
+ * Counters of the APDUs exchanged with the card of a reader, updated by the threads which transmit to the card. The
+ * counters are padded to their own cache lines, away from the state of the reader. The counters register themselves in
+ * a list of all the readers, for the exports of the metrics.
+ */
+class ReaderStats {
+public:
+  struct Counters {
+    uint64_t apdus;
+    uint64_t errors;        // failures of the card or the transport
+    uint64_t bytesIn;       // commands
+    uint64_t bytesOut;      // responses, SW included
+    uint64_t sw1[256];      // responses by first status byte
+  };
+
+  ReaderStats();
+
+  ReaderStats(const ReaderStats &other) = delete;
+
+  ReaderStats &operator=(const ReaderStats &other) = delete;
+
+  ~ReaderStats();
+
+  /**
+   * Name of the reader in the snapshots of all the readers
+   */
+  void setName(const std::string &name);
+
+  /**
+   * Count an exchange
+   * @param status first status byte of the response, -1 when it isn't known (truncated response)
+   * @param error failure of the card or the transport, only counted with the APDUs
+   */
+  void record(size_t command_lg, size_t response_lg, int status, bool error);
+
+  void snapshot(Counters *counters) const;
+
+  /**
+   * Counters of all the readers which exist, by name, the readers of the same name (in different contexts) are summed.
+   * The readers only take the lock of the list when they are created and destroyed.
+   */
+  static void snapshotAll(std::vector<std::pair<std::string, Counters>> *readers);
+
+private:
+  char leading[64];
+  std::atomic<uint64_t> apdus;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> bytesIn;
+  std::atomic<uint64_t> bytesOut;
+  std::atomic<uint64_t> sw1[256];
+  char trailing[64];
+  std::string name;            // guarded by the lock of the list of the readers
+};
+
+#endif //CALL_STATS_H
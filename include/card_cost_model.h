@@ -0,0 +1,54 @@
+/**
+ * Processing time of a smartcard per instruction
+ */
+#ifndef CARD_COST_MODEL_H
+#define CARD_COST_MODEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#define COST_DEFAULT_INS     0x100
+
+/**
+ * Cost of an instruction: a fixed time, a time per data byte (command and response data) and a random jitter which
+ * is added uniformly between 0 and the maximum
+ */
+struct InstructionCost {
+  uint32_t fixedMicroseconds;
+  uint32_t perByteNanoseconds;
+  uint32_t jitterMicroseconds;
+};
+
+/**
+ * Cost of an instruction as defined in a card table
+ */
+struct InstructionCostEntry {
+  unsigned int ins;     // 0x00-0xFF or COST_DEFAULT_INS for all the instructions without entry
+  InstructionCost cost;
+};
+
+/**
+ * Cost model of a card with a direct lookup on INS. The model is immutable and can be shared by several cards.
+ */
+class CardCostModel {
+public:
+  /**
+   * @param entries costs per instruction, the instructions without entry cost nothing unless there is a default
+   * @param count number of entries
+   */
+  CardCostModel(const InstructionCostEntry *entries, size_t count);
+
+  /**
+   * Processing time of a command
+   * @param ins instruction of the command
+   * @param data_lg number of command and response data bytes
+   * @param random random value for the jitter
+   */
+  std::chrono::nanoseconds cost(unsigned char ins, size_t data_lg, uint32_t random) const;
+
+private:
+  InstructionCost costs[256];
+};
+
+#endif //CARD_COST_MODEL_H
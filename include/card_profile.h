@@ -0,0 +1,66 @@
+/**
+ * Built-in card profiles: card definitions compiled at build time into constexpr tables by card_profile_compiler
+ */
+#ifndef CARD_PROFILE_H
+#define CARD_PROFILE_H
+
+#include <cstddef>
+#include <cstring>
+#include "response_table.h"
+
+/**
+ * Card profile generated from a card table in the profiles directory
+ */
+struct CardProfile {
+  const char *name;
+  const unsigned char *atr;
+  size_t atrLg;
+  DWORD protocols;
+  ResponseTableView responses;
+  const InstructionCostEntry *costs;
+  size_t costCount;
+};
+
+/**
+ * Compare 2 names at compile time, like strcmp
+ */
+constexpr int compareProfileNames(const char *a, const char *b) {
+  return (*a != *b) ? ((static_cast<unsigned char>(*a) < static_cast<unsigned char>(*b)) ? -1 : 1)
+                    : ((*a == '\0') ? 0 : compareProfileNames(a + 1, b + 1));
+}
+
+/**
+ * Verify at compile time that the profiles are sorted on their name, which is needed by findCardProfile
+ */
+template <size_t N>
+constexpr bool cardProfilesSorted(const CardProfile (&profiles)[N], size_t index = 1) {
+  return (index >= N) ? true
+                      : ((compareProfileNames(profiles[index - 1].name, profiles[index].name) < 0) &&
+                         cardProfilesSorted(profiles, index + 1));
+}
+
+/**
+ * Binary search of a profile on its name
+ * @return the profile or nullptr when there is no profile with that name
+ */
+template <size_t N>
+const CardProfile *findCardProfile(const CardProfile (&profiles)[N], const char *name) {
+  size_t low = 0;
+  size_t high = N;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    int order = strcmp(profiles[middle].name, name);
+    if (order == 0) {
+      return &profiles[middle];
+    }
+    if (order < 0) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return nullptr;
+}
+
+#endif //CARD_PROFILE_H
@@ -0,0 +1,190 @@
+/**
+ * EMV contact payment card (EMV 4.3 Book 1 and 3) with AES application cryptograms
+ */
+#ifndef EMV_SMARTCARD_H
+#define EMV_SMARTCARD_H
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+#include "smartcard.h"
+#include "aes.h"
+
+/**
+ * Definition of a payment application of an EMV card
+ */
+struct EmvApplication {
+  std::vector<unsigned char> aid;
+  std::string label;
+  unsigned char priority;
+  std::vector<unsigned char> pdol;          // PDOL of the FCI, empty without PDOL
+  uint16_t aip;                             // application interchange profile
+  std::vector<unsigned char> afl;           // application file locator, 4 bytes per entry
+  std::vector<unsigned char> masterKey;     // ICC master key of the application cryptograms (AES)
+  std::vector<unsigned char> iad;           // issuer application data of GENERATE AC
+  uint16_t atc;                             // application transaction counter of a new card
+  std::map<uint16_t, std::vector<unsigned char>> records;   // SFI << 8 | record number -> contents of the tag 70
+};
+
+/**
+ * Immutable part of the EMV cards of the same name. Everything which doesn't depend on the transaction is encoded
+ * when the template is loaded: the FCI of the PSE (1PAY.SYS.DDF01), of the PPSE (2PAY.SYS.DDF01) and of the
+ * applications, the directory records, the records of the applications and the GET PROCESSING OPTIONS responses.
+ * The cards reference these responses without copy, only GENERATE AC computes its response.
+ *
+ * Definition file of an EMV card:
+ *
+ *   # comment
+ *   ATR 3B 6E 00 00 80 31 80 66 B0 84 0C 01 6E 01 83 00 90 00
+ *   PROTOCOL T0 T1
+ *   APPLICATION A0000000041010 DEBIT MASTERCARD
+ *   PRIORITY 1
+ *   PDOL 9F3501
+ *   AIP 1980
+ *   AFL 08010100 10010200
+ *   RECORD 1 1 5A0854133300896000135F24032512315F3401008C0F9F02069F03069F1A0295055F2A02
+ *   RECORD 2 1 8E0A00000000000000001F03
+ *   RECORD 2 2 9F0702FF00
+ *   KEY 2B7E151628AED2A6ABF7158809CF4F3C
+ *   IAD 0110A00003220000000000000000000000FF
+ *   ATC 0000
+ *   COST AE 25000
+ *
+ * APPLICATION starts the definition of an application with its AID and label, the following lines up to the next
+ * APPLICATION belong to it. RECORD has the SFI, the record number and the contents of the tag 70. The record with the
+ * CDOL1 (8C) and the CDOL2 (8D) sets the length of the data of GENERATE AC. KEY is the ICC master key of the
+ * application cryptograms (AES-128, 192 or 256). PROTOCOL is T0 T1 by default, COST lines are the same as in a card
+ * table.
+ */
+class EmvCardTemplate : public CardTemplate {
+public:
+  EmvCardTemplate(std::vector<unsigned char> atr, DWORD protocols, std::shared_ptr<const CardCostModel> costs = nullptr);
+
+  /**
+   * Parse the definition of an EMV card
+   * @throw invalid_argument when the definition is malformed
+   */
+  static std::shared_ptr<EmvCardTemplate> load(std::istream &in);
+
+  /**
+   * @throw runtime_error when the file can't be read
+   */
+  static std::shared_ptr<EmvCardTemplate> loadFile(const std::string &path);
+
+  /**
+   * Add an application and encode its responses, the directories of the PSE and the PPSE are updated
+   * @throw invalid_argument when the application is inconsistent (AFL without record, malformed DOL, ...)
+   */
+  void addApplication(const EmvApplication &application);
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  /**
+   * Application with the responses encoded once
+   */
+  struct Application {
+    explicit Application(const EmvApplication &definition);
+
+    std::vector<unsigned char> aid;
+    uint16_t aip;
+    uint16_t atc;
+    size_t pdolLg;                 // length of the data of GET PROCESSING OPTIONS
+    size_t cdol1Lg;
+    size_t cdol2Lg;
+    Aes masterKey;
+    std::vector<unsigned char> iad;
+    std::vector<unsigned char> fci;                   // SELECT response with SW
+    std::vector<unsigned char> processingOptions;     // GET PROCESSING OPTIONS response with SW
+    std::map<uint16_t, std::vector<unsigned char>> records;   // READ RECORD responses with SW
+  };
+
+  const std::vector<Application> &getApplications() const { return applications; };
+
+  /**
+   * Application which matches the DF name of a SELECT, also a partial DF name
+   * @param next index of the first application to consider (P2 next occurrence)
+   * @return index of the application or -1
+   */
+  int findApplication(const unsigned char *name, size_t name_lg, size_t next) const;
+
+  const std::vector<unsigned char> &getPseFci() const { return pseFci; };
+
+  const std::vector<unsigned char> &getPpseFci() const { return ppseFci; };
+
+  /**
+   * Record of the directory of the PSE (SFI 1)
+   * @return the READ RECORD response or nullptr
+   */
+  const std::vector<unsigned char> *directoryRecord(unsigned char record) const;
+
+private:
+  void encodeDirectories();
+
+  std::vector<Application> applications;
+  std::vector<std::vector<unsigned char>> directory;   // READ RECORD responses of the PSE directory
+  std::vector<unsigned char> directoryEntries;          // templates 61 of the applications
+  std::vector<unsigned char> pseFci;
+  std::vector<unsigned char> ppseFci;
+};
+
+/**
+ * EMV payment card: SELECT of the PSE, the PPSE and the applications, READ RECORD, GET PROCESSING OPTIONS, GET DATA
+ * of the ATC and GENERATE AC. The application cryptogram is the AES-CMAC, truncated to 8 bytes, of the CDOL data,
+ * the AIP, the ATC and the IAD with the session key of the EMV common session key derivation (AES of the ATC). The
+ * card returns the type of cryptogram requested by the terminal, a second GENERATE AC closes the transaction.
+ * The ATC belongs to the card.
+ */
+class EmvSmartCard : public SmartCard {
+public:
+  explicit EmvSmartCard(std::shared_ptr<const EmvCardTemplate> cardTemplate);
+
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+private:
+  enum class State {
+    IDLE,
+    SELECTED,
+    INITIATED,
+    FIRST_AC,
+    COMPLETED
+  };
+
+  void select(const ApduView &apdu, ApduResponse &response);
+
+  /**
+   * Selection of the found application (-1 for none) or of a directory by SELECT
+   */
+  void selectApplication(const ApduView &apdu, int found, ApduResponse &response);
+
+  void readRecord(const ApduView &apdu, ApduResponse &response);
+
+  void getProcessingOptions(const ApduView &apdu, ApduResponse &response);
+
+  void getData(const ApduView &apdu, ApduResponse &response);
+
+  void generateAc(const ApduView &apdu, ApduResponse &response);
+
+  /**
+   * Selection and transaction of a logical channel
+   */
+  struct Channel {
+    int application;            // selected application or -1
+    bool directorySelected;     // PSE or PPSE selected
+    State state;
+  };
+
+  void resetChannel(unsigned int channel) override;
+
+  /**
+   * SELECT, READ RECORD and GET DATA, the ATC only changes with GET PROCESSING OPTIONS
+   */
+  bool isCacheable(const ApduView &apdu) const override;
+
+  const EmvCardTemplate *emv;   // owned by the template
+  Channel channels[MAX_CHANNELS];
+  std::vector<uint16_t> atc;    // per application, shared by the channels
+};
+
+#endif //EMV_SMARTCARD_H
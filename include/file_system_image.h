@@ -0,0 +1,165 @@
+/**
+ * Image of an ISO 7816-4 card file system, memory-mapped from a local file
+ *
+ * Layout of the image (little endian):
+ *   header     64 bytes: magic "CARDFS01", number of files, protocols, ATR
+ *   file table 32 bytes per file, the MF (3F00) is the first file and a DF is always before its children
+ *   data       contents of the EFs, referenced by offset and size from the file table
+ */
+#ifndef FILE_SYSTEM_IMAGE_H
+#define FILE_SYSTEM_IMAGE_H
+
+#include <wintypes.h>
+#include <pcsclite.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FS_IMAGE_MAGIC        "CARDFS01"
+#define FS_NO_PARENT          0xFFFF
+#define FS_MAX_AID_SIZE       16
+
+enum FsFileType : uint8_t {
+  FS_DF = 1,
+  FS_TRANSPARENT_EF = 2,
+  FS_LINEAR_FIXED_EF = 3
+};
+
+struct FsImageHeader {
+  char magic[8];
+  uint32_t fileCount;
+  uint32_t protocols;
+  uint8_t atrLg;
+  uint8_t atr[MAX_ATR_SIZE];
+  uint8_t reserved[14];
+};
+
+struct FsImageEntry {
+  uint16_t fid;
+  uint16_t parent;        // index of the parent DF in the file table, FS_NO_PARENT for the MF
+  uint8_t type;           // FsFileType
+  uint8_t recordLength;   // linear fixed EF
+  uint8_t aidLg;          // DF with a name
+  uint8_t sfi;            // short EF identifier, 0 when the EF has none
+  uint8_t aid[FS_MAX_AID_SIZE];
+  uint32_t offset;        // EF data in the image
+  uint32_t size;
+};
+
+static_assert(sizeof(FsImageHeader) == 64, "the image header is 64 bytes");
+static_assert(sizeof(FsImageEntry) == 32, "a file table entry is 32 bytes");
+
+/**
+ * Read-only mapping of a file system image. The image is validated once when it is opened and the lookups of files
+ * use indexes sorted on (parent, FID) and (parent, SFI). The mapping is shared by all the cards of the image.
+ */
+class FileSystemImage {
+public:
+  static const size_t NOT_FOUND = SIZE_MAX;
+
+  /**
+   * Map an image
+   * @throw runtime_error when the file can't be opened or mapped
+   * @throw invalid_argument when the image is malformed
+   */
+  static std::shared_ptr<const FileSystemImage> open(const std::string &path);
+
+  FileSystemImage(const FileSystemImage &other) = delete;
+
+  FileSystemImage &operator=(const FileSystemImage &other) = delete;
+
+  ~FileSystemImage();
+
+  const FsImageHeader &header() const { return *reinterpret_cast<const FsImageHeader *>(base); };
+
+  const FsImageEntry &entry(size_t index) const { return entries[index]; };
+
+  size_t fileCount() const { return header().fileCount; };
+
+  const unsigned char *data() const { return base; };
+
+  size_t size() const { return imageLg; };
+
+  int descriptor() const { return fd; };
+
+  /**
+   * File with the FID in the DF
+   * @return index of the file or NOT_FOUND
+   */
+  size_t findChild(size_t parent, uint16_t fid) const;
+
+  /**
+   * EF with the short identifier in the DF
+   * @return index of the file or NOT_FOUND
+   */
+  size_t findShortIdentifier(size_t parent, uint8_t sfi) const;
+
+  /**
+   * First DF of which the name starts with the AID
+   * @return index of the DF or NOT_FOUND
+   */
+  size_t findName(const unsigned char *aid, size_t aid_lg) const;
+
+private:
+  FileSystemImage(int fd, const unsigned char *base, size_t imageLg);
+
+  void validate() const;
+
+  void buildIndexes();
+
+  static size_t find(const std::vector<std::pair<uint32_t, uint32_t>> &index, uint32_t key);
+
+  int fd;
+  const unsigned char *base;
+  size_t imageLg;
+  const FsImageEntry *entries;
+  std::vector<std::pair<uint32_t, uint32_t>> childIndex;    // (parent << 16 | FID, file)
+  std::vector<std::pair<uint32_t, uint32_t>> sfiIndex;      // (parent << 8 | SFI, file)
+  std::vector<uint32_t> namedDFs;
+};
+
+/**
+ * Writer of file system images, used to prepare the images of the cards
+ */
+class FileSystemImageBuilder {
+public:
+  static const size_t MF = 0;
+
+  FileSystemImageBuilder(const std::vector<unsigned char> &atr, DWORD protocols);
+
+  /**
+   * Add a DF
+   * @return index of the DF, used as parent of its files
+   * @throw invalid_argument when the parent isn't a DF or the name is too long
+   */
+  size_t addDF(size_t parent, uint16_t fid, const std::vector<unsigned char> &aid = std::vector<unsigned char>());
+
+  /**
+   * Add a transparent EF
+   * @return index of the EF
+   */
+  size_t addTransparentEF(size_t parent, uint16_t fid, const std::vector<unsigned char> &contents, uint8_t sfi = 0);
+
+  /**
+   * Add a linear fixed EF, all records have the length of the longest one
+   * @return index of the EF
+   */
+  size_t addRecordEF(size_t parent, uint16_t fid, const std::vector<std::vector<unsigned char>> &records, uint8_t sfi = 0);
+
+  /**
+   * Write the image
+   * @throw runtime_error when the file can't be written
+   */
+  void write(const std::string &path) const;
+
+private:
+  size_t addFile(size_t parent, uint16_t fid, uint8_t type, uint8_t sfi);
+
+  FsImageHeader header;
+  std::vector<FsImageEntry> files;
+  std::vector<std::vector<unsigned char>> contents;
+};
+
+#endif //FILE_SYSTEM_IMAGE_H
@@ -0,0 +1,95 @@
+/**
+ * Smartcard with an ISO 7816-4 file system, backed by a memory-mapped image
+ */
+#ifndef FILE_SYSTEM_SMARTCARD_H
+#define FILE_SYSTEM_SMARTCARD_H
+
+#include <memory>
+#include "smartcard.h"
+#include "file_system_image.h"
+
+/**
+ * Template of the cards of an image: ATR and protocols from the image header and the image itself
+ */
+class FileSystemCardTemplate : public CardTemplate {
+public:
+  explicit FileSystemCardTemplate(std::shared_ptr<const FileSystemImage> image) :
+    CardTemplate(std::vector<unsigned char>(image->header().atr, image->header().atr + image->header().atrLg),
+                 SCARD_SHARE_SHARED, image->header().protocols),
+    image(std::move(image)) {
+  };
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  const std::shared_ptr<const FileSystemImage> image;
+};
+
+/**
+ * Smartcard implementing SELECT (FID, path, DF name), READ BINARY, UPDATE BINARY and READ RECORD on the files of an
+ * image. The image is shared read-only by all the cards. The first update maps a private copy-on-write view of the
+ * image for the card, so the writes are only visible to the card and the pages which aren't written stay shared.
+ */
+class FileSystemSmartCard : public SmartCard {
+public:
+  explicit FileSystemSmartCard(std::shared_ptr<const FileSystemCardTemplate> cardTemplate);
+
+  explicit FileSystemSmartCard(std::shared_ptr<const FileSystemImage> image) :
+    FileSystemSmartCard(std::make_shared<FileSystemCardTemplate>(std::move(image))) {
+  };
+
+  FileSystemSmartCard(const FileSystemSmartCard &other) = delete;
+
+  FileSystemSmartCard &operator=(const FileSystemSmartCard &other) = delete;
+
+  ~FileSystemSmartCard() override;
+
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+private:
+  /**
+   * Current DF and EF of a logical channel
+   */
+  struct Channel {
+    size_t currentDF;
+    size_t currentEF;
+  };
+
+  void resetChannel(unsigned int channel) override;
+
+  /**
+   * SELECT, READ BINARY and READ RECORD, UPDATE BINARY changes the state
+   */
+  bool isCacheable(const ApduView &apdu) const override;
+
+  /**
+   * Change the current DF and EF of a channel, which starts a new state epoch when they are different
+   */
+  void setCurrent(Channel &channel, size_t df, size_t ef);
+
+  DWORD select(const ApduView &apdu, ApduResponse &response);
+
+  DWORD readBinary(const ApduView &apdu, ApduResponse &response);
+
+  DWORD updateBinary(const ApduView &apdu, ApduResponse &response);
+
+  DWORD readRecord(const ApduView &apdu, ApduResponse &response);
+
+  /**
+   * Resolve the EF of READ/UPDATE BINARY: short identifier in P1 or the current EF
+   * @return status word, 0x9000 when the EF is found
+   */
+  uint16_t binaryTarget(const ApduView &apdu, size_t *ef, size_t *offset);
+
+  /**
+   * Contents of an EF, from the private view once the card has been written
+   */
+  const unsigned char *contents(const FsImageEntry &file) const {
+    return (overlay != nullptr) ? overlay + file.offset : image->data() + file.offset;
+  };
+
+  const FileSystemImage *image;   // owned by the template
+  unsigned char *overlay;   // private copy-on-write mapping, nullptr until the first write
+  Channel channels[MAX_CHANNELS];
+};
+
+#endif //FILE_SYSTEM_SMARTCARD_H
@@ -0,0 +1,203 @@
+/**
+ * GlobalPlatform card manager (issuer security domain) which loads and installs applets
+ */
+#ifndef GLOBAL_PLATFORM_SMARTCARD_H
+#define GLOBAL_PLATFORM_SMARTCARD_H
+
+#include <chrono>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "scp03_channel.h"
+#include "smartcard.h"
+
+/**
+ * Append-only storage of the load files of a card. The data is written in chunks which are never moved, so a load
+ * file of n blocks costs n copies of the block data, whatever its size. Only the tail can be removed, which happens
+ * when a load sequence is aborted.
+ */
+class AppendOnlyStore {
+public:
+  static const size_t CHUNK_SIZE = 64 * 1024;
+
+  AppendOnlyStore() : used(0) {
+  };
+
+  void append(const unsigned char *data, size_t data_lg);
+
+  /**
+   * Remove the data after the offset
+   */
+  void truncate(size_t offset);
+
+  /**
+   * Copy data of the store
+   * @return false when the range is outside of the store
+   */
+  bool read(size_t offset, unsigned char *out, size_t out_lg) const;
+
+  size_t size() const { return used; };
+
+private:
+  std::vector<std::unique_ptr<unsigned char[]>> chunks;
+  size_t used;
+};
+
+/**
+ * Phases of the provisioning of an applet, which have their own counters
+ */
+enum class GlobalPlatformPhase {
+  SELECT,
+  INSTALL_FOR_LOAD,
+  LOAD,
+  INSTALL_FOR_INSTALL,
+  DELETE,
+  AUTHENTICATE,       // INITIALIZE UPDATE and EXTERNAL AUTHENTICATE
+  COUNT
+};
+
+struct GlobalPlatformPhaseCounters {
+  unsigned long commands;
+  unsigned long long bytes;                 // command data bytes
+  std::chrono::nanoseconds processing;      // time spent by the card in the commands of the phase
+  std::chrono::nanoseconds elapsed;         // wall time from the first to the last command of the consecutive commands
+};
+
+struct GlobalPlatformCounters {
+  GlobalPlatformPhaseCounters phases[static_cast<size_t>(GlobalPlatformPhase::COUNT)];
+  unsigned long loadFiles;
+  unsigned long applets;
+};
+
+/**
+ * Template of the GlobalPlatform cards of the same name. Definition file of a card:
+ *
+ *   # comment
+ *   ATR 3B 8F 80 01 80 4F 0C A0 00 00 03 06 03 00 03 00 00 00 00 68
+ *   PROTOCOL T0 T1
+ *   ISD A000000151000000
+ *   MEMORY 1048576
+ *   SCP03 30 404142434445464748494A4B4C4D4E4F 404142434445464748494A4B4C4D4E4F
+ *   COST E8 1500
+ *
+ * ISD is the AID of the issuer security domain (A000000151000000 by default) and MEMORY the space of the load files
+ * in bytes (1 MiB by default). SCP03 is the key version number, K-ENC and K-MAC of the ISD: with keys, the card
+ * manager commands are only accepted in an SCP03 session, without keys they are accepted in clear.
+ * PROTOCOL is T0 T1 by default, COST lines are the same as in a card table.
+ */
+class GlobalPlatformCardTemplate : public CardTemplate {
+public:
+  GlobalPlatformCardTemplate(std::vector<unsigned char> atr, DWORD protocols, std::vector<unsigned char> isd,
+                             size_t memory, std::shared_ptr<const Scp03Keys> keys = nullptr,
+                             std::shared_ptr<const CardCostModel> costs = nullptr);
+
+  /**
+   * @throw invalid_argument when the definition is malformed
+   */
+  static std::shared_ptr<GlobalPlatformCardTemplate> load(std::istream &in);
+
+  /**
+   * @throw runtime_error when the file can't be read
+   */
+  static std::shared_ptr<GlobalPlatformCardTemplate> loadFile(const std::string &path);
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  const std::vector<unsigned char> isd;
+  const size_t memory;
+  const std::shared_ptr<const Scp03Keys> keys;   // null when the commands are accepted in clear
+  const std::vector<unsigned char> fci;   // SELECT response of the ISD with SW
+};
+
+/**
+ * GlobalPlatform card manager: SELECT of the ISD and of the installed applets, INSTALL [for load], LOAD,
+ * INSTALL [for install] and DELETE. When the template has SCP03 keys, the card manager commands are secured in an SCP03
+ * session opened by INITIALIZE UPDATE and EXTERNAL AUTHENTICATE (CLA 84), otherwise they are accepted with CLA 80.
+ * The load blocks are streamed into the store of the card, the load file is checked (C4 length) with the last block.
+ * The applets only answer SELECT. Every command is counted in the counters of its phase.
+ */
+class GlobalPlatformSmartCard : public SmartCard {
+public:
+  explicit GlobalPlatformSmartCard(std::shared_ptr<const GlobalPlatformCardTemplate> cardTemplate);
+
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+  const GlobalPlatformCounters &getCounters() const { return counters; };
+
+  /**
+   * Contents of a loaded file
+   * @return false when the load file doesn't exist
+   */
+  bool getLoadFile(const std::vector<unsigned char> &aid, std::vector<unsigned char> &contents) const;
+
+  /**
+   * @return true when the applet instance is installed
+   */
+  bool isInstalled(const std::vector<unsigned char> &aid) const;
+
+private:
+  struct LoadFile {
+    std::vector<unsigned char> aid;
+    size_t offset;
+    size_t length;
+  };
+
+  struct Applet {
+    std::vector<unsigned char> aid;
+    std::vector<unsigned char> loadFile;
+    std::vector<unsigned char> module;
+    std::vector<unsigned char> privileges;
+  };
+
+  /**
+   * Selection and SCP03 session of a logical channel
+   */
+  struct Channel {
+    bool isdSelected;
+    Scp03Channel session;
+  };
+
+  void resetChannel(unsigned int channel) override;
+
+  uint16_t select(const ApduView &apdu);
+
+  /**
+   * INITIALIZE UPDATE and EXTERNAL AUTHENTICATE
+   */
+  uint16_t authenticate(const ApduView &apdu, ApduResponse &response);
+
+  uint16_t installForLoad(const ApduView &apdu);
+
+  uint16_t load(const ApduView &apdu);
+
+  uint16_t installForInstall(const ApduView &apdu);
+
+  uint16_t remove(const ApduView &apdu);
+
+  /**
+   * Abort the current load sequence and free its blocks
+   */
+  void abortLoad();
+
+  const GlobalPlatformCardTemplate *gp;   // owned by the template
+  Channel channels[MAX_CHANNELS];
+  AppendOnlyStore store;
+  std::vector<LoadFile> loadFiles;
+  size_t loadedBytes;   // size of the load files, the store can be larger after a DELETE
+  std::vector<Applet> applets;
+
+  // Load sequence in progress
+  bool loading;
+  std::vector<unsigned char> loadingAid;
+  size_t loadingOffset;
+  unsigned int nextBlock;
+
+  GlobalPlatformCounters counters;
+  int lastPhase;                                       // phase of the previous command, -1 for none
+  std::chrono::steady_clock::time_point lastEnd;       // end of the previous command
+  uint32_t sequenceCounter;                            // SCP03 sessions of the card
+};
+
+#endif //GLOBAL_PLATFORM_SMARTCARD_H
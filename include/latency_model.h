@@ -0,0 +1,96 @@
+/**
+ * Transport latency model of a reader: time on the card interface (ISO 7816-3) and the CCID/USB overhead
+ */
+#ifndef LATENCY_MODEL_H
+#define LATENCY_MODEL_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "smartcard.h"
+#include "t1_transport.h"
+
+/**
+ * Block the calling thread for the duration: sleep and spin on the steady clock for the last part
+ */
+void preciseSleep(std::chrono::nanoseconds duration);
+
+/**
+ * How the latency is applied to the caller
+ */
+enum class LatencyMode {
+  Sleep,          // the calling thread is blocked for the duration of the exchange
+  VirtualClock    // the duration is only added to the clock of the reader
+};
+
+/**
+ * Latency of the APDU exchanges over a reader. The elementary time unit (etu) is derived from the clock rate
+ * conversion factor F and the baud rate adjustment factor D of TA1 in the ATR (F=372 and D=1 without TA1).
+ * - T=0: 12 etu per character for the command, the procedure byte and the response
+ * - T=1: 11 etu per character of the blocks and a block guard time of 22 etu for every block
+ * Every exchange adds the fixed overhead of the CCID/USB transfers.
+ */
+class LatencyModel {
+public:
+  static const uint32_t DEFAULT_CLOCK_FREQUENCY = 3571200;
+
+  /**
+   * @param mode sleep or advance the virtual clock
+   * @param clockFrequency clock of the card in Hz
+   * @param overhead fixed overhead of an exchange between the host and the reader
+   * @throws std::invalid_argument when the clock frequency is 0
+   */
+  LatencyModel(LatencyMode mode, uint32_t clockFrequency, std::chrono::microseconds overhead);
+
+  LatencyModel(const LatencyModel &other) = delete;
+
+  LatencyModel &operator=(const LatencyModel &other) = delete;
+
+  /**
+   * Derive the etu from TA1 of the ATR of the inserted card
+   */
+  void setATR(const std::vector<unsigned char> &atr);
+
+  /**
+   * Duration of an APDU exchange of which the blocks are not simulated. T=1 exchanges are estimated with blocks of
+   * 254 bytes.
+   */
+  std::chrono::nanoseconds exchangeTime(DWORD protocol, size_t command_lg, size_t response_lg) const;
+
+  /**
+   * Duration of an APDU exchange over simulated T=1 blocks
+   */
+  std::chrono::nanoseconds exchangeTime(const T1BlockCounters &blocks) const;
+
+  /**
+   * Sleep for the duration or advance the virtual clock. The processing time of the card is applied the same way.
+   */
+  void apply(std::chrono::nanoseconds duration);
+
+  /**
+   * Sum of the durations applied since the model was created
+   */
+  std::chrono::nanoseconds elapsed() const {
+    return std::chrono::nanoseconds(clock.load());
+  };
+
+  /**
+   * Baud rate on the card interface: f * D / F
+   */
+  uint32_t getBaudRate() const {
+    return static_cast<uint32_t>((static_cast<uint64_t>(clockFrequency) * baudRateAdjustment) / clockRateConversion);
+  };
+
+private:
+  std::chrono::nanoseconds etuTime(uint64_t etus) const;
+
+  LatencyMode mode;
+  uint32_t clockFrequency;
+  std::chrono::microseconds overhead;
+  uint32_t clockRateConversion;    // F
+  uint32_t baudRateAdjustment;     // D
+  std::atomic<int64_t> clock;      // nanoseconds
+};
+
+#endif //LATENCY_MODEL_H
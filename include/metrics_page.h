@@ -0,0 +1,102 @@
+/**
+ * Metrics of the stub published in a POSIX shared memory segment, for the monitoring of a running process
+ */
+#ifndef METRICS_PAGE_H
+#define METRICS_PAGE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "call_stats.h"
+
+/**
+ * Values of a publication, all of them 64-bit words
+ */
+struct MetricsSnapshot {
+  uint64_t pid;
+  uint64_t timestamp;              // nanoseconds since the Unix epoch
+  uint64_t publications;           // since the start of the page
+  int64_t contexts;                // established
+  int64_t handles;                 // connected
+  int64_t cards;                   // inserted in the readers
+  uint64_t events;                 // attachments of readers, insertions and removals of cards
+  uint64_t faults;                 // return codes replaced by a stubbed code
+  uint64_t calls[CallStats::FUNCTIONS];           // by TraceFunction - 1
+  uint64_t errors[CallStats::FUNCTIONS];
+  uint64_t totalNanoseconds[CallStats::FUNCTIONS];
+};
+
+/**
+ * Page of the metrics in a shared memory segment, written by a background thread every period under a seqlock: the
+ * sequence is odd while the values change, so a reader copies the values between two reads of the same even sequence.
+ * The PC/SC calls only update their counters (see CallStats) and the gauges below, they never wait for the page.
+ *
+ *   page: "WSMETRC1" | version (u32) | number of words (u32) | sequence (u64) | words of a MetricsSnapshot
+ *
+ * The page is in the byte order of the host, the segment is removed when the publication stops.
+ */
+class MetricsPage {
+public:
+  static const uint32_t VERSION = 2;
+  static const size_t HEADER_SIZE = 24;
+  static const size_t WORDS = sizeof(MetricsSnapshot) / sizeof(uint64_t);
+
+  /**
+   * Gauges of the stub, updated by the PC/SC calls
+   */
+  static std::atomic<int64_t> contexts;
+  static std::atomic<int64_t> handles;
+  static std::atomic<int64_t> cards;
+  static std::atomic<uint64_t> events;
+
+  /**
+   * Create the segment and start publishing
+   * @param name name of the segment, "/" followed by a name without "/"
+   * @throw invalid_argument when the name or the period is invalid
+   * @throw logic_error when the metrics are already published
+   * @throw runtime_error when the segment can't be created
+   */
+  static void start(const std::string &name, std::chrono::milliseconds period);
+
+  /**
+   * Publish the last values, stop publishing and remove the segment. Nothing happens when nothing is published.
+   */
+  static void stop();
+
+  static bool publishing();
+
+  /**
+   * Copy a consistent publication of a page
+   * @param attempts number of reads of a page being written before giving up
+   * @return false when the page isn't a metrics page of this version, or when it was always being written
+   */
+  static bool read(const void *page, size_t page_lg, MetricsSnapshot *snapshot, unsigned int attempts = 1000);
+};
+
+/**
+ * Read-only mapping of the page of another process
+ */
+class MetricsPageReader {
+public:
+  /**
+   * @throw runtime_error when the segment doesn't exist or can't be mapped
+   */
+  explicit MetricsPageReader(const std::string &name);
+
+  MetricsPageReader(const MetricsPageReader &other) = delete;
+
+  MetricsPageReader &operator=(const MetricsPageReader &other) = delete;
+
+  ~MetricsPageReader();
+
+  bool read(MetricsSnapshot *snapshot) const { return MetricsPage::read(page, pageLg, snapshot); };
+
+private:
+  int fd;
+  const void *page;
+  size_t pageLg;
+};
+
+#endif //METRICS_PAGE_H
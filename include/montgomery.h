@@ -0,0 +1,117 @@
+/**
+ * Multi-precision arithmetic modulo an odd number with Montgomery multiplication, used by the card keys
+ */
+#ifndef MONTGOMERY_H
+#define MONTGOMERY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Arithmetic modulo an odd number m of at most MAX_LIMBS 64-bit words. The numbers are little endian arrays of
+ * limbs() words, reduced modulo m. The Montgomery form of a is a * R mod m, with R = 2^(64 * limbs()).
+ *
+ * The arithmetic works on fixed size arrays and never allocates, so it can be used on the signing path of the cards.
+ * It isn't hardened against side channels: the simulator keys are test keys.
+ */
+class Montgomery {
+public:
+  static const size_t MAX_LIMBS = 32;
+
+  /**
+   * @param modulus big endian modulus
+   * @throw invalid_argument when the modulus is even, smaller than 3 or larger than MAX_LIMBS words
+   */
+  explicit Montgomery(const std::vector<unsigned char> &modulus);
+
+  size_t limbs() const { return n; };
+
+  const uint64_t *modulus() const { return m; };
+
+  /**
+   * r = a * b / R mod m, the result may alias the operands
+   */
+  void multiply(uint64_t *r, const uint64_t *a, const uint64_t *b) const;
+
+  /**
+   * r = a * a / R mod m, faster than multiply(r, a, a), the result may alias the operand
+   */
+  void square(uint64_t *r, const uint64_t *a) const;
+
+  /**
+   * r = a * b mod m of numbers in normal form
+   */
+  void multiplyModular(uint64_t *r, const uint64_t *a, const uint64_t *b) const;
+
+  void add(uint64_t *r, const uint64_t *a, const uint64_t *b) const;
+
+  void subtract(uint64_t *r, const uint64_t *a, const uint64_t *b) const;
+
+  void toMontgomery(uint64_t *r, const uint64_t *a) const;
+
+  void fromMontgomery(uint64_t *r, const uint64_t *a) const;
+
+  /**
+   * R mod m, the Montgomery form of 1
+   */
+  const uint64_t *one() const { return rModM; };
+
+  /**
+   * r = a mod m in normal form, for a number a of a_limbs words which is smaller than m * R
+   */
+  void reduce(uint64_t *r, const uint64_t *a, size_t a_limbs) const;
+
+  /**
+   * r = a^e mod m of numbers in Montgomery form with a sliding window of up to 6 bits, the exponent is a number of
+   * e_limbs words
+   */
+  void power(uint64_t *r, const uint64_t *a, const uint64_t *e, size_t e_limbs) const;
+
+  /**
+   * r = a^e mod m of numbers in normal form
+   */
+  void exponentiate(uint64_t *r, const uint64_t *a, const uint64_t *e, size_t e_limbs) const;
+
+  /**
+   * r = a^-1 mod m of numbers in Montgomery form, the modulus must be prime
+   */
+  void inverse(uint64_t *r, const uint64_t *a) const;
+
+  /**
+   * Words of a big endian number, the bytes which don't fit are ignored
+   */
+  static void fromBytes(uint64_t *r, size_t r_limbs, const unsigned char *bytes, size_t bytes_lg);
+
+  /**
+   * Big endian bytes of a number, the words which don't fit are ignored
+   */
+  static void toBytes(unsigned char *bytes, size_t bytes_lg, const uint64_t *a, size_t a_limbs);
+
+  /**
+   * @return -1, 0 or 1 when a is smaller, equal or larger than b
+   */
+  static int compare(const uint64_t *a, const uint64_t *b, size_t limbs);
+
+  static bool isZero(const uint64_t *a, size_t limbs);
+
+  /**
+   * r = a * b, the result has a_limbs + b_limbs words and may not alias the operands
+   */
+  static void multiplyWide(uint64_t *r, const uint64_t *a, size_t a_limbs, const uint64_t *b, size_t b_limbs);
+
+private:
+  /**
+   * r = t / R mod m for a number t of 2 * limbs() words smaller than m * R, t is overwritten
+   */
+  void redc(uint64_t *r, uint64_t *t) const;
+
+  size_t n;
+  uint64_t m[MAX_LIMBS];
+  uint64_t mInverse;          // -m^-1 mod 2^64
+  uint64_t rModM[MAX_LIMBS];
+  uint64_t r2ModM[MAX_LIMBS];
+  uint64_t mMinus2[MAX_LIMBS];
+};
+
+#endif //MONTGOMERY_H
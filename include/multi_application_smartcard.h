@@ -0,0 +1,148 @@
+/**
+ * Smartcard hosting several applications (PIV, file system, table, ...) which are selected by AID
+ */
+#ifndef MULTI_APPLICATION_SMARTCARD_H
+#define MULTI_APPLICATION_SMARTCARD_H
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "smartcard.h"
+
+/**
+ * Template of the multi-application cards of the same name: the ATR, the protocols and the index of the applications,
+ * which is sorted on the AIDs. The applications with the same AID prefix are contiguous in the index, so a partial
+ * AID is resolved with a binary search and the next or previous occurrence is the neighbour entry.
+ * Definition file of a card:
+ *
+ *   # comment
+ *   ATR 3B 8C 80 01 80 73 C8 21 13 66 02 04 03 00 00 60
+ *   PROTOCOL T0 T1
+ *   APPLICATION A000000308000010000100 piv piv_card.txt
+ *   APPLICATION A0000000041010 emv emv_card.txt
+ *   APPLICATION D2760000850101 fs ndef.img
+ *   COST A4 1500
+ *
+ * APPLICATION is the AID (5 to 16 bytes), the type and the definition file of an application, see
+ * SmartCard::register_implementation; the files are relative to the directory of the definition. Only the ATR, the
+ * protocols and the costs of the card are used, those of the applications are ignored.
+ * PROTOCOL is T0 T1 by default, COST lines are the same as in a card table.
+ */
+class MultiApplicationCardTemplate : public CardTemplate {
+public:
+  struct Application {
+    std::vector<unsigned char> aid;
+    std::shared_ptr<const CardTemplate> implementation;
+  };
+
+  MultiApplicationCardTemplate(std::vector<unsigned char> atr, DWORD protocols,
+                               std::shared_ptr<const CardCostModel> costs = nullptr);
+
+  /**
+   * @param directory directory of the definition files of the applications
+   * @throw invalid_argument when the definition is malformed
+   * @throw runtime_error when a file can't be read
+   */
+  static std::shared_ptr<MultiApplicationCardTemplate> load(std::istream &in, const std::string &directory);
+
+  static std::shared_ptr<MultiApplicationCardTemplate> loadFile(const std::string &path);
+
+  /**
+   * Add an application to the index
+   * @throw invalid_argument when the AID doesn't have 5 to 16 bytes or is already used
+   */
+  void addApplication(const std::vector<unsigned char> &aid, std::shared_ptr<const CardTemplate> implementation);
+
+  /**
+   * Applications sorted on their AID
+   */
+  const std::vector<Application> &applications() const { return index; };
+
+  /**
+   * First (lowest) application whose AID starts with the partial AID
+   * @return the position in the index or NOT_FOUND
+   */
+  size_t first(const unsigned char *partial, size_t partial_lg) const;
+
+  /**
+   * Last (highest) application whose AID starts with the partial AID
+   * @return the position in the index or NOT_FOUND
+   */
+  size_t last(const unsigned char *partial, size_t partial_lg) const;
+
+  /**
+   * Application after the current one whose AID starts with the partial AID, the first one when the current
+   * application doesn't match
+   * @param current position in the index or NOT_FOUND
+   * @return the position in the index or NOT_FOUND
+   */
+  size_t next(size_t current, const unsigned char *partial, size_t partial_lg) const;
+
+  /**
+   * Application before the current one whose AID starts with the partial AID, the last one when the current
+   * application doesn't match
+   * @param current position in the index or NOT_FOUND
+   * @return the position in the index or NOT_FOUND
+   */
+  size_t previous(size_t current, const unsigned char *partial, size_t partial_lg) const;
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  static const size_t NOT_FOUND = static_cast<size_t>(-1);
+
+private:
+  bool matches(size_t position, const unsigned char *partial, size_t partial_lg) const;
+
+  std::vector<Application> index;
+};
+
+/**
+ * Card which routes the commands to its applications, one card of each application template. SELECT by DF name
+ * resolves the (partial) AID in the index of the template, with the first, last, next and previous occurrences, and
+ * forwards a SELECT of the complete AID to the application; when no AID matches, the SELECT goes to the selected
+ * application, like on a Java Card. The selected application of each logical channel is kept, so the other commands
+ * are dispatched to it without lookup. Selecting another application, opening or closing the channel resets the
+ * state of the channel in the previous application.
+ */
+class MultiApplicationSmartCard : public SmartCard {
+public:
+  explicit MultiApplicationSmartCard(std::shared_ptr<const MultiApplicationCardTemplate> cardTemplate);
+
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+  /**
+   * AID of the application selected on a logical channel
+   * @return the AID or nullptr when no application is selected
+   */
+  const std::vector<unsigned char> *getSelected(unsigned int channel) const;
+
+private:
+  /**
+   * Selected application of a logical channel
+   */
+  struct Channel {
+    SmartCard *application;   // nullptr when no application is selected
+    size_t position;          // position of the application in the index
+  };
+
+  void resetChannel(unsigned int channel) override;
+
+  /**
+   * SELECT by DF name and the cacheable commands of the selected application
+   */
+  bool isCacheable(const ApduView &apdu) const override;
+
+  /**
+   * Execute a command in an application, a state change of the application is a state change of the card
+   */
+  DWORD forward(SmartCard *application, SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response);
+
+  DWORD select(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response);
+
+  const MultiApplicationCardTemplate *multi;   // owned by the template
+  std::vector<std::unique_ptr<SmartCard>> applications;   // in the order of the index
+  Channel channels[MAX_CHANNELS];
+};
+
+#endif //MULTI_APPLICATION_SMARTCARD_H
@@ -0,0 +1,43 @@
+/**
+ * ECDSA private key on the NIST P-256 curve
+ */
+#ifndef P256_KEY_H
+#define P256_KEY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * ECDSA P-256 private key. The multiples of the generator are computed with a table of the multiples j * 16^i * G,
+ * which is computed once per process, so a signature costs 64 point additions and two inversions. The nonce is
+ * deterministic (RFC 6979 with HMAC-SHA-256): the same hash always gives the same signature.
+ */
+class P256PrivateKey {
+public:
+  static const size_t SIZE = 32;
+
+  /**
+   * @param privateKey big endian private scalar
+   * @throw invalid_argument when the scalar isn't between 1 and the order of the curve
+   */
+  explicit P256PrivateKey(const std::vector<unsigned char> &privateKey);
+
+  /**
+   * Affine coordinates of the public point, SIZE bytes each
+   */
+  void publicKey(unsigned char *x, unsigned char *y) const;
+
+  /**
+   * Sign a hash, the leftmost 256 bits of the hash are used
+   * @param r first half of the signature, SIZE bytes
+   * @param s second half of the signature, SIZE bytes
+   */
+  void sign(const unsigned char *hash, size_t hash_lg, unsigned char *r, unsigned char *s) const;
+
+private:
+  uint64_t d[4];
+  unsigned char dBytes[SIZE];
+};
+
+#endif //P256_KEY_H
@@ -0,0 +1,63 @@
+/**
+ * Capture of the APDU traffic in a pcapng file
+ */
+#ifndef PCAPNG_EXPORT_H
+#define PCAPNG_EXPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Capture of the exchanges of SCardTransmit and SCardControl in the pcapng format, as the USB traffic of a CCID reader,
+ * so that the packet analysers (Wireshark, tshark) decode the APDUs. A capture is a section, appended to the file,
+ * with one interface of link type LINKTYPE_USB_LINUX_MMAPPED (220). An exchange is two enhanced packet blocks with
+ * microsecond timestamps, each a usbmon header and a CCID message:
+ *
+ *   command: bulk OUT URB submission (endpoint 0x02), PC_to_RDR_XfrBlock, or PC_to_RDR_Escape for SCardControl
+ *   response: bulk IN URB completion (endpoint 0x82), RDR_to_PC_DataBlock, or RDR_to_PC_Escape for SCardControl.
+ *             A failed call has an empty response with the command failed status and the ICC mute error.
+ *
+ * The USB device number is derived from the card handle, so that the conversations of the cards can be told apart,
+ * and bSeq of the CCID messages pairs a command with its response. The capture has no descriptors, the bulk transfers
+ * are decoded as CCID with "Decode As... USB CCID" in Wireshark.
+ *
+ * The packets are written in the background by an AsyncFileWriter, so the capture can stay on in load tests.
+ */
+class PcapngExport {
+public:
+  static const uint16_t LINKTYPE_USB_LINUX_MMAPPED = 220;
+  static const size_t USBMON_HEADER_SIZE = 64;
+  static const size_t CCID_HEADER_SIZE = 10;
+
+  /**
+   * Start a capture, the section is appended to the sections already in the file
+   * @throw logic_error when a capture is already running
+   * @throw runtime_error when the file can't be opened
+   */
+  static void start(const std::string &path);
+
+  /**
+   * Stop the capture, write the packets of all the threads and close the file. Nothing happens when no capture runs.
+   */
+  static void stop();
+
+  static bool capturing();
+
+  /**
+   * Clock of the timestamps, in microseconds since the Unix epoch
+   */
+  static uint64_t now();
+
+  /**
+   * Append the packets of an exchange to the buffer of the calling thread
+   * @param control true for SCardControl, false for SCardTransmit
+   * @param start clock at the beginning of the call, the timestamp of the command
+   * @param success false for a failed call, whose response is ignored
+   */
+  static void exchange(bool control, uint64_t start, uint64_t handle, bool success,
+                       const unsigned char *command, size_t command_lg,
+                       const unsigned char *response, size_t response_lg);
+};
+
+#endif //PCAPNG_EXPORT_H
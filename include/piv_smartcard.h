@@ -0,0 +1,147 @@
+/**
+ * PIV smartcard (NIST SP 800-73) with keys loaded from local files
+ */
+#ifndef PIV_SMARTCARD_H
+#define PIV_SMARTCARD_H
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "smartcard.h"
+#include "private_key.h"
+
+// PIV cryptographic algorithm identifiers
+#define PIV_ALGORITHM_RSA_1024   0x06
+#define PIV_ALGORITHM_RSA_2048   0x07
+#define PIV_ALGORITHM_RSA_3072   0x05
+#define PIV_ALGORITHM_RSA_4096   0x16
+#define PIV_ALGORITHM_ECC_P256   0x11
+
+/**
+ * Private key of a PIV key reference (9A, 9C, 9D, 9E, 82-95)
+ */
+struct PivKey {
+  unsigned char algorithm;
+  std::shared_ptr<const RsaPrivateKey> rsa;
+  std::shared_ptr<const P256PrivateKey> ecc;
+};
+
+/**
+ * Immutable part of the PIV cards of the same name: keys, data objects and PIN. The data objects are stored as the
+ * complete GET DATA response, which the cards reference without copy. Definition file of a PIV card:
+ *
+ *   # comment
+ *   ATR 3B F8 13 00 00 81 31 FE 15 59 75 62 69 6B 65 79 34 D4
+ *   PROTOCOL T1
+ *   PIN 123456 3
+ *   KEY 9A piv_authentication.pem
+ *   KEY 9C digital_signature.pem
+ *   CERT 9A piv_authentication.der
+ *   OBJECT 5FC102 3019D4E739DA739CED39CE739D836858210842108421C84210C3EB3410...
+ *   COST 87 250000
+ *
+ * PROTOCOL is T1 by default, PIN has the PIN (6 to 8 digits) and the number of retries (3 by default). KEY loads a
+ * private key file (see PrivateKey) for a key reference, CERT builds the certificate object of the key reference from
+ * a DER certificate file and OBJECT defines the contents of the tag 53 of a data object. The files are relative to the
+ * directory of the definition. COST lines are the same as in a card table.
+ */
+class PivCardTemplate : public CardTemplate {
+public:
+  PivCardTemplate(std::vector<unsigned char> atr, DWORD protocols, const std::string &pin, unsigned int pinRetries,
+                  std::shared_ptr<const CardCostModel> costs = nullptr);
+
+  /**
+   * Parse the definition of a PIV card
+   * @param directory directory of the files of the keys and certificates
+   * @throw invalid_argument when the definition or a key is malformed
+   * @throw runtime_error when a file can't be read
+   */
+  static std::shared_ptr<PivCardTemplate> load(std::istream &in, const std::string &directory);
+
+  static std::shared_ptr<PivCardTemplate> loadFile(const std::string &path);
+
+  /**
+   * Add the key of a key reference, the algorithm follows from the type and the size of the key
+   * @throw invalid_argument for an unknown key reference or an unsupported key size
+   */
+  void addKey(unsigned char reference, const PrivateKey &key);
+
+  /**
+   * Add a data object
+   * @param tag tag of the object (1 to 3 bytes)
+   * @param contents contents of the tag 53 of the object
+   */
+  void addObject(uint32_t tag, const std::vector<unsigned char> &contents);
+
+  /**
+   * Add the X.509 certificate object of a key reference
+   * @throw invalid_argument for an unknown key reference
+   */
+  void addCertificate(unsigned char reference, const std::vector<unsigned char> &certificate);
+
+  /**
+   * @return the key or nullptr
+   */
+  const PivKey *key(unsigned char reference) const;
+
+  /**
+   * @return the GET DATA response of the object, with the status word, or nullptr
+   */
+  const std::vector<unsigned char> *object(uint32_t tag) const;
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  const std::vector<unsigned char> pin;   // PIN padded with FF to 8 bytes
+  const unsigned int pinRetries;
+
+private:
+  std::map<unsigned char, PivKey> keys;
+  std::unordered_map<uint32_t, std::vector<unsigned char>> objects;
+};
+
+/**
+ * PIV card application: SELECT, GET DATA, VERIFY of the PIV card application PIN and GENERAL AUTHENTICATE
+ * (signature with RSA or ECDSA P-256). The PIN status and the retry counter belong to the card.
+ */
+class PivSmartCard : public SmartCard {
+public:
+  explicit PivSmartCard(std::shared_ptr<const PivCardTemplate> cardTemplate);
+
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+private:
+  void select(const ApduView &apdu, ApduResponse &response);
+
+  void getData(const ApduView &apdu, ApduResponse &response);
+
+  void verify(const ApduView &apdu, ApduResponse &response);
+
+  void generalAuthenticate(const ApduView &apdu, const unsigned char *data, size_t data_lg, ApduResponse &response);
+
+  /**
+   * Selection and security status of a logical channel
+   */
+  struct Channel {
+    bool selected;
+    bool pinVerified;
+    std::vector<unsigned char> chain;   // data of the chained GENERAL AUTHENTICATE commands
+    uint16_t chainParameters;           // P1 P2 of the chained commands
+  };
+
+  void resetChannel(unsigned int channel) override;
+
+  /**
+   * SELECT and GET DATA, the data objects don't change
+   */
+  bool isCacheable(const ApduView &apdu) const override;
+
+  const PivCardTemplate *piv;   // owned by the template
+  Channel channels[MAX_CHANNELS];
+  unsigned int retries;         // PIN retries, shared by the channels
+};
+
+#endif //PIV_SMARTCARD_H
@@ -0,0 +1,35 @@
+/**
+ * Private keys of the cards, read from PEM or DER files
+ */
+#ifndef PRIVATE_KEY_H
+#define PRIVATE_KEY_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "rsa_key.h"
+#include "p256_key.h"
+
+/**
+ * Private key of a card: either an RSA key or an ECC P-256 key. The supported encodings are the unencrypted
+ * PKCS #1 RSAPrivateKey, SEC 1 ECPrivateKey and PKCS #8 PrivateKeyInfo, in PEM or DER.
+ */
+struct PrivateKey {
+  std::shared_ptr<const RsaPrivateKey> rsa;
+  std::shared_ptr<const P256PrivateKey> ecc;
+
+  /**
+   * Decode a key
+   * @throw invalid_argument when the encoding is malformed or the key type isn't supported
+   */
+  static PrivateKey decode(const std::vector<unsigned char> &encoded);
+
+  /**
+   * Read a key file
+   * @throw runtime_error when the file can't be read
+   * @throw invalid_argument when the key is malformed or its type isn't supported
+   */
+  static PrivateKey loadFile(const std::string &path);
+};
+
+#endif //PRIVATE_KEY_H
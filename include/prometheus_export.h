@@ -0,0 +1,71 @@
+/**
+ * Metrics of the stub in the Prometheus text exposition format
+ */
+#ifndef PROMETHEUS_EXPORT_H
+#define PROMETHEUS_EXPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Dump of the metrics of the stub in the Prometheus text exposition format (version 0.0.4), for the textfile
+ * collector of the node exporter or a scraping sidecar:
+ *
+ *   winscard_stub_calls_total{function}, winscard_stub_call_errors_total{function}
+ *   winscard_stub_call_duration_seconds{function}: histogram, with a bucket for every power of 4 nanoseconds from
+ *                                                  HISTOGRAM_FIRST_MAGNITUDE to HISTOGRAM_LAST_MAGNITUDE, so that the
+ *                                                  log-linear buckets of CallStats fall entirely in one of them
+ *   winscard_stub_call_duration_max_seconds{function}
+ *   winscard_stub_event_wakeup_seconds: histogram of the delays from the events of the readers to the return of the
+ *                                       SCardGetStatusChange call waiting for them
+ *   winscard_stub_contexts, winscard_stub_handles, winscard_stub_cards: gauges of MetricsPage
+ *   winscard_stub_events_total, winscard_stub_injected_faults_total
+ *   winscard_stub_reader_apdus_total{reader}, winscard_stub_reader_errors_total{reader},
+ *   winscard_stub_reader_bytes_in_total{reader}, winscard_stub_reader_bytes_out_total{reader},
+ *   winscard_stub_reader_responses_total{reader,sw1}: the first status bytes which were received
+ *
+ * The dump is rendered from the snapshots of the counters, the PC/SC calls never wait for it.
+ */
+class PrometheusExport {
+public:
+  static const unsigned int HISTOGRAM_FIRST_MAGNITUDE = 10;
+  static const unsigned int HISTOGRAM_LAST_MAGNITUDE = 34;
+
+  /**
+   * Prefix of the destinations which are local stream sockets
+   */
+  static const char *const SOCKET_PREFIX;
+
+  /**
+   * Render the current values of the metrics
+   */
+  static std::string render();
+
+  /**
+   * Render the metrics to a destination
+   * @param destination path of a file, replaced atomically (written next to it and renamed), or "unix:" followed by
+   *        the path of a listening Unix stream socket, which receives the dump and the end of the stream
+   * @throw invalid_argument when the destination is empty or the path of the socket is too long
+   * @throw runtime_error when the dump can't be written
+   */
+  static void dump(const std::string &destination);
+
+  /**
+   * Dump the metrics to a destination at each SIGUSR1 received by the process. The signal handler only wakes a
+   * background thread, which renders and writes the dump.
+   * @throw invalid_argument when the destination is empty
+   * @throw logic_error when the dumps on signal are already started
+   * @throw runtime_error when the handler can't be installed
+   */
+  static void startSignalDumps(const std::string &destination);
+
+  /**
+   * Restore the previous handler of SIGUSR1 and stop the thread. Nothing happens when the dumps aren't started.
+   */
+  static void stopSignalDumps();
+
+  static bool dumpingOnSignal();
+};
+
+#endif //PROMETHEUS_EXPORT_H
@@ -0,0 +1,157 @@
+/**
+ * Smartcard which replays the responses of a session recorded with SCardStartTrace
+ */
+#ifndef REPLAY_SMARTCARD_H
+#define REPLAY_SMARTCARD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "response_database.h"
+#include "smartcard.h"
+
+/**
+ * Read-only mapping of a trace file (see apdu_trace.h) and the index of its SCardTransmit exchanges. The trace is only
+ * walked once, when it is opened: the exchanges reference the command and response bytes in the mapping, in the order
+ * of the trace, and the identical commands are contiguous in an index sorted on (hash, command, position). The
+ * exchanges which failed, and MANAGE CHANNEL which is handled by the base card, aren't indexed.
+ */
+class ReplayTrace {
+public:
+  struct Exchange {
+    const unsigned char *command;
+    size_t commandLg;
+    const unsigned char *response;   // data and SW
+    size_t responseLg;
+  };
+
+  /**
+   * Map a trace
+   * @param handle card handle of the exchanges to replay, 0 for the exchanges of all the cards
+   * @throw runtime_error when the file can't be opened or mapped
+   * @throw invalid_argument when the trace is malformed
+   */
+  static std::shared_ptr<const ReplayTrace> open(const std::string &path, uint64_t handle = 0);
+
+  ReplayTrace(const ReplayTrace &other) = delete;
+
+  ReplayTrace &operator=(const ReplayTrace &other) = delete;
+
+  ~ReplayTrace();
+
+  size_t size() const { return exchanges.size(); };
+
+  const Exchange &exchange(size_t position) const { return exchanges[position]; };
+
+  /**
+   * Look up the exchanges of a command
+   * @param first out: position of the first exchange of the command in the command index
+   * @return the number of exchanges of the command
+   */
+  size_t find(const unsigned char *command, size_t command_lg, size_t *first) const;
+
+  /**
+   * Exchange of the command index, the exchanges of a command follow each other in the order of the trace
+   * @return the position of the exchange in the trace
+   */
+  size_t indexed(size_t index) const { return byCommand[index].second; };
+
+private:
+  ReplayTrace(int fd, const unsigned char *base, size_t traceLg);
+
+  void buildIndexes(uint64_t handle);
+
+  int fd;
+  const unsigned char *base;
+  size_t traceLg;
+  std::vector<Exchange> exchanges;
+  std::vector<std::pair<uint64_t, uint32_t>> byCommand;   // hash of the command, position of the exchange
+};
+
+enum class ReplayMode {
+  Strict,    // the commands must come in the order of the trace
+  Lenient    // a command gets the response of its next exchange in the trace, wherever it is
+};
+
+/**
+ * Template of the replay cards of the same name. Definition file of a card:
+ *
+ *   # comment
+ *   ATR 3B 02 14 50
+ *   PROTOCOL T0 T1
+ *   TRACE session.trace
+ *   MODE strict
+ *   HANDLE 3
+ *   COST B0 800
+ *
+ * TRACE is the trace file, relative to the directory of the definition. MODE is strict (by default) or lenient.
+ * HANDLE selects the exchanges of a card handle when the trace holds several cards. PROTOCOL is T0 T1 by default,
+ * COST lines are the same as in a card table.
+ * Instead of a trace, DATABASE is a response database compiled by response_db_builder, which is replayed in lenient
+ * mode: opening it doesn't depend on the number of exchanges.
+ */
+class ReplayCardTemplate : public CardTemplate {
+public:
+  ReplayCardTemplate(std::vector<unsigned char> atr, DWORD protocols, std::shared_ptr<const ReplayTrace> trace,
+                     ReplayMode mode, std::shared_ptr<const CardCostModel> costs = nullptr);
+
+  ReplayCardTemplate(std::vector<unsigned char> atr, DWORD protocols, std::shared_ptr<const ResponseDatabase> database,
+                     std::shared_ptr<const CardCostModel> costs = nullptr);
+
+  /**
+   * @param directory directory of the trace file
+   * @throw invalid_argument when the definition or the trace is malformed
+   * @throw runtime_error when the trace can't be read
+   */
+  static std::shared_ptr<ReplayCardTemplate> load(std::istream &in, const std::string &directory);
+
+  static std::shared_ptr<ReplayCardTemplate> loadFile(const std::string &path);
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  const std::shared_ptr<const ReplayTrace> trace;              // null for a database
+  const std::shared_ptr<const ResponseDatabase> database;      // null for a trace
+  const ReplayMode mode;
+};
+
+/**
+ * Card which answers the commands with the responses of the trace, referenced in the mapping. In strict mode the
+ * command must be the one of the next exchange of the trace, in lenient mode a command gets the responses of its
+ * exchanges in turn, the first one again after the last one. A command which isn't replayed gets SW 6F00 and is
+ * counted as a mismatch. With a database, the card follows the AID selected on each channel for the keys, the lookups
+ * don't allocate.
+ */
+class ReplaySmartCard : public SmartCard {
+public:
+  explicit ReplaySmartCard(std::shared_ptr<const ReplayCardTemplate> cardTemplate);
+
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+  /**
+   * Position of the next exchange of the trace in strict mode
+   */
+  size_t getPosition() const { return position; };
+
+  unsigned long getMismatches() const { return mismatches; };
+
+private:
+  void resetChannel(unsigned int channel) override;
+
+  DWORD lookUp(const ApduView &apdu, ApduResponse &response);
+
+  const ReplayCardTemplate *replay;   // owned by the template
+  size_t position;
+  std::vector<uint32_t> replayed;     // lenient mode: replayed exchanges of a command at its first index position, or
+                                      // of a database entry at its cycle counter
+  unsigned long mismatches;
+  // Database
+  std::vector<unsigned char> key;
+  unsigned char selected[MAX_CHANNELS][16];
+  size_t selectedLg[MAX_CHANNELS];
+};
+
+#endif //REPLAY_SMARTCARD_H
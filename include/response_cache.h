@@ -0,0 +1,93 @@
+/**
+ * Memoization of the responses of the deterministic commands of a card
+ */
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct ResponseCacheCounters {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;   // least recently used entries replaced by a new response
+};
+
+/**
+ * LRU cache of the responses of a card, keyed on the command bytes and the state epoch of the card. A card changes its
+ * epoch whenever its state changes, so the responses computed in another state are never returned and age out of
+ * the cache.
+ *
+ * The entries are preallocated and linked by index, the lookup is an open addressing table on a hash of the key. The
+ * command and response buffers of an entry only grow, so the cache stops allocating once the entries fit the
+ * responses.
+ */
+class ResponseCache {
+public:
+  /**
+   * @param capacity maximum number of responses
+   * @throw invalid_argument when the capacity is 0
+   */
+  explicit ResponseCache(size_t capacity);
+
+  /**
+   * Look up the response of a command, which becomes the most recently used entry
+   * @param response_lg out: length of the response
+   * @return the response (data and SW), valid until the next insert, or nullptr
+   */
+  const unsigned char *find(const unsigned char *command, size_t command_lg, uint64_t epoch, size_t *response_lg);
+
+  /**
+   * Store the response of a command, replacing the least recently used entry when the cache is full
+   */
+  void insert(const unsigned char *command, size_t command_lg, uint64_t epoch, const unsigned char *response,
+              size_t response_lg);
+
+  void clear();
+
+  size_t size() const { return used; };
+
+  size_t capacity() const { return entries.size(); };
+
+  const ResponseCacheCounters &getCounters() const { return counters; };
+
+private:
+  static const uint32_t NONE = UINT32_MAX;
+
+  struct Entry {
+    uint64_t hash;
+    uint64_t epoch;
+    std::vector<unsigned char> command;
+    size_t commandLg;
+    std::vector<unsigned char> response;
+    size_t responseLg;
+    uint32_t previous;   // more recently used entry
+    uint32_t next;       // less recently used entry
+  };
+
+  static uint64_t hashOf(const unsigned char *command, size_t command_lg, uint64_t epoch);
+
+  /**
+   * Slot of the table which holds the key or the empty slot where it would be inserted
+   */
+  size_t slotOf(uint64_t hash, const unsigned char *command, size_t command_lg, uint64_t epoch) const;
+
+  /**
+   * Empty a slot and move the following entries of its cluster back (backward shift deletion)
+   */
+  void removeSlot(size_t slot);
+
+  void unlink(uint32_t entry);
+
+  void pushFront(uint32_t entry);
+
+  std::vector<Entry> entries;
+  std::vector<uint32_t> slots;   // entry index + 1, 0 for an empty slot
+  size_t used;
+  uint32_t head;                 // most recently used
+  uint32_t tail;                 // least recently used
+  ResponseCacheCounters counters;
+};
+
+#endif //RESPONSE_CACHE_H
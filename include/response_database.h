@@ -0,0 +1,166 @@
+/**
+ * Response database of the replay cards: the exchanges of traces compiled into a memory-mapped hash table
+ *
+ * Layout of the database (little endian):
+ *   header     64 bytes: magic "WSRESPDB", key flags, number of buckets, entries and cycling entries, offsets
+ *   buckets    16 bytes per bucket: hash of the key (0 for an empty bucket), offset of the entry in the data
+ *   data       entries aligned on 8 bytes: key length (u32), number of responses (u32), cycle counter (u32),
+ *              key, then the responses, each one a length (u32) followed by the data and SW
+ *
+ * The key of an exchange is the command with the CLA of the basic channel, preceded by the logical channel
+ * (RESPONSE_DB_KEY_CHANNEL) and by the length and the AID selected on the channel (RESPONSE_DB_KEY_AID).
+ */
+#ifndef RESPONSE_DATABASE_H
+#define RESPONSE_DATABASE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "smartcard.h"
+
+#define RESPONSE_DB_MAGIC          "WSRESPDB"
+#define RESPONSE_DB_KEY_CHANNEL    0x01
+#define RESPONSE_DB_KEY_AID        0x02
+#define RESPONSE_DB_NO_CYCLE       0xFFFFFFFF
+
+struct ResponseDbHeader {
+  char magic[8];
+  uint32_t flags;           // RESPONSE_DB_KEY_xxx
+  uint32_t reserved;
+  uint64_t bucketCount;     // power of 2
+  uint64_t entryCount;
+  uint64_t cycleCount;      // entries with several responses, which have a cycle counter in the card
+  uint64_t bucketsOffset;
+  uint64_t dataOffset;
+  uint64_t dataLg;
+};
+
+struct ResponseDbBucket {
+  uint64_t hash;
+  uint64_t offset;          // entry in the data
+};
+
+static_assert(sizeof(ResponseDbHeader) == 64, "the database header is 64 bytes");
+static_assert(sizeof(ResponseDbBucket) == 16, "a bucket is 16 bytes");
+
+/**
+ * Read-only mapping of a response database. Opening only checks the header, a lookup reads a bucket (two at most with
+ * a load factor of 1/2) and the entry, where the key and the responses are contiguous. The entries are trusted to be
+ * written by ResponseDatabaseBuilder, only the bounds of the keys are checked.
+ */
+class ResponseDatabase {
+public:
+  /**
+   * Longest key: channel, AID and extended length command
+   */
+  static const size_t MAX_KEY_SIZE = 2 + 16 + 4 + 3 + 65535 + 3;
+
+  /**
+   * Map a database
+   * @throw runtime_error when the file can't be opened or mapped
+   * @throw invalid_argument when the header is malformed
+   */
+  static std::shared_ptr<const ResponseDatabase> open(const std::string &path);
+
+  ResponseDatabase(const ResponseDatabase &other) = delete;
+
+  ResponseDatabase &operator=(const ResponseDatabase &other) = delete;
+
+  ~ResponseDatabase();
+
+  const ResponseDbHeader &header() const { return *reinterpret_cast<const ResponseDbHeader *>(base); };
+
+  /**
+   * Key of a command
+   * @param aid AID selected on the channel of the command, nullptr when none is selected
+   * @param key out: buffer of MAX_KEY_SIZE bytes
+   * @return the length of the key
+   */
+  static size_t makeKey(uint32_t flags, const ApduView &apdu, const unsigned char *aid, size_t aid_lg,
+                        unsigned char *key);
+
+  static uint64_t hashOf(const unsigned char *key, size_t key_lg);
+
+  /**
+   * @return true when the exchange selects the AID of the command data on the channel of the command: SELECT by DF
+   *         name of an AID of 1 to 16 bytes, accepted by the card
+   */
+  static bool selectsAid(const ApduView &apdu, const unsigned char *response, size_t response_lg);
+
+  /**
+   * Look up the entry of a key
+   * @return the entry or nullptr
+   */
+  const unsigned char *find(const unsigned char *key, size_t key_lg) const;
+
+  static size_t responseCount(const unsigned char *entry);
+
+  /**
+   * Index of the cycle counter of an entry with several responses, RESPONSE_DB_NO_CYCLE otherwise
+   */
+  static uint32_t cycle(const unsigned char *entry);
+
+  /**
+   * Response of an entry, the responses are in the order of the traces
+   * @return the data and SW of the response
+   */
+  static const unsigned char *response(const unsigned char *entry, size_t index, size_t *response_lg);
+
+private:
+  ResponseDatabase(int fd, const unsigned char *base, size_t databaseLg);
+
+  void validate();
+
+  int fd;
+  const unsigned char *base;
+  size_t databaseLg;
+  const ResponseDbBucket *buckets;
+  const unsigned char *data;
+};
+
+/**
+ * Compiler of traces (see apdu_trace.h) into a response database. The successful SCardTransmit exchanges are
+ * grouped by key, the AID selected on each channel of each card handle of the traces is followed through SELECT by DF
+ * name and MANAGE CHANNEL.
+ */
+class ResponseDatabaseBuilder {
+public:
+  explicit ResponseDatabaseBuilder(uint32_t flags) : flags(flags) {
+  };
+
+  /**
+   * Add the exchanges of a trace
+   * @throw runtime_error when the file can't be read
+   * @throw invalid_argument when the trace is malformed
+   */
+  void addTrace(const std::string &path);
+
+  /**
+   * Add the response of a command
+   * @param aid AID selected on the channel of the command, nullptr when none is selected
+   */
+  void add(const ApduView &apdu, const unsigned char *aid, size_t aid_lg, const unsigned char *response,
+           size_t response_lg);
+
+  size_t size() const { return entries.size(); };
+
+  /**
+   * @throw runtime_error when the file can't be written
+   */
+  void write(const std::string &path) const;
+
+private:
+  struct Entry {
+    std::string key;
+    std::vector<std::string> responses;
+  };
+
+  uint32_t flags;
+  std::vector<Entry> entries;                          // in the order of the first exchange of the key
+  std::unordered_map<std::string, size_t> positions;   // key, position in entries
+};
+
+#endif //RESPONSE_DATABASE_H
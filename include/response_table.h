@@ -0,0 +1,234 @@
+/**
+ * Compiled APDU response table: maps command patterns to canned responses without scanning the patterns
+ */
+#ifndef RESPONSE_TABLE_H
+#define RESPONSE_TABLE_H
+
+#include <wintypes.h>
+#include <pcsclite.h>
+#include <cstdint>
+#include <cstddef>
+#include <istream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "card_cost_model.h"
+
+/**
+ * Node of the byte trie on the command bytes. The edges of a node are stored contiguously and sorted on their byte.
+ */
+struct TrieNode {
+  uint32_t firstEdge;
+  uint32_t edgeCount;
+  int32_t exact;       // response when the command ends in this node, -1 if none
+  int32_t prefix;      // response for all commands starting with the path to this node, -1 if none
+};
+
+/**
+ * Open addressed hash slot of a CLA/INS/P1/P2 pattern
+ */
+struct HeaderSlot {
+  uint32_t value;      // header & mask of the group
+  int32_t response;    // -1 for an empty slot
+};
+
+/**
+ * All header patterns which share the same mask, the number of slots is a power of 2
+ */
+struct HeaderGroup {
+  uint32_t mask;
+  uint32_t firstSlot;
+  uint32_t slotCount;
+};
+
+struct ResponseEntry {
+  uint32_t offset;
+  uint32_t length;
+};
+
+/**
+ * Read-only view on the flat arrays of a compiled response table. The arrays are either owned by a ResponseTable or
+ * generated at build time, so the view is a literal type.
+ *
+ * Matching order: exact command, longest command prefix, header patterns (most specific mask first), default.
+ * The lookup cost depends on the length of the command and the number of distinct masks, not on the number of
+ * responses in the table.
+ */
+struct ResponseTableView {
+  const TrieNode *nodes;
+  const unsigned char *edgeBytes;
+  const uint32_t *edgeChildren;
+  const HeaderGroup *groups;
+  uint32_t groupCount;
+  const HeaderSlot *slots;
+  const ResponseEntry *entries;
+  const unsigned char *responses;
+  int32_t defaultResponse;
+
+  /**
+   * Find the response for a command
+   * @param command command APDU
+   * @param command_lg length of the command APDU
+   * @param response out: the response (data + SW1 SW2)
+   * @param response_lg out: length of the response
+   * @return true if a response was found
+   */
+  bool match(const unsigned char *command, size_t command_lg, const unsigned char **response, size_t *response_lg) const;
+
+  static uint32_t slotOf(uint32_t value, uint32_t slotCount) {
+    uint32_t hash = value * 0x9E3779B1u;
+    hash ^= hash >> 15;
+    return hash & (slotCount - 1);
+  }
+};
+
+/**
+ * Builder and owner of a compiled response table
+ */
+class ResponseTable {
+public:
+  ResponseTable();
+
+  ResponseTable(ResponseTable &other) = delete;
+
+  ResponseTable &operator=(ResponseTable &other) = delete;
+
+  /**
+   * Respond to a command which matches exactly
+   */
+  void addExact(const std::vector<unsigned char> &command, const std::vector<unsigned char> &response);
+
+  /**
+   * Respond to all commands which start with the prefix
+   */
+  void addPrefix(const std::vector<unsigned char> &prefix, const std::vector<unsigned char> &response);
+
+  /**
+   * Respond to all commands where (CLA INS P1 P2 & mask) == (header & mask)
+   */
+  void addHeader(uint32_t header, uint32_t mask, const std::vector<unsigned char> &response);
+
+  /**
+   * Respond to all commands which do not match any pattern
+   */
+  void setDefault(const std::vector<unsigned char> &response);
+
+  /**
+   * Parse one line of the table format:
+   *   <hex command> => <hex response>            exact command
+   *   <hex prefix>* => <hex response>            command prefix
+   *   <hex CLA INS P1 P2>/<hex mask> => <hex response>
+   *   DEFAULT => <hex response>
+   * Whitespace inside the hex strings is ignored.
+   * @throw invalid_argument for a malformed line
+   */
+  void addLine(const std::string &line);
+
+  /**
+   * Build the flat arrays used for the matching. Must be called after the last add and before view().
+   */
+  void compile();
+
+  const ResponseTableView &view() const {
+    return compiled;
+  };
+
+  bool match(const unsigned char *command, size_t command_lg, const unsigned char **response, size_t *response_lg) const {
+    return compiled.match(command, command_lg, response, response_lg);
+  };
+
+  /**
+   * Number of patterns in the table
+   */
+  size_t size() const {
+    return patterns;
+  };
+
+  /**
+   * Write the compiled arrays as constexpr C++ definitions, followed by a constexpr ResponseTableView with the
+   * name <identifier>. Used to compile the built-in card profiles into the library.
+   */
+  void generate(std::ostream &out, const std::string &identifier) const;
+
+  /**
+   * Parse a string of hex digits, whitespace is skipped
+   * @throw invalid_argument for invalid digits or an odd number of digits
+   */
+  static std::vector<unsigned char> parseHex(const std::string &hex);
+
+private:
+  int32_t addResponse(const std::vector<unsigned char> &response);
+  uint32_t insert(const std::vector<unsigned char> &command);
+
+  // Compiled arrays
+  std::vector<TrieNode> nodes;
+  std::vector<unsigned char> edgeBytes;
+  std::vector<uint32_t> edgeChildren;
+  std::vector<HeaderGroup> groups;
+  std::vector<HeaderSlot> slots;
+  std::vector<ResponseEntry> entries;
+  std::vector<unsigned char> responses;
+
+  // Build state
+  std::vector<std::map<unsigned char, uint32_t>> children;
+  std::map<uint32_t, std::map<uint32_t, int32_t>> headers;
+  std::map<std::string, int32_t> uniqueResponses;
+  size_t patterns;
+  int32_t defaultResponse;
+
+  ResponseTableView compiled;
+};
+
+/**
+ * Definition of a table card, loaded from a text file:
+ *
+ *   # comment
+ *   ATR 3B 02 14 50
+ *   PROTOCOL T0 T1
+ *   00A4040007A0000000031010 => 9000
+ *   00B0*                    => 6982
+ *   80CA0000/FFFF0000        => 6A88
+ *   DEFAULT                  => 6D00
+ *   COST 2A 150000 0 20000
+ *   COST DEFAULT 2000 500
+ *
+ * See ResponseTable::addLine for the syntax of the patterns. A COST line defines the processing time of an
+ * instruction (INS or DEFAULT): fixed microseconds, optionally followed by nanoseconds per data byte and the maximum
+ * jitter in microseconds.
+ */
+struct CardTable {
+  std::vector<unsigned char> atr;
+  DWORD protocols;
+  ResponseTable responses;
+  std::vector<InstructionCostEntry> costs;
+
+  /**
+   * Parse a card table
+   * @throw invalid_argument when the table is malformed
+   */
+  static std::shared_ptr<CardTable> load(std::istream &in);
+
+  /**
+   * Parse a card table from a file
+   * @throw invalid_argument when the table is malformed
+   * @throw runtime_error when the file can't be opened
+   */
+  static std::shared_ptr<CardTable> loadFile(const std::string &path);
+
+  /**
+   * Parse the fields of a PROTOCOL line: T0 and/or T1
+   * @return the SCARD_PROTOCOL_* mask
+   * @throw invalid_argument for an unknown protocol
+   */
+  static DWORD parseProtocols(const std::string &fields);
+
+  /**
+   * Parse the fields of a COST line: INS (hex) or DEFAULT, fixed microseconds, [nanoseconds per byte], [jitter]
+   * @throw invalid_argument when the cost is malformed
+   */
+  static InstructionCostEntry parseCost(const std::string &fields);
+};
+
+#endif //RESPONSE_TABLE_H
@@ -0,0 +1,62 @@
+/**
+ * RSA private key with the CRT parameters
+ */
+#ifndef RSA_KEY_H
+#define RSA_KEY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "montgomery.h"
+
+/**
+ * RSA private key which computes the private operation with the Chinese remainder theorem. The Montgomery constants
+ * of the primes are computed once when the key is loaded, a private operation only uses the stack.
+ */
+class RsaPrivateKey {
+public:
+  /**
+   * The components are big endian numbers as in PKCS #1
+   * @throw invalid_argument when the components aren't consistent or the primes are larger than 2048 bits
+   */
+  RsaPrivateKey(const std::vector<unsigned char> &modulus, const std::vector<unsigned char> &publicExponent,
+                const std::vector<unsigned char> &p, const std::vector<unsigned char> &q,
+                const std::vector<unsigned char> &dp, const std::vector<unsigned char> &dq,
+                const std::vector<unsigned char> &qInverse);
+
+  /**
+   * Length of the modulus in bytes
+   */
+  size_t size() const { return modulusLg; };
+
+  size_t bits() const { return modulusBits; };
+
+  /**
+   * Big endian modulus without leading zero bytes
+   */
+  const std::vector<unsigned char> &modulus() const { return n; };
+
+  const std::vector<unsigned char> &publicExponent() const { return e; };
+
+  /**
+   * Raw private operation out = in^d mod n
+   * @param in input of size() bytes
+   * @param out output of size() bytes
+   * @return false when the input isn't smaller than the modulus
+   */
+  bool privateOperation(const unsigned char *in, unsigned char *out) const;
+
+private:
+  size_t modulusLg;
+  size_t modulusBits;
+  std::vector<unsigned char> n;
+  std::vector<unsigned char> e;
+  uint64_t nWords[2 * Montgomery::MAX_LIMBS];
+  Montgomery p;
+  Montgomery q;
+  uint64_t dp[Montgomery::MAX_LIMBS];
+  uint64_t dq[Montgomery::MAX_LIMBS];
+  uint64_t qInverse[Montgomery::MAX_LIMBS];
+};
+
+#endif //RSA_KEY_H
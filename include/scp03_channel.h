@@ -0,0 +1,115 @@
+/**
+ * Card side of the SCP03 secure channel protocol (GlobalPlatform Card Specification, Amendment D)
+ */
+#ifndef SCP03_CHANNEL_H
+#define SCP03_CHANNEL_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "aes.h"
+#include "smartcard.h"
+
+/**
+ * Static keys of a security domain: the key version number, K-ENC and K-MAC. The DEK is only used to wrap the keys
+ * of PUT KEY, which isn't simulated.
+ */
+struct Scp03Keys {
+  /**
+   * @throw invalid_argument when the keys don't have the same length of 16, 24 or 32 bytes
+   */
+  Scp03Keys(unsigned char version, const std::vector<unsigned char> &enc, const std::vector<unsigned char> &mac);
+
+  const unsigned char version;
+  const size_t keyLength;   // bytes, which is also the length of the session keys
+  const Aes enc;
+  const Aes mac;
+};
+
+/**
+ * SCP03 session in pseudo-random card challenge mode, with the "i" parameter 70 (R-MAC and R-ENCRYPTION supported).
+ * INITIALIZE UPDATE derives the session keys, EXTERNAL AUTHENTICATE checks the host cryptogram and opens the session
+ * with its security level. Then every command is unwrapped (C-MAC, C-DECRYPTION) and every response is wrapped
+ * (R-MAC, R-ENCRYPTION); a failure closes the session.
+ *
+ * The plain commands and the wrapped responses are kept in buffers of the channel which only grow, so the secured
+ * commands don't allocate once the buffers fit the largest APDU.
+ */
+class Scp03Channel {
+public:
+  // Bits of the security level
+  static const unsigned char C_MAC = 0x01;
+  static const unsigned char C_DECRYPTION = 0x02;
+  static const unsigned char R_MAC = 0x10;
+  static const unsigned char R_ENCRYPTION = 0x20;
+
+  Scp03Channel();
+
+  /**
+   * INITIALIZE UPDATE: start a session with the host challenge. The key diversification data, the key information,
+   * the card challenge, the card cryptogram and the sequence counter are appended to the response on success.
+   * @param aid AID of the security domain, which diversifies the card challenge
+   * @param sequenceCounter counter of the sessions of the security domain (shared by the logical channels), which is
+   *                        incremented by the new session
+   * @return the status word
+   */
+  uint16_t initializeUpdate(const Scp03Keys &keys, const std::vector<unsigned char> &aid, uint32_t &sequenceCounter,
+                            const ApduView &apdu, ApduResponse &response);
+
+  /**
+   * EXTERNAL AUTHENTICATE: check the C-MAC and the host cryptogram, then open the session with the security level
+   * of P1
+   * @return the status word
+   */
+  uint16_t externalAuthenticate(const ApduView &apdu);
+
+  /**
+   * Check the C-MAC of a command of the open session and decrypt its data
+   * @param plain the command without secure messaging, the data is in the buffer of the channel until the next
+   *              command and raw still is the secured command
+   * @return 9000, otherwise the status word of the failure which closed the session
+   */
+  uint16_t unwrap(const ApduView &apdu, ApduView &plain);
+
+  /**
+   * Apply the response security level of the open session: encrypt the response data and add the R-MAC. The response
+   * then references the buffer of the channel.
+   */
+  void wrap(ApduResponse &response);
+
+  void close();
+
+  bool isOpen() const { return state == State::OPEN; };
+
+  unsigned char getSecurityLevel() const { return securityLevel; };
+
+private:
+  enum class State {
+    CLOSED,
+    INITIALIZED,    // INITIALIZE UPDATE done, EXTERNAL AUTHENTICATE expected
+    OPEN
+  };
+
+  /**
+   * Verify the C-MAC of the command, which is the last 8 bytes of the data, and update the MAC chaining value
+   */
+  bool verifyMac(const ApduView &apdu);
+
+  /**
+   * Initial vector of C-DECRYPTION or R-ENCRYPTION, the encryption of the encryption counter
+   */
+  void initialVector(bool response, unsigned char *iv) const;
+
+  State state;
+  std::unique_ptr<Aes> sessionEnc;
+  std::unique_ptr<Aes> sessionMac;
+  std::unique_ptr<Aes> sessionRmac;
+  unsigned char context[16];               // host challenge and card challenge
+  unsigned char chaining[Aes::BLOCK_SIZE]; // MAC chaining value
+  unsigned char counter[Aes::BLOCK_SIZE];  // encryption counter
+  unsigned char securityLevel;
+  std::vector<unsigned char> plainData;    // data of the unwrapped command
+  std::vector<unsigned char> wrapped;      // wrapped response
+};
+
+#endif //SCP03_CHANNEL_H
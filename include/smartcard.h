@@ -0,0 +1,494 @@
+/**
+ * Smartcard simulator base class and the APDU helpers shared by the card implementations
+ */
+#ifndef SMARTCARD_H
+#define SMARTCARD_H
+
+#include <wintypes.h>
+#include <winscard.h>
+#include <pcsclite.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "missing_stl.h"
+#include "card_cost_model.h"
+#include "response_cache.h"
+
+/**
+ * Non-owning view on a command APDU, which decodes the header and the body (short and extended length) following
+ * ISO 7816-4. The view is only valid as long as the command buffer exists.
+ *
+ * The logical channel is taken out of the CLA: cla is the class of the command on the basic channel, the further
+ * interindustry classes (channels 4 to 19) are mapped to the first interindustry coding with their chaining and
+ * secure messaging bits. The raw command keeps the CLA as it was sent.
+ */
+struct ApduView {
+  /**
+   * Decode the command APDU
+   * @param command the command bytes
+   * @param command_lg length of the command
+   */
+  ApduView(const unsigned char *command, size_t command_lg);
+
+  /**
+   * CLA, INS, P1 and P2 packed big endian in one word, which is used for the pattern matching
+   */
+  uint32_t header() const {
+    return (static_cast<uint32_t>(cla) << 24) | (static_cast<uint32_t>(ins) << 16) |
+           (static_cast<uint32_t>(p1) << 8) | static_cast<uint32_t>(p2);
+  }
+
+  const unsigned char *raw;
+  size_t rawLg;
+  unsigned char cla;
+  unsigned char ins;
+  unsigned char p1;
+  unsigned char p2;
+  unsigned char channel;   // logical channel, 0 to 19
+  const unsigned char *data;
+  size_t lc;
+  size_t ne;       // maximum number of response data bytes expected, 0 when there is no Le field
+  bool hasLe;
+  bool extended;
+  bool valid;      // false when the length fields are not consistent with the command length
+};
+
+/**
+ * Response of a smartcard. A card either writes the response into the scratch buffer of the caller or references
+ * its own read-only storage, which must stay valid until the next command to the card.
+ */
+class ApduResponse {
+public:
+  ApduResponse(unsigned char *buffer, size_t capacity) :
+    scratch(buffer), scratchLg(capacity), response(buffer), responseLg(0), required(0) {
+  };
+
+  /**
+   * Reference a response in the storage of the card (zero copy)
+   */
+  void reference(const unsigned char *data, size_t data_lg) {
+    response = data;
+    responseLg = data_lg;
+    required = data_lg;
+  }
+
+  /**
+   * Append data to the response in the scratch buffer
+   * @return false when the scratch buffer is too small
+   */
+  bool append(const unsigned char *data, size_t data_lg) {
+    if (response != scratch) {
+      clear();
+    }
+    required += data_lg;
+    if (responseLg + data_lg > scratchLg) {
+      return false;
+    }
+    if (data_lg > 0) {
+      memcpy(scratch + responseLg, data, data_lg);
+    }
+    responseLg += data_lg;
+    return true;
+  }
+
+  /**
+   * Append the status word to the response in the scratch buffer
+   */
+  bool status(uint16_t sw) {
+    const unsigned char bytes[] = { static_cast<unsigned char>(sw >> 8), static_cast<unsigned char>(sw) };
+    return append(bytes, sizeof(bytes));
+  }
+
+  void clear() {
+    response = scratch;
+    responseLg = 0;
+    required = 0;
+  }
+
+  const unsigned char *data() const { return response; };
+
+  size_t length() const { return responseLg; };
+
+  /**
+   * Length of the complete response, which is larger than length() when the scratch buffer overflowed
+   */
+  size_t requiredLength() const { return required; };
+
+  bool overflow() const { return required > responseLg; };
+
+private:
+  unsigned char *scratch;
+  size_t scratchLg;
+  const unsigned char *response;
+  size_t responseLg;
+  size_t required;
+};
+
+class SmartCard;
+
+/**
+ * Immutable definition of a type of smartcard (flyweight): the ATR, the sharing mode, the protocols, the cost model
+ * and the data of the implementation (response table, file system image, ...). A template is shared by all the cards
+ * of its type, which only hold their mutable state, and is the factory of these cards.
+ */
+class CardTemplate : public std::enable_shared_from_this<CardTemplate> {
+public:
+  CardTemplate(std::vector<unsigned char> atr, DWORD sharingMode, DWORD protocols,
+               std::shared_ptr<const CardCostModel> costs = nullptr) :
+    atr(std::move(atr)), sharingMode(sharingMode), protocols(protocols), costs(std::move(costs)) {
+  };
+
+  CardTemplate(const CardTemplate &other) = delete;
+
+  CardTemplate &operator=(const CardTemplate &other) = delete;
+
+  virtual ~CardTemplate() = default;
+
+  /**
+   * Create a card of this template, the template must be owned by a shared_ptr
+   */
+  virtual std::unique_ptr<SmartCard> instantiate() const = 0;
+
+  const std::vector<unsigned char> atr;
+  const DWORD sharingMode;
+  const DWORD protocols;
+  const std::shared_ptr<const CardCostModel> costs;
+};
+
+/**
+ * Smartcard virtual simulator base class. The specific implemenations wlll have to override the execute
+ * function
+ */
+class SmartCard {
+public:
+  /**
+   * Constructor which will define the behavior of sharing mode and the supported protocols by the template of the card
+   * Must be called by the derived class
+   * @param cardTemplate
+   */
+  explicit SmartCard(std::shared_ptr<const CardTemplate> cardTemplate) :
+    cardTemplate(std::move(cardTemplate)),
+    disposition(SCARD_LEAVE_CARD),
+    processingTime(0),
+    jitterState(0x9E3779B9),
+    openChannels(1),
+    stateEpoch(0) {
+  };
+
+  virtual ~SmartCard() = default;
+
+  /**
+   * Connect to the smartcard, which will verify the supported sharingMode and protocols. The connect function returns
+   * a handle to the smartcard and the active protocol: T=1 when both the card and the caller support it, otherwise T=0.
+   *
+   * @param dwShareMode
+   * @param dwPreferredProtocols
+   * @param phCard
+   * @param pdwActiveProtocol
+   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE
+   */
+  DWORD connect(DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol) {
+
+    if (dwShareMode != cardTemplate->sharingMode) {
+      return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
+    }
+    DWORD protocols = dwPreferredProtocols & cardTemplate->protocols;
+    if (protocols == 0) {
+      return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
+    }
+    DWORD activeProtocol = (protocols & SCARD_PROTOCOL_T1) ? static_cast<DWORD>(SCARD_PROTOCOL_T1) : protocols;
+
+    auto context = std::make_unique<struct SmartCardContext>(dwShareMode, activeProtocol, false);
+    std::lock_guard<std::mutex> lock(cardMutex);
+    scardHandles[++scardHandleIndex] = std::move(context);
+    *phCard = scardHandleIndex;
+    *pdwActiveProtocol = activeProtocol;
+
+    return SCARD_S_SUCCESS;
+  };
+
+  /**
+   * Disconnect from the smartcard with extra action to take for the card during the disconnect
+   *
+   * @param handle The handle of the Smartcard to disconnect
+   * @param disposition action to take of the smartcard
+   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_HANDLE
+   */
+  DWORD disconnect(SCARDHANDLE handle, DWORD dwDisposition) {
+    std::lock_guard<std::mutex> lock(cardMutex);
+    if (scardHandles.erase(handle) == 0) {
+      return static_cast<DWORD>(SCARD_E_INVALID_HANDLE);
+    }
+    disposition = dwDisposition;
+    return SCARD_S_SUCCESS;
+  }
+
+  /**
+   * Begin multiple calls to the Smartcard
+   * @param handle The handle to the smartcard
+   * @return SCARD_S_SUCCESS, SCARD_E_SHARING_VIOLATION, SCARD_E_INVALID_HANDLE
+   */
+  DWORD beginTransaction(SCARDHANDLE handle) {
+    std::lock_guard<std::mutex> lock(cardMutex);
+    try {
+      if (scardHandles.at(handle)->transaction)
+        return SCARD_E_SHARING_VIOLATION;
+
+      scardHandles.at(handle)->transaction = true;
+      return SCARD_S_SUCCESS;
+    }
+    catch (std::out_of_range &oor) {
+      return SCARD_E_INVALID_HANDLE;
+    }
+  }
+
+  /**
+   * End multiple calls to the Smartcard
+   * @param handle The handle to the smartcard
+   * @return SCARD_S_SUCCESS, SCARD_E_SHARING_VIOLATION, SCARD_E_INVALID_HANDLE
+   */
+  DWORD endTransaction(SCARDHANDLE handle, DWORD dwDisposition) {
+    std::lock_guard<std::mutex> lock(cardMutex);
+    try {
+      if (!scardHandles.at(handle)->transaction)
+        return SCARD_E_NOT_TRANSACTED;
+
+      scardHandles.at(handle)->transaction = false;
+      disposition = dwDisposition;
+
+      if (disposition == SCARD_RESET_CARD)
+        return SCARD_W_RESET_CARD;
+
+      return SCARD_S_SUCCESS;
+    }
+    catch (std::out_of_range &oor) {
+      return SCARD_E_INVALID_HANDLE;
+    }
+  }
+
+  /**
+   * Send a command APDU to the smartcard over a connected handle. The response is either written in the scratch buffer
+   * of the response or references the storage of the card or the scratch buffer of the calling thread, which stays
+   * valid until the next command sent by the thread. The commands of the threads which share the card (on the same or
+   * on different handles) are executed one after the other.
+   *
+   * The transport behaviour of the active protocol is emulated on top of the card implementation:
+   * - response data which doesn't fit Le is kept in the buffer of the handle and returned with SW 61xx, to be read
+   *   with GET RESPONSE (also for case 4 commands on T=0, which can't return data in the same exchange)
+   * - SW 6Cxx when Le is wrong and the exact length fits a short Le
+   * - extended length commands are only accepted on T=1
+   * The processing time of the command according to the cost model is available with getProcessingTime.
+   *
+   * @param handle handle to the smartcard
+   * @param in_apdu APDU command
+   * @param in_apdu_lg length of the APDU command
+   * @param response APDU response
+   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_HANDLE, SCARD_E_INSUFFICIENT_BUFFER + errors of the implementation
+   */
+  DWORD transmit(SCARDHANDLE handle, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response);
+
+  /**
+   * Function to override by the specific implemented Smartcard. The command is on an open logical channel
+   * (apdu.channel), MANAGE CHANNEL is handled by the base class.
+   *
+   * @param handle handle to the smartcard
+   * @param apdu decoded APDU command
+   * @param response APDU response (data followed by SW1 SW2)
+   * @return SCARD_S_SUCCESS
+   */
+  virtual DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) = 0;
+
+  /**
+   * Processing time of the last command according to the cost model of the card, 0 without cost model
+   */
+  std::chrono::nanoseconds getProcessingTime() const {
+    std::lock_guard<std::mutex> lock(cardMutex);
+    return processingTime;
+  }
+
+  DWORD getPreferredProtocol() const {
+    return cardTemplate->protocols;
+  }
+
+  /**
+   * Protocol negotiated by connect for the handle
+   * @return SCARD_PROTOCOL_T0, SCARD_PROTOCOL_T1 or 0 for an invalid handle
+   */
+  DWORD getActiveProtocol(SCARDHANDLE handle) const {
+    std::lock_guard<std::mutex> lock(cardMutex);
+    auto context = scardHandles.find(handle);
+    return (context == scardHandles.end()) ? 0 : context->second->protocol;
+  }
+
+  /**
+   * ATR of the card, shared with the cards of the same template
+   */
+  const std::vector<unsigned char> &getATR() const {
+    return cardTemplate->atr;
+  };
+
+  const std::shared_ptr<const CardTemplate> &getTemplate() const {
+    return cardTemplate;
+  }
+
+  /**
+   * Static member function for the factory method to instantiate the supported Smartcards: the template of the card
+   * is looked up and only the state of the new card is allocated.
+   * @param impl
+   * @return smart pointer to the SmartCard object
+   */
+  static std::unique_ptr<SmartCard> instance_of(const std::string &impl);
+
+  /**
+   * Template of a built-in or registered card
+   * @return the template or nullptr when there is no card with that name
+   */
+  static std::shared_ptr<const CardTemplate> template_of(const std::string &impl);
+
+  /**
+   * Register a card implementation at runtime, which can be instantiated afterwards by instance_of
+   *
+   * @param card name of the card used by instance_of
+   * @param type type of the card implementation ("table", "fs", "piv", "emv", "gp", "multi",
+   *             "replay")
+   * @param source file which contains the definition of the card
+   * @return SCARD_S_SUCCESS, SCARD_E_CARD_UNSUPPORTED, SCARD_E_FILE_NOT_FOUND, SCARD_E_INVALID_VALUE
+   */
+  static DWORD register_implementation(const std::string &card, const std::string &type, const std::string &source);
+
+  /**
+   * Load the template of a card implementation from its definition file
+   * @param type type of the card implementation, see register_implementation
+   * @return the template or nullptr for an unknown type
+   * @throw invalid_argument when the definition is malformed
+   * @throw runtime_error when a file can't be read
+   */
+  static std::shared_ptr<const CardTemplate> load_template(const std::string &type, const std::string &source);
+
+  /**
+   * Register the template of a card name
+   */
+  static void register_implementation(const std::string &card, std::shared_ptr<const CardTemplate> cardTemplate);
+
+  /**
+   * Memoize the responses of the deterministic commands of the card (see isCacheable) in an LRU cache of the given
+   * number of responses, 0 removes the cache. The cost model still applies to the responses of the cache.
+   * @throw invalid_argument for a capacity which can't be indexed
+   */
+  void setResponseCache(size_t capacity) {
+    std::lock_guard<std::mutex> lock(cardMutex);
+    responseCache = (capacity == 0) ? nullptr : std::make_unique<ResponseCache>(capacity);
+  }
+
+  /**
+   * @return the counters of the response cache or nullptr without cache
+   */
+  const ResponseCacheCounters *getResponseCacheCounters() const {
+    return responseCache ? &responseCache->getCounters() : nullptr;
+  }
+
+  /**
+   * Number of state changes of the card, which is part of the key of the cached responses
+   */
+  uint64_t getStateEpoch() const {
+    return stateEpoch;
+  }
+
+  static const unsigned int MAX_CHANNELS = 20;
+
+  /**
+   * @return true when the logical channel is open, the basic channel is always open
+   */
+  bool isChannelOpen(unsigned int channel) const {
+    return (channel < MAX_CHANNELS) && (((openChannels >> channel) & 1) != 0);
+  }
+
+protected:
+  /**
+   * Reset the state of a logical channel (selected application, security state) when MANAGE CHANNEL opens or closes
+   * it. The cards keep the state of the channels in arrays of MAX_CHANNELS entries indexed by apdu.channel.
+   */
+  virtual void resetChannel(unsigned int channel) {
+    (void)channel;
+  }
+
+  /**
+   * Commands of which the response only depends on the command bytes and on the state of the card, which can be
+   * answered by the response cache. The other commands are considered to change the state. A cacheable command which
+   * changes the state anyway (SELECT of another file) must call stateChanged, then its response isn't cached.
+   */
+  virtual bool isCacheable(const ApduView &apdu) const {
+    (void)apdu;
+    return false;
+  }
+
+  /**
+   * Start a new state epoch, the cached responses of the previous states are no longer used
+   */
+  void stateChanged() {
+    stateEpoch++;
+  }
+
+private:
+  // The multi-application card drives the channels of its applications
+  friend class MultiApplicationSmartCard;
+
+  // Largest response data of a card, kept for GET RESPONSE
+  static const size_t MAX_PENDING_SIZE = 65536;
+
+  struct SmartCardContext {
+    SmartCardContext(DWORD dwSharingMode, DWORD dwProtocol, bool bTransaction) :
+      sharingMode(dwSharingMode), protocol(dwProtocol), transaction(bTransaction),
+      pending(new unsigned char[MAX_PENDING_SIZE]), pendingOffset(0), pendingLg(0), pendingSW(0) {
+    };
+
+    DWORD sharingMode;
+    DWORD protocol;
+    bool  transaction;
+
+    // Response chaining: response data which is kept for GET RESPONSE. The buffer is allocated at the connection for
+    // the largest response and reused for every chained response of the handle.
+    std::unique_ptr<unsigned char[]> pending;
+    size_t pendingOffset;
+    size_t pendingLg;
+    uint16_t pendingSW;
+  };
+
+  /**
+   * Reply with the next part of the pending response data, followed by SW 61xx when more data is available or by the
+   * status word of the card for the last part
+   */
+  void replyPending(SmartCardContext &context, size_t count, ApduResponse &response);
+
+  /**
+   * MANAGE CHANNEL: open a logical channel (P1 00), chosen by the card when P2 is 00, or close the channel of P2
+   * (P1 80, P2 00 for the channel of the command). A new channel starts without selected application.
+   */
+  void manageChannel(const ApduView &apdu, ApduResponse &response);
+
+  /**
+   * execute between the USDT probes of the card
+   */
+  DWORD executeProbed(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response);
+
+  std::shared_ptr<const CardTemplate> cardTemplate;
+  SCARDHANDLE scardHandleIndex{0};
+  std::unordered_map<SCARDHANDLE, std::unique_ptr<SmartCardContext>> scardHandles;
+  DWORD disposition;
+  std::chrono::nanoseconds processingTime;
+  uint32_t jitterState;     // xorshift32, the jitter is reproducible for a card
+  uint32_t openChannels;    // bit per logical channel
+  uint64_t stateEpoch;
+  std::unique_ptr<ResponseCache> responseCache;   // null when the responses aren't memoized
+  // The handles and the state of the card are shared by the threads which use the card, see transmit
+  mutable std::mutex cardMutex;
+};
+
+#endif //SMARTCARD_H
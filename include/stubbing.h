@@ -58,6 +58,12 @@ void clear_stubbing(const char *module);
 
 void clear_modules();
 
+/**
+ * Number of return codes which differed from the default return code of the function, since the start of the process
+ * @return
+ */
+unsigned long long get_injected_return_codes();
+
 #ifdef __cplusplus
 };
 #endif
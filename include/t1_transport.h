@@ -0,0 +1,128 @@
+/**
+ * Block level simulation of the T=1 transmission protocol (ISO 7816-3) between a reader and a smartcard
+ */
+#ifndef T1_TRANSPORT_H
+#define T1_TRANSPORT_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "smartcard.h"
+
+/**
+ * Number of blocks and bytes exchanged on the T=1 link. The bytes include the prologue (NAD, PCB, LEN) and the
+ * epilogue (LRC) of every block.
+ */
+struct T1BlockCounters {
+  unsigned long apdus;
+  unsigned long iBlocks;
+  unsigned long rBlocks;
+  unsigned long sBlocks;
+  unsigned long bytesToCard;
+  unsigned long bytesFromCard;
+  unsigned long waitingTimeExtensions;
+};
+
+/**
+ * T=1 engine which plays both ends of the link. The reader segments the command APDU into I-blocks of at most IFSC
+ * bytes, the card acknowledges every chained block with an R-block and reassembles the command. The response is
+ * returned in I-blocks of at most IFSD bytes, acknowledged by the reader. The IFSD is announced with an S(IFS)
+ * exchange after the card is powered. When the processing time of the card exceeds the block waiting time (BWT), the
+ * card requests waiting time extensions with S(WTX) blocks. Every block is encoded with its sequence number and
+ * LRC so that its size on the wire is counted, both ends being simulated together the blocks are not validated again
+ * on reception.
+ */
+class T1Transport {
+public:
+  static const size_t DEFAULT_IFS = 32;
+  static const size_t MAX_IFS = 254;
+
+  /**
+   * BWT for the default BWI of 4 at 3.5712 MHz
+   */
+  static constexpr std::chrono::milliseconds DEFAULT_BWT{1600};
+
+  /**
+   * @param ifsc maximum information field size of the card (1-254)
+   * @param ifsd maximum information field size of the reader (1-254)
+   * @throws std::invalid_argument when the sizes are out of range
+   */
+  T1Transport(size_t ifsc, size_t ifsd);
+
+  T1Transport(const T1Transport &other) = delete;
+
+  T1Transport &operator=(const T1Transport &other) = delete;
+
+  /**
+   * Start a new session with the card: sequence numbers are reset and the IFSD is negotiated again
+   */
+  void reset();
+
+  /**
+   * Exchange a command APDU with the card over T=1 blocks
+   *
+   * @param card the smartcard
+   * @param handle handle to the smartcard
+   * @param in_apdu APDU command
+   * @param in_apdu_lg length of the APDU command
+   * @param response APDU response, which references the buffer of the transport
+   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER when the command is too long, SCARD_E_INSUFFICIENT_BUFFER
+   * when the response is too long + errors of the smartcard
+   */
+  DWORD transceive(SmartCard &card, SCARDHANDLE handle, const unsigned char *in_apdu, size_t in_apdu_lg,
+                   ApduResponse &response);
+
+  /**
+   * Blocks exchanged for the last APDU (apdus is 1)
+   */
+  const T1BlockCounters &lastApdu() const { return last; };
+
+  /**
+   * Blocks exchanged since the transport was created
+   */
+  const T1BlockCounters &total() const { return totals; };
+
+  size_t getIFSC() const { return ifsc; };
+
+  size_t getIFSD() const { return ifsd; };
+
+  void setBlockWaitingTime(std::chrono::nanoseconds bwt) { blockWaitingTime = bwt; };
+
+private:
+  /**
+   * Encode a block in the wire buffer
+   * @return length of the block
+   */
+  size_t encodeBlock(unsigned char pcb, const unsigned char *inf, size_t inf_lg);
+
+  /**
+   * Send the block in the wire buffer to the card or to the reader and count it
+   */
+  void sendBlock(size_t block_lg, bool toCard);
+
+  void negotiateIFSD();
+
+  /**
+   * S(WTX) exchanges of the card to cover its processing time
+   */
+  void extendWaitingTime(std::chrono::nanoseconds processing);
+
+  size_t ifsc;
+  size_t ifsd;
+  bool ifsdNegotiated;
+  unsigned char readerSequence;   // N(S) of the next I-block of the reader
+  unsigned char cardSequence;     // N(S) of the next I-block of the card
+  std::chrono::nanoseconds blockWaitingTime;
+
+  T1BlockCounters last;
+  T1BlockCounters totals;
+
+  // Buffers are allocated once: a block on the wire, the command reassembled by the card, the scratch buffer of the
+  // card and the response reassembled by the reader
+  std::vector<unsigned char> wire;
+  std::vector<unsigned char> command;
+  std::vector<unsigned char> cardScratch;
+  std::vector<unsigned char> reply;
+};
+
+#endif //T1_TRANSPORT_H
@@ -0,0 +1,74 @@
+/**
+ * Smartcard which is defined declaratively by a table of command patterns and responses
+ */
+#ifndef TABLE_SMARTCARD_H
+#define TABLE_SMARTCARD_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "smartcard.h"
+#include "response_table.h"
+#include "card_profile.h"
+
+class TableSmartCard;
+
+/**
+ * Immutable part of the table cards of the same name: ATR, responses and cost model. The template is created once,
+ * when the card is registered, and shared by all its cards.
+ */
+class TableCardTemplate : public CardTemplate {
+public:
+  explicit TableCardTemplate(std::shared_ptr<const CardTable> definition) :
+    CardTemplate(definition->atr, SCARD_SHARE_SHARED, definition->protocols,
+                 definition->costs.empty() ? nullptr :
+                 std::make_shared<CardCostModel>(definition->costs.data(), definition->costs.size())),
+    responses(&definition->responses.view()),
+    table(std::move(definition)) {
+  };
+
+  explicit TableCardTemplate(const CardProfile &profile) :
+    CardTemplate(std::vector<unsigned char>(profile.atr, profile.atr + profile.atrLg), SCARD_SHARE_SHARED,
+                 profile.protocols,
+                 (profile.costCount == 0) ? nullptr : std::make_shared<CardCostModel>(profile.costs, profile.costCount)),
+    responses(&profile.responses),
+    table(nullptr) {
+  };
+
+  std::unique_ptr<SmartCard> instantiate() const override;
+
+  const ResponseTableView *const responses;
+
+private:
+  std::shared_ptr<const CardTable> table;   // keeps the responses of a runtime table alive
+};
+
+/**
+ * Smartcard answering with the responses of a card table. The table is shared by all the cards of the same name,
+ * either loaded at runtime or compiled in the library as a built-in profile.
+ */
+class TableSmartCard : public SmartCard {
+public:
+  explicit TableSmartCard(std::shared_ptr<const TableCardTemplate> cardTemplate) :
+    SmartCard(cardTemplate),
+    responses(cardTemplate->responses) {
+  };
+
+  explicit TableSmartCard(std::shared_ptr<const CardTable> definition) :
+    TableSmartCard(std::make_shared<TableCardTemplate>(std::move(definition))) {
+  };
+
+  explicit TableSmartCard(const CardProfile &profile) :
+    TableSmartCard(std::make_shared<TableCardTemplate>(profile)) {
+  };
+
+  /**
+   * Answer with the response of the best matching pattern, the response is not copied
+   */
+  DWORD execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) override;
+
+private:
+  const ResponseTableView *responses;   // owned by the template
+};
+
+#endif //TABLE_SMARTCARD_H
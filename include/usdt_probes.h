@@ -0,0 +1,41 @@
+/**
+ * USDT probes of the stub, for perf and bpftrace
+ */
+#ifndef USDT_PROBES_H
+#define USDT_PROBES_H
+
+/**
+ * Static probes of the provider winscard_stub, compiled in when WINSCARD_STUB_USDT is defined (the CMake option of the
+ * same name, when <sys/sdt.h> is installed). A probe is a nop instruction and an ELF note while no tracer is attached,
+ * the arguments are only read by the tracer.
+ *
+ *   call_entry(function, handle)                                  entry of a PC/SC function or of a function of the
+ *                                                                 stub, function is TraceFunction
+ *   call_return(function, handle, input_lg, output_lg, result)    return of a PC/SC function, the lengths of the APDUs
+ *                                                                 of SCardTransmit and the buffers of SCardControl
+ *   card_execute_entry(handle, ins, lc)                           command executed by the implementation of a card
+ *   card_execute_return(handle, ins, response_lg, result)
+ *
+ * The ctest usdt_probes checks the notes of the library with readelf -n when the probes are compiled in.
+ *
+ * e.g. bpftrace -e 'usdt:<program>:winscard_stub:call_return /arg4 != 0/ { @[arg0, arg4] = count(); }'
+ */
+#ifdef WINSCARD_STUB_USDT
+#include <sys/sdt.h>
+
+#define USDT_CALL_ENTRY(function, handle) \
+  DTRACE_PROBE2(winscard_stub, call_entry, static_cast<unsigned int>(function), handle)
+#define USDT_CALL_RETURN(function, handle, input_lg, output_lg, result) \
+  DTRACE_PROBE5(winscard_stub, call_return, static_cast<unsigned int>(function), handle, input_lg, output_lg, result)
+#define USDT_CARD_EXECUTE_ENTRY(handle, ins, lc) \
+  DTRACE_PROBE3(winscard_stub, card_execute_entry, handle, ins, lc)
+#define USDT_CARD_EXECUTE_RETURN(handle, ins, response_lg, result) \
+  DTRACE_PROBE4(winscard_stub, card_execute_return, handle, ins, response_lg, result)
+#else
+#define USDT_CALL_ENTRY(function, handle) do {} while (0)
+#define USDT_CALL_RETURN(function, handle, input_lg, output_lg, result) do {} while (0)
+#define USDT_CARD_EXECUTE_ENTRY(handle, ins, lc) do {} while (0)
+#define USDT_CARD_EXECUTE_RETURN(handle, ins, response_lg, result) do {} while (0)
+#endif
+
+#endif //USDT_PROBES_H
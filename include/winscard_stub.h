@@ -1,6 +1,7 @@
 #ifndef WINSCARD_STUB_LIBRARY_H
 #define WINSCARD_STUB_LIBRARY_H
 
+#include <stdint.h>
 #include <wintypes.h>
 #include <winscard.h>
 
@@ -18,10 +19,345 @@ extern "C" {
  */
 PCSC_API LONG SCardAttachReader(SCARDCONTEXT hContext, LPCSTR szReader);
 
+#define SCARD_LATENCY_SLEEP           1   /**< Block the caller for the duration of the exchanges */
+#define SCARD_LATENCY_VIRTUAL_CLOCK   2   /**< Only advance the clock of the reader */
+
+/**
+ * Latency model of a reader: the card interface runs at the baud rate of TA1 in the ATR of the inserted card, every
+ * exchange adds a fixed overhead for the CCID/USB transfers
+ */
+typedef struct {
+  DWORD dwMode;                   /**< SCARD_LATENCY_SLEEP or SCARD_LATENCY_VIRTUAL_CLOCK */
+  DWORD dwClockFrequency;         /**< clock of the card in Hz, 0 for 3.5712 MHz */
+  DWORD dwOverheadMicroseconds;   /**< fixed overhead of every APDU exchange */
+} SCARD_LATENCY_MODEL;
+
+/**
+ * Attach a reader of which the APDU exchanges take time according to a latency model
+ * @param hContext
+ * @param szReader
+ * @param pModel
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE, SCARD_E_UNKNOWN_READER, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardAttachReaderWithLatency(SCARDCONTEXT hContext, LPCSTR szReader, const SCARD_LATENCY_MODEL *pModel);
+
+/**
+ * Replace the latency model of an attached reader
+ * @param hContext
+ * @param szReader
+ * @param pModel the new latency model, NULL removes the latency
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE, SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardConfigureReaderLatency(SCARDCONTEXT hContext, LPCSTR szReader, const SCARD_LATENCY_MODEL *pModel);
+
+/**
+ * Time spent in the APDU exchanges of a reader according to its latency model (the virtual clock)
+ * @param hContext
+ * @param szReader
+ * @param pullNanoseconds
+ * @return SCARD_S_SUCCESS, SCARD_E_UNSUPPORTED_FEATURE, SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardGetReaderElapsedTime(SCARDCONTEXT hContext, LPCSTR szReader, uint64_t *pullNanoseconds);
+
 PCSC_API LONG SCardInsertSmartCardInReader(SCARDCONTEXT hContext, LPCSTR szReader, LPCSTR szCard);
 
 PCSC_API LONG SCardRemoveSmartCardFromReader(SCARDCONTEXT hContext, LPCSTR szReader);
 
+/**
+ * Register a new smartcard, which can be inserted afterwards with SCardInsertSmartCardInReader
+ * @param szCard name of the new smartcard
+ * @param szType implementation of the smartcard: "table" (card defined by a table of APDU responses), "fs" (card
+ *               with the ISO 7816-4 file system of a memory-mapped image, see file_system_image.h), "piv" (PIV card
+ *               with keys from local files, see piv_smartcard.h), "emv" (EMV payment card, see emv_smartcard.h),
+ *               "gp" (GlobalPlatform card manager, see global_platform_smartcard.h), "multi" (card with several
+ *               applications selected by AID, see multi_application_smartcard.h) or "replay" (card which replays
+ *               the responses of a trace of SCardStartTrace, see replay_smartcard.h)
+ * @param szSource file with the definition of the smartcard
+ * @return SCARD_S_SUCCESS, SCARD_E_CARD_UNSUPPORTED, SCARD_E_FILE_NOT_FOUND, SCARD_E_INVALID_VALUE
+ */
+PCSC_API LONG SCardRegisterSmartCard(LPCSTR szCard, LPCSTR szType, LPCSTR szSource);
+
+/**
+ * Block counters of the T=1 simulation of a reader. The bytes include the prologue and epilogue of the blocks.
+ */
+typedef struct {
+  DWORD dwApdus;
+  DWORD dwIBlocks;
+  DWORD dwRBlocks;
+  DWORD dwSBlocks;
+  DWORD dwBytesToCard;
+  DWORD dwBytesFromCard;
+  DWORD dwWaitingTimeExtensions;  /**< S(WTX) requests of the card for long operations */
+} SCARD_T1_COUNTERS;
+
+/**
+ * Simulate the T=1 block exchanges (I-blocks, chaining with R-blocks, S(IFS) negotiation) of a reader for the cards
+ * connected with T=1
+ * @param hContext
+ * @param szReader
+ * @param dwIFSC maximum information field size of the card (1-254), 0 disables the simulation
+ * @param dwIFSD maximum information field size of the reader (1-254), 0 disables the simulation
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE, SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardConfigureReaderT1(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwIFSC, DWORD dwIFSD);
+
+/**
+ * Block counters of the T=1 simulation of a reader
+ * @param hContext
+ * @param szReader
+ * @param pLastApdu blocks exchanged for the last APDU
+ * @param pTotal blocks exchanged since the simulation was configured
+ * @return SCARD_S_SUCCESS, SCARD_E_UNSUPPORTED_FEATURE, SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardGetReaderT1Counters(SCARDCONTEXT hContext, LPCSTR szReader, SCARD_T1_COUNTERS *pLastApdu,
+                                       SCARD_T1_COUNTERS *pTotal);
+
+#define SCARD_GP_PHASE_SELECT               0
+#define SCARD_GP_PHASE_INSTALL_FOR_LOAD     1
+#define SCARD_GP_PHASE_LOAD                 2
+#define SCARD_GP_PHASE_INSTALL_FOR_INSTALL  3
+#define SCARD_GP_PHASE_DELETE               4
+#define SCARD_GP_PHASE_AUTHENTICATE         5   /**< INITIALIZE UPDATE and EXTERNAL AUTHENTICATE of SCP03 */
+#define SCARD_GP_PHASES                     6
+
+/**
+ * Counters of a provisioning phase of a GlobalPlatform card
+ */
+typedef struct {
+  DWORD dwCommands;
+  uint64_t ullBytes;                  /**< command data bytes */
+  uint64_t ullProcessingNanoseconds;  /**< time spent by the card simulator in the commands */
+  uint64_t ullElapsedNanoseconds;     /**< wall time of the runs of consecutive commands, including the caller */
+} SCARD_GP_PHASE_COUNTERS;
+
+typedef struct {
+  SCARD_GP_PHASE_COUNTERS rgPhases[SCARD_GP_PHASES];   /**< indexed by SCARD_GP_PHASE_xxx */
+  DWORD dwLoadFiles;
+  DWORD dwApplets;
+} SCARD_GP_COUNTERS;
+
+/**
+ * Counters of the provisioning phases of the GlobalPlatform card ("gp") inserted in a reader, since its insertion
+ * @param hContext
+ * @param szReader
+ * @param pCounters
+ * @return SCARD_S_SUCCESS, SCARD_E_NO_SMARTCARD, SCARD_E_UNSUPPORTED_FEATURE for another type of card,
+ *         SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardGetCardManagerCounters(SCARDCONTEXT hContext, LPCSTR szReader, SCARD_GP_COUNTERS *pCounters);
+
+/**
+ * Memoize the responses of the deterministic commands (SELECT, READ BINARY, GET DATA, ...) of the cards inserted in a
+ * reader, in an LRU cache keyed on the command and the state of the card. A command which changes the state of the card
+ * invalidates the cached responses. The processing time of the card model still applies to the cached responses.
+ * @param hContext
+ * @param szReader
+ * @param dwEntries number of responses of the cache, 0 disables the cache
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE, SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardConfigureResponseCache(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwEntries);
+
+typedef struct {
+  uint64_t ullHits;
+  uint64_t ullMisses;
+  uint64_t ullEvictions;     /**< least recently used responses replaced by a new one */
+} SCARD_RESPONSE_CACHE_COUNTERS;
+
+/**
+ * Counters of the response cache of the card inserted in a reader, since its insertion or the configuration of the
+ * cache
+ * @param hContext
+ * @param szReader
+ * @param pCounters
+ * @return SCARD_S_SUCCESS, SCARD_E_NO_SMARTCARD, SCARD_E_UNSUPPORTED_FEATURE when the cache is disabled,
+ *         SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardGetResponseCacheCounters(SCARDCONTEXT hContext, LPCSTR szReader,
+                                            SCARD_RESPONSE_CACHE_COUNTERS *pCounters);
+
+#define SCARD_STATS_ESTABLISH_CONTEXT               0
+#define SCARD_STATS_RELEASE_CONTEXT                 1
+#define SCARD_STATS_IS_VALID_CONTEXT                2
+#define SCARD_STATS_CONNECT                         3
+#define SCARD_STATS_RECONNECT                       4
+#define SCARD_STATS_DISCONNECT                      5
+#define SCARD_STATS_BEGIN_TRANSACTION               6
+#define SCARD_STATS_END_TRANSACTION                 7
+#define SCARD_STATS_STATUS                          8
+#define SCARD_STATS_GET_STATUS_CHANGE               9
+#define SCARD_STATS_CONTROL                         10
+#define SCARD_STATS_TRANSMIT                        11
+#define SCARD_STATS_LIST_READER_GROUPS              12
+#define SCARD_STATS_LIST_READERS                    13
+#define SCARD_STATS_FREE_MEMORY                     14
+#define SCARD_STATS_CANCEL                          15
+#define SCARD_STATS_GET_ATTRIB                      16
+#define SCARD_STATS_SET_ATTRIB                      17
+#define SCARD_STATS_ATTACH_READER                   18
+#define SCARD_STATS_ATTACH_READER_WITH_LATENCY      19
+#define SCARD_STATS_CONFIGURE_READER_LATENCY        20
+#define SCARD_STATS_GET_READER_ELAPSED_TIME         21
+#define SCARD_STATS_INSERT_SMART_CARD_IN_READER     22
+#define SCARD_STATS_REMOVE_SMART_CARD_FROM_READER   23
+#define SCARD_STATS_REGISTER_SMART_CARD             24
+#define SCARD_STATS_CONFIGURE_READER_T1             25
+#define SCARD_STATS_GET_READER_T1_COUNTERS          26
+#define SCARD_STATS_GET_CARD_MANAGER_COUNTERS       27
+#define SCARD_STATS_CONFIGURE_RESPONSE_CACHE        28
+#define SCARD_STATS_GET_RESPONSE_CACHE_COUNTERS     29
+#define SCARD_STATS_GET_STATS                       30
+#define SCARD_STATS_GET_STATS_BUCKET_BOUND          31
+#define SCARD_STATS_GET_READER_STATS                32
+#define SCARD_STATS_START_METRICS_PAGE              33
+#define SCARD_STATS_STOP_METRICS_PAGE               34
+#define SCARD_STATS_DUMP_METRICS                    35
+#define SCARD_STATS_START_METRICS_DUMP_ON_SIGNAL    36
+#define SCARD_STATS_STOP_METRICS_DUMP_ON_SIGNAL     37
+#define SCARD_STATS_START_TRACE                     38
+#define SCARD_STATS_STOP_TRACE                      39
+#define SCARD_STATS_START_CAPTURE                   40
+#define SCARD_STATS_STOP_CAPTURE                    41
+#define SCARD_STATS_FUNCTIONS                       42
+#define SCARD_STATS_LATENCY_BUCKETS                 544
+
+/**
+ * Counters of a function of the PC/SC API
+ */
+typedef struct {
+  uint64_t ullCalls;
+  uint64_t ullErrors;             /**< calls which didn't return SCARD_S_SUCCESS */
+  uint64_t ullTotalNanoseconds;
+  uint64_t ullMaxNanoseconds;
+  uint64_t rgullLatency[SCARD_STATS_LATENCY_BUCKETS];   /**< calls by duration, see SCardGetStatsBucketBound */
+} SCARD_CALL_STATS;
+
+/**
+ * Delays from the events of the readers (SCardAttachReader, SCardInsertSmartCardInReader,
+ * SCardRemoveSmartCardFromReader) to the return of the SCardGetStatusChange call waiting for them
+ */
+typedef struct {
+  uint64_t ullWakeups;
+  uint64_t ullTotalNanoseconds;
+  uint64_t ullMaxNanoseconds;
+  uint64_t rgullLatency[SCARD_STATS_LATENCY_BUCKETS];   /**< wakeups by delay, see SCardGetStatsBucketBound */
+} SCARD_WAKEUP_STATS;
+
+typedef struct {
+  SCARD_CALL_STATS rgCalls[SCARD_STATS_FUNCTIONS];   /**< indexed by SCARD_STATS_xxx */
+  SCARD_WAKEUP_STATS sWakeups;
+} SCARD_STATS;
+
+/**
+ * Counters of the calls of the PC/SC API (SCardEstablishContext to SCardSetAttrib) and of the functions of the stub
+ * (SCardAttachReader to SCardStopCapture) by all the threads since the load of the library, and the delays of the
+ * wakeups of SCardGetStatusChange. The threads count in their own shards, which are merged by the snapshot, so the
+ * calls in progress may be partially counted.
+ * @param pStats
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER
+ */
+PCSC_API LONG SCardGetStats(SCARD_STATS *pStats);
+
+/**
+ * Smallest duration of a bucket of the latency histograms. The histograms are log-linear: a bucket per nanosecond
+ * below 16 ns, then 16 buckets per power of 2, so the duration of a call is known within 1/16. The last bucket holds
+ * the calls of 2^37 ns and more.
+ * @param dwBucket
+ * @param pullNanoseconds
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_INVALID_VALUE when the bucket doesn't exist
+ */
+PCSC_API LONG SCardGetStatsBucketBound(DWORD dwBucket, uint64_t *pullNanoseconds);
+
+typedef struct {
+  uint64_t ullApdus;
+  uint64_t ullErrors;         /**< APDUs which failed in the card or the transport */
+  uint64_t ullBytesIn;        /**< command bytes */
+  uint64_t ullBytesOut;       /**< response bytes, SW included */
+  uint64_t rgullSw1[256];     /**< responses by first status byte */
+} SCARD_READER_STATS;
+
+/**
+ * Counters of the APDUs transmitted to the cards of a reader, since the reader was attached
+ * @param hContext
+ * @param szReader
+ * @param pStats
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_READER_UNAVAILABLE, SCARD_E_INVALID_HANDLE
+ */
+PCSC_API LONG SCardGetReaderStats(SCARDCONTEXT hContext, LPCSTR szReader, SCARD_READER_STATS *pStats);
+
+/**
+ * Publish the metrics of the stub in a POSIX shared memory segment, for the monitoring of the process from outside
+ * (see metrics_reader): the counters of the calls, the established contexts, the connected handles, the inserted cards,
+ * the reader and card events, and the injected return codes. The page is written every period by a background thread
+ * under a seqlock, the PC/SC calls never wait for it. See metrics_page.h for the layout.
+ * @param szName name of the segment, "/" followed by a name without "/"
+ * @param dwPeriod milliseconds between two publications
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_INVALID_VALUE when the name or the period is invalid or
+ *         the metrics are already published, SCARD_E_NO_ACCESS when the segment can't be created
+ */
+PCSC_API LONG SCardStartMetricsPage(LPCSTR szName, DWORD dwPeriod);
+
+/**
+ * Stop publishing the metrics and remove the shared memory segment
+ * @return SCARD_S_SUCCESS
+ */
+PCSC_API LONG SCardStopMetricsPage();
+
+/**
+ * Dump the metrics of the stub in the Prometheus text exposition format: the counters and the latency histograms of
+ * the calls, the gauges of SCardStartMetricsPage, the injected return codes and the counters of the readers. See
+ * prometheus_export.h for the metrics.
+ * @param szDestination path of a file, replaced atomically, or "unix:" followed by the path of a listening Unix
+ *        stream socket
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_INVALID_VALUE when the destination is invalid,
+ *         SCARD_E_NO_ACCESS when the dump can't be written
+ */
+PCSC_API LONG SCardDumpMetrics(LPCSTR szDestination);
+
+/**
+ * Dump the metrics like SCardDumpMetrics at each SIGUSR1 received by the process, from a background thread
+ * @param szDestination
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_INVALID_VALUE when the destination is invalid or the
+ *         dumps are already started, SCARD_E_NO_ACCESS when the handler can't be installed
+ */
+PCSC_API LONG SCardStartMetricsDumpOnSignal(LPCSTR szDestination);
+
+/**
+ * Stop the dumps on SIGUSR1 and restore the previous handler of the signal
+ * @return SCARD_S_SUCCESS
+ */
+PCSC_API LONG SCardStopMetricsDumpOnSignal();
+
+/**
+ * Record the calls of the PC/SC API and of the functions of the stub in a binary trace file: the function, the
+ * handle, the timestamp, the duration, the return code, and the command and response bytes of SCardTransmit. The
+ * session is appended to the file, see apdu_trace.h for the format and trace_decoder to print it.
+ * @param szPath
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_INVALID_VALUE when a trace is already recorded,
+ *         SCARD_E_NO_ACCESS when the file can't be written
+ */
+PCSC_API LONG SCardStartTrace(LPCSTR szPath);
+
+/**
+ * Stop the recording and write the pending records in the trace file
+ * @return SCARD_S_SUCCESS
+ */
+PCSC_API LONG SCardStopTrace();
+
+/**
+ * Capture the exchanges of SCardTransmit and SCardControl in a pcapng file, as the USB traffic of a CCID reader, for
+ * the packet analysers. The capture is appended to the file as a new section, see pcapng_export.h for the encoding.
+ * @param szPath
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_PARAMETER, SCARD_E_INVALID_VALUE when a capture is already running,
+ *         SCARD_E_NO_ACCESS when the file can't be written
+ */
+PCSC_API LONG SCardStartCapture(LPCSTR szPath);
+
+/**
+ * Stop the capture and write the pending packets in the pcapng file
+ * @return SCARD_S_SUCCESS
+ */
+PCSC_API LONG SCardStopCapture();
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,474 @@
+/**
+ * Implementation of AES with the AES-NI instructions, and with the arithmetic of GF(2^8) on the processors without
+ * them
+ */
+#include <cstring>
+#include <stdexcept>
+#include "aes.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES_NI_AVAILABLE
+#include <cpuid.h>
+#include <wmmintrin.h>
+// The functions which use the AES instructions are compiled for them whatever the target of the build, they are
+// only called after the CPUID check
+#define AES_NI_FUNCTION __attribute__((target("aes,sse2")))
+#endif
+
+using namespace std;
+
+const size_t Aes::BLOCK_SIZE;
+
+// Eight bytes processed side by side in a 64-bit word
+#define LANES           0x0101010101010101ULL
+
+/**
+ * Multiplication by x in GF(2^8) of each byte
+ */
+static uint64_t xtimeLanes(uint64_t bytes) {
+  return ((bytes & 0x7F7F7F7F7F7F7F7FULL) << 1) ^ (((bytes >> 7) & LANES) * 0x1B);
+}
+
+static unsigned char xtime(unsigned char byte) {
+  return static_cast<unsigned char>(xtimeLanes(byte));
+}
+
+/**
+ * Product in GF(2^8) of the bytes of a and b, with masks instead of branches on the bits
+ */
+static uint64_t multiplyLanes(uint64_t a, uint64_t b) {
+  uint64_t product = 0;
+  for (unsigned int i = 0; i < 8; i++) {
+    product ^= a & (((b >> i) & LANES) * 0xFF);
+    a = xtimeLanes(a);
+  }
+  return product;
+}
+
+/**
+ * Inverse in GF(2^8) of each byte, 0 for 0: x^254 with the addition chain 2, 3, 6, 12, 15, 30, 60, 120, 240, 252, 254
+ */
+static uint64_t inverseLanes(uint64_t x) {
+  uint64_t x2 = multiplyLanes(x, x);
+  uint64_t x3 = multiplyLanes(x2, x);
+  uint64_t x12 = multiplyLanes(x3, x3);
+  x12 = multiplyLanes(x12, x12);
+  uint64_t x15 = multiplyLanes(x12, x3);
+  uint64_t x240 = x15;
+  for (unsigned int i = 0; i < 4; i++) {
+    x240 = multiplyLanes(x240, x240);
+  }
+  return multiplyLanes(multiplyLanes(x240, x12), x2);
+}
+
+/**
+ * Left rotation of each byte
+ */
+static uint64_t rotateLanes(uint64_t bytes, unsigned int count) {
+  return ((bytes << count) & (LANES * ((0xFF << count) & 0xFF))) |
+         ((bytes >> (8 - count)) & (LANES * (0xFF >> (8 - count))));
+}
+
+/**
+ * S-box of each byte: the inverse followed by the affine transformation
+ */
+static uint64_t substituteLanes(uint64_t bytes) {
+  uint64_t inverse = inverseLanes(bytes);
+  return inverse ^ rotateLanes(inverse, 1) ^ rotateLanes(inverse, 2) ^ rotateLanes(inverse, 3) ^
+         rotateLanes(inverse, 4) ^ (LANES * 0x63);
+}
+
+/**
+ * Inverse S-box of each byte: the inverse affine transformation followed by the inverse
+ */
+static uint64_t inverseSubstituteLanes(uint64_t bytes) {
+  return inverseLanes(rotateLanes(bytes, 1) ^ rotateLanes(bytes, 3) ^ rotateLanes(bytes, 6) ^ (LANES * 0x05));
+}
+
+static void subBytes(unsigned char *state, uint64_t (*substitute)(uint64_t)) {
+  uint64_t lanes[2];
+  memcpy(lanes, state, sizeof(lanes));
+  lanes[0] = substitute(lanes[0]);
+  lanes[1] = substitute(lanes[1]);
+  memcpy(state, lanes, sizeof(lanes));
+}
+
+/**
+ * ShiftRows on the state in column order (byte r + 4 c is the row r of the column c), the row r turns by r columns to
+ * the left, or to the right for InvShiftRows
+ */
+static void shiftRows(unsigned char *state, bool inverse) {
+  unsigned char shifted[Aes::BLOCK_SIZE];
+  for (unsigned int c = 0; c < 4; c++) {
+    for (unsigned int r = 0; r < 4; r++) {
+      unsigned int from = inverse ? (c + 4 - r) % 4 : (c + r) % 4;
+      shifted[r + 4 * c] = state[r + 4 * from];
+    }
+  }
+  memcpy(state, shifted, sizeof(shifted));
+}
+
+static void mixColumn(unsigned char *column) {
+  unsigned char a0 = column[0];
+  unsigned char all = static_cast<unsigned char>(column[0] ^ column[1] ^ column[2] ^ column[3]);
+  column[0] ^= all ^ xtime(static_cast<unsigned char>(column[0] ^ column[1]));
+  column[1] ^= all ^ xtime(static_cast<unsigned char>(column[1] ^ column[2]));
+  column[2] ^= all ^ xtime(static_cast<unsigned char>(column[2] ^ column[3]));
+  column[3] ^= all ^ xtime(static_cast<unsigned char>(column[3] ^ a0));
+}
+
+/**
+ * InvMixColumns of a column: a multiplication by 4 x^2 + 5 which leaves a MixColumns
+ */
+static void inverseMixColumn(unsigned char *column) {
+  unsigned char even = xtime(xtime(static_cast<unsigned char>(column[0] ^ column[2])));
+  unsigned char odd = xtime(xtime(static_cast<unsigned char>(column[1] ^ column[3])));
+  column[0] ^= even;
+  column[1] ^= odd;
+  column[2] ^= even;
+  column[3] ^= odd;
+  mixColumn(column);
+}
+
+static uint32_t load32(const unsigned char *bytes) {
+  return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+         (static_cast<uint32_t>(bytes[2]) << 8) | static_cast<uint32_t>(bytes[3]);
+}
+
+static void store32(unsigned char *bytes, uint32_t word) {
+  bytes[0] = static_cast<unsigned char>(word >> 24);
+  bytes[1] = static_cast<unsigned char>(word >> 16);
+  bytes[2] = static_cast<unsigned char>(word >> 8);
+  bytes[3] = static_cast<unsigned char>(word);
+}
+
+static uint32_t subWord(uint32_t word) {
+  return static_cast<uint32_t>(substituteLanes(word));
+}
+
+static void xorBlock(unsigned char *block, const unsigned char *data) {
+  for (size_t i = 0; i < Aes::BLOCK_SIZE; i++) {
+    block[i] ^= data[i];
+  }
+}
+
+/**
+ * Rounds without lookup tables: the S-box is computed in GF(2^8) for the 16 bytes of the state, so the time and the
+ * memory accesses don't depend on the key or the data
+ */
+static void encryptBlock(const unsigned char *keys, unsigned int rounds, const unsigned char *in, unsigned char *out) {
+  unsigned char state[Aes::BLOCK_SIZE];
+  memcpy(state, in, Aes::BLOCK_SIZE);
+  xorBlock(state, keys);
+  for (unsigned int r = 1; r <= rounds; r++) {
+    subBytes(state, substituteLanes);
+    shiftRows(state, false);
+    // Last round without MixColumns
+    if (r != rounds) {
+      for (unsigned int c = 0; c < 4; c++) {
+        mixColumn(state + 4 * c);
+      }
+    }
+    xorBlock(state, keys + r * Aes::BLOCK_SIZE);
+  }
+  memcpy(out, state, Aes::BLOCK_SIZE);
+}
+
+/**
+ * Equivalent inverse cipher, with the decryption keys to which InvMixColumns is applied
+ */
+static void decryptBlock(const unsigned char *keys, unsigned int rounds, const unsigned char *in, unsigned char *out) {
+  unsigned char state[Aes::BLOCK_SIZE];
+  memcpy(state, in, Aes::BLOCK_SIZE);
+  xorBlock(state, keys);
+  for (unsigned int r = 1; r <= rounds; r++) {
+    subBytes(state, inverseSubstituteLanes);
+    shiftRows(state, true);
+    // Last round without InvMixColumns
+    if (r != rounds) {
+      for (unsigned int c = 0; c < 4; c++) {
+        inverseMixColumn(state + 4 * c);
+      }
+    }
+    xorBlock(state, keys + r * Aes::BLOCK_SIZE);
+  }
+  memcpy(out, state, Aes::BLOCK_SIZE);
+}
+
+#ifdef AES_NI_AVAILABLE
+
+static bool cpuHasAes() {
+  unsigned int eax, ebx, ecx, edx;
+  return (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0) && ((ecx & bit_AES) != 0) && ((edx & bit_SSE2) != 0);
+}
+
+AES_NI_FUNCTION static inline __m128i loadBlock(const unsigned char *bytes) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+}
+
+AES_NI_FUNCTION static inline void storeBlock(unsigned char *bytes, __m128i block) {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), block);
+}
+
+AES_NI_FUNCTION static inline __m128i encryptNi(const unsigned char *keys, unsigned int rounds, __m128i state) {
+  state = _mm_xor_si128(state, loadBlock(keys));
+  for (unsigned int r = 1; r < rounds; r++) {
+    state = _mm_aesenc_si128(state, loadBlock(keys + r * Aes::BLOCK_SIZE));
+  }
+  return _mm_aesenclast_si128(state, loadBlock(keys + rounds * Aes::BLOCK_SIZE));
+}
+
+AES_NI_FUNCTION static inline __m128i decryptNi(const unsigned char *keys, unsigned int rounds, __m128i state) {
+  state = _mm_xor_si128(state, loadBlock(keys));
+  for (unsigned int r = 1; r < rounds; r++) {
+    state = _mm_aesdec_si128(state, loadBlock(keys + r * Aes::BLOCK_SIZE));
+  }
+  return _mm_aesdeclast_si128(state, loadBlock(keys + rounds * Aes::BLOCK_SIZE));
+}
+
+AES_NI_FUNCTION static void encryptBlockNi(const unsigned char *keys, unsigned int rounds, const unsigned char *in,
+                                           unsigned char *out) {
+  storeBlock(out, encryptNi(keys, rounds, loadBlock(in)));
+}
+
+AES_NI_FUNCTION static void decryptBlockNi(const unsigned char *keys, unsigned int rounds, const unsigned char *in,
+                                           unsigned char *out) {
+  storeBlock(out, decryptNi(keys, rounds, loadBlock(in)));
+}
+
+/**
+ * CBC encryption, out is null for a CBC-MAC. The blocks depend on each other, only the rounds are accelerated.
+ */
+AES_NI_FUNCTION static void encryptCbcNi(const unsigned char *keys, unsigned int rounds, unsigned char *iv,
+                                         const unsigned char *in, unsigned char *out, size_t blocks) {
+  __m128i state = loadBlock(iv);
+  for (size_t i = 0; i < blocks; i++) {
+    state = encryptNi(keys, rounds, _mm_xor_si128(state, loadBlock(in + i * Aes::BLOCK_SIZE)));
+    if (out != nullptr) {
+      storeBlock(out + i * Aes::BLOCK_SIZE, state);
+    }
+  }
+  storeBlock(iv, state);
+}
+
+/**
+ * CBC decryption of four independent blocks at a time, which fills the pipeline of the AES unit
+ */
+AES_NI_FUNCTION static void decryptCbcNi(const unsigned char *keys, unsigned int rounds, unsigned char *iv,
+                                         const unsigned char *in, unsigned char *out, size_t blocks) {
+  __m128i previous = loadBlock(iv);
+  size_t i = 0;
+  for (; i + 4 <= blocks; i += 4) {
+    const unsigned char *block = in + i * Aes::BLOCK_SIZE;
+    __m128i c0 = loadBlock(block);
+    __m128i c1 = loadBlock(block + Aes::BLOCK_SIZE);
+    __m128i c2 = loadBlock(block + 2 * Aes::BLOCK_SIZE);
+    __m128i c3 = loadBlock(block + 3 * Aes::BLOCK_SIZE);
+    __m128i key = loadBlock(keys);
+    __m128i p0 = _mm_xor_si128(c0, key);
+    __m128i p1 = _mm_xor_si128(c1, key);
+    __m128i p2 = _mm_xor_si128(c2, key);
+    __m128i p3 = _mm_xor_si128(c3, key);
+    for (unsigned int r = 1; r < rounds; r++) {
+      key = loadBlock(keys + r * Aes::BLOCK_SIZE);
+      p0 = _mm_aesdec_si128(p0, key);
+      p1 = _mm_aesdec_si128(p1, key);
+      p2 = _mm_aesdec_si128(p2, key);
+      p3 = _mm_aesdec_si128(p3, key);
+    }
+    key = loadBlock(keys + rounds * Aes::BLOCK_SIZE);
+    unsigned char *plain = out + i * Aes::BLOCK_SIZE;
+    storeBlock(plain, _mm_xor_si128(_mm_aesdeclast_si128(p0, key), previous));
+    storeBlock(plain + Aes::BLOCK_SIZE, _mm_xor_si128(_mm_aesdeclast_si128(p1, key), c0));
+    storeBlock(plain + 2 * Aes::BLOCK_SIZE, _mm_xor_si128(_mm_aesdeclast_si128(p2, key), c1));
+    storeBlock(plain + 3 * Aes::BLOCK_SIZE, _mm_xor_si128(_mm_aesdeclast_si128(p3, key), c2));
+    previous = c3;
+  }
+  for (; i < blocks; i++) {
+    __m128i cipher = loadBlock(in + i * Aes::BLOCK_SIZE);
+    storeBlock(out + i * Aes::BLOCK_SIZE, _mm_xor_si128(decryptNi(keys, rounds, cipher), previous));
+    previous = cipher;
+  }
+  storeBlock(iv, previous);
+}
+
+#endif
+
+bool Aes::hardwareSupported() {
+#ifdef AES_NI_AVAILABLE
+  static const bool supported = cpuHasAes();
+  return supported;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Multiplication by x in GF(2^128) of the CMAC subkeys
+ */
+static void doubleBlock(unsigned char *block) {
+  unsigned char carry = static_cast<unsigned char>(((block[0] & 0x80) != 0) ? 0x87 : 0x00);
+  for (size_t i = 0; i < Aes::BLOCK_SIZE - 1; i++) {
+    block[i] = static_cast<unsigned char>((block[i] << 1) | (block[i + 1] >> 7));
+  }
+  block[Aes::BLOCK_SIZE - 1] = static_cast<unsigned char>((block[Aes::BLOCK_SIZE - 1] << 1) ^ carry);
+}
+
+Aes::Aes(const unsigned char *key, size_t key_lg, bool hardware) :
+  encryptionKeys(), decryptionKeys(), subkeys(), rounds(0), hardware(hardware && hardwareSupported()) {
+  if ((key_lg != 16) && (key_lg != 24) && (key_lg != 32)) {
+    throw invalid_argument("the AES key must have 16, 24 or 32 bytes");
+  }
+  size_t keyWords = key_lg / 4;
+  rounds = static_cast<unsigned int>(keyWords + 6);
+
+  uint32_t words[60];
+  for (size_t i = 0; i < keyWords; i++) {
+    words[i] = load32(key + 4 * i);
+  }
+  uint32_t rcon = 0x01;
+  for (size_t i = keyWords; i < 4 * (rounds + 1); i++) {
+    uint32_t word = words[i - 1];
+    if (i % keyWords == 0) {
+      word = subWord((word << 8) | (word >> 24)) ^ (rcon << 24);
+      rcon = ((rcon << 1) ^ (((rcon & 0x80) != 0) ? 0x1B : 0)) & 0xFF;
+    }
+    else if ((keyWords > 6) && (i % keyWords == 4)) {
+      word = subWord(word);
+    }
+    words[i] = words[i - keyWords] ^ word;
+  }
+
+  for (size_t i = 0; i < 4 * (rounds + 1); i++) {
+    store32(encryptionKeys + 4 * i, words[i]);
+    // The decryption rounds take the keys backwards, InvMixColumns is applied to the inner rounds
+    size_t round = rounds - i / 4;
+    unsigned char *column = decryptionKeys + 4 * (4 * round + i % 4);
+    store32(column, words[i]);
+    if ((round != 0) && (round != rounds)) {
+      inverseMixColumn(column);
+    }
+  }
+
+  encrypt(subkeys[0], subkeys[0]);
+  doubleBlock(subkeys[0]);
+  memcpy(subkeys[1], subkeys[0], BLOCK_SIZE);
+  doubleBlock(subkeys[1]);
+}
+
+void Aes::encrypt(const unsigned char *in, unsigned char *out) const {
+#ifdef AES_NI_AVAILABLE
+  if (hardware) {
+    encryptBlockNi(encryptionKeys, rounds, in, out);
+    return;
+  }
+#endif
+  encryptBlock(encryptionKeys, rounds, in, out);
+}
+
+void Aes::decrypt(const unsigned char *in, unsigned char *out) const {
+#ifdef AES_NI_AVAILABLE
+  if (hardware) {
+    decryptBlockNi(decryptionKeys, rounds, in, out);
+    return;
+  }
+#endif
+  decryptBlock(decryptionKeys, rounds, in, out);
+}
+
+void Aes::encryptCbc(unsigned char *iv, const unsigned char *in, unsigned char *out, size_t blocks) const {
+#ifdef AES_NI_AVAILABLE
+  if (hardware) {
+    encryptCbcNi(encryptionKeys, rounds, iv, in, out, blocks);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < blocks; i++) {
+    xorBlock(iv, in + i * BLOCK_SIZE);
+    encryptBlock(encryptionKeys, rounds, iv, iv);
+    memcpy(out + i * BLOCK_SIZE, iv, BLOCK_SIZE);
+  }
+}
+
+void Aes::decryptCbc(unsigned char *iv, const unsigned char *in, unsigned char *out, size_t blocks) const {
+#ifdef AES_NI_AVAILABLE
+  if (hardware) {
+    decryptCbcNi(decryptionKeys, rounds, iv, in, out, blocks);
+    return;
+  }
+#endif
+  unsigned char cipher[BLOCK_SIZE];
+  for (size_t i = 0; i < blocks; i++) {
+    memcpy(cipher, in + i * BLOCK_SIZE, BLOCK_SIZE);
+    decryptBlock(decryptionKeys, rounds, cipher, out + i * BLOCK_SIZE);
+    xorBlock(out + i * BLOCK_SIZE, iv);
+    memcpy(iv, cipher, BLOCK_SIZE);
+  }
+}
+
+void Aes::chain(unsigned char *state, const unsigned char *data, size_t blocks) const {
+#ifdef AES_NI_AVAILABLE
+  if (hardware) {
+    encryptCbcNi(encryptionKeys, rounds, state, data, nullptr, blocks);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < blocks; i++) {
+    xorBlock(state, data + i * BLOCK_SIZE);
+    encryptBlock(encryptionKeys, rounds, state, state);
+  }
+}
+
+/**
+ * Copy a range of the concatenation of the prefix and of the data
+ */
+static void gather(const unsigned char *prefix, size_t prefix_lg, const unsigned char *data, size_t offset,
+                   size_t count, unsigned char *out) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (offset + i < prefix_lg) ? prefix[offset + i] : data[offset + i - prefix_lg];
+  }
+}
+
+void Aes::cmac(const unsigned char *data, size_t data_lg, unsigned char *mac) const {
+  cmac(nullptr, 0, data, data_lg, mac);
+}
+
+void Aes::cmac(const unsigned char *prefix, size_t prefix_lg, const unsigned char *data, size_t data_lg,
+               unsigned char *mac) const {
+  unsigned char state[BLOCK_SIZE] = { 0 };
+  unsigned char block[BLOCK_SIZE];
+  size_t total = prefix_lg + data_lg;
+  size_t last = (total == 0) ? 0 : (total - 1) / BLOCK_SIZE * BLOCK_SIZE;   // offset of the last block
+
+  // The blocks before the last one are chained in place, except the one which straddles the prefix and the data
+  size_t offset = 0;
+  while (offset < last) {
+    if (offset + BLOCK_SIZE <= prefix_lg) {
+      chain(state, prefix + offset, 1);
+      offset += BLOCK_SIZE;
+    }
+    else if (offset >= prefix_lg) {
+      chain(state, data + offset - prefix_lg, (last - offset) / BLOCK_SIZE);
+      offset = last;
+    }
+    else {
+      gather(prefix, prefix_lg, data, offset, BLOCK_SIZE, block);
+      chain(state, block, 1);
+      offset += BLOCK_SIZE;
+    }
+  }
+
+  // The last block is xored with K1 when it is complete, otherwise it is padded and xored with K2
+  size_t remaining = total - last;
+  memset(block, 0, sizeof(block));
+  gather(prefix, prefix_lg, data, last, remaining, block);
+  if (remaining < BLOCK_SIZE) {
+    block[remaining] = 0x80;
+    xorBlock(block, subkeys[1]);
+  }
+  else {
+    xorBlock(block, subkeys[0]);
+  }
+  xorBlock(state, block);
+  encrypt(state, mac);
+}
@@ -0,0 +1,171 @@
+/**
+ * Implementation of the binary trace of the PC/SC calls
+ */
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include "apdu_trace.h"
+#include "async_file_writer.h"
+
+using namespace std;
+
+#define TRACE_MAGIC              "WSTRACE1"
+#define TRACE_MAGIC_SIZE         8
+
+const size_t ApduTrace::HEADER_SIZE;
+const size_t ApduTrace::RECORD_HEADER_SIZE;
+
+static atomic<uint32_t> threadCount(0);
+static atomic<uint64_t> origin(0);   // clock at the start of the session
+
+static void put16(unsigned char *data, uint16_t value) {
+  data[0] = static_cast<unsigned char>(value);
+  data[1] = static_cast<unsigned char>(value >> 8);
+}
+
+static void put32(unsigned char *data, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+static void put64(unsigned char *data, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    data[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+static uint16_t get16(const unsigned char *data) {
+  return static_cast<uint16_t>(data[0] | (data[1] << 8));
+}
+
+static uint32_t get32(const unsigned char *data) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static uint64_t get64(const unsigned char *data) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+/**
+ * The writer is never destroyed, the threads which still record at the exit of the process would use it
+ */
+static AsyncFileWriter &writer() {
+  static AsyncFileWriter *instance = new AsyncFileWriter();
+  return *instance;
+}
+
+/**
+ * Sequence number of the calling thread, from 1
+ */
+static uint32_t threadNumber() {
+  static thread_local uint32_t number = ++threadCount;
+  return number;
+}
+
+const char *traceFunctionName(uint16_t function) {
+  static const char *names[] = {
+    "SCardEstablishContext", "SCardReleaseContext", "SCardIsValidContext", "SCardConnect", "SCardReconnect",
+    "SCardDisconnect", "SCardBeginTransaction", "SCardEndTransaction", "SCardStatus", "SCardGetStatusChange",
+    "SCardControl", "SCardTransmit", "SCardListReaderGroups", "SCardListReaders", "SCardFreeMemory", "SCardCancel",
+    "SCardGetAttrib", "SCardSetAttrib",
+    "SCardAttachReader", "SCardAttachReaderWithLatency", "SCardConfigureReaderLatency", "SCardGetReaderElapsedTime",
+    "SCardInsertSmartCardInReader", "SCardRemoveSmartCardFromReader", "SCardRegisterSmartCard",
+    "SCardConfigureReaderT1", "SCardGetReaderT1Counters", "SCardGetCardManagerCounters",
+    "SCardConfigureResponseCache", "SCardGetResponseCacheCounters", "SCardGetStats", "SCardGetStatsBucketBound",
+    "SCardGetReaderStats", "SCardStartMetricsPage", "SCardStopMetricsPage", "SCardDumpMetrics",
+    "SCardStartMetricsDumpOnSignal", "SCardStopMetricsDumpOnSignal", "SCardStartTrace", "SCardStopTrace",
+    "SCardStartCapture", "SCardStopCapture"
+  };
+  if ((function == 0) || (function > sizeof(names) / sizeof(names[0]))) {
+    return "unknown";
+  }
+  return names[function - 1];
+}
+
+void ApduTrace::start(const string &path) {
+  unsigned char header[HEADER_SIZE];
+  memcpy(header, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  put64(header + TRACE_MAGIC_SIZE, static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+    chrono::system_clock::now().time_since_epoch()).count()));
+  if (recording()) {
+    throw logic_error("a trace is already recorded");
+  }
+  origin = now();
+  writer().start(path, header, sizeof(header));
+}
+
+void ApduTrace::stop() {
+  writer().stop();
+}
+
+bool ApduTrace::recording() {
+  return writer().active();
+}
+
+uint64_t ApduTrace::now() {
+  return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void ApduTrace::record(TraceFunction function, uint64_t start, uint64_t handle, long result,
+                       const unsigned char *input, size_t input_lg, const unsigned char *output, size_t output_lg) {
+  if (!recording()) {
+    return;
+  }
+  uint64_t end = now();
+  uint64_t session = origin.load(memory_order_relaxed);
+  unsigned char header[RECORD_HEADER_SIZE];
+  put32(header, static_cast<uint32_t>(RECORD_HEADER_SIZE + input_lg + output_lg));
+  put16(header + 4, static_cast<uint16_t>(function));
+  put16(header + 6, 0);
+  put32(header + 8, threadNumber());
+  put64(header + 12, (start > session) ? start - session : 0);
+  put64(header + 20, (end > start) ? end - start : 0);
+  put64(header + 28, handle);
+  put32(header + 36, static_cast<uint32_t>(result));
+  put32(header + 40, static_cast<uint32_t>(input_lg));
+  const unsigned char *parts[] = {header, input, output};
+  size_t part_lgs[] = {sizeof(header), input_lg, output_lg};
+  writer().append(parts, part_lgs, 3);
+}
+
+bool ApduTrace::decodeHeader(const unsigned char *data, size_t data_lg, uint64_t *start) {
+  if ((data_lg < HEADER_SIZE) || (memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0)) {
+    return false;
+  }
+  *start = get64(data + TRACE_MAGIC_SIZE);
+  return true;
+}
+
+bool ApduTrace::decodeRecord(const unsigned char *data, size_t data_lg, TraceRecord *record, size_t *record_lg) {
+  if (data_lg < RECORD_HEADER_SIZE) {
+    return false;
+  }
+  size_t length = get32(data);
+  size_t input_lg = get32(data + 40);
+  if ((length < RECORD_HEADER_SIZE) || (length > data_lg) || (input_lg > length - RECORD_HEADER_SIZE)) {
+    return false;
+  }
+  record->function = get16(data + 4);
+  record->thread = get32(data + 8);
+  record->timestamp = get64(data + 12);
+  record->duration = get64(data + 20);
+  record->handle = get64(data + 28);
+  record->result = get32(data + 36);
+  record->input = data + RECORD_HEADER_SIZE;
+  record->inputLg = input_lg;
+  record->output = record->input + input_lg;
+  record->outputLg = length - RECORD_HEADER_SIZE - input_lg;
+  *record_lg = length;
+  return true;
+}
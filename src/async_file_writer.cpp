@@ -0,0 +1,173 @@
+/**
+ * Implementation of the background writer of the records of a file
+ */
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include "async_file_writer.h"
+
+using namespace std;
+
+#define BUFFER_CAPACITY          (64 * 1024)
+#define FLUSH_THRESHOLD          (48 * 1024)
+#define FLUSH_PERIOD             chrono::milliseconds(20)
+
+const size_t AsyncFileWriter::MAX_WRITERS;
+
+atomic<size_t> AsyncFileWriter::writerCount(0);
+
+AsyncFileWriter::AsyncFileWriter() :
+  id(writerCount++),
+  enabled(false),
+  file(nullptr),
+  stopping(false),
+  pending(false) {
+  if (id >= MAX_WRITERS) {
+    throw logic_error("too many file writers");
+  }
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+  stop();
+}
+
+AsyncFileWriter::ThreadRegistration::~ThreadRegistration() {
+  for (shared_ptr<ThreadBuffer> &buffer : buffers) {
+    if (buffer != nullptr) {
+      lock_guard<mutex> guard(buffer->lock);
+      buffer->exited = true;
+    }
+  }
+}
+
+AsyncFileWriter::ThreadBuffer &AsyncFileWriter::threadBuffer() {
+  static thread_local ThreadRegistration registration;
+  shared_ptr<ThreadBuffer> &buffer = registration.buffers[id];
+  if (buffer == nullptr) {
+    buffer = make_shared<ThreadBuffer>();
+    buffer->records.reserve(BUFFER_CAPACITY);
+    buffer->flushing.reserve(BUFFER_CAPACITY);
+    buffer->exited = false;
+    lock_guard<mutex> guard(registry);
+    buffers.push_back(buffer);
+  }
+  return *buffer;
+}
+
+void AsyncFileWriter::start(const string &path, const unsigned char *header, size_t header_lg) {
+  lock_guard<mutex> guard(control);
+  if (enabled) {
+    throw logic_error("'" + path + "' can't be opened, the writer is already active");
+  }
+  FILE *opened = fopen(path.c_str(), "ab");
+  if (opened == nullptr) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  if ((header_lg > 0) && (fwrite(header, 1, header_lg, opened) != header_lg)) {
+    fclose(opened);
+    throw runtime_error("can't write '" + path + "'");
+  }
+
+  file = opened;
+  stopping = false;
+  pending = false;
+  flusher = thread(&AsyncFileWriter::run, this);
+  enabled.store(true, memory_order_release);
+}
+
+void AsyncFileWriter::stop() {
+  lock_guard<mutex> guard(control);
+  if (!enabled) {
+    return;
+  }
+  // The threads check the flag under the lock of their buffer, so nothing is appended after the last flush
+  enabled = false;
+  {
+    lock_guard<mutex> wakeGuard(wake);
+    stopping = true;
+  }
+  signal.notify_one();
+  flusher.join();
+  fclose(file);
+  file = nullptr;
+}
+
+bool AsyncFileWriter::append(const unsigned char *const *parts, const size_t *part_lgs, size_t part_count) {
+  if (!active()) {
+    return false;
+  }
+  ThreadBuffer &buffer = threadBuffer();
+  size_t record_lg = 0;
+  for (size_t i = 0; i < part_count; i++) {
+    record_lg += part_lgs[i];
+  }
+  bool full;
+  {
+    lock_guard<mutex> guard(buffer.lock);
+    if (!enabled.load(memory_order_acquire)) {
+      return false;
+    }
+    size_t offset = buffer.records.size();
+    buffer.records.resize(offset + record_lg);
+    unsigned char *data = buffer.records.data() + offset;
+    for (size_t i = 0; i < part_count; i++) {
+      if (part_lgs[i] > 0) {
+        memcpy(data, parts[i], part_lgs[i]);
+        data += part_lgs[i];
+      }
+    }
+    full = buffer.records.size() >= FLUSH_THRESHOLD;
+  }
+  if (full) {
+    {
+      lock_guard<mutex> guard(wake);
+      pending = true;
+    }
+    signal.notify_one();
+  }
+  return true;
+}
+
+void AsyncFileWriter::run() {
+  unique_lock<mutex> lock(wake);
+  while (!stopping) {
+    signal.wait_for(lock, FLUSH_PERIOD, [this] { return stopping || pending; });
+    pending = false;
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+  lock.unlock();
+  flush();
+}
+
+void AsyncFileWriter::flush() {
+  {
+    lock_guard<mutex> guard(registry);
+    snapshot = buffers;
+  }
+  for (const shared_ptr<ThreadBuffer> &buffer : snapshot) {
+    bool exited;
+    {
+      lock_guard<mutex> guard(buffer->lock);
+      buffer->records.swap(buffer->flushing);
+      exited = buffer->exited;
+    }
+    if (!buffer->flushing.empty()) {
+      fwrite(buffer->flushing.data(), 1, buffer->flushing.size(), file);
+      buffer->flushing.clear();
+    }
+    if (exited) {
+      // The thread is gone, its last records are written
+      lock_guard<mutex> guard(registry);
+      for (size_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i] == buffer) {
+          buffers.erase(buffers.begin() + i);
+          break;
+        }
+      }
+    }
+  }
+  snapshot.clear();
+  fflush(file);
+}
@@ -0,0 +1,338 @@
+/**
+ * Implementation of the counters of the PC/SC calls and of the APDUs of the readers
+ */
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include "call_stats.h"
+
+using namespace std;
+
+#define CACHE_LINE               64
+#define CALLS                    0
+#define ERRORS                   1
+#define TOTAL_NANOSECONDS        2
+#define MAX_NANOSECONDS          3
+#define COUNTERS                 4          // followed by the latency buckets
+#define ROW                      ((COUNTERS + CallStats::BUCKETS + 7) / 8 * 8)   // counters of a function, whole lines
+#define CALIBRATION_PERIOD       chrono::milliseconds(2)
+
+const size_t CallStats::FUNCTIONS;
+const size_t CallStats::SUB_BUCKETS;
+const unsigned int CallStats::MAX_MAGNITUDE;
+const size_t CallStats::BUCKETS;
+
+namespace {
+
+/**
+ * Counters of a thread, only written by the thread. The reader merging the shards may see a call partially counted.
+ */
+struct ThreadStats {
+  atomic<uint64_t> rows[CallStats::FUNCTIONS][ROW];
+  double nanosecondsPerTick;
+};
+
+/**
+ * Add to a counter of the shard of the calling thread, which is the only writer
+ */
+inline void add(atomic<uint64_t> &counter, uint64_t value) {
+  counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/**
+ * Live shards and the sums of the shards of the exited threads
+ */
+struct Registry {
+  mutex lock;
+  vector<ThreadStats *> shards;
+  uint64_t retired[CallStats::FUNCTIONS * ROW];
+};
+
+/**
+ * The registry is never destroyed, the threads which exit after the static destructors use it
+ */
+Registry &registry() {
+  static Registry *instance = new Registry();
+  return *instance;
+}
+
+/**
+ * @param sums FUNCTIONS rows
+ */
+void merge(uint64_t *sums, const ThreadStats &shard) {
+  for (size_t function = 0; function < CallStats::FUNCTIONS; function++) {
+    uint64_t *row = sums + function * ROW;
+    for (size_t i = 0; i < COUNTERS + CallStats::BUCKETS; i++) {
+      uint64_t value = shard.rows[function][i].load(memory_order_relaxed);
+      if (i == MAX_NANOSECONDS) {
+        row[i] = (value > row[i]) ? value : row[i];
+      }
+      else {
+        row[i] += value;
+      }
+    }
+  }
+}
+
+/**
+ * Counters of the readers which exist
+ */
+struct ReaderRegistry {
+  mutex lock;
+  vector<ReaderStats *> readers;
+};
+
+/**
+ * Never destroyed like the registry of the threads, the readers of the leaked contexts outlive the static destructors
+ */
+ReaderRegistry &readerRegistry() {
+  static ReaderRegistry *instance = new ReaderRegistry();
+  return *instance;
+}
+
+/**
+ * Wakeups of the waiters of the events, rare enough to be shared by the threads
+ */
+struct Wakeups {
+  atomic<uint64_t> wakeups;
+  atomic<uint64_t> totalNanoseconds;
+  atomic<uint64_t> maxNanoseconds;
+  atomic<uint64_t> latency[CallStats::BUCKETS];
+};
+
+Wakeups wakeups;
+
+/**
+ * Shard of the calling thread, a trivial thread local which doesn't go through the initialization check of the
+ * registration
+ */
+thread_local ThreadStats *current = nullptr;
+
+/**
+ * Shard of a thread, merged in the registry when the thread exits
+ */
+struct ThreadRegistration {
+  ThreadRegistration() : shard(nullptr) {}
+
+  ~ThreadRegistration() {
+    if (shard != nullptr) {
+      Registry &stats = registry();
+      lock_guard<mutex> guard(stats.lock);
+      merge(stats.retired, *shard);
+      for (size_t i = 0; i < stats.shards.size(); i++) {
+        if (stats.shards[i] == shard) {
+          stats.shards.erase(stats.shards.begin() + i);
+          break;
+        }
+      }
+      shard->~ThreadStats();
+      free(shard);
+      current = nullptr;
+    }
+  }
+
+  ThreadStats *shard;
+};
+
+/**
+ * Nanoseconds of a tick of CallStats::ticks()
+ */
+double nanosecondsPerTick() {
+#ifdef CALL_STATS_TSC
+  static const double rate = [] {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint64_t first = CallStats::ticks();
+    chrono::steady_clock::time_point end;
+    do {
+      end = chrono::steady_clock::now();
+    } while (end - start < CALIBRATION_PERIOD);
+    uint64_t last = CallStats::ticks();
+    double elapsed = static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+    return (last > first) ? elapsed / static_cast<double>(last - first) : 1.0;
+  }();
+  return rate;
+#else
+  return 1.0;
+#endif
+}
+
+ThreadStats *registerThread() {
+  static thread_local ThreadRegistration registration;
+  // Aligned on a cache line, so that the shards of the threads don't share lines
+  void *memory = nullptr;
+  if (posix_memalign(&memory, CACHE_LINE, sizeof(ThreadStats)) != 0) {
+    throw bad_alloc();
+  }
+  ThreadStats *shard = new (memory) ThreadStats();
+  shard->nanosecondsPerTick = nanosecondsPerTick();
+  Registry &stats = registry();
+  lock_guard<mutex> guard(stats.lock);
+  stats.shards.push_back(shard);
+  registration.shard = shard;
+  return shard;
+}
+
+}
+
+void CallStats::record(TraceFunction function, uint64_t start, bool error) {
+  uint64_t end = ticks();
+  ThreadStats *shard = current;
+  if (shard == nullptr) {
+    shard = current = registerThread();
+  }
+  uint64_t nanoseconds = (end > start) ? static_cast<uint64_t>(static_cast<double>(end - start)
+                                                               * shard->nanosecondsPerTick) : 0;
+  atomic<uint64_t> *row = shard->rows[static_cast<size_t>(function) - 1];
+  add(row[CALLS], 1);
+  if (error) {
+    add(row[ERRORS], 1);
+  }
+  add(row[TOTAL_NANOSECONDS], nanoseconds);
+  if (nanoseconds > row[MAX_NANOSECONDS].load(memory_order_relaxed)) {
+    row[MAX_NANOSECONDS].store(nanoseconds, memory_order_relaxed);
+  }
+  add(row[COUNTERS + bucketOf(nanoseconds)], 1);
+}
+
+void CallStats::snapshot(FunctionStats *stats) {
+  Registry &shards = registry();
+  vector<uint64_t> sums;
+  {
+    lock_guard<mutex> guard(shards.lock);
+    sums.assign(shards.retired, shards.retired + FUNCTIONS * ROW);
+    for (const ThreadStats *shard : shards.shards) {
+      merge(sums.data(), *shard);
+    }
+  }
+  for (size_t function = 0; function < FUNCTIONS; function++) {
+    const uint64_t *row = sums.data() + function * ROW;
+    stats[function].calls = row[CALLS];
+    stats[function].errors = row[ERRORS];
+    stats[function].totalNanoseconds = row[TOTAL_NANOSECONDS];
+    stats[function].maxNanoseconds = row[MAX_NANOSECONDS];
+    for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+      stats[function].latency[bucket] = row[COUNTERS + bucket];
+    }
+  }
+}
+
+size_t CallStats::bucketOf(uint64_t nanoseconds) {
+  if (nanoseconds < SUB_BUCKETS) {
+    return static_cast<size_t>(nanoseconds);
+  }
+  unsigned int magnitude = 63 - static_cast<unsigned int>(__builtin_clzll(nanoseconds));   // 4 and more
+  if (magnitude > MAX_MAGNITUDE) {
+    return BUCKETS - 1;
+  }
+  return SUB_BUCKETS * (magnitude - 3) + static_cast<size_t>((nanoseconds >> (magnitude - 4)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t CallStats::bucketLowerBound(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned int magnitude = static_cast<unsigned int>(bucket / SUB_BUCKETS) + 3;
+  return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << (magnitude - 4);
+}
+
+uint64_t WakeupStats::now() {
+  return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void WakeupStats::record(uint64_t raised) {
+  uint64_t woken = now();
+  uint64_t nanoseconds = (woken > raised) ? woken - raised : 0;
+  wakeups.wakeups.fetch_add(1, memory_order_relaxed);
+  wakeups.totalNanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+  uint64_t max = wakeups.maxNanoseconds.load(memory_order_relaxed);
+  while ((nanoseconds > max) && !wakeups.maxNanoseconds.compare_exchange_weak(max, nanoseconds, memory_order_relaxed)) {
+  }
+  wakeups.latency[CallStats::bucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+}
+
+void WakeupStats::snapshot(Counters *counters) {
+  counters->wakeups = wakeups.wakeups.load(memory_order_relaxed);
+  counters->totalNanoseconds = wakeups.totalNanoseconds.load(memory_order_relaxed);
+  counters->maxNanoseconds = wakeups.maxNanoseconds.load(memory_order_relaxed);
+  for (size_t bucket = 0; bucket < CallStats::BUCKETS; bucket++) {
+    counters->latency[bucket] = wakeups.latency[bucket].load(memory_order_relaxed);
+  }
+}
+
+ReaderStats::ReaderStats() : apdus(0), errors(0), bytesIn(0), bytesOut(0) {
+  for (atomic<uint64_t> &counter : sw1) {
+    counter.store(0, memory_order_relaxed);
+  }
+  ReaderRegistry &registry = readerRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  registry.readers.push_back(this);
+}
+
+ReaderStats::~ReaderStats() {
+  ReaderRegistry &registry = readerRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  for (size_t i = 0; i < registry.readers.size(); i++) {
+    if (registry.readers[i] == this) {
+      registry.readers.erase(registry.readers.begin() + i);
+      break;
+    }
+  }
+}
+
+void ReaderStats::setName(const string &reader) {
+  ReaderRegistry &registry = readerRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  name = reader;
+}
+
+void ReaderStats::record(size_t command_lg, size_t response_lg, int status, bool error) {
+  apdus.fetch_add(1, memory_order_relaxed);
+  if (error) {
+    errors.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  bytesIn.fetch_add(command_lg, memory_order_relaxed);
+  bytesOut.fetch_add(response_lg, memory_order_relaxed);
+  if (status >= 0) {
+    sw1[status & 0xFF].fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void ReaderStats::snapshot(Counters *counters) const {
+  counters->apdus = apdus.load(memory_order_relaxed);
+  counters->errors = errors.load(memory_order_relaxed);
+  counters->bytesIn = bytesIn.load(memory_order_relaxed);
+  counters->bytesOut = bytesOut.load(memory_order_relaxed);
+  for (size_t i = 0; i < 256; i++) {
+    counters->sw1[i] = sw1[i].load(memory_order_relaxed);
+  }
+}
+
+void ReaderStats::snapshotAll(vector<pair<string, Counters>> *readers) {
+  readers->clear();
+  ReaderRegistry &registry = readerRegistry();
+  lock_guard<mutex> guard(registry.lock);
+  for (const ReaderStats *reader : registry.readers) {
+    Counters counters;
+    reader->snapshot(&counters);
+    size_t i = 0;
+    while ((i < readers->size()) && ((*readers)[i].first != reader->name)) {
+      i++;
+    }
+    if (i == readers->size()) {
+      readers->emplace_back(reader->name, counters);
+      continue;
+    }
+    Counters &sums = (*readers)[i].second;
+    sums.apdus += counters.apdus;
+    sums.errors += counters.errors;
+    sums.bytesIn += counters.bytesIn;
+    sums.bytesOut += counters.bytesOut;
+    for (size_t status = 0; status < 256; status++) {
+      sums.sw1[status] += counters.sw1[status];
+    }
+  }
+}
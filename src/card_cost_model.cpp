@@ -0,0 +1,31 @@
+/**
+ * Implementation of the processing time model of a smartcard
+ */
+#include "card_cost_model.h"
+
+using namespace std;
+
+CardCostModel::CardCostModel(const InstructionCostEntry *entries, size_t count) : costs() {
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].ins == COST_DEFAULT_INS) {
+      for (auto &cost : costs) {
+        cost = entries[i].cost;
+      }
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].ins < COST_DEFAULT_INS) {
+      costs[entries[i].ins] = entries[i].cost;
+    }
+  }
+}
+
+chrono::nanoseconds CardCostModel::cost(unsigned char ins, size_t data_lg, uint32_t random) const {
+  const InstructionCost &cost = costs[ins];
+  uint64_t nanoseconds = static_cast<uint64_t>(cost.fixedMicroseconds) * 1000 +
+                         static_cast<uint64_t>(cost.perByteNanoseconds) * data_lg;
+  if (cost.jitterMicroseconds > 0) {
+    nanoseconds += random % (static_cast<uint64_t>(cost.jitterMicroseconds) * 1000 + 1);
+  }
+  return chrono::nanoseconds(nanoseconds);
+}
@@ -0,0 +1,690 @@
+/**
+ * Implementation of the EMV smartcard
+ */
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "emv_smartcard.h"
+#include "response_table.h"
+
+using namespace std;
+
+#define CLA_ISO                  0x00
+#define CLA_PROPRIETARY          0x80
+
+#define INS_SELECT               0xA4
+#define INS_READ_RECORD          0xB2
+#define INS_GET_PROCESSING_OPTIONS 0xA8
+#define INS_GET_DATA             0xCA
+#define INS_GENERATE_AC          0xAE
+
+#define SW_SUCCESS               0x9000
+#define SW_WRONG_LENGTH          0x6700
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+#define SW_WRONG_DATA            0x6A80
+#define SW_FILE_NOT_FOUND        0x6A82
+#define SW_RECORD_NOT_FOUND      0x6A83
+#define SW_WRONG_P1P2            0x6A86
+#define SW_REFERENCE_NOT_FOUND   0x6A88
+#define SW_INS_NOT_SUPPORTED     0x6D00
+#define SW_CLA_NOT_SUPPORTED     0x6E00
+
+#define TAG_FCI                  0x6F
+#define TAG_DF_NAME              0x84
+#define TAG_FCI_PROPRIETARY      0xA5
+#define TAG_SFI                  0x88
+#define TAG_FCI_DISCRETIONARY    0xBF0C
+#define TAG_APPLICATION_TEMPLATE 0x61
+#define TAG_AID                  0x4F
+#define TAG_LABEL                0x50
+#define TAG_PRIORITY             0x87
+#define TAG_PDOL                 0x9F38
+#define TAG_RECORD               0x70
+#define TAG_FORMAT_1             0x80
+#define TAG_COMMAND_TEMPLATE     0x83
+#define TAG_CDOL1                0x8C
+#define TAG_CDOL2                0x8D
+#define TAG_ATC                  0x9F36
+
+#define DIRECTORY_SFI            1
+#define CRYPTOGRAM_TYPE          0xC0
+#define CRYPTOGRAM_ARQC          0x80
+#define CRYPTOGRAM_SIZE          8
+#define MAX_ATC                  0xFFFF
+
+static const unsigned char PSE_NAME[] = "1PAY.SYS.DDF01";
+static const unsigned char PPSE_NAME[] = "2PAY.SYS.DDF01";
+static const size_t DIRECTORY_NAME_SIZE = sizeof(PSE_NAME) - 1;
+
+/**
+ * Append a BER-TLV with a tag of one or two bytes
+ */
+static void appendTlv(vector<unsigned char> &out, uint16_t tag, const vector<unsigned char> &value) {
+  if (tag > 0xFF) {
+    out.push_back(static_cast<unsigned char>(tag >> 8));
+  }
+  out.push_back(static_cast<unsigned char>(tag));
+  if (value.size() >= 0x100) {
+    out.push_back(0x82);
+    out.push_back(static_cast<unsigned char>(value.size() >> 8));
+  }
+  else if (value.size() >= 0x80) {
+    out.push_back(0x81);
+  }
+  out.push_back(static_cast<unsigned char>(value.size()));
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+static void appendStatus(vector<unsigned char> &out, uint16_t sw) {
+  out.push_back(static_cast<unsigned char>(sw >> 8));
+  out.push_back(static_cast<unsigned char>(sw));
+}
+
+/**
+ * Tag of a BER-TLV or of a DOL entry, with the bytes which follow the first byte when its number is 1F
+ * @return false when the data ends in the tag
+ */
+static bool nextTag(const unsigned char **position, const unsigned char *end, uint32_t *tag) {
+  const unsigned char *p = *position;
+  if (p == end) {
+    return false;
+  }
+  uint32_t value = *p;
+  if ((*p++ & 0x1F) == 0x1F) {
+    do {
+      if ((p == end) || (value > 0xFFFF)) {
+        return false;
+      }
+      value = (value << 8) | *p;
+    } while ((*p++ & 0x80) != 0);
+  }
+  *tag = value;
+  *position = p;
+  return true;
+}
+
+/**
+ * Total length of the data described by a data object list
+ * @throw invalid_argument when the DOL is malformed
+ */
+static size_t dolLength(const unsigned char *dol, size_t dol_lg) {
+  const unsigned char *position = dol;
+  const unsigned char *end = dol + dol_lg;
+  size_t length = 0;
+  while (position < end) {
+    uint32_t tag;
+    if (!nextTag(&position, end, &tag) || (position == end) || (*position >= 0x80)) {
+      throw invalid_argument("malformed data object list");
+    }
+    length += *position++;
+  }
+  return length;
+}
+
+/**
+ * Value of a tag at the top level of the contents of a record
+ * @return false when the record doesn't have the tag
+ * @throw invalid_argument when the record is malformed
+ */
+static bool findTag(const vector<unsigned char> &record, uint32_t tag, const unsigned char **value, size_t *value_lg) {
+  const unsigned char *position = record.data();
+  const unsigned char *end = record.data() + record.size();
+  while (position < end) {
+    uint32_t found;
+    if (!nextTag(&position, end, &found) || (position == end)) {
+      throw invalid_argument("malformed record");
+    }
+    size_t length = *position++;
+    if ((length == 0x81) || (length == 0x82)) {
+      size_t length_lg = length & 0x7F;
+      if (static_cast<size_t>(end - position) < length_lg) {
+        throw invalid_argument("malformed record");
+      }
+      length = 0;
+      for (size_t i = 0; i < length_lg; i++) {
+        length = (length << 8) | *position++;
+      }
+    }
+    else if (length >= 0x80) {
+      throw invalid_argument("malformed record");
+    }
+    if (static_cast<size_t>(end - position) < length) {
+      throw invalid_argument("malformed record");
+    }
+    if (found == tag) {
+      *value = position;
+      *value_lg = length;
+      return true;
+    }
+    position += length;
+  }
+  return false;
+}
+
+/**
+ * Template 61 of an application in the directories
+ */
+static vector<unsigned char> applicationTemplate(const EmvApplication &application) {
+  vector<unsigned char> entry;
+  appendTlv(entry, TAG_AID, application.aid);
+  if (!application.label.empty()) {
+    appendTlv(entry, TAG_LABEL, vector<unsigned char>(application.label.begin(), application.label.end()));
+  }
+  appendTlv(entry, TAG_PRIORITY, { application.priority });
+  vector<unsigned char> applicationTemplate;
+  appendTlv(applicationTemplate, TAG_APPLICATION_TEMPLATE, entry);
+  return applicationTemplate;
+}
+
+EmvCardTemplate::Application::Application(const EmvApplication &definition) :
+  aid(definition.aid),
+  aip(definition.aip),
+  atc(definition.atc),
+  pdolLg(dolLength(definition.pdol.data(), definition.pdol.size())),
+  cdol1Lg(0),
+  cdol2Lg(0),
+  masterKey(definition.masterKey.data(), definition.masterKey.size()),
+  iad(definition.iad) {
+  if ((aid.size() < 5) || (aid.size() > 16)) {
+    throw invalid_argument("the AID must have 5 to 16 bytes");
+  }
+  if (definition.iad.size() > 32) {
+    throw invalid_argument("the issuer application data is limited to 32 bytes");
+  }
+
+  // FCI: 6F { 84 AID, A5 { 50 label, 87 priority, 9F38 PDOL } }
+  vector<unsigned char> proprietary;
+  if (!definition.label.empty()) {
+    appendTlv(proprietary, TAG_LABEL, vector<unsigned char>(definition.label.begin(), definition.label.end()));
+  }
+  appendTlv(proprietary, TAG_PRIORITY, { definition.priority });
+  if (!definition.pdol.empty()) {
+    appendTlv(proprietary, TAG_PDOL, definition.pdol);
+  }
+  vector<unsigned char> contents;
+  appendTlv(contents, TAG_DF_NAME, aid);
+  appendTlv(contents, TAG_FCI_PROPRIETARY, proprietary);
+  appendTlv(fci, TAG_FCI, contents);
+  appendStatus(fci, SW_SUCCESS);
+
+  // Response format 1 of GET PROCESSING OPTIONS: 80 { AIP AFL }
+  if (definition.afl.empty() || (definition.afl.size() % 4 != 0)) {
+    throw invalid_argument("the AFL must have entries of 4 bytes");
+  }
+  vector<unsigned char> options = { static_cast<unsigned char>(aip >> 8), static_cast<unsigned char>(aip) };
+  options.insert(options.end(), definition.afl.begin(), definition.afl.end());
+  appendTlv(processingOptions, TAG_FORMAT_1, options);
+  appendStatus(processingOptions, SW_SUCCESS);
+
+  for (auto &record : definition.records) {
+    unsigned char sfi = static_cast<unsigned char>(record.first >> 8);
+    if ((sfi == 0) || (sfi > 30) || ((record.first & 0xFF) == 0)) {
+      throw invalid_argument("invalid SFI or record number");
+    }
+    const unsigned char *dol;
+    size_t dol_lg;
+    if (findTag(record.second, TAG_CDOL1, &dol, &dol_lg)) {
+      cdol1Lg = dolLength(dol, dol_lg);
+    }
+    if (findTag(record.second, TAG_CDOL2, &dol, &dol_lg)) {
+      cdol2Lg = dolLength(dol, dol_lg);
+    }
+    vector<unsigned char> &response = records[record.first];
+    appendTlv(response, TAG_RECORD, record.second);
+    appendStatus(response, SW_SUCCESS);
+  }
+  if (cdol1Lg == 0) {
+    throw invalid_argument("no record with a CDOL1");
+  }
+  if ((cdol1Lg > 255) || (cdol2Lg > 255)) {
+    throw invalid_argument("the CDOL data must fit a short command");
+  }
+
+  for (size_t i = 0; i < definition.afl.size(); i += 4) {
+    unsigned char sfi = static_cast<unsigned char>(definition.afl[i] >> 3);
+    for (unsigned int number = definition.afl[i + 1]; (number != 0) && (number <= definition.afl[i + 2]); number++) {
+      if (records.find(static_cast<uint16_t>((sfi << 8) | number)) == records.end()) {
+        throw invalid_argument("the AFL references the missing record " + to_string(number) + " of the SFI " +
+                               to_string(sfi));
+      }
+    }
+  }
+}
+
+EmvCardTemplate::EmvCardTemplate(vector<unsigned char> atr, DWORD protocols, shared_ptr<const CardCostModel> costs) :
+  CardTemplate(std::move(atr), SCARD_SHARE_SHARED, protocols, std::move(costs)) {
+  encodeDirectories();
+}
+
+shared_ptr<EmvCardTemplate> EmvCardTemplate::load(istream &in) {
+  vector<unsigned char> atr;
+  DWORD protocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+  vector<InstructionCostEntry> costs;
+  vector<EmvApplication> applications;
+
+  string line;
+  unsigned int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == string::npos) || (line[start] == '#')) {
+      continue;
+    }
+    line = line.substr(start);
+    size_t end = line.find_last_not_of(" \t\r");
+    line = line.substr(0, end + 1);
+
+    try {
+      istringstream fields(line);
+      string keyword;
+      fields >> keyword;
+      string arguments = line.substr(keyword.size());
+      if (keyword == "ATR") {
+        atr = ResponseTable::parseHex(arguments);
+        if (atr.empty() || (atr.size() > MAX_ATR_SIZE)) {
+          throw invalid_argument("invalid ATR length");
+        }
+      }
+      else if (keyword == "PROTOCOL") {
+        protocols = CardTable::parseProtocols(arguments);
+      }
+      else if (keyword == "COST") {
+        costs.push_back(CardTable::parseCost(arguments));
+      }
+      else if (keyword == "APPLICATION") {
+        string aid;
+        if (!(fields >> aid)) {
+          throw invalid_argument("missing AID in APPLICATION");
+        }
+        EmvApplication application = { ResponseTable::parseHex(aid), string(), 1, {}, 0, {}, {}, {}, 0, {} };
+        string label;
+        getline(fields, label);
+        size_t labelStart = label.find_first_not_of(" \t");
+        application.label = (labelStart == string::npos) ? string() : label.substr(labelStart);
+        applications.push_back(application);
+      }
+      else if (applications.empty()) {
+        throw invalid_argument("'" + keyword + "' before APPLICATION");
+      }
+      else {
+        EmvApplication &application = applications.back();
+        if (keyword == "PRIORITY") {
+          unsigned int priority;
+          if (!(fields >> priority) || (priority > 15)) {
+            throw invalid_argument("invalid PRIORITY");
+          }
+          application.priority = static_cast<unsigned char>(priority);
+        }
+        else if (keyword == "PDOL") {
+          application.pdol = ResponseTable::parseHex(arguments);
+        }
+        else if (keyword == "AIP") {
+          vector<unsigned char> aip = ResponseTable::parseHex(arguments);
+          if (aip.size() != 2) {
+            throw invalid_argument("the AIP must have 2 bytes");
+          }
+          application.aip = static_cast<uint16_t>((aip[0] << 8) | aip[1]);
+        }
+        else if (keyword == "AFL") {
+          application.afl = ResponseTable::parseHex(arguments);
+        }
+        else if (keyword == "RECORD") {
+          unsigned int sfi;
+          unsigned int number;
+          if (!(fields >> sfi >> number) || (sfi == 0) || (sfi > 30) || (number == 0) || (number > 255)) {
+            throw invalid_argument("invalid SFI or record number in RECORD");
+          }
+          string contents;
+          getline(fields, contents);
+          application.records[static_cast<uint16_t>((sfi << 8) | number)] = ResponseTable::parseHex(contents);
+        }
+        else if (keyword == "KEY") {
+          application.masterKey = ResponseTable::parseHex(arguments);
+        }
+        else if (keyword == "IAD") {
+          application.iad = ResponseTable::parseHex(arguments);
+        }
+        else if (keyword == "ATC") {
+          vector<unsigned char> atc = ResponseTable::parseHex(arguments);
+          if (atc.size() != 2) {
+            throw invalid_argument("the ATC must have 2 bytes");
+          }
+          application.atc = static_cast<uint16_t>((atc[0] << 8) | atc[1]);
+        }
+        else {
+          throw invalid_argument("unknown keyword '" + keyword + "'");
+        }
+      }
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("line " + to_string(lineNumber) + ": " + e.what());
+    }
+  }
+
+  if (atr.empty()) {
+    throw invalid_argument("missing ATR");
+  }
+  if (applications.empty()) {
+    throw invalid_argument("missing APPLICATION");
+  }
+
+  auto emv = make_shared<EmvCardTemplate>(atr, protocols,
+                                          costs.empty() ? nullptr : make_shared<CardCostModel>(costs.data(), costs.size()));
+  for (size_t i = 0; i < applications.size(); i++) {
+    try {
+      emv->addApplication(applications[i]);
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("application " + to_string(i + 1) + ": " + e.what());
+    }
+  }
+  return emv;
+}
+
+shared_ptr<EmvCardTemplate> EmvCardTemplate::loadFile(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  return load(in);
+}
+
+void EmvCardTemplate::addApplication(const EmvApplication &application) {
+  applications.emplace_back(application);
+  vector<unsigned char> entry = applicationTemplate(application);
+  directoryEntries.insert(directoryEntries.end(), entry.begin(), entry.end());
+  directory.emplace_back();
+  appendTlv(directory.back(), TAG_RECORD, entry);
+  appendStatus(directory.back(), SW_SUCCESS);
+  encodeDirectories();
+}
+
+void EmvCardTemplate::encodeDirectories() {
+  // PSE: 6F { 84 1PAY.SYS.DDF01, A5 { 88 SFI } }, the applications are in the records of the SFI
+  vector<unsigned char> proprietary;
+  appendTlv(proprietary, TAG_SFI, { DIRECTORY_SFI });
+  vector<unsigned char> contents;
+  appendTlv(contents, TAG_DF_NAME, vector<unsigned char>(PSE_NAME, PSE_NAME + DIRECTORY_NAME_SIZE));
+  appendTlv(contents, TAG_FCI_PROPRIETARY, proprietary);
+  pseFci.clear();
+  appendTlv(pseFci, TAG_FCI, contents);
+  appendStatus(pseFci, SW_SUCCESS);
+
+  // PPSE: 6F { 84 2PAY.SYS.DDF01, A5 { BF0C { 61 ... } } }, the applications are in the FCI
+  vector<unsigned char> discretionary;
+  appendTlv(discretionary, TAG_FCI_DISCRETIONARY, directoryEntries);
+  contents.clear();
+  appendTlv(contents, TAG_DF_NAME, vector<unsigned char>(PPSE_NAME, PPSE_NAME + DIRECTORY_NAME_SIZE));
+  appendTlv(contents, TAG_FCI_PROPRIETARY, discretionary);
+  ppseFci.clear();
+  appendTlv(ppseFci, TAG_FCI, contents);
+  appendStatus(ppseFci, SW_SUCCESS);
+}
+
+int EmvCardTemplate::findApplication(const unsigned char *name, size_t name_lg, size_t next) const {
+  for (size_t i = next; i < applications.size(); i++) {
+    const vector<unsigned char> &aid = applications[i].aid;
+    if ((name_lg >= 5) && (name_lg <= aid.size()) && (memcmp(name, aid.data(), name_lg) == 0)) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+const vector<unsigned char> *EmvCardTemplate::directoryRecord(unsigned char record) const {
+  if ((record == 0) || (record > directory.size())) {
+    return nullptr;
+  }
+  return &directory[record - 1];
+}
+
+unique_ptr<SmartCard> EmvCardTemplate::instantiate() const {
+  return make_unique<EmvSmartCard>(static_pointer_cast<const EmvCardTemplate>(shared_from_this()));
+}
+
+EmvSmartCard::EmvSmartCard(shared_ptr<const EmvCardTemplate> cardTemplate) :
+  SmartCard(cardTemplate),
+  emv(cardTemplate.get()) {
+  for (auto &definition : emv->getApplications()) {
+    atc.push_back(definition.atc);
+  }
+  for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++) {
+    resetChannel(channel);
+  }
+}
+
+void EmvSmartCard::resetChannel(unsigned int channel) {
+  channels[channel] = Channel{ -1, false, State::IDLE };
+}
+
+bool EmvSmartCard::isCacheable(const ApduView &apdu) const {
+  return (apdu.ins == INS_SELECT) || (apdu.ins == INS_READ_RECORD) || (apdu.ins == INS_GET_DATA);
+}
+
+DWORD EmvSmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  const Channel &channel = channels[apdu.channel];
+  (void)handle;
+  switch (apdu.ins) {
+    case INS_SELECT:
+    case INS_READ_RECORD:
+      if (apdu.cla != CLA_ISO) {
+        response.status(SW_CLA_NOT_SUPPORTED);
+      }
+      else if (apdu.ins == INS_SELECT) {
+        select(apdu, response);
+      }
+      else {
+        readRecord(apdu, response);
+      }
+      break;
+    case INS_GET_PROCESSING_OPTIONS:
+    case INS_GET_DATA:
+    case INS_GENERATE_AC:
+      if (apdu.cla != CLA_PROPRIETARY) {
+        response.status(SW_CLA_NOT_SUPPORTED);
+      }
+      else if (channel.application < 0) {
+        response.status(SW_CONDITIONS_NOT_SATISFIED);
+      }
+      else if (apdu.ins == INS_GET_PROCESSING_OPTIONS) {
+        getProcessingOptions(apdu, response);
+      }
+      else if (apdu.ins == INS_GET_DATA) {
+        getData(apdu, response);
+      }
+      else {
+        generateAc(apdu, response);
+      }
+      break;
+    default:
+      response.status(SW_INS_NOT_SUPPORTED);
+      break;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+void EmvSmartCard::select(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  // By name, first (P2 00) or next (P2 02) occurrence
+  if ((apdu.p1 != 0x04) || ((apdu.p2 != 0x00) && (apdu.p2 != 0x02))) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+
+  bool next = (apdu.p2 == 0x02);
+  int found = emv->findApplication(apdu.data, apdu.lc,
+                                   (next && (channel.application >= 0)) ? channel.application + 1 : 0);
+  const Channel previous = channel;
+  selectApplication(apdu, found, response);
+  if ((channel.application != previous.application) || (channel.directorySelected != previous.directorySelected) ||
+      (channel.state != previous.state)) {
+    stateChanged();
+  }
+}
+
+void EmvSmartCard::selectApplication(const ApduView &apdu, int found, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  bool next = (apdu.p2 == 0x02);
+  channel.application = -1;
+  channel.directorySelected = false;
+  channel.state = State::IDLE;
+
+  if ((apdu.lc == DIRECTORY_NAME_SIZE) && !next) {
+    if (memcmp(apdu.data, PSE_NAME, DIRECTORY_NAME_SIZE) == 0) {
+      channel.directorySelected = true;
+      response.reference(emv->getPseFci().data(), emv->getPseFci().size());
+      return;
+    }
+    if (memcmp(apdu.data, PPSE_NAME, DIRECTORY_NAME_SIZE) == 0) {
+      channel.directorySelected = true;
+      response.reference(emv->getPpseFci().data(), emv->getPpseFci().size());
+      return;
+    }
+  }
+  if (found < 0) {
+    response.status(SW_FILE_NOT_FOUND);
+    return;
+  }
+
+  channel.application = found;
+  channel.state = State::SELECTED;
+  const vector<unsigned char> &fci = emv->getApplications()[static_cast<size_t>(found)].fci;
+  response.reference(fci.data(), fci.size());
+}
+
+void EmvSmartCard::readRecord(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  if ((apdu.p1 == 0) || ((apdu.p2 & 0x07) != 0x04)) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+  uint16_t sfi = static_cast<uint16_t>(apdu.p2 >> 3);
+
+  const vector<unsigned char> *record = nullptr;
+  if (channel.directorySelected) {
+    record = (sfi == DIRECTORY_SFI) ? emv->directoryRecord(apdu.p1) : nullptr;
+  }
+  else if (channel.application >= 0) {
+    auto &records = emv->getApplications()[static_cast<size_t>(channel.application)].records;
+    auto found = records.find(static_cast<uint16_t>((sfi << 8) | apdu.p1));
+    record = (found != records.end()) ? &found->second : nullptr;
+  }
+  else {
+    response.status(SW_CONDITIONS_NOT_SATISFIED);
+    return;
+  }
+
+  if (record == nullptr) {
+    response.status(SW_RECORD_NOT_FOUND);
+    return;
+  }
+  response.reference(record->data(), record->size());
+}
+
+void EmvSmartCard::getProcessingOptions(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  const EmvCardTemplate::Application &selected = emv->getApplications()[static_cast<size_t>(channel.application)];
+  if ((apdu.p1 != 0x00) || (apdu.p2 != 0x00)) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+  if (channel.state != State::SELECTED) {
+    response.status(SW_CONDITIONS_NOT_SATISFIED);
+    return;
+  }
+  // 83 { PDOL data }
+  if ((apdu.lc < 2) || (apdu.data[0] != TAG_COMMAND_TEMPLATE) || (apdu.data[1] != apdu.lc - 2)) {
+    response.status(SW_WRONG_DATA);
+    return;
+  }
+  if (apdu.data[1] != selected.pdolLg) {
+    response.status(SW_WRONG_LENGTH);
+    return;
+  }
+  uint16_t &counter = atc[static_cast<size_t>(channel.application)];
+  if (counter == MAX_ATC) {
+    response.status(SW_CONDITIONS_NOT_SATISFIED);
+    return;
+  }
+
+  counter++;
+  channel.state = State::INITIATED;
+  response.reference(selected.processingOptions.data(), selected.processingOptions.size());
+}
+
+void EmvSmartCard::getData(const ApduView &apdu, ApduResponse &response) {
+  const Channel &channel = channels[apdu.channel];
+  uint16_t tag = static_cast<uint16_t>((apdu.p1 << 8) | apdu.p2);
+  if (tag != TAG_ATC) {
+    response.status(SW_REFERENCE_NOT_FOUND);
+    return;
+  }
+  uint16_t counter = atc[static_cast<size_t>(channel.application)];
+  const unsigned char value[] = { apdu.p1, apdu.p2, 0x02, static_cast<unsigned char>(counter >> 8),
+                                  static_cast<unsigned char>(counter) };
+  response.append(value, sizeof(value));
+  response.status(SW_SUCCESS);
+}
+
+void EmvSmartCard::generateAc(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  const EmvCardTemplate::Application &selected = emv->getApplications()[static_cast<size_t>(channel.application)];
+  unsigned char type = static_cast<unsigned char>(apdu.p1 & CRYPTOGRAM_TYPE);
+  if ((type == CRYPTOGRAM_TYPE) || (apdu.p2 != 0x00)) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+
+  // First GENERATE AC with the CDOL1 data, second one after an ARQC with the CDOL2 data
+  size_t expected;
+  if (channel.state == State::INITIATED) {
+    expected = selected.cdol1Lg;
+  }
+  else if ((channel.state == State::FIRST_AC) && (selected.cdol2Lg > 0)) {
+    if (type == CRYPTOGRAM_ARQC) {
+      response.status(SW_WRONG_P1P2);
+      return;
+    }
+    expected = selected.cdol2Lg;
+  }
+  else {
+    response.status(SW_CONDITIONS_NOT_SATISFIED);
+    return;
+  }
+  if (apdu.lc != expected) {
+    response.status(SW_WRONG_LENGTH);
+    return;
+  }
+  channel.state = ((channel.state == State::INITIATED) && (type == CRYPTOGRAM_ARQC)) ? State::FIRST_AC
+                                                                                    : State::COMPLETED;
+
+  // Session key: AES(MK, ATC || F0 || 00...), common session key derivation of EMV Book 2 A1.3
+  uint16_t counter = atc[static_cast<size_t>(channel.application)];
+  unsigned char sessionKey[Aes::BLOCK_SIZE] = { static_cast<unsigned char>(counter >> 8),
+                                                static_cast<unsigned char>(counter), 0xF0 };
+  selected.masterKey.encrypt(sessionKey, sessionKey);
+  Aes session(sessionKey, sizeof(sessionKey));
+
+  // Cryptogram of the CDOL data, the AIP, the ATC and the IAD
+  unsigned char data[255 + 2 + 2 + 32];
+  size_t data_lg = 0;
+  memcpy(data, apdu.data, apdu.lc);
+  data_lg += apdu.lc;
+  data[data_lg++] = static_cast<unsigned char>(selected.aip >> 8);
+  data[data_lg++] = static_cast<unsigned char>(selected.aip);
+  data[data_lg++] = static_cast<unsigned char>(counter >> 8);
+  data[data_lg++] = static_cast<unsigned char>(counter);
+  memcpy(data + data_lg, selected.iad.data(), selected.iad.size());
+  data_lg += selected.iad.size();
+  unsigned char mac[Aes::BLOCK_SIZE];
+  session.cmac(data, data_lg, mac);
+
+  // Response format 1: 80 { CID ATC AC IAD }
+  unsigned char header[] = { TAG_FORMAT_1, static_cast<unsigned char>(1 + 2 + CRYPTOGRAM_SIZE + selected.iad.size()),
+                             type, static_cast<unsigned char>(counter >> 8), static_cast<unsigned char>(counter) };
+  response.append(header, sizeof(header));
+  response.append(mac, CRYPTOGRAM_SIZE);
+  response.append(selected.iad.data(), selected.iad.size());
+  response.status(SW_SUCCESS);
+}
@@ -0,0 +1,236 @@
+/**
+ * Implementation of the memory-mapped card file system image and its builder
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file_system_image.h"
+
+using namespace std;
+
+#define FID_MF                0x3F00
+
+const size_t FileSystemImage::NOT_FOUND;
+const size_t FileSystemImageBuilder::MF;
+
+shared_ptr<const FileSystemImage> FileSystemImage::open(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    ::close(fd);
+    throw runtime_error("can't stat '" + path + "'");
+  }
+  size_t image_lg = static_cast<size_t>(status.st_size);
+  if (image_lg < sizeof(FsImageHeader)) {
+    ::close(fd);
+    throw invalid_argument("'" + path + "' is not a file system image");
+  }
+
+  void *mapping = mmap(nullptr, image_lg, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    ::close(fd);
+    throw runtime_error("can't map '" + path + "'");
+  }
+
+  // The image owns the descriptor and the mapping from here on
+  shared_ptr<FileSystemImage> image(new FileSystemImage(fd, static_cast<const unsigned char *>(mapping), image_lg));
+  image->validate();
+  image->buildIndexes();
+  return image;
+}
+
+FileSystemImage::FileSystemImage(int fd, const unsigned char *base, size_t imageLg) :
+  fd(fd), base(base), imageLg(imageLg), entries(reinterpret_cast<const FsImageEntry *>(base + sizeof(FsImageHeader))) {
+}
+
+FileSystemImage::~FileSystemImage() {
+  munmap(const_cast<unsigned char *>(base), imageLg);
+  ::close(fd);
+}
+
+void FileSystemImage::validate() const {
+  const FsImageHeader &image_header = header();
+
+  if (memcmp(image_header.magic, FS_IMAGE_MAGIC, sizeof(image_header.magic)) != 0) {
+    throw invalid_argument("invalid magic of the file system image");
+  }
+  if ((image_header.atrLg == 0) || (image_header.atrLg > MAX_ATR_SIZE) || (image_header.protocols == 0)) {
+    throw invalid_argument("invalid ATR or protocols in the file system image");
+  }
+  size_t file_count = image_header.fileCount;
+  if ((file_count == 0) || (file_count > (imageLg - sizeof(FsImageHeader)) / sizeof(FsImageEntry))) {
+    throw invalid_argument("invalid number of files in the file system image");
+  }
+  if ((entries[0].type != FS_DF) || (entries[0].parent != FS_NO_PARENT) || (entries[0].fid != FID_MF)) {
+    throw invalid_argument("the first file of the file system image must be the MF");
+  }
+
+  for (size_t i = 1; i < file_count; i++) {
+    const FsImageEntry &file = entries[i];
+    if ((file.parent >= i) || (entries[file.parent].type != FS_DF)) {
+      throw invalid_argument("file " + to_string(i) + " has an invalid parent");
+    }
+    if ((file.type != FS_DF) && (file.type != FS_TRANSPARENT_EF) && (file.type != FS_LINEAR_FIXED_EF)) {
+      throw invalid_argument("file " + to_string(i) + " has an invalid type");
+    }
+    if ((file.aidLg > FS_MAX_AID_SIZE) || (file.sfi > 30)) {
+      throw invalid_argument("file " + to_string(i) + " has an invalid name or short identifier");
+    }
+    if ((static_cast<uint64_t>(file.offset) + file.size) > imageLg) {
+      throw invalid_argument("file " + to_string(i) + " is outside the image");
+    }
+    if ((file.type == FS_LINEAR_FIXED_EF) && (file.recordLength == 0)) {
+      throw invalid_argument("file " + to_string(i) + " has records of length 0");
+    }
+  }
+}
+
+void FileSystemImage::buildIndexes() {
+  for (uint32_t i = 1; i < fileCount(); i++) {
+    const FsImageEntry &file = entries[i];
+    childIndex.emplace_back((static_cast<uint32_t>(file.parent) << 16) | file.fid, i);
+    if (file.sfi != 0) {
+      sfiIndex.emplace_back((static_cast<uint32_t>(file.parent) << 8) | file.sfi, i);
+    }
+    if ((file.type == FS_DF) && (file.aidLg > 0)) {
+      namedDFs.push_back(i);
+    }
+  }
+  // The first file of duplicates is found
+  sort(childIndex.begin(), childIndex.end());
+  sort(sfiIndex.begin(), sfiIndex.end());
+}
+
+size_t FileSystemImage::find(const vector<pair<uint32_t, uint32_t>> &index, uint32_t key) {
+  auto found = lower_bound(index.begin(), index.end(), make_pair(key, static_cast<uint32_t>(0)));
+  if ((found == index.end()) || (found->first != key)) {
+    return NOT_FOUND;
+  }
+  return found->second;
+}
+
+size_t FileSystemImage::findChild(size_t parent, uint16_t fid) const {
+  return find(childIndex, (static_cast<uint32_t>(parent) << 16) | fid);
+}
+
+size_t FileSystemImage::findShortIdentifier(size_t parent, uint8_t sfi) const {
+  if (sfi == 0) {
+    return NOT_FOUND;
+  }
+  return find(sfiIndex, (static_cast<uint32_t>(parent) << 8) | sfi);
+}
+
+size_t FileSystemImage::findName(const unsigned char *aid, size_t aid_lg) const {
+  for (uint32_t index : namedDFs) {
+    const FsImageEntry &df = entries[index];
+    if ((aid_lg <= df.aidLg) && (memcmp(df.aid, aid, aid_lg) == 0)) {
+      return index;
+    }
+  }
+  return NOT_FOUND;
+}
+
+FileSystemImageBuilder::FileSystemImageBuilder(const vector<unsigned char> &atr, DWORD protocols) : header() {
+  if (atr.empty() || (atr.size() > MAX_ATR_SIZE)) {
+    throw invalid_argument("invalid ATR length");
+  }
+  memcpy(header.magic, FS_IMAGE_MAGIC, sizeof(header.magic));
+  header.protocols = protocols;
+  header.atrLg = static_cast<uint8_t>(atr.size());
+  memcpy(header.atr, atr.data(), atr.size());
+
+  FsImageEntry mf = FsImageEntry();
+  mf.fid = FID_MF;
+  mf.parent = FS_NO_PARENT;
+  mf.type = FS_DF;
+  files.push_back(mf);
+  contents.emplace_back();
+}
+
+size_t FileSystemImageBuilder::addFile(size_t parent, uint16_t fid, uint8_t type, uint8_t sfi) {
+  if ((parent >= files.size()) || (files[parent].type != FS_DF)) {
+    throw invalid_argument("the parent of a file must be a DF");
+  }
+  if (files.size() >= FS_NO_PARENT) {
+    throw invalid_argument("too many files in the image");
+  }
+  if (sfi > 30) {
+    throw invalid_argument("short EF identifier must be between 1 and 30");
+  }
+  FsImageEntry file = FsImageEntry();
+  file.fid = fid;
+  file.parent = static_cast<uint16_t>(parent);
+  file.type = type;
+  file.sfi = sfi;
+  files.push_back(file);
+  contents.emplace_back();
+  return files.size() - 1;
+}
+
+size_t FileSystemImageBuilder::addDF(size_t parent, uint16_t fid, const vector<unsigned char> &aid) {
+  if (aid.size() > FS_MAX_AID_SIZE) {
+    throw invalid_argument("name of a DF is at most 16 bytes");
+  }
+  size_t index = addFile(parent, fid, FS_DF, 0);
+  files[index].aidLg = static_cast<uint8_t>(aid.size());
+  if (!aid.empty()) {
+    memcpy(files[index].aid, aid.data(), aid.size());
+  }
+  return index;
+}
+
+size_t FileSystemImageBuilder::addTransparentEF(size_t parent, uint16_t fid, const vector<unsigned char> &data, uint8_t sfi) {
+  size_t index = addFile(parent, fid, FS_TRANSPARENT_EF, sfi);
+  contents[index] = data;
+  return index;
+}
+
+size_t FileSystemImageBuilder::addRecordEF(size_t parent, uint16_t fid, const vector<vector<unsigned char>> &records, uint8_t sfi) {
+  size_t record_lg = 1;
+  for (auto &record : records) {
+    record_lg = max(record_lg, record.size());
+  }
+  if ((record_lg > 255) || (records.size() > 254)) {
+    throw invalid_argument("a linear fixed EF has at most 254 records of 255 bytes");
+  }
+
+  size_t index = addFile(parent, fid, FS_LINEAR_FIXED_EF, sfi);
+  files[index].recordLength = static_cast<uint8_t>(record_lg);
+  for (auto &record : records) {
+    contents[index].insert(contents[index].end(), record.begin(), record.end());
+    contents[index].resize(contents[index].size() + record_lg - record.size(), 0xFF);
+  }
+  return index;
+}
+
+void FileSystemImageBuilder::write(const string &path) const {
+  FsImageHeader image_header = header;
+  image_header.fileCount = static_cast<uint32_t>(files.size());
+
+  vector<FsImageEntry> table = files;
+  size_t offset = sizeof(FsImageHeader) + table.size() * sizeof(FsImageEntry);
+  for (size_t i = 0; i < table.size(); i++) {
+    table[i].offset = static_cast<uint32_t>(offset);
+    table[i].size = static_cast<uint32_t>(contents[i].size());
+    offset += contents[i].size();
+  }
+
+  ofstream out(path, ios::binary | ios::trunc);
+  out.write(reinterpret_cast<const char *>(&image_header), sizeof(image_header));
+  out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(FsImageEntry));
+  for (auto &data : contents) {
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+  }
+  if (!out) {
+    throw runtime_error("can't write '" + path + "'");
+  }
+}
@@ -0,0 +1,372 @@
+/**
+ * Implementation of the file system smartcard
+ */
+#include <algorithm>
+#include <sys/mman.h>
+#include "file_system_smartcard.h"
+
+using namespace std;
+
+#define INS_SELECT               0xA4
+#define INS_READ_BINARY          0xB0
+#define INS_UPDATE_BINARY        0xD6
+#define INS_READ_RECORD          0xB2
+
+#define SW_SUCCESS               0x9000
+#define SW_END_OF_FILE           0x6282
+#define SW_MEMORY_FAILURE        0x6581
+#define SW_WRONG_LENGTH          0x6700
+#define SW_INCOMPATIBLE_FILE     0x6981
+#define SW_NO_CURRENT_EF         0x6986
+#define SW_FILE_NOT_FOUND        0x6A82
+#define SW_RECORD_NOT_FOUND      0x6A83
+#define SW_WRONG_P1P2            0x6A86
+#define SW_WRONG_OFFSET          0x6B00
+#define SW_INS_NOT_SUPPORTED     0x6D00
+
+#define FID_MF                   0x3F00
+
+// SELECT P1
+#define SELECT_FID               0x00
+#define SELECT_CHILD_DF          0x01
+#define SELECT_CHILD_EF          0x02
+#define SELECT_PARENT_DF         0x03
+#define SELECT_NAME              0x04
+#define SELECT_PATH_FROM_MF      0x08
+#define SELECT_PATH_FROM_DF      0x09
+
+// SELECT P2
+#define SELECT_RETURN_FCI        0x00
+#define SELECT_RETURN_FCP        0x04
+#define SELECT_NO_RESPONSE       0x0C
+
+static uint16_t fidAt(const unsigned char *data) {
+  return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+unique_ptr<SmartCard> FileSystemCardTemplate::instantiate() const {
+  return make_unique<FileSystemSmartCard>(static_pointer_cast<const FileSystemCardTemplate>(shared_from_this()));
+}
+
+FileSystemSmartCard::FileSystemSmartCard(shared_ptr<const FileSystemCardTemplate> cardTemplate) :
+  SmartCard(cardTemplate),
+  image(cardTemplate->image.get()),
+  overlay(nullptr) {
+  for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++) {
+    resetChannel(channel);
+  }
+}
+
+void FileSystemSmartCard::resetChannel(unsigned int channel) {
+  channels[channel].currentDF = 0;
+  channels[channel].currentEF = FileSystemImage::NOT_FOUND;
+}
+
+FileSystemSmartCard::~FileSystemSmartCard() {
+  if (overlay != nullptr) {
+    munmap(overlay, image->size());
+  }
+}
+
+void FileSystemSmartCard::setCurrent(Channel &channel, size_t df, size_t ef) {
+  if ((channel.currentDF != df) || (channel.currentEF != ef)) {
+    channel.currentDF = df;
+    channel.currentEF = ef;
+    stateChanged();
+  }
+}
+
+bool FileSystemSmartCard::isCacheable(const ApduView &apdu) const {
+  return (apdu.ins == INS_SELECT) || (apdu.ins == INS_READ_BINARY) || (apdu.ins == INS_READ_RECORD);
+}
+
+DWORD FileSystemSmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  (void)handle;
+
+  switch (apdu.ins) {
+    case INS_SELECT:
+      return select(apdu, response);
+    case INS_READ_BINARY:
+      return readBinary(apdu, response);
+    case INS_UPDATE_BINARY:
+      return updateBinary(apdu, response);
+    case INS_READ_RECORD:
+      return readRecord(apdu, response);
+    default:
+      response.status(SW_INS_NOT_SUPPORTED);
+      return SCARD_S_SUCCESS;
+  }
+}
+
+DWORD FileSystemSmartCard::select(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  size_t found = FileSystemImage::NOT_FOUND;
+
+  if ((apdu.p2 != SELECT_RETURN_FCI) && (apdu.p2 != SELECT_RETURN_FCP) && (apdu.p2 != SELECT_NO_RESPONSE)) {
+    response.status(SW_WRONG_P1P2);
+    return SCARD_S_SUCCESS;
+  }
+
+  switch (apdu.p1) {
+    case SELECT_FID:
+      if ((apdu.lc == 0) || ((apdu.lc == 2) && (fidAt(apdu.data) == FID_MF))) {
+        found = 0;
+      }
+      else if (apdu.lc == 2) {
+        uint16_t fid = fidAt(apdu.data);
+        const FsImageEntry &df = image->entry(channel.currentDF);
+        if (df.fid == fid) {
+          found = channel.currentDF;
+        }
+        else {
+          found = image->findChild(channel.currentDF, fid);
+          if ((found == FileSystemImage::NOT_FOUND) && (df.parent != FS_NO_PARENT) &&
+              (image->entry(df.parent).fid == fid)) {
+            found = df.parent;
+          }
+        }
+      }
+      else {
+        response.status(SW_WRONG_LENGTH);
+        return SCARD_S_SUCCESS;
+      }
+      break;
+
+    case SELECT_CHILD_DF:
+    case SELECT_CHILD_EF:
+      if (apdu.lc != 2) {
+        response.status(SW_WRONG_LENGTH);
+        return SCARD_S_SUCCESS;
+      }
+      found = image->findChild(channel.currentDF, fidAt(apdu.data));
+      if ((found != FileSystemImage::NOT_FOUND) &&
+          ((image->entry(found).type == FS_DF) != (apdu.p1 == SELECT_CHILD_DF))) {
+        found = FileSystemImage::NOT_FOUND;
+      }
+      break;
+
+    case SELECT_PARENT_DF:
+      if (image->entry(channel.currentDF).parent != FS_NO_PARENT) {
+        found = image->entry(channel.currentDF).parent;
+      }
+      break;
+
+    case SELECT_NAME:
+      if ((apdu.lc == 0) || (apdu.lc > FS_MAX_AID_SIZE)) {
+        response.status(SW_WRONG_LENGTH);
+        return SCARD_S_SUCCESS;
+      }
+      found = image->findName(apdu.data, apdu.lc);
+      break;
+
+    case SELECT_PATH_FROM_MF:
+    case SELECT_PATH_FROM_DF: {
+      if ((apdu.lc == 0) || (apdu.lc % 2 != 0)) {
+        response.status(SW_WRONG_LENGTH);
+        return SCARD_S_SUCCESS;
+      }
+      size_t position = 0;
+      found = (apdu.p1 == SELECT_PATH_FROM_MF) ? 0 : channel.currentDF;
+      if ((apdu.p1 == SELECT_PATH_FROM_MF) && (fidAt(apdu.data) == FID_MF)) {
+        position = 2;
+      }
+      for (; (position < apdu.lc) && (found != FileSystemImage::NOT_FOUND); position += 2) {
+        found = (image->entry(found).type == FS_DF) ? image->findChild(found, fidAt(apdu.data + position))
+                                                    : FileSystemImage::NOT_FOUND;
+      }
+      break;
+    }
+
+    default:
+      response.status(SW_WRONG_P1P2);
+      return SCARD_S_SUCCESS;
+  }
+
+  if (found == FileSystemImage::NOT_FOUND) {
+    response.status(SW_FILE_NOT_FOUND);
+    return SCARD_S_SUCCESS;
+  }
+
+  const FsImageEntry &file = image->entry(found);
+  if (file.type == FS_DF) {
+    setCurrent(channel, found, FileSystemImage::NOT_FOUND);
+  }
+  else {
+    setCurrent(channel, file.parent, found);
+  }
+
+  if (apdu.p2 == SELECT_NO_RESPONSE) {
+    response.status(SW_SUCCESS);
+    return SCARD_S_SUCCESS;
+  }
+
+  // FCP template: file descriptor, FID, size or name, life cycle status
+  unsigned char fcp[2 + 7 + 4 + 6 + 2 + FS_MAX_AID_SIZE + 3];
+  size_t fcp_lg = 2;
+  fcp[fcp_lg++] = 0x82;
+  if (file.type == FS_DF) {
+    fcp[fcp_lg++] = 0x01;
+    fcp[fcp_lg++] = 0x38;
+  }
+  else if (file.type == FS_TRANSPARENT_EF) {
+    fcp[fcp_lg++] = 0x01;
+    fcp[fcp_lg++] = 0x01;
+  }
+  else {
+    fcp[fcp_lg++] = 0x05;
+    fcp[fcp_lg++] = 0x02;
+    fcp[fcp_lg++] = 0x21;
+    fcp[fcp_lg++] = 0x00;
+    fcp[fcp_lg++] = file.recordLength;
+    fcp[fcp_lg++] = static_cast<unsigned char>(file.size / file.recordLength);
+  }
+  fcp[fcp_lg++] = 0x83;
+  fcp[fcp_lg++] = 0x02;
+  fcp[fcp_lg++] = static_cast<unsigned char>(file.fid >> 8);
+  fcp[fcp_lg++] = static_cast<unsigned char>(file.fid);
+  if (file.type != FS_DF) {
+    fcp[fcp_lg++] = 0x80;
+    fcp[fcp_lg++] = 0x04;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      fcp[fcp_lg++] = static_cast<unsigned char>(file.size >> shift);
+    }
+  }
+  else if (file.aidLg > 0) {
+    fcp[fcp_lg++] = 0x84;
+    fcp[fcp_lg++] = file.aidLg;
+    memcpy(fcp + fcp_lg, file.aid, file.aidLg);
+    fcp_lg += file.aidLg;
+  }
+  fcp[fcp_lg++] = 0x8A;
+  fcp[fcp_lg++] = 0x01;
+  fcp[fcp_lg++] = 0x05;
+  fcp[0] = 0x62;
+  fcp[1] = static_cast<unsigned char>(fcp_lg - 2);
+
+  response.append(fcp, fcp_lg);
+  response.status(SW_SUCCESS);
+  return SCARD_S_SUCCESS;
+}
+
+uint16_t FileSystemSmartCard::binaryTarget(const ApduView &apdu, size_t *ef, size_t *offset) {
+  Channel &channel = channels[apdu.channel];
+  if (apdu.p1 & 0x80) {
+    *ef = image->findShortIdentifier(channel.currentDF, apdu.p1 & 0x1F);
+    if (*ef == FileSystemImage::NOT_FOUND) {
+      return SW_FILE_NOT_FOUND;
+    }
+    setCurrent(channel, channel.currentDF, *ef);
+    *offset = apdu.p2;
+  }
+  else {
+    if (channel.currentEF == FileSystemImage::NOT_FOUND) {
+      return SW_NO_CURRENT_EF;
+    }
+    *ef = channel.currentEF;
+    *offset = (static_cast<size_t>(apdu.p1 & 0x7F) << 8) | apdu.p2;
+  }
+  if (image->entry(*ef).type != FS_TRANSPARENT_EF) {
+    return SW_INCOMPATIBLE_FILE;
+  }
+  return SW_SUCCESS;
+}
+
+DWORD FileSystemSmartCard::readBinary(const ApduView &apdu, ApduResponse &response) {
+  size_t ef = 0;
+  size_t offset = 0;
+
+  uint16_t sw = binaryTarget(apdu, &ef, &offset);
+  if (sw != SW_SUCCESS) {
+    response.status(sw);
+    return SCARD_S_SUCCESS;
+  }
+  if (!apdu.hasLe) {
+    response.status(SW_WRONG_LENGTH);
+    return SCARD_S_SUCCESS;
+  }
+
+  const FsImageEntry &file = image->entry(ef);
+  if (offset > file.size) {
+    response.status(SW_WRONG_OFFSET);
+    return SCARD_S_SUCCESS;
+  }
+
+  // Le 00 (0000 extended) reads up to the end of the file without warning
+  size_t count = min(apdu.ne, file.size - offset);
+  bool maximum = (apdu.ne == 256) || (apdu.ne == 65536);
+  response.append(contents(file) + offset, count);
+  response.status(((count < apdu.ne) && !maximum) ? SW_END_OF_FILE : SW_SUCCESS);
+  return SCARD_S_SUCCESS;
+}
+
+DWORD FileSystemSmartCard::updateBinary(const ApduView &apdu, ApduResponse &response) {
+  size_t ef = 0;
+  size_t offset = 0;
+
+  uint16_t sw = binaryTarget(apdu, &ef, &offset);
+  if (sw != SW_SUCCESS) {
+    response.status(sw);
+    return SCARD_S_SUCCESS;
+  }
+
+  const FsImageEntry &file = image->entry(ef);
+  if (offset > file.size) {
+    response.status(SW_WRONG_OFFSET);
+    return SCARD_S_SUCCESS;
+  }
+  if ((apdu.lc == 0) || (offset + apdu.lc > file.size)) {
+    response.status(SW_WRONG_LENGTH);
+    return SCARD_S_SUCCESS;
+  }
+
+  if (overlay == nullptr) {
+    void *mapping = mmap(nullptr, image->size(), PROT_READ | PROT_WRITE, MAP_PRIVATE, image->descriptor(), 0);
+    if (mapping == MAP_FAILED) {
+      response.status(SW_MEMORY_FAILURE);
+      return SCARD_S_SUCCESS;
+    }
+    overlay = static_cast<unsigned char *>(mapping);
+  }
+  memcpy(overlay + file.offset + offset, apdu.data, apdu.lc);
+
+  response.status(SW_SUCCESS);
+  return SCARD_S_SUCCESS;
+}
+
+DWORD FileSystemSmartCard::readRecord(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  // Only the record number in P1 is supported
+  if ((apdu.p1 == 0) || ((apdu.p2 & 0x07) != 0x04)) {
+    response.status(SW_WRONG_P1P2);
+    return SCARD_S_SUCCESS;
+  }
+
+  size_t ef = channel.currentEF;
+  uint8_t sfi = apdu.p2 >> 3;
+  if (sfi != 0) {
+    ef = image->findShortIdentifier(channel.currentDF, sfi);
+    if (ef == FileSystemImage::NOT_FOUND) {
+      response.status(SW_FILE_NOT_FOUND);
+      return SCARD_S_SUCCESS;
+    }
+    setCurrent(channel, channel.currentDF, ef);
+  }
+  else if (ef == FileSystemImage::NOT_FOUND) {
+    response.status(SW_NO_CURRENT_EF);
+    return SCARD_S_SUCCESS;
+  }
+
+  const FsImageEntry &file = image->entry(ef);
+  if (file.type != FS_LINEAR_FIXED_EF) {
+    response.status(SW_INCOMPATIBLE_FILE);
+    return SCARD_S_SUCCESS;
+  }
+  if (apdu.p1 > file.size / file.recordLength) {
+    response.status(SW_RECORD_NOT_FOUND);
+    return SCARD_S_SUCCESS;
+  }
+
+  response.append(contents(file) + static_cast<size_t>(apdu.p1 - 1) * file.recordLength, file.recordLength);
+  response.status(SW_SUCCESS);
+  return SCARD_S_SUCCESS;
+}
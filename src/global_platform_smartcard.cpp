@@ -0,0 +1,566 @@
+/**
+ * Implementation of the GlobalPlatform card manager
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "global_platform_smartcard.h"
+#include "response_table.h"
+
+using namespace std;
+
+#define CLA_ISO                  0x00
+#define CLA_GLOBAL_PLATFORM      0x80
+#define CLA_SECURE_MESSAGING     0x04
+
+#define INS_SELECT               0xA4
+#define INS_INSTALL              0xE6
+#define INS_LOAD                 0xE8
+#define INS_DELETE               0xE4
+#define INS_INITIALIZE_UPDATE    0x50
+#define INS_EXTERNAL_AUTHENTICATE 0x82
+
+#define SW_SUCCESS               0x9000
+#define SW_SECURITY_STATUS_NOT_SATISFIED 0x6982
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+#define SW_WRONG_DATA            0x6A80
+#define SW_FILE_NOT_FOUND        0x6A82
+#define SW_NOT_ENOUGH_MEMORY     0x6A84
+#define SW_WRONG_P1P2            0x6A86
+#define SW_REFERENCE_NOT_FOUND   0x6A88
+#define SW_INS_NOT_SUPPORTED     0x6D00
+#define SW_CLA_NOT_SUPPORTED     0x6E00
+
+#define P1_FOR_LOAD              0x02
+#define P1_FOR_INSTALL           0x04
+#define P1_MAKE_SELECTABLE       0x08
+#define LOAD_LAST_BLOCK          0x80
+#define DELETE_RELATED_OBJECTS   0x80
+
+#define TAG_AID                  0x4F
+#define TAG_LOAD_FILE_DATA_BLOCK 0xC4
+
+static const unsigned char DEFAULT_ISD[] = { 0xA0, 0x00, 0x00, 0x01, 0x51, 0x00, 0x00, 0x00 };
+static const size_t DEFAULT_MEMORY = 1024 * 1024;
+
+const size_t AppendOnlyStore::CHUNK_SIZE;
+
+void AppendOnlyStore::append(const unsigned char *data, size_t data_lg) {
+  while (data_lg > 0) {
+    size_t chunk = used / CHUNK_SIZE;
+    size_t offset = used % CHUNK_SIZE;
+    if (chunk == chunks.size()) {
+      chunks.emplace_back(new unsigned char[CHUNK_SIZE]);
+    }
+    size_t count = min(data_lg, CHUNK_SIZE - offset);
+    memcpy(chunks[chunk].get() + offset, data, count);
+    used += count;
+    data += count;
+    data_lg -= count;
+  }
+}
+
+void AppendOnlyStore::truncate(size_t offset) {
+  if (offset < used) {
+    used = offset;
+  }
+}
+
+bool AppendOnlyStore::read(size_t offset, unsigned char *out, size_t out_lg) const {
+  if ((offset > used) || (out_lg > used - offset)) {
+    return false;
+  }
+  while (out_lg > 0) {
+    size_t count = min(out_lg, CHUNK_SIZE - offset % CHUNK_SIZE);
+    memcpy(out, chunks[offset / CHUNK_SIZE].get() + offset % CHUNK_SIZE, count);
+    offset += count;
+    out += count;
+    out_lg -= count;
+  }
+  return true;
+}
+
+/**
+ * FCI of the ISD: 6F { 84 AID, A5 { 9F65 FF } }, the maximum length of the data field of the commands
+ */
+static vector<unsigned char> isdFci(const vector<unsigned char> &isd) {
+  vector<unsigned char> fci = { 0x6F, static_cast<unsigned char>(2 + isd.size() + 2 + 4), 0x84,
+                                static_cast<unsigned char>(isd.size()) };
+  fci.insert(fci.end(), isd.begin(), isd.end());
+  fci.insert(fci.end(), { 0xA5, 0x04, 0x9F, 0x65, 0x01, 0xFF, 0x90, 0x00 });
+  return fci;
+}
+
+GlobalPlatformCardTemplate::GlobalPlatformCardTemplate(vector<unsigned char> atr, DWORD protocols,
+                                                       vector<unsigned char> isd, size_t memory,
+                                                       shared_ptr<const Scp03Keys> keys,
+                                                       shared_ptr<const CardCostModel> costs) :
+  CardTemplate(std::move(atr), SCARD_SHARE_SHARED, protocols, std::move(costs)),
+  isd(std::move(isd)),
+  memory(memory),
+  keys(std::move(keys)),
+  fci(isdFci(this->isd)) {
+  if ((this->isd.size() < 5) || (this->isd.size() > 16)) {
+    throw invalid_argument("the AID of the ISD must have 5 to 16 bytes");
+  }
+}
+
+shared_ptr<GlobalPlatformCardTemplate> GlobalPlatformCardTemplate::load(istream &in) {
+  vector<unsigned char> atr;
+  DWORD protocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+  vector<unsigned char> isd(DEFAULT_ISD, DEFAULT_ISD + sizeof(DEFAULT_ISD));
+  size_t memory = DEFAULT_MEMORY;
+  shared_ptr<Scp03Keys> keys;
+  vector<InstructionCostEntry> costs;
+
+  string line;
+  unsigned int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == string::npos) || (line[start] == '#')) {
+      continue;
+    }
+    line = line.substr(start);
+
+    try {
+      istringstream fields(line);
+      string keyword;
+      fields >> keyword;
+      string arguments = line.substr(keyword.size());
+      if (keyword == "ATR") {
+        atr = ResponseTable::parseHex(arguments);
+        if (atr.empty() || (atr.size() > MAX_ATR_SIZE)) {
+          throw invalid_argument("invalid ATR length");
+        }
+      }
+      else if (keyword == "PROTOCOL") {
+        protocols = CardTable::parseProtocols(arguments);
+      }
+      else if (keyword == "ISD") {
+        isd = ResponseTable::parseHex(arguments);
+      }
+      else if (keyword == "MEMORY") {
+        unsigned long long bytes;
+        if (!(fields >> bytes) || (bytes == 0)) {
+          throw invalid_argument("invalid MEMORY");
+        }
+        memory = static_cast<size_t>(bytes);
+      }
+      else if (keyword == "SCP03") {
+        string version, enc, mac, extra;
+        if (!(fields >> version >> enc >> mac) || (fields >> extra)) {
+          throw invalid_argument("SCP03 needs the key version, K-ENC and K-MAC");
+        }
+        vector<unsigned char> versionBytes = ResponseTable::parseHex(version);
+        if (versionBytes.size() != 1) {
+          throw invalid_argument("invalid key version");
+        }
+        keys = make_shared<Scp03Keys>(versionBytes[0], ResponseTable::parseHex(enc), ResponseTable::parseHex(mac));
+      }
+      else if (keyword == "COST") {
+        costs.push_back(CardTable::parseCost(arguments));
+      }
+      else {
+        throw invalid_argument("unknown keyword '" + keyword + "'");
+      }
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("line " + to_string(lineNumber) + ": " + e.what());
+    }
+  }
+
+  if (atr.empty()) {
+    throw invalid_argument("missing ATR");
+  }
+  return make_shared<GlobalPlatformCardTemplate>(atr, protocols, isd, memory, keys,
+                                                 costs.empty() ? nullptr : make_shared<CardCostModel>(costs.data(), costs.size()));
+}
+
+shared_ptr<GlobalPlatformCardTemplate> GlobalPlatformCardTemplate::loadFile(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  return load(in);
+}
+
+unique_ptr<SmartCard> GlobalPlatformCardTemplate::instantiate() const {
+  return make_unique<GlobalPlatformSmartCard>(static_pointer_cast<const GlobalPlatformCardTemplate>(shared_from_this()));
+}
+
+namespace {
+
+/**
+ * Reader of the length-value fields of the INSTALL commands
+ */
+class LvReader {
+public:
+  LvReader(const unsigned char *data, size_t data_lg) : position(data), end(data + data_lg), valid(true) {
+  };
+
+  vector<unsigned char> next() {
+    if ((position == end) || (static_cast<size_t>(end - position - 1) < *position)) {
+      valid = false;
+      return vector<unsigned char>();
+    }
+    size_t length = *position++;
+    vector<unsigned char> value(position, position + length);
+    position += length;
+    return value;
+  }
+
+  /**
+   * All the fields were present and the data has no trailing bytes
+   */
+  bool complete() const { return valid && (position == end); };
+
+private:
+  const unsigned char *position;
+  const unsigned char *end;
+  bool valid;
+};
+
+}
+
+static bool validAid(const vector<unsigned char> &aid) {
+  return (aid.size() >= 5) && (aid.size() <= 16);
+}
+
+GlobalPlatformSmartCard::GlobalPlatformSmartCard(shared_ptr<const GlobalPlatformCardTemplate> cardTemplate) :
+  SmartCard(cardTemplate),
+  gp(cardTemplate.get()),
+  loadedBytes(0),
+  loading(false),
+  loadingOffset(0),
+  nextBlock(0),
+  counters(),
+  lastPhase(-1),
+  sequenceCounter(0) {
+  for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++) {
+    resetChannel(channel);
+  }
+}
+
+void GlobalPlatformSmartCard::resetChannel(unsigned int channel) {
+  channels[channel].isdSelected = false;
+  channels[channel].session.close();
+}
+
+/**
+ * Phase of a card manager command
+ * @return false when the instruction isn't supported
+ */
+static bool commandPhase(const ApduView &apdu, GlobalPlatformPhase &phase) {
+  switch (apdu.ins) {
+  case INS_INSTALL:
+    phase = (apdu.p1 == P1_FOR_LOAD) ? GlobalPlatformPhase::INSTALL_FOR_LOAD : GlobalPlatformPhase::INSTALL_FOR_INSTALL;
+    return true;
+  case INS_LOAD:
+    phase = GlobalPlatformPhase::LOAD;
+    return true;
+  case INS_DELETE:
+    phase = GlobalPlatformPhase::DELETE;
+    return true;
+  case INS_INITIALIZE_UPDATE:
+  case INS_EXTERNAL_AUTHENTICATE:
+    phase = GlobalPlatformPhase::AUTHENTICATE;
+    return true;
+  default:
+    return false;
+  }
+}
+
+DWORD GlobalPlatformSmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  (void)handle;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  Channel &channel = channels[apdu.channel];
+  GlobalPlatformPhase phase;
+  uint16_t sw;
+  bool secured = false;
+  if ((apdu.ins == INS_SELECT) && (apdu.cla == CLA_ISO)) {
+    phase = GlobalPlatformPhase::SELECT;
+    channel.session.close();
+    sw = select(apdu);
+  }
+  else if (!channel.isdSelected) {
+    response.status((apdu.cla == CLA_ISO) || (apdu.cla == CLA_GLOBAL_PLATFORM) ? SW_INS_NOT_SUPPORTED
+                                                                                : SW_CLA_NOT_SUPPORTED);
+    return SCARD_S_SUCCESS;
+  }
+  else if ((apdu.cla & ~CLA_SECURE_MESSAGING) != CLA_GLOBAL_PLATFORM) {
+    response.status(SW_CLA_NOT_SUPPORTED);
+    return SCARD_S_SUCCESS;
+  }
+  else if (!commandPhase(apdu, phase)) {
+    response.status(SW_INS_NOT_SUPPORTED);
+    return SCARD_S_SUCCESS;
+  }
+  else if (phase == GlobalPlatformPhase::AUTHENTICATE) {
+    sw = authenticate(apdu, response);
+  }
+  else {
+    // The commands of an SCP03 session are unwrapped, without keys the commands are accepted in clear
+    ApduView command(apdu);
+    if (channel.session.isOpen()) {
+      sw = channel.session.unwrap(apdu, command);
+      secured = (sw == SW_SUCCESS);
+    }
+    else {
+      sw = ((gp->keys != nullptr) || ((apdu.cla & CLA_SECURE_MESSAGING) != 0)) ? SW_SECURITY_STATUS_NOT_SATISFIED
+                                                                                : SW_SUCCESS;
+    }
+    if (sw == SW_SUCCESS) {
+      switch (phase) {
+      case GlobalPlatformPhase::INSTALL_FOR_LOAD:
+        sw = installForLoad(command);
+        break;
+      case GlobalPlatformPhase::LOAD:
+        sw = load(command);
+        break;
+      case GlobalPlatformPhase::INSTALL_FOR_INSTALL:
+        sw = installForInstall(command);
+        break;
+      default:
+        sw = remove(command);
+        break;
+      }
+    }
+  }
+
+  // A load sequence is only continued by LOAD commands
+  if (loading && (phase != GlobalPlatformPhase::LOAD) && (phase != GlobalPlatformPhase::INSTALL_FOR_LOAD)) {
+    abortLoad();
+  }
+
+  if ((sw == SW_SUCCESS) && (phase == GlobalPlatformPhase::SELECT) && channel.isdSelected) {
+    response.reference(gp->fci.data(), gp->fci.size());
+  }
+  else if ((sw == SW_SUCCESS) && (phase != GlobalPlatformPhase::SELECT) &&
+           (phase != GlobalPlatformPhase::AUTHENTICATE)) {
+    // The successful GlobalPlatform commands return a single 00 byte
+    const unsigned char empty = 0x00;
+    response.append(&empty, 1);
+    response.status(SW_SUCCESS);
+  }
+  else {
+    response.status(sw);
+  }
+  if (secured) {
+    channel.session.wrap(response);
+  }
+
+  chrono::steady_clock::time_point end = chrono::steady_clock::now();
+  GlobalPlatformPhaseCounters &phaseCounters = counters.phases[static_cast<size_t>(phase)];
+  phaseCounters.commands++;
+  phaseCounters.bytes += apdu.lc;
+  phaseCounters.processing += chrono::duration_cast<chrono::nanoseconds>(end - start);
+  // Consecutive commands of a phase are one run, the time between them belongs to the phase
+  phaseCounters.elapsed += chrono::duration_cast<chrono::nanoseconds>(
+    end - ((lastPhase == static_cast<int>(phase)) ? lastEnd : start));
+  lastPhase = static_cast<int>(phase);
+  lastEnd = end;
+  return SCARD_S_SUCCESS;
+}
+
+uint16_t GlobalPlatformSmartCard::select(const ApduView &apdu) {
+  if ((apdu.p1 != 0x04) || ((apdu.p2 & 0xF3) != 0x00)) {
+    return SW_WRONG_P1P2;
+  }
+  // An empty AID selects the ISD
+  if ((apdu.lc == 0) || ((apdu.lc == gp->isd.size()) && (memcmp(apdu.data, gp->isd.data(), apdu.lc) == 0))) {
+    channels[apdu.channel].isdSelected = true;
+    return SW_SUCCESS;
+  }
+  channels[apdu.channel].isdSelected = false;
+  return isInstalled(vector<unsigned char>(apdu.data, apdu.data + apdu.lc)) ? SW_SUCCESS : SW_FILE_NOT_FOUND;
+}
+
+uint16_t GlobalPlatformSmartCard::authenticate(const ApduView &apdu, ApduResponse &response) {
+  if (gp->keys == nullptr) {
+    return SW_INS_NOT_SUPPORTED;
+  }
+  Scp03Channel &session = channels[apdu.channel].session;
+  if (apdu.ins == INS_INITIALIZE_UPDATE) {
+    if (apdu.cla != CLA_GLOBAL_PLATFORM) {
+      return SW_CLA_NOT_SUPPORTED;
+    }
+    return session.initializeUpdate(*gp->keys, gp->isd, sequenceCounter, apdu, response);
+  }
+  return session.externalAuthenticate(apdu);
+}
+
+uint16_t GlobalPlatformSmartCard::installForLoad(const ApduView &apdu) {
+  if (apdu.p2 != 0x00) {
+    return SW_WRONG_P1P2;
+  }
+  // Load file AID, security domain AID, load file data block hash, load parameters, load token
+  LvReader fields(apdu.data, apdu.lc);
+  vector<unsigned char> aid = fields.next();
+  vector<unsigned char> securityDomain = fields.next();
+  fields.next();
+  fields.next();
+  fields.next();
+  if (!fields.complete() || !validAid(aid) || (!securityDomain.empty() && (securityDomain != gp->isd))) {
+    return SW_WRONG_DATA;
+  }
+  if (loading) {
+    abortLoad();
+  }
+  for (const LoadFile &loadFile : loadFiles) {
+    if (loadFile.aid == aid) {
+      return SW_CONDITIONS_NOT_SATISFIED;
+    }
+  }
+
+  loading = true;
+  loadingAid = aid;
+  loadingOffset = store.size();
+  nextBlock = 0;
+  return SW_SUCCESS;
+}
+
+uint16_t GlobalPlatformSmartCard::load(const ApduView &apdu) {
+  if (!loading) {
+    return SW_CONDITIONS_NOT_SATISFIED;
+  }
+  if (((apdu.p1 & ~LOAD_LAST_BLOCK) != 0) || (apdu.p2 != (nextBlock & 0xFF))) {
+    abortLoad();
+    return SW_WRONG_P1P2;
+  }
+  if (store.size() - loadingOffset + apdu.lc > gp->memory - loadedBytes) {
+    abortLoad();
+    return SW_NOT_ENOUGH_MEMORY;
+  }
+  store.append(apdu.data, apdu.lc);
+  nextBlock++;
+  if ((apdu.p1 & LOAD_LAST_BLOCK) == 0) {
+    return SW_SUCCESS;
+  }
+
+  // The load file is C4 { load file data block }
+  size_t length = store.size() - loadingOffset;
+  unsigned char header[4];
+  if (!store.read(loadingOffset, header, min(length, sizeof(header))) || (length < 2) ||
+      (header[0] != TAG_LOAD_FILE_DATA_BLOCK)) {
+    abortLoad();
+    return SW_WRONG_DATA;
+  }
+  size_t header_lg = 2;
+  size_t contents_lg = header[1];
+  if (header[1] == 0x81) {
+    header_lg = 3;
+    contents_lg = header[2];
+  }
+  else if (header[1] == 0x82) {
+    header_lg = 4;
+    contents_lg = (static_cast<size_t>(header[2]) << 8) | header[3];
+  }
+  else if (header[1] > 0x80) {
+    abortLoad();
+    return SW_WRONG_DATA;
+  }
+  if ((length < header_lg) || (header_lg + contents_lg != length)) {
+    abortLoad();
+    return SW_WRONG_DATA;
+  }
+
+  loadFiles.push_back(LoadFile{ loadingAid, loadingOffset, length });
+  loadedBytes += length;
+  counters.loadFiles++;
+  loading = false;
+  return SW_SUCCESS;
+}
+
+uint16_t GlobalPlatformSmartCard::installForInstall(const ApduView &apdu) {
+  unsigned char options = apdu.p1 & ~(P1_FOR_INSTALL | P1_MAKE_SELECTABLE);
+  if ((options != 0) || ((apdu.p1 & P1_FOR_INSTALL) == 0) || (apdu.p2 != 0x00)) {
+    return SW_WRONG_P1P2;
+  }
+  // Load file AID, module AID, application AID, privileges, install parameters, install token
+  LvReader fields(apdu.data, apdu.lc);
+  Applet applet;
+  applet.loadFile = fields.next();
+  applet.module = fields.next();
+  applet.aid = fields.next();
+  applet.privileges = fields.next();
+  fields.next();
+  fields.next();
+  if (!fields.complete() || !validAid(applet.loadFile) || !validAid(applet.module) || !validAid(applet.aid) ||
+      ((applet.privileges.size() != 1) && (applet.privileges.size() != 3))) {
+    return SW_WRONG_DATA;
+  }
+  auto loadFile = find_if(loadFiles.begin(), loadFiles.end(),
+                          [&applet](const LoadFile &file) { return file.aid == applet.loadFile; });
+  if (loadFile == loadFiles.end()) {
+    return SW_REFERENCE_NOT_FOUND;
+  }
+  if (isInstalled(applet.aid) || (applet.aid == gp->isd)) {
+    return SW_CONDITIONS_NOT_SATISFIED;
+  }
+
+  applets.push_back(std::move(applet));
+  counters.applets++;
+  return SW_SUCCESS;
+}
+
+uint16_t GlobalPlatformSmartCard::remove(const ApduView &apdu) {
+  if ((apdu.p1 != 0x00) || ((apdu.p2 & ~DELETE_RELATED_OBJECTS) != 0)) {
+    return SW_WRONG_P1P2;
+  }
+  if ((apdu.lc < 2) || (apdu.data[0] != TAG_AID) || (apdu.data[1] != apdu.lc - 2)) {
+    return SW_WRONG_DATA;
+  }
+  vector<unsigned char> aid(apdu.data + 2, apdu.data + apdu.lc);
+
+  auto applet = find_if(applets.begin(), applets.end(), [&aid](const Applet &installed) { return installed.aid == aid; });
+  if (applet != applets.end()) {
+    applets.erase(applet);
+    return SW_SUCCESS;
+  }
+
+  auto loadFile = find_if(loadFiles.begin(), loadFiles.end(), [&aid](const LoadFile &file) { return file.aid == aid; });
+  if (loadFile == loadFiles.end()) {
+    return SW_REFERENCE_NOT_FOUND;
+  }
+  bool instances = any_of(applets.begin(), applets.end(), [&aid](const Applet &installed) {
+    return installed.loadFile == aid;
+  });
+  if (instances) {
+    if ((apdu.p2 & DELETE_RELATED_OBJECTS) == 0) {
+      return SW_CONDITIONS_NOT_SATISFIED;
+    }
+    applets.erase(remove_if(applets.begin(), applets.end(), [&aid](const Applet &installed) {
+      return installed.loadFile == aid;
+    }), applets.end());
+  }
+  // The space of the load file is reused when it is at the end of the store
+  if (loadFile->offset + loadFile->length == store.size()) {
+    store.truncate(loadFile->offset);
+  }
+  loadedBytes -= loadFile->length;
+  loadFiles.erase(loadFile);
+  return SW_SUCCESS;
+}
+
+void GlobalPlatformSmartCard::abortLoad() {
+  store.truncate(loadingOffset);
+  loading = false;
+}
+
+bool GlobalPlatformSmartCard::getLoadFile(const vector<unsigned char> &aid, vector<unsigned char> &contents) const {
+  for (const LoadFile &loadFile : loadFiles) {
+    if (loadFile.aid == aid) {
+      contents.resize(loadFile.length);
+      return store.read(loadFile.offset, contents.data(), loadFile.length);
+    }
+  }
+  return false;
+}
+
+bool GlobalPlatformSmartCard::isInstalled(const vector<unsigned char> &aid) const {
+  return any_of(applets.begin(), applets.end(), [&aid](const Applet &applet) { return applet.aid == aid; });
+}
@@ -0,0 +1,99 @@
+/**
+ * Implementation of the transport latency model of a reader
+ */
+#include <thread>
+#include "latency_model.h"
+
+using namespace std;
+
+#define ATR_TA1_PRESENT       0x10
+
+#define T0_CHARACTER_ETU      12
+#define T1_CHARACTER_ETU      11
+#define T1_BLOCK_GUARD_ETU    22
+#define T1_BLOCK_FRAMING_LG   4
+#define T1_ESTIMATED_IFS      254
+
+// Sleeping is not precise below this margin, the remaining time is spent spinning on the steady clock
+#define SPIN_MARGIN           chrono::microseconds(200)
+
+// Fi and Di of ISO 7816-3, 0 is RFU
+static const uint32_t g_clock_rate_conversion[16] = {
+  372, 372, 558, 744, 1116, 1488, 1860, 0, 0, 512, 768, 1024, 1536, 2048, 0, 0
+};
+static const uint32_t g_baud_rate_adjustment[16] = {
+  0, 1, 2, 4, 8, 16, 32, 64, 12, 20, 0, 0, 0, 0, 0, 0
+};
+
+static size_t blockCount(size_t lg) {
+  return (lg == 0) ? 1 : (lg + T1_ESTIMATED_IFS - 1) / T1_ESTIMATED_IFS;
+}
+
+LatencyModel::LatencyModel(LatencyMode mode, uint32_t clockFrequency, chrono::microseconds overhead) :
+  mode(mode), clockFrequency(clockFrequency), overhead(overhead), clockRateConversion(372), baudRateAdjustment(1),
+  clock(0) {
+
+  if (clockFrequency == 0) {
+    throw invalid_argument("Clock frequency of the card can't be 0");
+  }
+}
+
+void LatencyModel::setATR(const vector<unsigned char> &atr) {
+  clockRateConversion = 372;
+  baudRateAdjustment = 1;
+
+  if ((atr.size() < 3) || !(atr[1] & ATR_TA1_PRESENT)) {
+    return;
+  }
+  uint32_t fi = g_clock_rate_conversion[atr[2] >> 4];
+  uint32_t di = g_baud_rate_adjustment[atr[2] & 0x0F];
+  if ((fi != 0) && (di != 0)) {
+    clockRateConversion = fi;
+    baudRateAdjustment = di;
+  }
+}
+
+chrono::nanoseconds LatencyModel::etuTime(uint64_t etus) const {
+  return chrono::nanoseconds((etus * clockRateConversion * 1000000000ULL) /
+                             (static_cast<uint64_t>(baudRateAdjustment) * clockFrequency));
+}
+
+chrono::nanoseconds LatencyModel::exchangeTime(DWORD protocol, size_t command_lg, size_t response_lg) const {
+  if (protocol != SCARD_PROTOCOL_T1) {
+    // Command, procedure byte and response
+    return overhead + etuTime((command_lg + 1 + response_lg) * T0_CHARACTER_ETU);
+  }
+
+  // Chained I-blocks, each acknowledged by an R-block except the last one
+  T1BlockCounters blocks = T1BlockCounters();
+  size_t command_blocks = blockCount(command_lg);
+  size_t response_blocks = blockCount(response_lg);
+  blocks.iBlocks = command_blocks + response_blocks;
+  blocks.rBlocks = (command_blocks - 1) + (response_blocks - 1);
+  blocks.bytesToCard = command_lg + (command_blocks + response_blocks - 1) * T1_BLOCK_FRAMING_LG;
+  blocks.bytesFromCard = response_lg + (response_blocks + command_blocks - 1) * T1_BLOCK_FRAMING_LG;
+  return exchangeTime(blocks);
+}
+
+chrono::nanoseconds LatencyModel::exchangeTime(const T1BlockCounters &blocks) const {
+  uint64_t characters = blocks.bytesToCard + blocks.bytesFromCard;
+  uint64_t block_count = blocks.iBlocks + blocks.rBlocks + blocks.sBlocks;
+  return overhead + etuTime(characters * T1_CHARACTER_ETU + block_count * T1_BLOCK_GUARD_ETU);
+}
+
+void LatencyModel::apply(chrono::nanoseconds duration) {
+  clock += duration.count();
+  if (mode == LatencyMode::Sleep) {
+    preciseSleep(duration);
+  }
+}
+
+void preciseSleep(chrono::nanoseconds duration) {
+  auto deadline = chrono::steady_clock::now() + duration;
+  if (duration > SPIN_MARGIN) {
+    this_thread::sleep_for(duration - SPIN_MARGIN);
+  }
+  while (chrono::steady_clock::now() < deadline) {
+    this_thread::yield();
+  }
+}
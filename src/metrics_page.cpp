@@ -0,0 +1,243 @@
+/**
+ * Implementation of the shared memory page of the metrics
+ */
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "metrics_page.h"
+#include "stubbing.h"
+
+using namespace std;
+
+#define METRICS_MAGIC            "WSMETRC1"
+#define METRICS_MAGIC_SIZE       8
+#define SEQUENCE_OFFSET          16
+
+static_assert(sizeof(MetricsSnapshot) % sizeof(uint64_t) == 0, "the snapshot is made of words");
+static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t), "the words of the page are atomic");
+
+const uint32_t MetricsPage::VERSION;
+const size_t MetricsPage::HEADER_SIZE;
+const size_t MetricsPage::WORDS;
+
+atomic<int64_t> MetricsPage::contexts(0);
+atomic<int64_t> MetricsPage::handles(0);
+atomic<int64_t> MetricsPage::cards(0);
+atomic<uint64_t> MetricsPage::events(0);
+
+namespace {
+
+class Publisher {
+public:
+  Publisher() : fd(-1), page(nullptr), pageLg(0), publications(0), stopping(false) {}
+
+  void run() {
+    unique_lock<mutex> lock(wake);
+    while (!stopping) {
+      signal.wait_for(lock, period, [this] { return stopping; });
+      lock.unlock();
+      publish();
+      lock.lock();
+    }
+  }
+
+  /**
+   * Write the values under the seqlock, the publisher is the only writer
+   */
+  void publish() {
+    MetricsSnapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.pid = static_cast<uint64_t>(getpid());
+    snapshot.timestamp = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+      chrono::system_clock::now().time_since_epoch()).count());
+    snapshot.publications = ++publications;
+    snapshot.contexts = MetricsPage::contexts.load(memory_order_relaxed);
+    snapshot.handles = MetricsPage::handles.load(memory_order_relaxed);
+    snapshot.cards = MetricsPage::cards.load(memory_order_relaxed);
+    snapshot.events = MetricsPage::events.load(memory_order_relaxed);
+    snapshot.faults = get_injected_return_codes();
+    CallStats::snapshot(stats.data());
+    for (size_t i = 0; i < CallStats::FUNCTIONS; i++) {
+      snapshot.calls[i] = stats[i].calls;
+      snapshot.errors[i] = stats[i].errors;
+      snapshot.totalNanoseconds[i] = stats[i].totalNanoseconds;
+    }
+    uint64_t words[MetricsPage::WORDS];
+    memcpy(words, &snapshot, sizeof(words));
+
+    atomic<uint64_t> *sequence = reinterpret_cast<atomic<uint64_t> *>(page + SEQUENCE_OFFSET);
+    atomic<uint64_t> *values = reinterpret_cast<atomic<uint64_t> *>(page + MetricsPage::HEADER_SIZE);
+    uint64_t current = sequence->load(memory_order_relaxed);
+    sequence->store(current + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < MetricsPage::WORDS; i++) {
+      values[i].store(words[i], memory_order_relaxed);
+    }
+    sequence->store(current + 2, memory_order_release);
+  }
+
+  mutex control;                    // start and stop
+  string name;
+  int fd;
+  unsigned char *page;
+  size_t pageLg;
+  chrono::milliseconds period;
+  uint64_t publications;
+  vector<CallStats::FunctionStats> stats;
+  thread publisher;
+  mutex wake;
+  condition_variable signal;
+  bool stopping;
+};
+
+/**
+ * The publisher is never destroyed, like the other background writers
+ */
+Publisher &publisher() {
+  static Publisher *instance = new Publisher();
+  return *instance;
+}
+
+}
+
+void MetricsPage::start(const string &name, chrono::milliseconds period) {
+  if ((name.size() < 2) || (name[0] != '/') || (name.find('/', 1) != string::npos)) {
+    throw invalid_argument("'" + name + "' is not a shared memory name");
+  }
+  if (period.count() <= 0) {
+    throw invalid_argument("the period must be positive");
+  }
+  Publisher &page = publisher();
+  lock_guard<mutex> guard(page.control);
+  if (page.page != nullptr) {
+    throw logic_error("the metrics are already published in '" + page.name + "'");
+  }
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw runtime_error("can't create the shared memory '" + name + "'");
+  }
+  size_t page_lg = HEADER_SIZE + WORDS * sizeof(uint64_t);
+  if (ftruncate(fd, static_cast<off_t>(page_lg)) != 0) {
+    ::close(fd);
+    shm_unlink(name.c_str());
+    throw runtime_error("can't size the shared memory '" + name + "'");
+  }
+  void *mapping = mmap(nullptr, page_lg, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    ::close(fd);
+    shm_unlink(name.c_str());
+    throw runtime_error("can't map the shared memory '" + name + "'");
+  }
+
+  // Until the first publication, the readers see no publication
+  unsigned char *data = static_cast<unsigned char *>(mapping);
+  memset(data, 0, page_lg);
+  memcpy(data, METRICS_MAGIC, METRICS_MAGIC_SIZE);
+  uint32_t version = VERSION;
+  uint32_t words = static_cast<uint32_t>(WORDS);
+  memcpy(data + 8, &version, sizeof(version));
+  memcpy(data + 12, &words, sizeof(words));
+
+  page.name = name;
+  page.fd = fd;
+  page.page = data;
+  page.pageLg = page_lg;
+  page.period = period;
+  page.publications = 0;
+  page.stats.resize(CallStats::FUNCTIONS);
+  page.stopping = false;
+  page.publish();
+  page.publisher = thread(&Publisher::run, &page);
+}
+
+void MetricsPage::stop() {
+  Publisher &page = publisher();
+  lock_guard<mutex> guard(page.control);
+  if (page.page == nullptr) {
+    return;
+  }
+  {
+    lock_guard<mutex> wakeGuard(page.wake);
+    page.stopping = true;
+  }
+  page.signal.notify_one();
+  page.publisher.join();
+  page.publish();
+  munmap(page.page, page.pageLg);
+  ::close(page.fd);
+  shm_unlink(page.name.c_str());
+  page.page = nullptr;
+  page.fd = -1;
+}
+
+bool MetricsPage::publishing() {
+  Publisher &page = publisher();
+  lock_guard<mutex> guard(page.control);
+  return page.page != nullptr;
+}
+
+bool MetricsPage::read(const void *page, size_t page_lg, MetricsSnapshot *snapshot, unsigned int attempts) {
+  const unsigned char *data = static_cast<const unsigned char *>(page);
+  uint32_t version;
+  uint32_t words;
+  if ((page_lg < HEADER_SIZE + WORDS * sizeof(uint64_t)) || (memcmp(data, METRICS_MAGIC, METRICS_MAGIC_SIZE) != 0)) {
+    return false;
+  }
+  memcpy(&version, data + 8, sizeof(version));
+  memcpy(&words, data + 12, sizeof(words));
+  if ((version != VERSION) || (words != WORDS)) {
+    return false;
+  }
+
+  const atomic<uint64_t> *sequence = reinterpret_cast<const atomic<uint64_t> *>(data + SEQUENCE_OFFSET);
+  const atomic<uint64_t> *values = reinterpret_cast<const atomic<uint64_t> *>(data + HEADER_SIZE);
+  uint64_t copy[WORDS];
+  for (unsigned int attempt = 0; attempt < attempts; attempt++) {
+    uint64_t before = sequence->load(memory_order_acquire);
+    if ((before & 1) != 0) {
+      this_thread::yield();
+      continue;
+    }
+    for (size_t i = 0; i < WORDS; i++) {
+      copy[i] = values[i].load(memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (sequence->load(memory_order_relaxed) == before) {
+      memcpy(snapshot, copy, sizeof(copy));
+      return true;
+    }
+  }
+  return false;
+}
+
+MetricsPageReader::MetricsPageReader(const string &name) : fd(-1), page(nullptr), pageLg(0) {
+  fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    throw runtime_error("can't open the shared memory '" + name + "'");
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    ::close(fd);
+    throw runtime_error("can't stat the shared memory '" + name + "'");
+  }
+  pageLg = static_cast<size_t>(status.st_size);
+  void *mapping = mmap(nullptr, pageLg, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    ::close(fd);
+    throw runtime_error("can't map the shared memory '" + name + "'");
+  }
+  page = mapping;
+}
+
+MetricsPageReader::~MetricsPageReader() {
+  munmap(const_cast<void *>(page), pageLg);
+  ::close(fd);
+}
@@ -0,0 +1,445 @@
+/**
+ * Implementation of the Montgomery arithmetic
+ */
+#include <cstring>
+#include <stdexcept>
+#include "montgomery.h"
+
+using namespace std;
+
+// Largest width of the sliding window of the exponentiation
+#define MAX_WINDOW_BITS 6
+
+typedef unsigned __int128 wide_t;
+
+const size_t Montgomery::MAX_LIMBS;
+
+static uint64_t addWords(uint64_t *r, const uint64_t *a, const uint64_t *b, size_t limbs) {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < limbs; i++) {
+    wide_t sum = static_cast<wide_t>(a[i]) + b[i] + carry;
+    r[i] = static_cast<uint64_t>(sum);
+    carry = static_cast<uint64_t>(sum >> 64);
+  }
+  return carry;
+}
+
+static uint64_t subtractWords(uint64_t *r, const uint64_t *a, const uint64_t *b, size_t limbs) {
+  uint64_t borrow = 0;
+  for (size_t i = 0; i < limbs; i++) {
+    wide_t difference = static_cast<wide_t>(a[i]) - b[i] - borrow;
+    r[i] = static_cast<uint64_t>(difference);
+    borrow = static_cast<uint64_t>(difference >> 64) & 1;
+  }
+  return borrow;
+}
+
+Montgomery::Montgomery(const vector<unsigned char> &modulus) : n(0), m(), mInverse(0), rModM(), r2ModM(), mMinus2() {
+  size_t start = 0;
+  while ((start < modulus.size()) && (modulus[start] == 0)) {
+    start++;
+  }
+  size_t modulus_lg = modulus.size() - start;
+  if ((modulus_lg == 0) || (modulus_lg > MAX_LIMBS * 8) || ((modulus.back() & 1) == 0) ||
+      ((modulus_lg == 1) && (modulus.back() < 3))) {
+    throw invalid_argument("invalid modulus");
+  }
+  n = (modulus_lg + 7) / 8;
+  fromBytes(m, n, modulus.data() + start, modulus_lg);
+
+  // Newton iteration, m is its own inverse modulo 8
+  uint64_t inverse = m[0];
+  for (int i = 0; i < 5; i++) {
+    inverse *= 2 - m[0] * inverse;
+  }
+  mInverse = 0 - inverse;
+
+  // R and R^2 modulo m by doubling 1
+  uint64_t value[MAX_LIMBS] = { 1 };
+  for (size_t i = 0; i < 128 * n; i++) {
+    uint64_t carry = value[n - 1] >> 63;
+    for (size_t j = n - 1; j > 0; j--) {
+      value[j] = (value[j] << 1) | (value[j - 1] >> 63);
+    }
+    value[0] <<= 1;
+    if ((carry != 0) || (compare(value, m, n) >= 0)) {
+      subtractWords(value, value, m, n);
+    }
+    if (i == 64 * n - 1) {
+      memcpy(rModM, value, n * sizeof(uint64_t));
+    }
+  }
+  memcpy(r2ModM, value, n * sizeof(uint64_t));
+
+  const uint64_t two[MAX_LIMBS] = { 2 };
+  subtractWords(mMinus2, m, two, n);
+}
+
+/**
+ * Sum of the products of a column of a product scanning (Comba) multiplication, on 3 words. The carries of the sum
+ * don't wait for the multiplications, unlike the carry of a row of the operand scanning.
+ */
+struct ColumnSum {
+  wide_t low;
+  uint64_t high;
+
+  void multiplyAdd(uint64_t a, uint64_t b) {
+    wide_t product = static_cast<wide_t>(a) * b;
+    low += product;
+    high += (low < product) ? 1 : 0;
+  }
+
+  void add(const ColumnSum &other) {
+    low += other.low;
+    high += other.high + ((low < other.low) ? 1 : 0);
+  }
+
+  /**
+   * Word of the column, the sum moves to the next column
+   */
+  uint64_t next() {
+    uint64_t word = static_cast<uint64_t>(low);
+    low = (low >> 64) | (static_cast<wide_t>(high) << 64);
+    high = 0;
+    return word;
+  }
+};
+
+/**
+ * r = t mod m for t < 2 * m, top is the carry out of the N words of t
+ */
+static void finalSubtract(uint64_t *r, const uint64_t *t, uint64_t top, const uint64_t *m, size_t limbs) {
+  if ((top != 0) || (Montgomery::compare(t, m, limbs) >= 0)) {
+    subtractWords(r, t, m, limbs);
+  }
+  else {
+    memcpy(r, t, limbs * sizeof(uint64_t));
+  }
+}
+
+/**
+ * Montgomery product of numbers of n words of any size, r = a * b / 2^(64 * n) mod m
+ */
+static void montgomeryProduct(uint64_t *r, const uint64_t *a, const uint64_t *b, const uint64_t *m, uint64_t mInverse,
+                              size_t limbs) {
+  uint64_t t[Montgomery::MAX_LIMBS + 1];
+  memset(t, 0, (limbs + 1) * sizeof(uint64_t));
+
+  // t = (t + a * b[i] + q * m) / 2^64 in one pass, q clears the lowest word
+  for (size_t i = 0; i < limbs; i++) {
+    wide_t product = static_cast<wide_t>(a[0]) * b[i] + t[0];
+    uint64_t q = static_cast<uint64_t>(product) * mInverse;
+    wide_t reduction = static_cast<wide_t>(q) * m[0] + static_cast<uint64_t>(product);
+    uint64_t productCarry = static_cast<uint64_t>(product >> 64);
+    uint64_t reductionCarry = static_cast<uint64_t>(reduction >> 64);
+    for (size_t j = 1; j < limbs; j++) {
+      product = static_cast<wide_t>(a[j]) * b[i] + t[j] + productCarry;
+      productCarry = static_cast<uint64_t>(product >> 64);
+      reduction = static_cast<wide_t>(q) * m[j] + static_cast<uint64_t>(product) + reductionCarry;
+      reductionCarry = static_cast<uint64_t>(reduction >> 64);
+      t[j - 1] = static_cast<uint64_t>(reduction);
+    }
+    wide_t top = static_cast<wide_t>(t[limbs]) + productCarry + reductionCarry;
+    t[limbs - 1] = static_cast<uint64_t>(top);
+    t[limbs] = static_cast<uint64_t>(top >> 64);
+  }
+  finalSubtract(r, t, t[limbs], m, limbs);
+}
+
+/**
+ * Montgomery product of numbers of N words, r = a * b / 2^(64 * N) mod m, for the sizes of the card keys: 4 words
+ * for P-256 and 16 for the primes of RSA-2048. The columns of a * b and of q * m are summed together, the words q of
+ * the reduction are computed by the low columns. The loops are unrolled, which removes the indexing of the short
+ * columns.
+ */
+template<size_t N>
+static void montgomeryProduct(uint64_t *r, const uint64_t *a, const uint64_t *b, const uint64_t *m, uint64_t mInverse) {
+  uint64_t q[N];
+  uint64_t t[N];
+  ColumnSum sum = { 0, 0 };
+#pragma GCC unroll 16
+  for (size_t i = 0; i < N; i++) {
+#pragma GCC unroll 16
+    for (size_t j = 0; j < i; j++) {
+      sum.multiplyAdd(a[j], b[i - j]);
+      sum.multiplyAdd(q[j], m[i - j]);
+    }
+    sum.multiplyAdd(a[i], b[0]);
+    q[i] = static_cast<uint64_t>(sum.low) * mInverse;
+    sum.multiplyAdd(q[i], m[0]);
+    sum.next();
+  }
+#pragma GCC unroll 16
+  for (size_t i = N; i < 2 * N; i++) {
+#pragma GCC unroll 16
+    for (size_t j = i - N + 1; j < N; j++) {
+      sum.multiplyAdd(a[j], b[i - j]);
+      sum.multiplyAdd(q[j], m[i - j]);
+    }
+    t[i - N] = sum.next();
+  }
+  finalSubtract(r, t, sum.next(), m, N);
+}
+
+/**
+ * Montgomery square of a number of N words, r = a^2 / 2^(64 * N) mod m. The products a[j] * a[i - j] of j < i - j
+ * are computed once and added twice, which saves almost half of the products of a * a.
+ */
+template<size_t N>
+static void montgomerySquare(uint64_t *r, const uint64_t *a, const uint64_t *m, uint64_t mInverse) {
+  uint64_t q[N];
+  uint64_t t[N];
+  ColumnSum sum = { 0, 0 };
+#pragma GCC unroll 16
+  for (size_t i = 0; i < N; i++) {
+    ColumnSum cross = { 0, 0 };
+#pragma GCC unroll 16
+    for (size_t j = 0; j < (i + 1) / 2; j++) {
+      cross.multiplyAdd(a[j], a[i - j]);
+    }
+    sum.add(cross);
+    sum.add(cross);
+    if ((i % 2) == 0) {
+      sum.multiplyAdd(a[i / 2], a[i / 2]);
+    }
+#pragma GCC unroll 16
+    for (size_t j = 0; j < i; j++) {
+      sum.multiplyAdd(q[j], m[i - j]);
+    }
+    q[i] = static_cast<uint64_t>(sum.low) * mInverse;
+    sum.multiplyAdd(q[i], m[0]);
+    sum.next();
+  }
+#pragma GCC unroll 16
+  for (size_t i = N; i < 2 * N; i++) {
+    ColumnSum cross = { 0, 0 };
+#pragma GCC unroll 16
+    for (size_t j = i - N + 1; j < (i + 1) / 2; j++) {
+      cross.multiplyAdd(a[j], a[i - j]);
+    }
+    sum.add(cross);
+    sum.add(cross);
+    if ((i % 2) == 0) {
+      sum.multiplyAdd(a[i / 2], a[i / 2]);
+    }
+#pragma GCC unroll 16
+    for (size_t j = i - N + 1; j < N; j++) {
+      sum.multiplyAdd(q[j], m[i - j]);
+    }
+    t[i - N] = sum.next();
+  }
+  finalSubtract(r, t, sum.next(), m, N);
+}
+
+void Montgomery::multiply(uint64_t *r, const uint64_t *a, const uint64_t *b) const {
+  switch (n) {
+    case 4:
+      montgomeryProduct<4>(r, a, b, m, mInverse);
+      break;
+    case 16:
+      montgomeryProduct<16>(r, a, b, m, mInverse);
+      break;
+    default:
+      montgomeryProduct(r, a, b, m, mInverse, n);
+      break;
+  }
+}
+
+void Montgomery::square(uint64_t *r, const uint64_t *a) const {
+  switch (n) {
+    case 4:
+      montgomerySquare<4>(r, a, m, mInverse);
+      break;
+    case 16:
+      montgomerySquare<16>(r, a, m, mInverse);
+      break;
+    default:
+      montgomeryProduct(r, a, a, m, mInverse, n);
+      break;
+  }
+}
+
+void Montgomery::redc(uint64_t *r, uint64_t *t) const {
+  uint64_t top = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t q = t[i] * mInverse;
+    uint64_t carry = 0;
+    for (size_t j = 0; j < n; j++) {
+      wide_t sum = static_cast<wide_t>(q) * m[j] + t[i + j] + carry;
+      t[i + j] = static_cast<uint64_t>(sum);
+      carry = static_cast<uint64_t>(sum >> 64);
+    }
+    wide_t sum = static_cast<wide_t>(t[i + n]) + carry + top;
+    t[i + n] = static_cast<uint64_t>(sum);
+    top = static_cast<uint64_t>(sum >> 64);
+  }
+  finalSubtract(r, t + n, top, m, n);
+}
+
+void Montgomery::multiplyModular(uint64_t *r, const uint64_t *a, const uint64_t *b) const {
+  multiply(r, a, b);
+  multiply(r, r, r2ModM);
+}
+
+void Montgomery::add(uint64_t *r, const uint64_t *a, const uint64_t *b) const {
+  uint64_t carry = addWords(r, a, b, n);
+  if ((carry != 0) || (compare(r, m, n) >= 0)) {
+    subtractWords(r, r, m, n);
+  }
+}
+
+void Montgomery::subtract(uint64_t *r, const uint64_t *a, const uint64_t *b) const {
+  if (subtractWords(r, a, b, n) != 0) {
+    addWords(r, r, m, n);
+  }
+}
+
+void Montgomery::toMontgomery(uint64_t *r, const uint64_t *a) const {
+  multiply(r, a, r2ModM);
+}
+
+void Montgomery::fromMontgomery(uint64_t *r, const uint64_t *a) const {
+  uint64_t t[2 * MAX_LIMBS];
+  memset(t, 0, 2 * n * sizeof(uint64_t));
+  memcpy(t, a, n * sizeof(uint64_t));
+  redc(r, t);
+}
+
+void Montgomery::reduce(uint64_t *r, const uint64_t *a, size_t a_limbs) const {
+  uint64_t t[2 * MAX_LIMBS];
+  memset(t, 0, 2 * n * sizeof(uint64_t));
+  memcpy(t, a, ((a_limbs < 2 * n) ? a_limbs : 2 * n) * sizeof(uint64_t));
+  redc(r, t);
+  multiply(r, r, r2ModM);
+}
+
+/**
+ * Width of the sliding window of an exponent of the given number of bits, which minimizes the products of the table
+ * (2^(w - 1)) and of the windows (about bits / (w + 1))
+ */
+static size_t windowBits(size_t bits) {
+  if (bits > 768) {
+    return MAX_WINDOW_BITS;
+  }
+  if (bits > 240) {
+    return 5;
+  }
+  if (bits > 80) {
+    return 4;
+  }
+  return (bits > 24) ? 3 : 1;
+}
+
+void Montgomery::power(uint64_t *r, const uint64_t *a, const uint64_t *e, size_t e_limbs) const {
+  size_t bits = e_limbs * 64;
+  while ((bits > 0) && (((e[(bits - 1) / 64] >> ((bits - 1) % 64)) & 1) == 0)) {
+    bits--;
+  }
+  if (bits == 0) {
+    memcpy(r, rModM, n * sizeof(uint64_t));
+    return;
+  }
+
+  // Sliding window: the table holds the odd powers a, a^3, ..., a^(2^w - 1)
+  const size_t window = windowBits(bits);
+  uint64_t table[1 << (MAX_WINDOW_BITS - 1)][MAX_LIMBS];
+  memcpy(table[0], a, n * sizeof(uint64_t));
+  if (window > 1) {
+    uint64_t a2[MAX_LIMBS];
+    square(a2, a);
+    for (size_t i = 1; i < (static_cast<size_t>(1) << (window - 1)); i++) {
+      multiply(table[i], table[i - 1], a2);
+    }
+  }
+
+  uint64_t result[MAX_LIMBS];
+  bool started = false;
+  size_t i = bits;
+  while (i > 0) {
+    if (((e[(i - 1) / 64] >> ((i - 1) % 64)) & 1) == 0) {
+      square(result, result);
+      i--;
+      continue;
+    }
+    // Longest window of at most w bits which starts at bit i - 1 and ends with a 1
+    size_t low = (i > window) ? i - window : 0;
+    while (((e[low / 64] >> (low % 64)) & 1) == 0) {
+      low++;
+    }
+    size_t digit = 0;
+    for (size_t k = i; k-- > low;) {
+      digit = (digit << 1) | ((e[k / 64] >> (k % 64)) & 1);
+      if (started) {
+        square(result, result);
+      }
+    }
+    if (started) {
+      multiply(result, result, table[digit >> 1]);
+    }
+    else {
+      memcpy(result, table[digit >> 1], n * sizeof(uint64_t));
+      started = true;
+    }
+    i = low;
+  }
+  memcpy(r, result, n * sizeof(uint64_t));
+}
+
+void Montgomery::exponentiate(uint64_t *r, const uint64_t *a, const uint64_t *e, size_t e_limbs) const {
+  uint64_t base[MAX_LIMBS];
+  toMontgomery(base, a);
+  power(r, base, e, e_limbs);
+  fromMontgomery(r, r);
+}
+
+void Montgomery::inverse(uint64_t *r, const uint64_t *a) const {
+  power(r, a, mMinus2, n);
+}
+
+void Montgomery::fromBytes(uint64_t *r, size_t r_limbs, const unsigned char *bytes, size_t bytes_lg) {
+  memset(r, 0, r_limbs * sizeof(uint64_t));
+  for (size_t k = 0; k < bytes_lg; k++) {
+    size_t limb = k / 8;
+    if (limb < r_limbs) {
+      r[limb] |= static_cast<uint64_t>(bytes[bytes_lg - 1 - k]) << (8 * (k % 8));
+    }
+  }
+}
+
+void Montgomery::toBytes(unsigned char *bytes, size_t bytes_lg, const uint64_t *a, size_t a_limbs) {
+  for (size_t k = 0; k < bytes_lg; k++) {
+    size_t limb = k / 8;
+    bytes[bytes_lg - 1 - k] = (limb < a_limbs) ? static_cast<unsigned char>(a[limb] >> (8 * (k % 8))) : 0;
+  }
+}
+
+int Montgomery::compare(const uint64_t *a, const uint64_t *b, size_t limbs) {
+  for (size_t i = limbs; i-- > 0;) {
+    if (a[i] != b[i]) {
+      return (a[i] < b[i]) ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+bool Montgomery::isZero(const uint64_t *a, size_t limbs) {
+  for (size_t i = 0; i < limbs; i++) {
+    if (a[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Montgomery::multiplyWide(uint64_t *r, const uint64_t *a, size_t a_limbs, const uint64_t *b, size_t b_limbs) {
+  memset(r, 0, (a_limbs + b_limbs) * sizeof(uint64_t));
+  for (size_t i = 0; i < b_limbs; i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < a_limbs; j++) {
+      wide_t sum = static_cast<wide_t>(a[j]) * b[i] + r[i + j] + carry;
+      r[i + j] = static_cast<uint64_t>(sum);
+      carry = static_cast<uint64_t>(sum >> 64);
+    }
+    r[i + a_limbs] = carry;
+  }
+}
@@ -0,0 +1,300 @@
+/**
+ * Implementation of the multi-application smartcard
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "multi_application_smartcard.h"
+#include "response_table.h"
+
+using namespace std;
+
+#define CLA_PROPRIETARY          0x80
+
+#define INS_SELECT               0xA4
+
+#define SW_FILE_NOT_FOUND        0x6A82
+#define SW_INS_NOT_SUPPORTED     0x6D00
+
+// SELECT P1 and P2
+#define SELECT_NAME              0x04
+#define SELECT_OCCURRENCE        0x03
+#define SELECT_FIRST             0x00
+#define SELECT_LAST              0x01
+#define SELECT_NEXT              0x02
+#define SELECT_PREVIOUS          0x03
+
+#define MIN_AID_SIZE             5
+#define MAX_AID_SIZE             16
+
+const size_t MultiApplicationCardTemplate::NOT_FOUND;
+
+MultiApplicationCardTemplate::MultiApplicationCardTemplate(vector<unsigned char> atr, DWORD protocols,
+                                                           shared_ptr<const CardCostModel> costs) :
+  CardTemplate(std::move(atr), SCARD_SHARE_SHARED, protocols, std::move(costs)) {
+}
+
+shared_ptr<MultiApplicationCardTemplate> MultiApplicationCardTemplate::load(istream &in, const string &directory) {
+  vector<unsigned char> atr;
+  DWORD protocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+  vector<InstructionCostEntry> costs;
+  vector<Application> applications;
+
+  string line;
+  unsigned int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == string::npos) || (line[start] == '#')) {
+      continue;
+    }
+    line = line.substr(start);
+
+    try {
+      istringstream fields(line);
+      string keyword;
+      fields >> keyword;
+      string arguments = line.substr(keyword.size());
+      if (keyword == "ATR") {
+        atr = ResponseTable::parseHex(arguments);
+        if (atr.empty() || (atr.size() > MAX_ATR_SIZE)) {
+          throw invalid_argument("invalid ATR length");
+        }
+      }
+      else if (keyword == "PROTOCOL") {
+        protocols = CardTable::parseProtocols(arguments);
+      }
+      else if (keyword == "APPLICATION") {
+        string aid, type, file, extra;
+        if (!(fields >> aid >> type >> file) || (fields >> extra)) {
+          throw invalid_argument("APPLICATION needs the AID, the type and the file of the application");
+        }
+        string path = (directory.empty() || (file[0] == '/')) ? file : directory + "/" + file;
+        shared_ptr<const CardTemplate> implementation = SmartCard::load_template(type, path);
+        if (implementation == nullptr) {
+          throw invalid_argument("unknown application type '" + type + "'");
+        }
+        applications.push_back({ ResponseTable::parseHex(aid), implementation });
+      }
+      else if (keyword == "COST") {
+        costs.push_back(CardTable::parseCost(arguments));
+      }
+      else {
+        throw invalid_argument("unknown keyword '" + keyword + "'");
+      }
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("line " + to_string(lineNumber) + ": " + e.what());
+    }
+  }
+
+  if (atr.empty()) {
+    throw invalid_argument("missing ATR");
+  }
+  auto cardTemplate = make_shared<MultiApplicationCardTemplate>(
+    atr, protocols, costs.empty() ? nullptr : make_shared<CardCostModel>(costs.data(), costs.size()));
+  for (Application &application : applications) {
+    cardTemplate->addApplication(application.aid, std::move(application.implementation));
+  }
+  return cardTemplate;
+}
+
+shared_ptr<MultiApplicationCardTemplate> MultiApplicationCardTemplate::loadFile(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  size_t separator = path.find_last_of('/');
+  return load(in, (separator == string::npos) ? string() : path.substr(0, separator));
+}
+
+void MultiApplicationCardTemplate::addApplication(const vector<unsigned char> &aid,
+                                                  shared_ptr<const CardTemplate> implementation) {
+  if ((aid.size() < MIN_AID_SIZE) || (aid.size() > MAX_AID_SIZE)) {
+    throw invalid_argument("the AID of an application must have 5 to 16 bytes");
+  }
+  if (implementation == nullptr) {
+    throw invalid_argument("missing implementation of the application");
+  }
+  auto position = lower_bound(index.begin(), index.end(), aid,
+                              [](const Application &application, const vector<unsigned char> &key) {
+                                return application.aid < key;
+                              });
+  if ((position != index.end()) && (position->aid == aid)) {
+    throw invalid_argument("duplicate AID");
+  }
+  index.insert(position, { aid, std::move(implementation) });
+}
+
+bool MultiApplicationCardTemplate::matches(size_t position, const unsigned char *partial, size_t partial_lg) const {
+  const vector<unsigned char> &aid = index[position].aid;
+  return (aid.size() >= partial_lg) && equal(partial, partial + partial_lg, aid.begin());
+}
+
+size_t MultiApplicationCardTemplate::first(const unsigned char *partial, size_t partial_lg) const {
+  // The AIDs starting with the partial AID are the smallest ones which aren't lower than it
+  auto position = lower_bound(index.begin(), index.end(), partial,
+                              [partial_lg](const Application &application, const unsigned char *key) {
+                                return lexicographical_compare(application.aid.begin(), application.aid.end(),
+                                                               key, key + partial_lg);
+                              });
+  size_t found = static_cast<size_t>(position - index.begin());
+  return ((found < index.size()) && matches(found, partial, partial_lg)) ? found : NOT_FOUND;
+}
+
+size_t MultiApplicationCardTemplate::last(const unsigned char *partial, size_t partial_lg) const {
+  size_t found = first(partial, partial_lg);
+  if (found == NOT_FOUND) {
+    return NOT_FOUND;
+  }
+  while ((found + 1 < index.size()) && matches(found + 1, partial, partial_lg)) {
+    found++;
+  }
+  return found;
+}
+
+size_t MultiApplicationCardTemplate::next(size_t current, const unsigned char *partial, size_t partial_lg) const {
+  if ((current >= index.size()) || !matches(current, partial, partial_lg)) {
+    return first(partial, partial_lg);
+  }
+  return ((current + 1 < index.size()) && matches(current + 1, partial, partial_lg)) ? current + 1 : NOT_FOUND;
+}
+
+size_t MultiApplicationCardTemplate::previous(size_t current, const unsigned char *partial, size_t partial_lg) const {
+  if ((current >= index.size()) || !matches(current, partial, partial_lg)) {
+    return last(partial, partial_lg);
+  }
+  return ((current > 0) && matches(current - 1, partial, partial_lg)) ? current - 1 : NOT_FOUND;
+}
+
+unique_ptr<SmartCard> MultiApplicationCardTemplate::instantiate() const {
+  return make_unique<MultiApplicationSmartCard>(
+    static_pointer_cast<const MultiApplicationCardTemplate>(shared_from_this()));
+}
+
+MultiApplicationSmartCard::MultiApplicationSmartCard(shared_ptr<const MultiApplicationCardTemplate> cardTemplate) :
+  SmartCard(cardTemplate),
+  multi(cardTemplate.get()) {
+  for (const MultiApplicationCardTemplate::Application &application : multi->applications()) {
+    applications.push_back(application.implementation->instantiate());
+  }
+  for (Channel &channel : channels) {
+    channel.application = nullptr;
+    channel.position = MultiApplicationCardTemplate::NOT_FOUND;
+  }
+}
+
+void MultiApplicationSmartCard::resetChannel(unsigned int channel) {
+  Channel &state = channels[channel];
+  if (state.application != nullptr) {
+    state.application->resetChannel(channel);
+  }
+  state.application = nullptr;
+  state.position = MultiApplicationCardTemplate::NOT_FOUND;
+}
+
+const vector<unsigned char> *MultiApplicationSmartCard::getSelected(unsigned int channel) const {
+  if ((channel >= MAX_CHANNELS) || (channels[channel].application == nullptr)) {
+    return nullptr;
+  }
+  return &multi->applications()[channels[channel].position].aid;
+}
+
+static bool isSelectByName(const ApduView &apdu) {
+  return (apdu.ins == INS_SELECT) && (apdu.p1 == SELECT_NAME) && ((apdu.cla & CLA_PROPRIETARY) == 0);
+}
+
+bool MultiApplicationSmartCard::isCacheable(const ApduView &apdu) const {
+  SmartCard *application = channels[apdu.channel].application;
+  return isSelectByName(apdu) || (application == nullptr) || application->isCacheable(apdu);
+}
+
+DWORD MultiApplicationSmartCard::forward(SmartCard *application, SCARDHANDLE handle, const ApduView &apdu,
+                                         ApduResponse &response) {
+  uint64_t epoch = application->stateEpoch;
+  DWORD ret = application->execute(handle, apdu, response);
+  if (application->stateEpoch != epoch) {
+    stateChanged();
+  }
+  return ret;
+}
+
+DWORD MultiApplicationSmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  if (isSelectByName(apdu)) {
+    return select(handle, apdu, response);
+  }
+  SmartCard *application = channels[apdu.channel].application;
+  if (application == nullptr) {
+    response.status(SW_INS_NOT_SUPPORTED);
+    return SCARD_S_SUCCESS;
+  }
+  return forward(application, handle, apdu, response);
+}
+
+DWORD MultiApplicationSmartCard::select(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  size_t found;
+  switch (apdu.p2 & SELECT_OCCURRENCE) {
+    case SELECT_FIRST:
+      found = multi->first(apdu.data, apdu.lc);
+      break;
+    case SELECT_LAST:
+      found = multi->last(apdu.data, apdu.lc);
+      break;
+    case SELECT_NEXT:
+      found = multi->next(channel.position, apdu.data, apdu.lc);
+      break;
+    default:
+      found = multi->previous(channel.position, apdu.data, apdu.lc);
+      break;
+  }
+
+  if (found == MultiApplicationCardTemplate::NOT_FOUND) {
+    // Not an application: the selected application may have a DF with that name
+    if ((channel.application != nullptr) &&
+        (multi->first(apdu.data, apdu.lc) == MultiApplicationCardTemplate::NOT_FOUND)) {
+      return forward(channel.application, handle, apdu, response);
+    }
+    response.status(SW_FILE_NOT_FOUND);
+    return SCARD_S_SUCCESS;
+  }
+
+  // The application gets the SELECT of its first occurrence with the complete AID, on the same channel
+  const vector<unsigned char> &aid = multi->applications()[found].aid;
+  unsigned char command[5 + MAX_AID_SIZE + 1];
+  command[0] = apdu.raw[0];
+  command[1] = INS_SELECT;
+  command[2] = SELECT_NAME;
+  command[3] = static_cast<unsigned char>(apdu.p2 & ~SELECT_OCCURRENCE);
+  command[4] = static_cast<unsigned char>(aid.size());
+  memcpy(command + 5, aid.data(), aid.size());
+  size_t command_lg = 5 + aid.size();
+  if (apdu.hasLe) {
+    command[command_lg++] = 0x00;
+  }
+  bool complete = (apdu.lc == aid.size()) && ((apdu.p2 & SELECT_OCCURRENCE) == SELECT_FIRST);
+  ApduView forwarded = complete ? apdu : ApduView(command, command_lg);
+
+  SmartCard *application = applications[found].get();
+  DWORD ret = forward(application, handle, forwarded, response);
+  if (ret != SCARD_S_SUCCESS) {
+    return ret;
+  }
+  unsigned char sw1 = (response.length() >= 2) ? response.data()[response.length() - 2] : 0x00;
+  if ((sw1 != 0x90) && (sw1 != 0x61) && (sw1 != 0x62) && (sw1 != 0x63)) {
+    // The selection of the channel doesn't change when the application refuses it
+    return SCARD_S_SUCCESS;
+  }
+
+  if (channel.application != application) {
+    if (channel.application != nullptr) {
+      channel.application->resetChannel(apdu.channel);
+    }
+    channel.application = application;
+    channel.position = found;
+    stateChanged();
+  }
+  return SCARD_S_SUCCESS;
+}
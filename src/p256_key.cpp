@@ -0,0 +1,443 @@
+/**
+ * Implementation of the ECDSA P-256 private key
+ */
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+#include "montgomery.h"
+#include "p256_key.h"
+
+using namespace std;
+
+const size_t P256PrivateKey::SIZE;
+
+static const vector<unsigned char> P256_P = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const vector<unsigned char> P256_N = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xBC, 0xE6, 0xFA, 0xAD, 0xA7, 0x17, 0x9E, 0x84, 0xF3, 0xB9, 0xCA, 0xC2, 0xFC, 0x63, 0x25, 0x51
+};
+
+static const unsigned char P256_GX[] = {
+  0x6B, 0x17, 0xD1, 0xF2, 0xE1, 0x2C, 0x42, 0x47, 0xF8, 0xBC, 0xE6, 0xE5, 0x63, 0xA4, 0x40, 0xF2,
+  0x77, 0x03, 0x7D, 0x81, 0x2D, 0xEB, 0x33, 0xA0, 0xF4, 0xA1, 0x39, 0x45, 0xD8, 0x98, 0xC2, 0x96
+};
+
+static const unsigned char P256_GY[] = {
+  0x4F, 0xE3, 0x42, 0xE2, 0xFE, 0x1A, 0x7F, 0x9B, 0x8E, 0xE7, 0xEB, 0x4A, 0x7C, 0x0F, 0x9E, 0x16,
+  0x2B, 0xCE, 0x33, 0x57, 0x6B, 0x31, 0x5E, 0xCE, 0xCB, 0xB6, 0x40, 0x68, 0x37, 0xBF, 0x51, 0xF5
+};
+
+namespace {
+
+/**
+ * SHA-256, only used for the HMAC of the deterministic nonce
+ */
+class Sha256 {
+public:
+  Sha256() : state{ 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 },
+             block(), blockLg(0), total(0) {
+  };
+
+  void update(const unsigned char *data, size_t data_lg) {
+    total += data_lg;
+    while (data_lg > 0) {
+      size_t count = min(data_lg, sizeof(block) - blockLg);
+      memcpy(block + blockLg, data, count);
+      blockLg += count;
+      data += count;
+      data_lg -= count;
+      if (blockLg == sizeof(block)) {
+        compress();
+        blockLg = 0;
+      }
+    }
+  }
+
+  void final(unsigned char *digest) {
+    uint64_t bits = total * 8;
+    const unsigned char padding = 0x80;
+    const unsigned char zero = 0x00;
+    update(&padding, 1);
+    while (blockLg != 56) {
+      update(&zero, 1);
+    }
+    unsigned char length[8];
+    for (int i = 0; i < 8; i++) {
+      length[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    }
+    update(length, sizeof(length));
+    for (int i = 0; i < 8; i++) {
+      for (int j = 0; j < 4; j++) {
+        digest[4 * i + j] = static_cast<unsigned char>(state[i] >> (24 - 8 * j));
+      }
+    }
+  }
+
+private:
+  static uint32_t rotate(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  void compress() {
+    static const uint32_t K[64] = {
+      0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+      0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+      0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+      0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+      0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+      0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+      0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+      0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+    };
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (static_cast<uint32_t>(block[4 * i]) << 24) | (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+             (static_cast<uint32_t>(block[4 * i + 2]) << 8) | static_cast<uint32_t>(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+      uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+
+  uint32_t state[8];
+  unsigned char block[64];
+  size_t blockLg;
+  uint64_t total;
+};
+
+typedef pair<const unsigned char *, size_t> Bytes;
+
+/**
+ * HMAC-SHA-256 of the concatenation of the parts with a key of 32 bytes
+ */
+void hmac(const unsigned char *key, initializer_list<Bytes> parts, unsigned char *mac) {
+  unsigned char pad[64];
+  unsigned char inner[32];
+
+  memset(pad, 0x36, sizeof(pad));
+  for (size_t i = 0; i < 32; i++) {
+    pad[i] ^= key[i];
+  }
+  Sha256 innerHash;
+  innerHash.update(pad, sizeof(pad));
+  for (const Bytes &part : parts) {
+    innerHash.update(part.first, part.second);
+  }
+  innerHash.final(inner);
+
+  memset(pad, 0x5C, sizeof(pad));
+  for (size_t i = 0; i < 32; i++) {
+    pad[i] ^= key[i];
+  }
+  Sha256 outerHash;
+  outerHash.update(pad, sizeof(pad));
+  outerHash.update(inner, sizeof(inner));
+  outerHash.final(mac);
+}
+
+/**
+ * Point with coordinates in the Montgomery form of the field
+ */
+struct AffinePoint {
+  uint64_t x[4];
+  uint64_t y[4];
+};
+
+struct JacobianPoint {
+  uint64_t x[4];
+  uint64_t y[4];
+  uint64_t z[4];
+  bool infinity;
+};
+
+/**
+ * Arithmetic of the curve y^2 = x^3 - 3x + b and the table of the multiples of the generator
+ */
+class Curve {
+public:
+  Curve() : field(P256_P), order(P256_N) {
+    AffinePoint base;
+    uint64_t coordinate[4];
+    Montgomery::fromBytes(coordinate, 4, P256_GX, sizeof(P256_GX));
+    field.toMontgomery(base.x, coordinate);
+    Montgomery::fromBytes(coordinate, 4, P256_GY, sizeof(P256_GY));
+    field.toMontgomery(base.y, coordinate);
+
+    for (size_t i = 0; i < 64; i++) {
+      table[i][1] = base;
+      JacobianPoint multiple = toJacobian(base);
+      for (size_t j = 2; j < 16; j++) {
+        addAffine(multiple, multiple, base);
+        toAffine(table[i][j], multiple);
+      }
+
+      JacobianPoint next = toJacobian(base);
+      for (int j = 0; j < 4; j++) {
+        doublePoint(next, next);
+      }
+      toAffine(base, next);
+    }
+  };
+
+  /**
+   * k * G for a scalar in normal form, by 4 bits windows of the scalar
+   */
+  void multiplyBase(JacobianPoint &r, const uint64_t *k) const {
+    r.infinity = true;
+    for (size_t i = 0; i < 64; i++) {
+      unsigned int digit = static_cast<unsigned int>(k[i / 16] >> ((i % 16) * 4)) & 0x0F;
+      if (digit != 0) {
+        addAffine(r, r, table[i][digit]);
+      }
+    }
+  }
+
+  void toAffine(AffinePoint &r, const JacobianPoint &a) const {
+    uint64_t zInverse[4];
+    uint64_t zInverse2[4];
+    field.inverse(zInverse, a.z);
+    field.square(zInverse2, zInverse);
+    field.multiply(r.x, a.x, zInverse2);
+    field.multiply(zInverse2, zInverse2, zInverse);
+    field.multiply(r.y, a.y, zInverse2);
+  }
+
+  const Montgomery field;
+  const Montgomery order;
+
+private:
+  JacobianPoint toJacobian(const AffinePoint &a) const {
+    JacobianPoint r;
+    memcpy(r.x, a.x, sizeof(r.x));
+    memcpy(r.y, a.y, sizeof(r.y));
+    memcpy(r.z, field.one(), sizeof(r.z));
+    r.infinity = false;
+    return r;
+  }
+
+  /**
+   * dbl-2001-b, a = -3
+   */
+  void doublePoint(JacobianPoint &r, const JacobianPoint &a) const {
+    if (a.infinity) {
+      r.infinity = true;
+      return;
+    }
+    uint64_t delta[4], gamma[4], beta[4], alpha[4], t[4];
+
+    field.square(delta, a.z);
+    field.square(gamma, a.y);
+    field.multiply(beta, a.x, gamma);
+    field.subtract(t, a.x, delta);
+    field.add(alpha, a.x, delta);
+    field.multiply(alpha, alpha, t);
+    field.add(t, alpha, alpha);
+    field.add(alpha, alpha, t);
+
+    // Z3 = (Y1 + Z1)^2 - gamma - delta
+    field.add(t, a.y, a.z);
+    field.square(r.z, t);
+    field.subtract(r.z, r.z, gamma);
+    field.subtract(r.z, r.z, delta);
+
+    // X3 = alpha^2 - 8 * beta
+    field.add(beta, beta, beta);
+    field.add(beta, beta, beta);
+    field.square(r.x, alpha);
+    field.subtract(r.x, r.x, beta);
+    field.subtract(r.x, r.x, beta);
+
+    // Y3 = alpha * (4 * beta - X3) - 8 * gamma^2
+    field.subtract(t, beta, r.x);
+    field.multiply(r.y, alpha, t);
+    field.square(gamma, gamma);
+    field.add(gamma, gamma, gamma);
+    field.add(gamma, gamma, gamma);
+    field.add(gamma, gamma, gamma);
+    field.subtract(r.y, r.y, gamma);
+    r.infinity = false;
+  }
+
+  /**
+   * madd-2007-bl, mixed addition of a Jacobian and an affine point
+   */
+  void addAffine(JacobianPoint &r, const JacobianPoint &a, const AffinePoint &b) const {
+    if (a.infinity) {
+      r = toJacobian(b);
+      return;
+    }
+    uint64_t z1z1[4], u2[4], s2[4], h[4], hh[4], i[4], j[4], rr[4], v[4], t[4];
+
+    field.square(z1z1, a.z);
+    field.multiply(u2, b.x, z1z1);
+    field.multiply(s2, b.y, a.z);
+    field.multiply(s2, s2, z1z1);
+    field.subtract(h, u2, a.x);
+    field.subtract(rr, s2, a.y);
+    if (Montgomery::isZero(h, 4)) {
+      if (Montgomery::isZero(rr, 4)) {
+        doublePoint(r, a);
+      }
+      else {
+        r.infinity = true;
+      }
+      return;
+    }
+
+    field.square(hh, h);
+    field.add(i, hh, hh);
+    field.add(i, i, i);
+    field.multiply(j, h, i);
+    field.add(rr, rr, rr);
+    field.multiply(v, a.x, i);
+
+    // Z3 = (Z1 + H)^2 - Z1Z1 - HH
+    field.add(t, a.z, h);
+    field.square(r.z, t);
+    field.subtract(r.z, r.z, z1z1);
+    field.subtract(r.z, r.z, hh);
+
+    // Y3 = r * (V - X3) - 2 * Y1 * J, with Y1 read before X3 is written
+    field.multiply(t, a.y, j);
+    field.add(t, t, t);
+
+    // X3 = r^2 - J - 2 * V
+    field.square(r.x, rr);
+    field.subtract(r.x, r.x, j);
+    field.subtract(r.x, r.x, v);
+    field.subtract(r.x, r.x, v);
+
+    field.subtract(v, v, r.x);
+    field.multiply(r.y, rr, v);
+    field.subtract(r.y, r.y, t);
+    r.infinity = false;
+  }
+
+  AffinePoint table[64][16];   // table[i][j] = j * 16^i * G, the entries j = 0 aren't used
+};
+
+const Curve &curve() {
+  static const Curve instance;
+  return instance;
+}
+
+}
+
+P256PrivateKey::P256PrivateKey(const vector<unsigned char> &privateKey) : d(), dBytes() {
+  size_t start = 0;
+  while ((start < privateKey.size()) && (privateKey[start] == 0)) {
+    start++;
+  }
+  const Montgomery &order = curve().order;
+  if ((privateKey.size() == start) || (privateKey.size() - start > SIZE)) {
+    throw invalid_argument("invalid P-256 private key");
+  }
+  Montgomery::fromBytes(d, 4, privateKey.data() + start, privateKey.size() - start);
+  if (Montgomery::compare(d, order.modulus(), 4) >= 0) {
+    throw invalid_argument("invalid P-256 private key");
+  }
+  Montgomery::toBytes(dBytes, SIZE, d, 4);
+}
+
+void P256PrivateKey::publicKey(unsigned char *x, unsigned char *y) const {
+  const Curve &p256 = curve();
+  JacobianPoint point;
+  AffinePoint affine;
+  uint64_t coordinate[4];
+
+  p256.multiplyBase(point, d);
+  p256.toAffine(affine, point);
+  p256.field.fromMontgomery(coordinate, affine.x);
+  Montgomery::toBytes(x, SIZE, coordinate, 4);
+  p256.field.fromMontgomery(coordinate, affine.y);
+  Montgomery::toBytes(y, SIZE, coordinate, 4);
+}
+
+void P256PrivateKey::sign(const unsigned char *hash, size_t hash_lg, unsigned char *r, unsigned char *s) const {
+  const Curve &p256 = curve();
+  const Montgomery &order = p256.order;
+
+  // e = bits2int(hash) mod n
+  uint64_t e[4];
+  unsigned char h1[SIZE];
+  Montgomery::fromBytes(e, 4, hash, min(hash_lg, SIZE));
+  order.reduce(e, e, 4);
+  Montgomery::toBytes(h1, SIZE, e, 4);
+
+  // HMAC_DRBG of RFC 6979
+  unsigned char v[32];
+  unsigned char k[32];
+  const unsigned char zero = 0x00;
+  const unsigned char one = 0x01;
+  memset(v, 0x01, sizeof(v));
+  memset(k, 0x00, sizeof(k));
+  hmac(k, { Bytes(v, sizeof(v)), Bytes(&zero, 1), Bytes(dBytes, SIZE), Bytes(h1, SIZE) }, k);
+  hmac(k, { Bytes(v, sizeof(v)) }, v);
+  hmac(k, { Bytes(v, sizeof(v)), Bytes(&one, 1), Bytes(dBytes, SIZE), Bytes(h1, SIZE) }, k);
+  hmac(k, { Bytes(v, sizeof(v)) }, v);
+
+  for (;;) {
+    hmac(k, { Bytes(v, sizeof(v)) }, v);
+    uint64_t nonce[4];
+    Montgomery::fromBytes(nonce, 4, v, sizeof(v));
+
+    if (!Montgomery::isZero(nonce, 4) && (Montgomery::compare(nonce, order.modulus(), 4) < 0)) {
+      JacobianPoint point;
+      AffinePoint affine;
+      uint64_t x[4];
+      p256.multiplyBase(point, nonce);
+      p256.toAffine(affine, point);
+      p256.field.fromMontgomery(x, affine.x);
+
+      // r = x mod n, s = k^-1 * (e + r * d) mod n
+      uint64_t rValue[4];
+      uint64_t sValue[4];
+      order.reduce(rValue, x, 4);
+      order.multiplyModular(sValue, rValue, d);
+      order.add(sValue, sValue, e);
+      order.toMontgomery(nonce, nonce);
+      order.inverse(nonce, nonce);
+      order.multiply(sValue, sValue, nonce);
+
+      if (!Montgomery::isZero(rValue, 4) && !Montgomery::isZero(sValue, 4)) {
+        Montgomery::toBytes(r, SIZE, rValue, 4);
+        Montgomery::toBytes(s, SIZE, sValue, 4);
+        return;
+      }
+    }
+
+    hmac(k, { Bytes(v, sizeof(v)), Bytes(&zero, 1) }, k);
+    hmac(k, { Bytes(v, sizeof(v)) }, v);
+  }
+}
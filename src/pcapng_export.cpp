@@ -0,0 +1,196 @@
+/**
+ * Implementation of the pcapng capture of the APDU traffic
+ */
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include "async_file_writer.h"
+#include "pcapng_export.h"
+
+using namespace std;
+
+#define BLOCK_SECTION_HEADER     0x0A0D0D0A
+#define BLOCK_INTERFACE          0x00000001
+#define BLOCK_ENHANCED_PACKET    0x00000006
+#define BYTE_ORDER_MAGIC         0x1A2B3C4D
+#define OPTION_END               0
+#define OPTION_SHB_USERAPPL      4
+#define APPLICATION_NAME         "winscard_stub"
+
+#define EPB_HEADER_SIZE          28
+#define PACKET_HEADER_SIZE       (EPB_HEADER_SIZE + PcapngExport::USBMON_HEADER_SIZE + PcapngExport::CCID_HEADER_SIZE)
+
+#define USB_BUS                  1
+#define USB_TRANSFER_BULK        3
+#define USB_ENDPOINT_OUT         0x02
+#define USB_ENDPOINT_IN          0x82
+#define USB_DIRECTION_IN         0x0200   // URB_DIR_IN of the transfer flags
+#define USB_STATUS_IN_PROGRESS   (-115)   // -EINPROGRESS of a submission
+
+#define PC_TO_RDR_XFR_BLOCK      0x6F
+#define PC_TO_RDR_ESCAPE         0x6B
+#define RDR_TO_PC_DATA_BLOCK     0x80
+#define RDR_TO_PC_ESCAPE         0x83
+#define CCID_COMMAND_FAILED      0x40
+#define CCID_ICC_MUTE            0xFE
+
+const uint16_t PcapngExport::LINKTYPE_USB_LINUX_MMAPPED;
+const size_t PcapngExport::USBMON_HEADER_SIZE;
+const size_t PcapngExport::CCID_HEADER_SIZE;
+
+static atomic<uint32_t> sequence(0);
+
+static void put16(unsigned char *data, uint16_t value) {
+  data[0] = static_cast<unsigned char>(value);
+  data[1] = static_cast<unsigned char>(value >> 8);
+}
+
+static void put32(unsigned char *data, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+static void put64(unsigned char *data, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    data[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+/**
+ * The writer is never destroyed, the threads which still capture at the exit of the process would use it
+ */
+static AsyncFileWriter &writer() {
+  static AsyncFileWriter *instance = new AsyncFileWriter();
+  return *instance;
+}
+
+/**
+ * Encode the enhanced packet block of a CCID message, except its data
+ * @param head out: PACKET_HEADER_SIZE bytes, the block header, the usbmon header and the CCID header
+ * @param tail out: the padding of the data and the trailing length of the block
+ * @return the length of the tail
+ */
+static size_t encodePacket(uint64_t timestamp, bool in, unsigned char device, uint64_t urb, unsigned char type,
+                           unsigned char sequence_number, unsigned char status, unsigned char error, size_t data_lg,
+                           unsigned char *head, unsigned char *tail) {
+  size_t packet_lg = PcapngExport::USBMON_HEADER_SIZE + PcapngExport::CCID_HEADER_SIZE + data_lg;
+  size_t padding = (4 - packet_lg % 4) % 4;
+  uint32_t block_lg = static_cast<uint32_t>(EPB_HEADER_SIZE + packet_lg + padding + 4);
+  uint32_t message_lg = static_cast<uint32_t>(PcapngExport::CCID_HEADER_SIZE + data_lg);
+  memset(head, 0, PACKET_HEADER_SIZE);
+
+  put32(head, BLOCK_ENHANCED_PACKET);
+  put32(head + 4, block_lg);
+  put32(head + 8, 0);                                          // interface
+  put32(head + 12, static_cast<uint32_t>(timestamp >> 32));
+  put32(head + 16, static_cast<uint32_t>(timestamp));
+  put32(head + 20, static_cast<uint32_t>(packet_lg));          // captured length
+  put32(head + 24, static_cast<uint32_t>(packet_lg));          // original length
+
+  unsigned char *usbmon = head + EPB_HEADER_SIZE;
+  put64(usbmon, urb);
+  usbmon[8] = in ? 'C' : 'S';
+  usbmon[9] = USB_TRANSFER_BULK;
+  usbmon[10] = in ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT;
+  usbmon[11] = device;
+  put16(usbmon + 12, USB_BUS);
+  usbmon[14] = '-';                                            // no setup packet
+  usbmon[15] = 0;                                              // data present
+  put64(usbmon + 16, timestamp / 1000000);
+  put32(usbmon + 24, static_cast<uint32_t>(timestamp % 1000000));
+  put32(usbmon + 28, in ? 0 : static_cast<uint32_t>(USB_STATUS_IN_PROGRESS));
+  put32(usbmon + 32, message_lg);                              // URB length
+  put32(usbmon + 36, message_lg);                              // captured data length
+  put32(usbmon + 56, in ? USB_DIRECTION_IN : 0);
+
+  unsigned char *ccid = usbmon + PcapngExport::USBMON_HEADER_SIZE;
+  ccid[0] = type;
+  put32(ccid + 1, static_cast<uint32_t>(data_lg));
+  ccid[5] = 0;                                                 // slot
+  ccid[6] = sequence_number;
+  ccid[7] = status;
+  ccid[8] = error;
+
+  memset(tail, 0, padding);
+  put32(tail + padding, block_lg);
+  return padding + 4;
+}
+
+void PcapngExport::start(const string &path) {
+  if (capturing()) {
+    throw logic_error("a capture is already running");
+  }
+  const size_t application_lg = sizeof(APPLICATION_NAME) - 1;
+  const size_t application_padded = (application_lg + 3) & ~static_cast<size_t>(3);
+  const size_t section_lg = 24 + 4 + application_padded + 4 + 4;
+  unsigned char header[section_lg + 20];
+  memset(header, 0, sizeof(header));
+
+  put32(header, BLOCK_SECTION_HEADER);
+  put32(header + 4, static_cast<uint32_t>(section_lg));
+  put32(header + 8, BYTE_ORDER_MAGIC);
+  put16(header + 12, 1);                                       // version 1.0
+  put16(header + 14, 0);
+  put64(header + 16, UINT64_MAX);                              // unknown section length
+  put16(header + 24, OPTION_SHB_USERAPPL);
+  put16(header + 26, static_cast<uint16_t>(application_lg));
+  memcpy(header + 28, APPLICATION_NAME, application_lg);
+  put16(header + 28 + application_padded, OPTION_END);
+  put32(header + section_lg - 4, static_cast<uint32_t>(section_lg));
+
+  unsigned char *interface = header + section_lg;
+  put32(interface, BLOCK_INTERFACE);
+  put32(interface + 4, 20);
+  put16(interface + 8, LINKTYPE_USB_LINUX_MMAPPED);
+  put32(interface + 12, 0);                                    // no snapshot length
+  put32(interface + 16, 20);
+
+  writer().start(path, header, sizeof(header));
+}
+
+void PcapngExport::stop() {
+  writer().stop();
+}
+
+bool PcapngExport::capturing() {
+  return writer().active();
+}
+
+uint64_t PcapngExport::now() {
+  return static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(
+    chrono::system_clock::now().time_since_epoch()).count());
+}
+
+void PcapngExport::exchange(bool control, uint64_t start, uint64_t handle, bool success,
+                            const unsigned char *command, size_t command_lg,
+                            const unsigned char *response, size_t response_lg) {
+  if (!capturing()) {
+    return;
+  }
+  uint64_t end = now();
+  uint32_t number = sequence++;
+  unsigned char device = static_cast<unsigned char>(1 + handle % 127);
+  if (!success) {
+    response_lg = 0;
+  }
+
+  unsigned char commandHead[PACKET_HEADER_SIZE];
+  unsigned char commandTail[8];
+  size_t commandTailLg = encodePacket(start, false, device, 2 * static_cast<uint64_t>(number),
+                                      control ? PC_TO_RDR_ESCAPE : PC_TO_RDR_XFR_BLOCK,
+                                      static_cast<unsigned char>(number), 0, 0, command_lg, commandHead, commandTail);
+  unsigned char responseHead[PACKET_HEADER_SIZE];
+  unsigned char responseTail[8];
+  size_t responseTailLg = encodePacket((end > start) ? end : start, true, device, 2 * static_cast<uint64_t>(number) + 1,
+                                       control ? RDR_TO_PC_ESCAPE : RDR_TO_PC_DATA_BLOCK,
+                                       static_cast<unsigned char>(number), success ? 0 : CCID_COMMAND_FAILED,
+                                       success ? 0 : CCID_ICC_MUTE, response_lg, responseHead, responseTail);
+
+  // The command and its response are appended together, so that they follow each other in the file
+  const unsigned char *parts[] = {commandHead, command, commandTail, responseHead, response, responseTail};
+  size_t part_lgs[] = {sizeof(commandHead), command_lg, commandTailLg, sizeof(responseHead), response_lg,
+                       responseTailLg};
+  writer().append(parts, part_lgs, 6);
+}
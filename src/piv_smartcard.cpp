@@ -0,0 +1,628 @@
+/**
+ * Implementation of the PIV smartcard
+ */
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include "piv_smartcard.h"
+#include "response_table.h"
+
+using namespace std;
+
+#define CLA_CHAINING             0x10
+
+#define INS_SELECT               0xA4
+#define INS_GET_DATA             0xCB
+#define INS_VERIFY               0x20
+#define INS_GENERAL_AUTHENTICATE 0x87
+
+#define SW_SUCCESS               0x9000
+#define SW_VERIFY_FAILED         0x63C0
+#define SW_WRONG_LENGTH          0x6700
+#define SW_CHAINING_UNSUPPORTED  0x6884
+#define SW_SECURITY_STATUS       0x6982
+#define SW_PIN_BLOCKED           0x6983
+#define SW_WRONG_DATA            0x6A80
+#define SW_FILE_NOT_FOUND        0x6A82
+#define SW_WRONG_P1P2            0x6A86
+#define SW_REFERENCE_NOT_FOUND   0x6A88
+#define SW_INS_NOT_SUPPORTED     0x6D00
+
+#define PIV_PIN_REFERENCE        0x80
+#define PIV_CARD_AUTHENTICATION  0x9E
+#define PIV_PIN_SIZE             8
+#define PIV_MAX_CHAIN            4096
+
+#define TAG_DATA_OBJECT          0x53
+#define TAG_TAG_LIST             0x5C
+#define TAG_DYNAMIC_TEMPLATE     0x7C
+#define TAG_CHALLENGE            0x81
+#define TAG_RESPONSE             0x82
+
+static const unsigned char PIV_AID[] = { 0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00 };
+
+// Application property template of the SELECT response
+static const unsigned char PIV_APT[] = {
+  0x61, 0x11, 0x4F, 0x06, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00, 0x79, 0x07, 0x4F, 0x05, 0xA0, 0x00, 0x00, 0x03, 0x08,
+  0x90, 0x00
+};
+
+/**
+ * Tag of the certificate object of a key reference, 0 when the key reference doesn't exist
+ */
+static uint32_t certificateTag(unsigned char reference) {
+  switch (reference) {
+    case 0x9A:
+      return 0x5FC105;
+    case 0x9C:
+      return 0x5FC10A;
+    case 0x9D:
+      return 0x5FC10B;
+    case PIV_CARD_AUTHENTICATION:
+      return 0x5FC101;
+    default:
+      // Retired key management keys
+      return ((reference >= 0x82) && (reference <= 0x95)) ? 0x5FC10D + (reference - 0x82) : 0;
+  }
+}
+
+/**
+ * BER-TLV length
+ * @return number of bytes written
+ */
+static size_t encodeLength(unsigned char *out, size_t length) {
+  if (length < 0x80) {
+    out[0] = static_cast<unsigned char>(length);
+    return 1;
+  }
+  if (length < 0x100) {
+    out[0] = 0x81;
+    out[1] = static_cast<unsigned char>(length);
+    return 2;
+  }
+  out[0] = 0x82;
+  out[1] = static_cast<unsigned char>(length >> 8);
+  out[2] = static_cast<unsigned char>(length);
+  return 3;
+}
+
+/**
+ * Next BER-TLV with a tag of one byte
+ * @return false when the TLV is malformed
+ */
+static bool nextTlv(const unsigned char **position, const unsigned char *end, unsigned char *tag,
+                    const unsigned char **value, size_t *value_lg) {
+  const unsigned char *p = *position;
+  if (end - p < 2) {
+    return false;
+  }
+  *tag = *p++;
+  size_t length = *p++;
+  if ((length == 0x81) || (length == 0x82)) {
+    size_t length_lg = length & 0x7F;
+    if (static_cast<size_t>(end - p) < length_lg) {
+      return false;
+    }
+    length = 0;
+    for (size_t i = 0; i < length_lg; i++) {
+      length = (length << 8) | *p++;
+    }
+  }
+  else if (length >= 0x80) {
+    return false;
+  }
+  if (static_cast<size_t>(end - p) < length) {
+    return false;
+  }
+  *value = p;
+  *value_lg = length;
+  *position = p + length;
+  return true;
+}
+
+/**
+ * DER INTEGER of a big endian unsigned number
+ * @return number of bytes written
+ */
+static size_t encodeInteger(unsigned char *out, const unsigned char *number, size_t number_lg) {
+  while ((number_lg > 1) && (number[0] == 0)) {
+    number++;
+    number_lg--;
+  }
+  size_t padding = ((number[0] & 0x80) != 0) ? 1 : 0;
+  out[0] = 0x02;
+  out[1] = static_cast<unsigned char>(number_lg + padding);
+  out[2] = 0x00;
+  memcpy(out + 2 + padding, number, number_lg);
+  return 2 + padding + number_lg;
+}
+
+static vector<unsigned char> readFile(const string &path) {
+  ifstream in(path, ios::binary);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  return vector<unsigned char>((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+static string pathIn(const string &directory, const string &file) {
+  if (directory.empty() || (file[0] == '/')) {
+    return file;
+  }
+  return directory + "/" + file;
+}
+
+static unsigned char parseReference(const string &hex) {
+  vector<unsigned char> reference = ResponseTable::parseHex(hex);
+  if ((reference.size() != 1) || (certificateTag(reference[0]) == 0)) {
+    throw invalid_argument("invalid key reference '" + hex + "'");
+  }
+  return reference[0];
+}
+
+static vector<unsigned char> padPin(const string &pin) {
+  if ((pin.size() < 6) || (pin.size() > PIV_PIN_SIZE) || (pin.find_first_not_of("0123456789") != string::npos)) {
+    throw invalid_argument("the PIN must have 6 to 8 digits");
+  }
+  vector<unsigned char> padded(pin.begin(), pin.end());
+  padded.resize(PIV_PIN_SIZE, 0xFF);
+  return padded;
+}
+
+PivCardTemplate::PivCardTemplate(vector<unsigned char> atr, DWORD protocols, const string &pin, unsigned int pinRetries,
+                                 shared_ptr<const CardCostModel> costs) :
+  CardTemplate(std::move(atr), SCARD_SHARE_SHARED, protocols, std::move(costs)),
+  pin(padPin(pin)),
+  pinRetries(pinRetries) {
+  if ((pinRetries == 0) || (pinRetries > 15)) {
+    throw invalid_argument("the PIN retries must be between 1 and 15");
+  }
+}
+
+shared_ptr<PivCardTemplate> PivCardTemplate::load(istream &in, const string &directory) {
+  vector<unsigned char> atr;
+  DWORD protocols = SCARD_PROTOCOL_T1;
+  string pin;
+  unsigned int pinRetries = 3;
+  vector<InstructionCostEntry> costs;
+  vector<pair<unsigned char, string>> keyFiles;
+  vector<pair<unsigned char, string>> certificateFiles;
+  vector<pair<uint32_t, vector<unsigned char>>> objectContents;
+
+  string line;
+  unsigned int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == string::npos) || (line[start] == '#')) {
+      continue;
+    }
+    line = line.substr(start);
+
+    try {
+      istringstream fields(line);
+      string keyword;
+      fields >> keyword;
+      string arguments = line.substr(keyword.size());
+      if (keyword == "ATR") {
+        atr = ResponseTable::parseHex(arguments);
+        if (atr.empty() || (atr.size() > MAX_ATR_SIZE)) {
+          throw invalid_argument("invalid ATR length");
+        }
+      }
+      else if (keyword == "PROTOCOL") {
+        protocols = CardTable::parseProtocols(arguments);
+      }
+      else if (keyword == "PIN") {
+        if (!(fields >> pin)) {
+          throw invalid_argument("missing PIN");
+        }
+        if (!(fields >> pinRetries) && !fields.eof()) {
+          throw invalid_argument("invalid PIN retries");
+        }
+      }
+      else if ((keyword == "KEY") || (keyword == "CERT")) {
+        string reference;
+        string file;
+        if (!(fields >> reference >> file)) {
+          throw invalid_argument("missing key reference or file in " + keyword);
+        }
+        auto &files = (keyword == "KEY") ? keyFiles : certificateFiles;
+        files.emplace_back(parseReference(reference), pathIn(directory, file));
+      }
+      else if (keyword == "OBJECT") {
+        string tag;
+        if (!(fields >> tag)) {
+          throw invalid_argument("missing tag in OBJECT");
+        }
+        vector<unsigned char> tagBytes = ResponseTable::parseHex(tag);
+        if (tagBytes.empty() || (tagBytes.size() > 3)) {
+          throw invalid_argument("invalid tag '" + tag + "' in OBJECT");
+        }
+        uint32_t value = 0;
+        for (unsigned char byte : tagBytes) {
+          value = (value << 8) | byte;
+        }
+        string contents;
+        getline(fields, contents);
+        objectContents.emplace_back(value, ResponseTable::parseHex(contents));
+      }
+      else if (keyword == "COST") {
+        costs.push_back(CardTable::parseCost(arguments));
+      }
+      else {
+        throw invalid_argument("unknown keyword '" + keyword + "'");
+      }
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("line " + to_string(lineNumber) + ": " + e.what());
+    }
+  }
+
+  if (atr.empty()) {
+    throw invalid_argument("missing ATR");
+  }
+  if (protocols == 0) {
+    throw invalid_argument("missing PROTOCOL");
+  }
+  if (pin.empty()) {
+    throw invalid_argument("missing PIN");
+  }
+
+  auto piv = make_shared<PivCardTemplate>(atr, protocols, pin, pinRetries,
+                                          costs.empty() ? nullptr : make_shared<CardCostModel>(costs.data(), costs.size()));
+  for (auto &key : keyFiles) {
+    piv->addKey(key.first, PrivateKey::loadFile(key.second));
+  }
+  for (auto &certificate : certificateFiles) {
+    piv->addCertificate(certificate.first, readFile(certificate.second));
+  }
+  for (auto &object : objectContents) {
+    piv->addObject(object.first, object.second);
+  }
+  return piv;
+}
+
+shared_ptr<PivCardTemplate> PivCardTemplate::loadFile(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  size_t separator = path.find_last_of('/');
+  return load(in, (separator == string::npos) ? string() : path.substr(0, separator));
+}
+
+void PivCardTemplate::addKey(unsigned char reference, const PrivateKey &key) {
+  if (certificateTag(reference) == 0) {
+    throw invalid_argument("invalid key reference");
+  }
+
+  PivKey pivKey = { 0, key.rsa, key.ecc };
+  if (key.ecc) {
+    pivKey.algorithm = PIV_ALGORITHM_ECC_P256;
+  }
+  else if (key.rsa) {
+    switch (key.rsa->bits()) {
+      case 1024:
+        pivKey.algorithm = PIV_ALGORITHM_RSA_1024;
+        break;
+      case 2048:
+        pivKey.algorithm = PIV_ALGORITHM_RSA_2048;
+        break;
+      case 3072:
+        pivKey.algorithm = PIV_ALGORITHM_RSA_3072;
+        break;
+      case 4096:
+        pivKey.algorithm = PIV_ALGORITHM_RSA_4096;
+        break;
+      default:
+        throw invalid_argument("RSA keys of " + to_string(key.rsa->bits()) + " bits are not supported by PIV");
+    }
+  }
+  else {
+    throw invalid_argument("empty private key");
+  }
+  keys[reference] = pivKey;
+}
+
+void PivCardTemplate::addObject(uint32_t tag, const vector<unsigned char> &contents) {
+  if (contents.size() > 0xFFFF) {
+    throw invalid_argument("data object larger than 65535 bytes");
+  }
+  vector<unsigned char> response(1 + 3 + contents.size() + 2);
+  response[0] = TAG_DATA_OBJECT;
+  size_t offset = 1 + encodeLength(response.data() + 1, contents.size());
+  memcpy(response.data() + offset, contents.data(), contents.size());
+  response.resize(offset + contents.size() + 2);
+  response[offset + contents.size()] = static_cast<unsigned char>(SW_SUCCESS >> 8);
+  response[offset + contents.size() + 1] = static_cast<unsigned char>(SW_SUCCESS);
+  objects[tag] = std::move(response);
+}
+
+void PivCardTemplate::addCertificate(unsigned char reference, const vector<unsigned char> &certificate) {
+  uint32_t tag = certificateTag(reference);
+  if (tag == 0) {
+    throw invalid_argument("invalid key reference");
+  }
+
+  // 70 certificate, 71 certificate info (uncompressed), FE error detection code
+  unsigned char length[3];
+  vector<unsigned char> contents(1, 0x70);
+  contents.insert(contents.end(), length, length + encodeLength(length, certificate.size()));
+  contents.insert(contents.end(), certificate.begin(), certificate.end());
+  contents.insert(contents.end(), { 0x71, 0x01, 0x00, 0xFE, 0x00 });
+  addObject(tag, contents);
+}
+
+const PivKey *PivCardTemplate::key(unsigned char reference) const {
+  auto found = keys.find(reference);
+  return (found != keys.end()) ? &found->second : nullptr;
+}
+
+const vector<unsigned char> *PivCardTemplate::object(uint32_t tag) const {
+  auto found = objects.find(tag);
+  return (found != objects.end()) ? &found->second : nullptr;
+}
+
+unique_ptr<SmartCard> PivCardTemplate::instantiate() const {
+  return make_unique<PivSmartCard>(static_pointer_cast<const PivCardTemplate>(shared_from_this()));
+}
+
+PivSmartCard::PivSmartCard(shared_ptr<const PivCardTemplate> cardTemplate) :
+  SmartCard(cardTemplate),
+  piv(cardTemplate.get()),
+  retries(cardTemplate->pinRetries) {
+  for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++) {
+    resetChannel(channel);
+  }
+}
+
+void PivSmartCard::resetChannel(unsigned int channel) {
+  Channel &state = channels[channel];
+  state.selected = false;
+  state.pinVerified = false;
+  state.chain.clear();
+  state.chainParameters = 0;
+}
+
+bool PivSmartCard::isCacheable(const ApduView &apdu) const {
+  return (apdu.ins == INS_SELECT) || (apdu.ins == INS_GET_DATA);
+}
+
+DWORD PivSmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  (void)handle;
+  Channel &channel = channels[apdu.channel];
+  const unsigned char *data = apdu.data;
+  size_t data_lg = apdu.lc;
+  uint16_t parameters = static_cast<uint16_t>((apdu.p1 << 8) | apdu.p2);
+
+  // Command chaining, only for GENERAL AUTHENTICATE
+  if (!channel.chain.empty() && ((apdu.ins != INS_GENERAL_AUTHENTICATE) || (parameters != channel.chainParameters))) {
+    channel.chain.clear();
+    stateChanged();
+  }
+  if ((apdu.cla & CLA_CHAINING) != 0) {
+    if (!channel.selected || (apdu.ins != INS_GENERAL_AUTHENTICATE)) {
+      response.status(SW_CHAINING_UNSUPPORTED);
+    }
+    else if (channel.chain.size() + data_lg > PIV_MAX_CHAIN) {
+      channel.chain.clear();
+      response.status(SW_WRONG_LENGTH);
+    }
+    else {
+      channel.chainParameters = parameters;
+      channel.chain.insert(channel.chain.end(), data, data + data_lg);
+      response.status(SW_SUCCESS);
+    }
+    return SCARD_S_SUCCESS;
+  }
+  if (!channel.chain.empty()) {
+    channel.chain.insert(channel.chain.end(), data, data + data_lg);
+    data = channel.chain.data();
+    data_lg = channel.chain.size();
+  }
+
+  if (apdu.ins == INS_SELECT) {
+    select(apdu, response);
+  }
+  else if (!channel.selected) {
+    response.status(SW_INS_NOT_SUPPORTED);
+  }
+  else {
+    switch (apdu.ins) {
+      case INS_GET_DATA:
+        getData(apdu, response);
+        break;
+      case INS_VERIFY:
+        verify(apdu, response);
+        break;
+      case INS_GENERAL_AUTHENTICATE:
+        generalAuthenticate(apdu, data, data_lg, response);
+        break;
+      default:
+        response.status(SW_INS_NOT_SUPPORTED);
+        break;
+    }
+  }
+  channel.chain.clear();
+  return SCARD_S_SUCCESS;
+}
+
+void PivSmartCard::select(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  // The AID may be truncated to the version of the application
+  if ((apdu.p1 == 0x04) && (apdu.lc >= 5) && (apdu.lc <= sizeof(PIV_AID)) &&
+      (memcmp(apdu.data, PIV_AID, apdu.lc) == 0)) {
+    if (!channel.selected) {
+      channel.selected = true;
+      stateChanged();
+    }
+    response.reference(PIV_APT, sizeof(PIV_APT));
+    return;
+  }
+  if (channel.selected || channel.pinVerified) {
+    channel.selected = false;
+    channel.pinVerified = false;
+    stateChanged();
+  }
+  response.status(SW_FILE_NOT_FOUND);
+}
+
+void PivSmartCard::getData(const ApduView &apdu, ApduResponse &response) {
+  if ((apdu.p1 != 0x3F) || (apdu.p2 != 0xFF)) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+  if ((apdu.lc < 3) || (apdu.lc > 5) || (apdu.data[0] != TAG_TAG_LIST) || (apdu.data[1] != apdu.lc - 2)) {
+    response.status(SW_WRONG_DATA);
+    return;
+  }
+
+  uint32_t tag = 0;
+  for (size_t i = 2; i < apdu.lc; i++) {
+    tag = (tag << 8) | apdu.data[i];
+  }
+  const vector<unsigned char> *object = piv->object(tag);
+  if (object == nullptr) {
+    response.status(SW_FILE_NOT_FOUND);
+    return;
+  }
+  response.reference(object->data(), object->size());
+}
+
+void PivSmartCard::verify(const ApduView &apdu, ApduResponse &response) {
+  Channel &channel = channels[apdu.channel];
+  if (apdu.p2 != PIV_PIN_REFERENCE) {
+    response.status(SW_REFERENCE_NOT_FOUND);
+    return;
+  }
+  if (apdu.p1 == 0xFF) {
+    // Reset of the security status
+    if (apdu.lc != 0) {
+      response.status(SW_WRONG_DATA);
+      return;
+    }
+    channel.pinVerified = false;
+    response.status(SW_SUCCESS);
+    return;
+  }
+  if (apdu.p1 != 0x00) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+
+  if (apdu.lc == 0) {
+    // Status of the PIN
+    if (channel.pinVerified) {
+      response.status(SW_SUCCESS);
+    }
+    else {
+      response.status((retries == 0) ? SW_PIN_BLOCKED : static_cast<uint16_t>(SW_VERIFY_FAILED | retries));
+    }
+    return;
+  }
+  if (apdu.lc != PIV_PIN_SIZE) {
+    response.status(SW_WRONG_DATA);
+    return;
+  }
+  if (retries == 0) {
+    response.status(SW_PIN_BLOCKED);
+    return;
+  }
+
+  if (memcmp(apdu.data, piv->pin.data(), PIV_PIN_SIZE) == 0) {
+    channel.pinVerified = true;
+    retries = piv->pinRetries;
+    response.status(SW_SUCCESS);
+  }
+  else {
+    channel.pinVerified = false;
+    retries--;
+    response.status(static_cast<uint16_t>(SW_VERIFY_FAILED | retries));
+  }
+}
+
+void PivSmartCard::generalAuthenticate(const ApduView &apdu, const unsigned char *data, size_t data_lg,
+                                       ApduResponse &response) {
+  const Channel &channel = channels[apdu.channel];
+  const PivKey *key = piv->key(apdu.p2);
+  if ((key == nullptr) || (key->algorithm != apdu.p1)) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+  if ((apdu.p2 != PIV_CARD_AUTHENTICATION) && !channel.pinVerified) {
+    response.status(SW_SECURITY_STATUS);
+    return;
+  }
+
+  // Dynamic authentication template with an empty response and the challenge to sign
+  const unsigned char *position = data;
+  const unsigned char *end = data + data_lg;
+  unsigned char tag;
+  const unsigned char *value;
+  size_t value_lg;
+  if (!nextTlv(&position, end, &tag, &value, &value_lg) || (tag != TAG_DYNAMIC_TEMPLATE) || (position != end)) {
+    response.status(SW_WRONG_DATA);
+    return;
+  }
+  const unsigned char *challenge = nullptr;
+  size_t challenge_lg = 0;
+  bool responseRequested = false;
+  position = value;
+  end = value + value_lg;
+  while (position < end) {
+    if (!nextTlv(&position, end, &tag, &value, &value_lg)) {
+      response.status(SW_WRONG_DATA);
+      return;
+    }
+    if ((tag == TAG_RESPONSE) && (value_lg == 0)) {
+      responseRequested = true;
+    }
+    else if (tag == TAG_CHALLENGE) {
+      challenge = value;
+      challenge_lg = value_lg;
+    }
+  }
+  if (!responseRequested || (challenge == nullptr)) {
+    response.status(SW_WRONG_DATA);
+    return;
+  }
+
+  unsigned char signature[512];
+  size_t signature_lg = 0;
+  if (key->rsa) {
+    if ((challenge_lg != key->rsa->size()) || !key->rsa->privateOperation(challenge, signature)) {
+      response.status(SW_WRONG_DATA);
+      return;
+    }
+    signature_lg = key->rsa->size();
+  }
+  else {
+    if ((challenge_lg == 0) || (challenge_lg > 2 * P256PrivateKey::SIZE)) {
+      response.status(SW_WRONG_DATA);
+      return;
+    }
+    unsigned char r[P256PrivateKey::SIZE];
+    unsigned char s[P256PrivateKey::SIZE];
+    key->ecc->sign(challenge, challenge_lg, r, s);
+    signature_lg = 2;
+    signature_lg += encodeInteger(signature + signature_lg, r, sizeof(r));
+    signature_lg += encodeInteger(signature + signature_lg, s, sizeof(s));
+    signature[0] = 0x30;
+    signature[1] = static_cast<unsigned char>(signature_lg - 2);
+  }
+
+  // 7C { 82 signature }
+  unsigned char header[8];
+  size_t header_lg = 0;
+  unsigned char responseHeader[4] = { TAG_RESPONSE };
+  size_t responseHeader_lg = 1 + encodeLength(responseHeader + 1, signature_lg);
+  header[header_lg++] = TAG_DYNAMIC_TEMPLATE;
+  header_lg += encodeLength(header + header_lg, responseHeader_lg + signature_lg);
+  response.append(header, header_lg);
+  response.append(responseHeader, responseHeader_lg);
+  response.append(signature, signature_lg);
+  response.status(SW_SUCCESS);
+}
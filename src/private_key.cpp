@@ -0,0 +1,249 @@
+/**
+ * Implementation of the decoding of the private keys
+ */
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include "private_key.h"
+
+using namespace std;
+
+#define DER_INTEGER              0x02
+#define DER_OCTET_STRING         0x04
+#define DER_OID                  0x06
+#define DER_SEQUENCE             0x30
+#define DER_EC_PARAMETERS        0xA0
+
+#define PEM_BEGIN                "-----BEGIN "
+#define PEM_END                  "-----END "
+#define PEM_DASHES               "-----"
+
+static const unsigned char OID_RSA_ENCRYPTION[] = { 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01 };
+static const unsigned char OID_EC_PUBLIC_KEY[] = { 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01 };
+static const unsigned char OID_PRIME256V1[] = { 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07 };
+
+namespace {
+
+/**
+ * Reader of the elements of a DER value
+ */
+class DerReader {
+public:
+  DerReader(const unsigned char *data, size_t data_lg) : position(data), end(data + data_lg) {
+  };
+
+  bool atEnd() const { return position == end; };
+
+  unsigned char peek() const {
+    if (atEnd()) {
+      throw invalid_argument("truncated DER value");
+    }
+    return *position;
+  }
+
+  /**
+   * Next element, which must have the tag
+   */
+  DerReader next(unsigned char tag) {
+    if (peek() != tag) {
+      throw invalid_argument("unexpected DER tag");
+    }
+    position++;
+    if (atEnd()) {
+      throw invalid_argument("truncated DER value");
+    }
+
+    size_t length = *position++;
+    if (length > 0x80) {
+      size_t length_lg = length & 0x7F;
+      if ((length_lg > 4) || (static_cast<size_t>(end - position) < length_lg)) {
+        throw invalid_argument("invalid DER length");
+      }
+      length = 0;
+      for (size_t i = 0; i < length_lg; i++) {
+        length = (length << 8) | *position++;
+      }
+    }
+    else if (length == 0x80) {
+      throw invalid_argument("indefinite DER length");
+    }
+    if (static_cast<size_t>(end - position) < length) {
+      throw invalid_argument("truncated DER value");
+    }
+
+    DerReader element(position, length);
+    position += length;
+    return element;
+  }
+
+  vector<unsigned char> integer() {
+    DerReader value = next(DER_INTEGER);
+    return vector<unsigned char>(value.position, value.end);
+  }
+
+  bool equals(const unsigned char *bytes, size_t bytes_lg) const {
+    return (static_cast<size_t>(end - position) == bytes_lg) && (memcmp(position, bytes, bytes_lg) == 0);
+  }
+
+  const unsigned char *position;
+  const unsigned char *end;
+};
+
+}
+
+static void checkCurve(DerReader &parameters) {
+  if (!parameters.next(DER_OID).equals(OID_PRIME256V1, sizeof(OID_PRIME256V1))) {
+    throw invalid_argument("only ECC keys on the curve P-256 are supported");
+  }
+}
+
+/**
+ * PKCS #1 RSAPrivateKey
+ */
+static shared_ptr<const RsaPrivateKey> decodeRsa(DerReader der) {
+  DerReader key = der.next(DER_SEQUENCE);
+  key.integer();
+  vector<unsigned char> modulus = key.integer();
+  vector<unsigned char> publicExponent = key.integer();
+  key.integer();
+  vector<unsigned char> p = key.integer();
+  vector<unsigned char> q = key.integer();
+  vector<unsigned char> dp = key.integer();
+  vector<unsigned char> dq = key.integer();
+  vector<unsigned char> qInverse = key.integer();
+  return make_shared<RsaPrivateKey>(modulus, publicExponent, p, q, dp, dq, qInverse);
+}
+
+/**
+ * SEC 1 ECPrivateKey, the curve is either in the key or in the algorithm of PKCS #8
+ */
+static shared_ptr<const P256PrivateKey> decodeEcc(DerReader der) {
+  DerReader key = der.next(DER_SEQUENCE);
+  if (key.integer() != vector<unsigned char>({ 0x01 })) {
+    throw invalid_argument("unsupported ECPrivateKey version");
+  }
+  DerReader scalar = key.next(DER_OCTET_STRING);
+  if (!key.atEnd() && (key.peek() == DER_EC_PARAMETERS)) {
+    DerReader parameters = key.next(DER_EC_PARAMETERS);
+    checkCurve(parameters);
+  }
+  return make_shared<P256PrivateKey>(vector<unsigned char>(scalar.position, scalar.end));
+}
+
+static PrivateKey decodeDer(const unsigned char *der, size_t der_lg) {
+  PrivateKey key;
+  DerReader content = DerReader(der, der_lg).next(DER_SEQUENCE);
+  content.integer();
+
+  switch (content.peek()) {
+    case DER_SEQUENCE: {
+      // PKCS #8 PrivateKeyInfo
+      DerReader algorithm = content.next(DER_SEQUENCE);
+      DerReader oid = algorithm.next(DER_OID);
+      DerReader privateKey = content.next(DER_OCTET_STRING);
+      if (oid.equals(OID_RSA_ENCRYPTION, sizeof(OID_RSA_ENCRYPTION))) {
+        key.rsa = decodeRsa(privateKey);
+      }
+      else if (oid.equals(OID_EC_PUBLIC_KEY, sizeof(OID_EC_PUBLIC_KEY))) {
+        checkCurve(algorithm);
+        key.ecc = decodeEcc(privateKey);
+      }
+      else {
+        throw invalid_argument("unsupported private key algorithm");
+      }
+      break;
+    }
+    case DER_OCTET_STRING:
+      key.ecc = decodeEcc(DerReader(der, der_lg));
+      break;
+    case DER_INTEGER:
+      key.rsa = decodeRsa(DerReader(der, der_lg));
+      break;
+    default:
+      throw invalid_argument("unsupported private key encoding");
+  }
+  return key;
+}
+
+static vector<unsigned char> decodeBase64(const string &text) {
+  vector<unsigned char> bytes;
+  uint32_t bits = 0;
+  int bitCount = 0;
+
+  for (char c : text) {
+    int value;
+    if ((c >= 'A') && (c <= 'Z')) {
+      value = c - 'A';
+    }
+    else if ((c >= 'a') && (c <= 'z')) {
+      value = c - 'a' + 26;
+    }
+    else if ((c >= '0') && (c <= '9')) {
+      value = c - '0' + 52;
+    }
+    else if (c == '+') {
+      value = 62;
+    }
+    else if (c == '/') {
+      value = 63;
+    }
+    else if (c == '=') {
+      break;
+    }
+    else if ((c == '\n') || (c == '\r') || (c == ' ') || (c == '\t')) {
+      continue;
+    }
+    else {
+      throw invalid_argument("invalid base64 character");
+    }
+    bits = (bits << 6) | static_cast<uint32_t>(value);
+    bitCount += 6;
+    if (bitCount >= 8) {
+      bitCount -= 8;
+      bytes.push_back(static_cast<unsigned char>(bits >> bitCount));
+    }
+  }
+  return bytes;
+}
+
+PrivateKey PrivateKey::decode(const vector<unsigned char> &encoded) {
+  string text(encoded.begin(), encoded.end());
+  if (text.find(PEM_BEGIN) == string::npos) {
+    return decodeDer(encoded.data(), encoded.size());
+  }
+
+  // First key block of the PEM file, other blocks like EC PARAMETERS are skipped
+  size_t begin = 0;
+  while ((begin = text.find(PEM_BEGIN, begin)) != string::npos) {
+    size_t labelStart = begin + strlen(PEM_BEGIN);
+    size_t labelEnd = text.find(PEM_DASHES, labelStart);
+    if (labelEnd == string::npos) {
+      break;
+    }
+    string label = text.substr(labelStart, labelEnd - labelStart);
+    size_t end = text.find(PEM_END + label + PEM_DASHES, labelEnd);
+    if (end == string::npos) {
+      throw invalid_argument("PEM block '" + label + "' without end");
+    }
+    if ((label == "PRIVATE KEY") || (label == "RSA PRIVATE KEY") || (label == "EC PRIVATE KEY")) {
+      size_t body = labelEnd + strlen(PEM_DASHES);
+      vector<unsigned char> der = decodeBase64(text.substr(body, end - body));
+      return decodeDer(der.data(), der.size());
+    }
+    if (label == "ENCRYPTED PRIVATE KEY") {
+      throw invalid_argument("encrypted private keys are not supported");
+    }
+    begin = end;
+  }
+  throw invalid_argument("no private key in the PEM file");
+}
+
+PrivateKey PrivateKey::loadFile(const string &path) {
+  ifstream in(path, ios::binary);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  vector<unsigned char> encoded((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  return decode(encoded);
+}
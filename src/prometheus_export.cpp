@@ -0,0 +1,389 @@
+/**
+ * Implementation of the Prometheus dump of the metrics
+ */
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "call_stats.h"
+#include "metrics_page.h"
+#include "prometheus_export.h"
+#include "stubbing.h"
+
+using namespace std;
+
+#define METRIC_PREFIX            "winscard_stub_"
+#define TEMPORARY_SUFFIX         ".tmp"
+#define WAKE_DUMP                'd'
+#define WAKE_STOP                's'
+
+const unsigned int PrometheusExport::HISTOGRAM_FIRST_MAGNITUDE;
+const unsigned int PrometheusExport::HISTOGRAM_LAST_MAGNITUDE;
+const char *const PrometheusExport::SOCKET_PREFIX = "unix:";
+
+namespace {
+
+/**
+ * Value of a label, with the backslashes, the double quotes and the line feeds escaped
+ */
+string escape(const string &value) {
+  string escaped;
+  for (char c : value) {
+    if (c == '\\') {
+      escaped += "\\\\";
+    }
+    else if (c == '"') {
+      escaped += "\\\"";
+    }
+    else if (c == '\n') {
+      escaped += "\\n";
+    }
+    else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+string seconds(uint64_t nanoseconds) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.9g", static_cast<double>(nanoseconds) / 1e9);
+  return text;
+}
+
+void family(string &text, const char *name, const char *type, const char *help) {
+  text += "# HELP " METRIC_PREFIX;
+  text += name;
+  text += ' ';
+  text += help;
+  text += "\n# TYPE " METRIC_PREFIX;
+  text += name;
+  text += ' ';
+  text += type;
+  text += '\n';
+}
+
+void sample(string &text, const string &name, const string &labels, const string &value) {
+  text += METRIC_PREFIX;
+  text += name;
+  if (!labels.empty()) {
+    text += '{';
+    text += labels;
+    text += '}';
+  }
+  text += ' ';
+  text += value;
+  text += '\n';
+}
+
+/**
+ * Samples of a histogram of the buckets of CallStats
+ * @param labels labels of the series, may be empty
+ */
+void histogram(string &text, const string &name, const string &labels, const uint64_t *latency, uint64_t count,
+               uint64_t total_nanoseconds) {
+  string prefix = labels.empty() ? string() : labels + ",";
+  // The buckets of CallStats start on the powers of 2, the durations below 2^magnitude are the buckets before
+  size_t bucket = 0;
+  uint64_t cumulated = 0;
+  for (unsigned int magnitude = PrometheusExport::HISTOGRAM_FIRST_MAGNITUDE;
+       magnitude <= PrometheusExport::HISTOGRAM_LAST_MAGNITUDE; magnitude += 2) {
+    uint64_t bound = static_cast<uint64_t>(1) << magnitude;
+    while ((bucket < CallStats::BUCKETS) && (CallStats::bucketLowerBound(bucket) < bound)) {
+      cumulated += latency[bucket++];
+    }
+    sample(text, name + "_bucket", prefix + "le=\"" + seconds(bound) + "\"", to_string(cumulated));
+  }
+  sample(text, name + "_bucket", prefix + "le=\"+Inf\"", to_string(count));
+  sample(text, name + "_sum", labels, seconds(total_nanoseconds));
+  sample(text, name + "_count", labels, to_string(count));
+}
+
+string functionLabel(size_t function) {
+  return "function=\"" + string(traceFunctionName(static_cast<uint16_t>(function + 1))) + "\"";
+}
+
+void renderCalls(string &text) {
+  vector<CallStats::FunctionStats> stats(CallStats::FUNCTIONS);
+  CallStats::snapshot(stats.data());
+
+  family(text, "calls_total", "counter", "Calls of the PC/SC functions.");
+  for (size_t function = 0; function < CallStats::FUNCTIONS; function++) {
+    sample(text, "calls_total", functionLabel(function), to_string(stats[function].calls));
+  }
+  family(text, "call_errors_total", "counter", "Calls of the PC/SC functions which returned an error.");
+  for (size_t function = 0; function < CallStats::FUNCTIONS; function++) {
+    sample(text, "call_errors_total", functionLabel(function), to_string(stats[function].errors));
+  }
+  family(text, "call_duration_seconds", "histogram", "Durations of the calls of the PC/SC functions.");
+  for (size_t function = 0; function < CallStats::FUNCTIONS; function++) {
+    histogram(text, "call_duration_seconds", functionLabel(function), stats[function].latency, stats[function].calls,
+              stats[function].totalNanoseconds);
+  }
+  family(text, "call_duration_max_seconds", "gauge", "Longest call of the PC/SC functions.");
+  for (size_t function = 0; function < CallStats::FUNCTIONS; function++) {
+    sample(text, "call_duration_max_seconds", functionLabel(function), seconds(stats[function].maxNanoseconds));
+  }
+}
+
+void renderWakeups(string &text) {
+  WakeupStats::Counters wakeups;
+  WakeupStats::snapshot(&wakeups);
+  family(text, "event_wakeup_seconds", "histogram",
+         "Delays from the events of the readers to the return of SCardGetStatusChange.");
+  histogram(text, "event_wakeup_seconds", "", wakeups.latency, wakeups.wakeups, wakeups.totalNanoseconds);
+}
+
+void renderGauges(string &text) {
+  family(text, "contexts", "gauge", "Established contexts.");
+  sample(text, "contexts", "", to_string(MetricsPage::contexts.load(memory_order_relaxed)));
+  family(text, "handles", "gauge", "Connected card handles.");
+  sample(text, "handles", "", to_string(MetricsPage::handles.load(memory_order_relaxed)));
+  family(text, "cards", "gauge", "Cards inserted in the readers.");
+  sample(text, "cards", "", to_string(MetricsPage::cards.load(memory_order_relaxed)));
+  family(text, "events_total", "counter", "Attachments of readers, insertions and removals of cards.");
+  sample(text, "events_total", "", to_string(MetricsPage::events.load(memory_order_relaxed)));
+  family(text, "injected_faults_total", "counter", "Return codes replaced by a stubbed code.");
+  sample(text, "injected_faults_total", "", to_string(get_injected_return_codes()));
+}
+
+void renderReaders(string &text) {
+  vector<pair<string, ReaderStats::Counters>> readers;
+  ReaderStats::snapshotAll(&readers);
+
+  family(text, "reader_apdus_total", "counter", "APDUs transmitted to the cards of the readers.");
+  for (const pair<string, ReaderStats::Counters> &reader : readers) {
+    sample(text, "reader_apdus_total", "reader=\"" + escape(reader.first) + "\"", to_string(reader.second.apdus));
+  }
+  family(text, "reader_errors_total", "counter", "APDUs which failed in the card or the transport.");
+  for (const pair<string, ReaderStats::Counters> &reader : readers) {
+    sample(text, "reader_errors_total", "reader=\"" + escape(reader.first) + "\"", to_string(reader.second.errors));
+  }
+  family(text, "reader_bytes_in_total", "counter", "Bytes of the commands.");
+  for (const pair<string, ReaderStats::Counters> &reader : readers) {
+    sample(text, "reader_bytes_in_total", "reader=\"" + escape(reader.first) + "\"",
+           to_string(reader.second.bytesIn));
+  }
+  family(text, "reader_bytes_out_total", "counter", "Bytes of the responses, status words included.");
+  for (const pair<string, ReaderStats::Counters> &reader : readers) {
+    sample(text, "reader_bytes_out_total", "reader=\"" + escape(reader.first) + "\"",
+           to_string(reader.second.bytesOut));
+  }
+  family(text, "reader_responses_total", "counter", "Responses by first status byte.");
+  for (const pair<string, ReaderStats::Counters> &reader : readers) {
+    for (size_t status = 0; status < 256; status++) {
+      if (reader.second.sw1[status] == 0) {
+        continue;
+      }
+      char sw1[3];
+      snprintf(sw1, sizeof(sw1), "%02X", static_cast<unsigned int>(status));
+      sample(text, "reader_responses_total", "reader=\"" + escape(reader.first) + "\",sw1=\"" + sw1 + "\"",
+             to_string(reader.second.sw1[status]));
+    }
+  }
+}
+
+bool writeAll(int fd, const string &text) {
+  size_t written = 0;
+  while (written < text.size()) {
+    ssize_t lg = send(fd, text.data() + written, text.size() - written, MSG_NOSIGNAL);
+    if (lg < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += static_cast<size_t>(lg);
+  }
+  return true;
+}
+
+void dumpToSocket(const string &path, const string &text) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || (path.size() >= sizeof(address.sun_path))) {
+    throw invalid_argument("'" + path + "' is not the path of a socket");
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw runtime_error("can't create a socket");
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+    ::close(fd);
+    throw runtime_error("can't connect to '" + path + "'");
+  }
+  bool written = writeAll(fd, text);
+  ::close(fd);
+  if (!written) {
+    throw runtime_error("can't write to '" + path + "'");
+  }
+}
+
+void dumpToFile(const string &path, const string &text) {
+  string temporary = path + TEMPORARY_SUFFIX;
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (file == nullptr) {
+    throw runtime_error("can't create '" + temporary + "'");
+  }
+  bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+  written = (fclose(file) == 0) && written;
+  if (!written || (rename(temporary.c_str(), path.c_str()) != 0)) {
+    remove(temporary.c_str());
+    throw runtime_error("can't write '" + path + "'");
+  }
+}
+
+/**
+ * Write end of the pipe waking the dumper, -1 when the dumps on signal are stopped
+ */
+atomic<int> wakeFd(-1);
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the signal handler uses a lock-free atomic");
+
+extern "C" void onSignal(int) {
+  int saved = errno;
+  int fd = wakeFd.load();
+  if (fd >= 0) {
+    char wake = WAKE_DUMP;
+    ssize_t ignored = write(fd, &wake, 1);
+    (void) ignored;
+  }
+  errno = saved;
+}
+
+class SignalDumper {
+public:
+  SignalDumper() : pipe{-1, -1} {}
+
+  /**
+   * Dump once for the signals received since the previous dump, until the stop byte
+   */
+  void run() {
+    char wakes[64];
+    for (;;) {
+      ssize_t lg = read(pipe[0], wakes, sizeof(wakes));
+      if (lg < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      if ((lg == 0) || (memchr(wakes, WAKE_STOP, static_cast<size_t>(lg)) != nullptr)) {
+        return;
+      }
+      try {
+        PrometheusExport::dump(destination);
+      }
+      catch (exception &e) {
+        // The dump of the next signal may succeed
+      }
+    }
+  }
+
+  mutex control;                    // start and stop
+  string destination;
+  int pipe[2];
+  struct sigaction previous;
+  thread dumper;
+};
+
+/**
+ * The dumper is never destroyed, like the other background writers
+ */
+SignalDumper &signalDumper() {
+  static SignalDumper *instance = new SignalDumper();
+  return *instance;
+}
+
+}
+
+string PrometheusExport::render() {
+  string text;
+  text.reserve(32768);
+  renderCalls(text);
+  renderWakeups(text);
+  renderGauges(text);
+  renderReaders(text);
+  return text;
+}
+
+void PrometheusExport::dump(const string &destination) {
+  size_t prefix_lg = strlen(SOCKET_PREFIX);
+  if (destination.empty()) {
+    throw invalid_argument("the destination of the metrics is empty");
+  }
+  if (destination.compare(0, prefix_lg, SOCKET_PREFIX) == 0) {
+    dumpToSocket(destination.substr(prefix_lg), render());
+  }
+  else {
+    dumpToFile(destination, render());
+  }
+}
+
+void PrometheusExport::startSignalDumps(const string &destination) {
+  if (destination.empty()) {
+    throw invalid_argument("the destination of the metrics is empty");
+  }
+  SignalDumper &dumper = signalDumper();
+  lock_guard<mutex> guard(dumper.control);
+  if (dumper.pipe[0] >= 0) {
+    throw logic_error("the metrics are already dumped on signal to '" + dumper.destination + "'");
+  }
+  if (pipe2(dumper.pipe, O_CLOEXEC) != 0) {
+    throw runtime_error("can't create the pipe of the signal handler");
+  }
+  // The handler never blocks: the signals beyond the capacity of the pipe are coalesced
+  fcntl(dumper.pipe[1], F_SETFL, O_NONBLOCK);
+  dumper.destination = destination;
+  wakeFd.store(dumper.pipe[1]);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGUSR1, &action, &dumper.previous) != 0) {
+    wakeFd.store(-1);
+    ::close(dumper.pipe[0]);
+    ::close(dumper.pipe[1]);
+    dumper.pipe[0] = dumper.pipe[1] = -1;
+    throw runtime_error("can't install the handler of SIGUSR1");
+  }
+  dumper.dumper = thread(&SignalDumper::run, &dumper);
+}
+
+void PrometheusExport::stopSignalDumps() {
+  SignalDumper &dumper = signalDumper();
+  lock_guard<mutex> guard(dumper.control);
+  if (dumper.pipe[0] < 0) {
+    return;
+  }
+  sigaction(SIGUSR1, &dumper.previous, nullptr);
+  wakeFd.store(-1);
+  char wake = WAKE_STOP;
+  while ((write(dumper.pipe[1], &wake, 1) < 0) && (errno == EINTR || errno == EAGAIN)) {
+    this_thread::yield();
+  }
+  dumper.dumper.join();
+  ::close(dumper.pipe[0]);
+  ::close(dumper.pipe[1]);
+  dumper.pipe[0] = dumper.pipe[1] = -1;
+}
+
+bool PrometheusExport::dumpingOnSignal() {
+  SignalDumper &dumper = signalDumper();
+  lock_guard<mutex> guard(dumper.control);
+  return dumper.pipe[0] >= 0;
+}
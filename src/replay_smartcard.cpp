@@ -0,0 +1,334 @@
+/**
+ * Implementation of the replay smartcard
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "apdu_trace.h"
+#include "replay_smartcard.h"
+#include "response_table.h"
+
+using namespace std;
+
+#define CLA_PROPRIETARY          0x80
+
+#define INS_MANAGE_CHANNEL       0x70
+
+#define SW_NO_PRECISE_DIAGNOSIS  0x6F00
+
+#define FNV_OFFSET_BASIS         0xCBF29CE484222325ULL
+#define FNV_PRIME                0x100000001B3ULL
+
+static uint64_t hashOf(const unsigned char *command, size_t command_lg) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < command_lg; i++) {
+    hash = (hash ^ command[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Order of the command index: hash, then command bytes, then position in the trace
+ */
+static int compareCommands(const ReplayTrace::Exchange &a, const unsigned char *command, size_t command_lg) {
+  int order = memcmp(a.command, command, min(a.commandLg, command_lg));
+  if (order != 0) {
+    return order;
+  }
+  return (a.commandLg < command_lg) ? -1 : ((a.commandLg > command_lg) ? 1 : 0);
+}
+
+shared_ptr<const ReplayTrace> ReplayTrace::open(const string &path, uint64_t handle) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    ::close(fd);
+    throw runtime_error("can't stat '" + path + "'");
+  }
+  size_t trace_lg = static_cast<size_t>(status.st_size);
+  if (trace_lg < ApduTrace::HEADER_SIZE) {
+    ::close(fd);
+    throw invalid_argument("'" + path + "' is not a trace");
+  }
+
+  void *mapping = mmap(nullptr, trace_lg, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    ::close(fd);
+    throw runtime_error("can't map '" + path + "'");
+  }
+
+  // The trace owns the descriptor and the mapping from here on
+  shared_ptr<ReplayTrace> trace(new ReplayTrace(fd, static_cast<const unsigned char *>(mapping), trace_lg));
+  trace->buildIndexes(handle);
+  return trace;
+}
+
+ReplayTrace::ReplayTrace(int fd, const unsigned char *base, size_t traceLg) :
+  fd(fd), base(base), traceLg(traceLg) {
+}
+
+ReplayTrace::~ReplayTrace() {
+  munmap(const_cast<unsigned char *>(base), traceLg);
+  ::close(fd);
+}
+
+void ReplayTrace::buildIndexes(uint64_t handle) {
+  uint64_t start;
+  if (!ApduTrace::decodeHeader(base, traceLg, &start)) {
+    throw invalid_argument("the trace doesn't start with a session header");
+  }
+  size_t offset = ApduTrace::HEADER_SIZE;
+  while (offset < traceLg) {
+    if (ApduTrace::decodeHeader(base + offset, traceLg - offset, &start)) {
+      offset += ApduTrace::HEADER_SIZE;
+      continue;
+    }
+    TraceRecord record;
+    size_t record_lg;
+    if (!ApduTrace::decodeRecord(base + offset, traceLg - offset, &record, &record_lg)) {
+      throw invalid_argument("invalid record at offset " + to_string(offset) + " of the trace");
+    }
+    offset += record_lg;
+
+    if ((record.function != static_cast<uint16_t>(TraceFunction::Transmit)) || (record.result != SCARD_S_SUCCESS) ||
+        (record.inputLg < 4) || (record.outputLg < 2) || ((handle != 0) && (record.handle != handle))) {
+      continue;
+    }
+    if ((record.input[1] == INS_MANAGE_CHANNEL) && ((record.input[0] & CLA_PROPRIETARY) == 0)) {
+      continue;
+    }
+    byCommand.emplace_back(hashOf(record.input, record.inputLg), static_cast<uint32_t>(exchanges.size()));
+    exchanges.push_back(Exchange{ record.input, record.inputLg, record.output, record.outputLg });
+  }
+
+  sort(byCommand.begin(), byCommand.end(),
+       [this](const pair<uint64_t, uint32_t> &a, const pair<uint64_t, uint32_t> &b) {
+         if (a.first != b.first) {
+           return a.first < b.first;
+         }
+         const Exchange &other = exchanges[b.second];
+         int order = compareCommands(exchanges[a.second], other.command, other.commandLg);
+         return (order != 0) ? (order < 0) : (a.second < b.second);
+       });
+}
+
+size_t ReplayTrace::find(const unsigned char *command, size_t command_lg, size_t *first) const {
+  uint64_t hash = hashOf(command, command_lg);
+  auto lower = lower_bound(byCommand.begin(), byCommand.end(), hash,
+                           [this, command, command_lg](const pair<uint64_t, uint32_t> &entry, uint64_t key) {
+                             return (entry.first < key) ||
+                                    ((entry.first == key) &&
+                                     (compareCommands(exchanges[entry.second], command, command_lg) < 0));
+                           });
+  size_t count = 0;
+  for (auto entry = lower; (entry != byCommand.end()) && (entry->first == hash) &&
+                           (compareCommands(exchanges[entry->second], command, command_lg) == 0); ++entry) {
+    count++;
+  }
+  *first = static_cast<size_t>(lower - byCommand.begin());
+  return count;
+}
+
+ReplayCardTemplate::ReplayCardTemplate(vector<unsigned char> atr, DWORD protocols, shared_ptr<const ReplayTrace> trace,
+                                       ReplayMode mode, shared_ptr<const CardCostModel> costs) :
+  CardTemplate(std::move(atr), SCARD_SHARE_SHARED, protocols, std::move(costs)),
+  trace(std::move(trace)),
+  mode(mode) {
+}
+
+ReplayCardTemplate::ReplayCardTemplate(vector<unsigned char> atr, DWORD protocols,
+                                       shared_ptr<const ResponseDatabase> database,
+                                       shared_ptr<const CardCostModel> costs) :
+  CardTemplate(std::move(atr), SCARD_SHARE_SHARED, protocols, std::move(costs)),
+  database(std::move(database)),
+  mode(ReplayMode::Lenient) {
+}
+
+shared_ptr<ReplayCardTemplate> ReplayCardTemplate::load(istream &in, const string &directory) {
+  vector<unsigned char> atr;
+  DWORD protocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+  vector<InstructionCostEntry> costs;
+  string tracePath;
+  string databasePath;
+  bool strict = false;
+  ReplayMode mode = ReplayMode::Strict;
+  uint64_t handle = 0;
+
+  string line;
+  unsigned int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == string::npos) || (line[start] == '#')) {
+      continue;
+    }
+    line = line.substr(start);
+
+    try {
+      istringstream fields(line);
+      string keyword, value, extra;
+      fields >> keyword;
+      string arguments = line.substr(keyword.size());
+      if (keyword == "ATR") {
+        atr = ResponseTable::parseHex(arguments);
+        if (atr.empty() || (atr.size() > MAX_ATR_SIZE)) {
+          throw invalid_argument("invalid ATR length");
+        }
+      }
+      else if (keyword == "PROTOCOL") {
+        protocols = CardTable::parseProtocols(arguments);
+      }
+      else if (keyword == "TRACE") {
+        if (!(fields >> value) || (fields >> extra)) {
+          throw invalid_argument("TRACE needs the trace file");
+        }
+        tracePath = (directory.empty() || (value[0] == '/')) ? value : directory + "/" + value;
+      }
+      else if (keyword == "DATABASE") {
+        if (!(fields >> value) || (fields >> extra)) {
+          throw invalid_argument("DATABASE needs the response database file");
+        }
+        databasePath = (directory.empty() || (value[0] == '/')) ? value : directory + "/" + value;
+      }
+      else if (keyword == "MODE") {
+        if (!(fields >> value) || (fields >> extra) || ((value != "strict") && (value != "lenient"))) {
+          throw invalid_argument("MODE is strict or lenient");
+        }
+        mode = (value == "strict") ? ReplayMode::Strict : ReplayMode::Lenient;
+        strict = (mode == ReplayMode::Strict);
+      }
+      else if (keyword == "HANDLE") {
+        if (!(fields >> handle) || (handle == 0) || (fields >> extra)) {
+          throw invalid_argument("HANDLE needs a card handle of the trace");
+        }
+      }
+      else if (keyword == "COST") {
+        costs.push_back(CardTable::parseCost(arguments));
+      }
+      else {
+        throw invalid_argument("unknown keyword '" + keyword + "'");
+      }
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("line " + to_string(lineNumber) + ": " + e.what());
+    }
+  }
+
+  if (atr.empty()) {
+    throw invalid_argument("missing ATR");
+  }
+  if (tracePath.empty() == databasePath.empty()) {
+    throw invalid_argument("either TRACE or DATABASE is needed");
+  }
+  shared_ptr<const CardCostModel> costModel =
+    costs.empty() ? nullptr : make_shared<CardCostModel>(costs.data(), costs.size());
+  if (!databasePath.empty()) {
+    if (strict || (handle != 0)) {
+      throw invalid_argument("a database is replayed in lenient mode for all the cards");
+    }
+    return make_shared<ReplayCardTemplate>(atr, protocols, ResponseDatabase::open(databasePath), costModel);
+  }
+  return make_shared<ReplayCardTemplate>(atr, protocols, ReplayTrace::open(tracePath, handle), mode, costModel);
+}
+
+shared_ptr<ReplayCardTemplate> ReplayCardTemplate::loadFile(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  size_t separator = path.find_last_of('/');
+  return load(in, (separator == string::npos) ? string() : path.substr(0, separator));
+}
+
+unique_ptr<SmartCard> ReplayCardTemplate::instantiate() const {
+  return make_unique<ReplaySmartCard>(static_pointer_cast<const ReplayCardTemplate>(shared_from_this()));
+}
+
+ReplaySmartCard::ReplaySmartCard(shared_ptr<const ReplayCardTemplate> cardTemplate) :
+  SmartCard(cardTemplate),
+  replay(cardTemplate.get()),
+  position(0),
+  mismatches(0) {
+  if (replay->database) {
+    replayed.assign(replay->database->header().cycleCount, 0);
+    key.resize(ResponseDatabase::MAX_KEY_SIZE);
+  }
+  else if (replay->mode == ReplayMode::Lenient) {
+    replayed.assign(replay->trace->size(), 0);
+  }
+  for (size_t &aid_lg : selectedLg) {
+    aid_lg = 0;
+  }
+}
+
+void ReplaySmartCard::resetChannel(unsigned int channel) {
+  selectedLg[channel] = 0;
+}
+
+DWORD ReplaySmartCard::lookUp(const ApduView &apdu, ApduResponse &response) {
+  const ResponseDatabase &database = *replay->database;
+  size_t aid_lg = selectedLg[apdu.channel];
+  size_t key_lg = ResponseDatabase::makeKey(database.header().flags, apdu,
+                                            (aid_lg == 0) ? nullptr : selected[apdu.channel], aid_lg, key.data());
+  const unsigned char *entry = database.find(key.data(), key_lg);
+  if (entry == nullptr) {
+    mismatches++;
+    response.status(SW_NO_PRECISE_DIAGNOSIS);
+    return SCARD_S_SUCCESS;
+  }
+
+  size_t index = 0;
+  uint32_t cycle = ResponseDatabase::cycle(entry);
+  if (cycle < replayed.size()) {
+    index = replayed[cycle]++ % ResponseDatabase::responseCount(entry);
+  }
+  size_t recorded_lg;
+  const unsigned char *recorded = ResponseDatabase::response(entry, index, &recorded_lg);
+  response.reference(recorded, recorded_lg);
+  if (ResponseDatabase::selectsAid(apdu, recorded, recorded_lg)) {
+    memcpy(selected[apdu.channel], apdu.data, apdu.lc);
+    selectedLg[apdu.channel] = apdu.lc;
+  }
+  return SCARD_S_SUCCESS;
+}
+
+DWORD ReplaySmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  (void)handle;
+  if (replay->database) {
+    return lookUp(apdu, response);
+  }
+  const ReplayTrace &trace = *replay->trace;
+  if (replay->mode == ReplayMode::Strict) {
+    if (position < trace.size()) {
+      const ReplayTrace::Exchange &exchange = trace.exchange(position);
+      if ((exchange.commandLg == apdu.rawLg) && (memcmp(exchange.command, apdu.raw, apdu.rawLg) == 0)) {
+        position++;
+        response.reference(exchange.response, exchange.responseLg);
+        return SCARD_S_SUCCESS;
+      }
+    }
+  }
+  else {
+    size_t first;
+    size_t count = trace.find(apdu.raw, apdu.rawLg, &first);
+    if (count > 0) {
+      const ReplayTrace::Exchange &exchange = trace.exchange(trace.indexed(first + replayed[first] % count));
+      replayed[first]++;
+      response.reference(exchange.response, exchange.responseLg);
+      return SCARD_S_SUCCESS;
+    }
+  }
+  mismatches++;
+  response.status(SW_NO_PRECISE_DIAGNOSIS);
+  return SCARD_S_SUCCESS;
+}
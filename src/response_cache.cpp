@@ -0,0 +1,168 @@
+/**
+ * Implementation of the response cache
+ */
+#include <cstring>
+#include <stdexcept>
+#include "response_cache.h"
+
+using namespace std;
+
+#define FNV_OFFSET_BASIS         0xCBF29CE484222325ULL
+#define FNV_PRIME                0x100000001B3ULL
+
+const uint32_t ResponseCache::NONE;
+
+ResponseCache::ResponseCache(size_t capacity) :
+  entries(capacity),
+  used(0),
+  head(NONE),
+  tail(NONE),
+  counters() {
+  if ((capacity == 0) || (capacity >= NONE / 2)) {
+    throw invalid_argument("invalid capacity of the response cache");
+  }
+  // At most half of the slots are used, which keeps the clusters short
+  size_t slotCount = 1;
+  while (slotCount < 2 * capacity) {
+    slotCount <<= 1;
+  }
+  slots.assign(slotCount, 0);
+}
+
+uint64_t ResponseCache::hashOf(const unsigned char *command, size_t command_lg, uint64_t epoch) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < command_lg; i++) {
+    hash = (hash ^ command[i]) * FNV_PRIME;
+  }
+  for (int shift = 0; shift < 64; shift += 8) {
+    hash = (hash ^ ((epoch >> shift) & 0xFF)) * FNV_PRIME;
+  }
+  return hash;
+}
+
+size_t ResponseCache::slotOf(uint64_t hash, const unsigned char *command, size_t command_lg, uint64_t epoch) const {
+  size_t mask = slots.size() - 1;
+  for (size_t slot = static_cast<size_t>(hash) & mask; ; slot = (slot + 1) & mask) {
+    if (slots[slot] == 0) {
+      return slot;
+    }
+    const Entry &entry = entries[slots[slot] - 1];
+    if ((entry.hash == hash) && (entry.epoch == epoch) && (entry.commandLg == command_lg) &&
+        (memcmp(entry.command.data(), command, command_lg) == 0)) {
+      return slot;
+    }
+  }
+}
+
+void ResponseCache::removeSlot(size_t slot) {
+  size_t mask = slots.size() - 1;
+  size_t next = slot;
+  while (true) {
+    next = (next + 1) & mask;
+    if (slots[next] == 0) {
+      break;
+    }
+    // An entry stays when its home slot is cyclically in (slot, next]
+    size_t home = static_cast<size_t>(entries[slots[next] - 1].hash) & mask;
+    bool stays = (slot <= next) ? ((slot < home) && (home <= next)) : ((slot < home) || (home <= next));
+    if (!stays) {
+      slots[slot] = slots[next];
+      slot = next;
+    }
+  }
+  slots[slot] = 0;
+}
+
+void ResponseCache::unlink(uint32_t entry) {
+  Entry &current = entries[entry];
+  if (current.previous != NONE) {
+    entries[current.previous].next = current.next;
+  }
+  else {
+    head = current.next;
+  }
+  if (current.next != NONE) {
+    entries[current.next].previous = current.previous;
+  }
+  else {
+    tail = current.previous;
+  }
+}
+
+void ResponseCache::pushFront(uint32_t entry) {
+  entries[entry].previous = NONE;
+  entries[entry].next = head;
+  if (head != NONE) {
+    entries[head].previous = entry;
+  }
+  else {
+    tail = entry;
+  }
+  head = entry;
+}
+
+const unsigned char *ResponseCache::find(const unsigned char *command, size_t command_lg, uint64_t epoch,
+                                         size_t *response_lg) {
+  size_t slot = slotOf(hashOf(command, command_lg, epoch), command, command_lg, epoch);
+  if (slots[slot] == 0) {
+    counters.misses++;
+    return nullptr;
+  }
+  counters.hits++;
+  uint32_t entry = slots[slot] - 1;
+  if (entry != head) {
+    unlink(entry);
+    pushFront(entry);
+  }
+  *response_lg = entries[entry].responseLg;
+  return entries[entry].response.data();
+}
+
+void ResponseCache::insert(const unsigned char *command, size_t command_lg, uint64_t epoch,
+                           const unsigned char *response, size_t response_lg) {
+  uint64_t hash = hashOf(command, command_lg, epoch);
+  size_t slot = slotOf(hash, command, command_lg, epoch);
+  uint32_t entry;
+  if (slots[slot] != 0) {
+    entry = slots[slot] - 1;
+    unlink(entry);
+  }
+  else if (used < entries.size()) {
+    entry = static_cast<uint32_t>(used++);
+    slots[slot] = entry + 1;
+  }
+  else {
+    entry = tail;
+    unlink(entry);
+    removeSlot(slotOf(entries[entry].hash, entries[entry].command.data(), entries[entry].commandLg,
+                      entries[entry].epoch));
+    counters.evictions++;
+    // The removal may have moved the entries of the cluster
+    slot = slotOf(hash, command, command_lg, epoch);
+    slots[slot] = entry + 1;
+  }
+
+  Entry &stored = entries[entry];
+  stored.hash = hash;
+  stored.epoch = epoch;
+  if (stored.command.size() < command_lg) {
+    stored.command.resize(command_lg);
+  }
+  memcpy(stored.command.data(), command, command_lg);
+  stored.commandLg = command_lg;
+  if (stored.response.size() < response_lg) {
+    stored.response.resize(response_lg);
+  }
+  if (response_lg > 0) {
+    memcpy(stored.response.data(), response, response_lg);
+  }
+  stored.responseLg = response_lg;
+  pushFront(entry);
+}
+
+void ResponseCache::clear() {
+  slots.assign(slots.size(), 0);
+  used = 0;
+  head = NONE;
+  tail = NONE;
+}
@@ -0,0 +1,308 @@
+/**
+ * Implementation of the response database of the replay cards and of its builder
+ */
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "apdu_trace.h"
+#include "response_database.h"
+
+using namespace std;
+
+#define CLA_PROPRIETARY          0x80
+
+#define INS_SELECT               0xA4
+#define INS_MANAGE_CHANNEL       0x70
+
+#define SELECT_NAME              0x04
+#define CHANNEL_CLOSE            0x80
+
+#define FNV_OFFSET_BASIS         0xCBF29CE484222325ULL
+#define FNV_PRIME                0x100000001B3ULL
+
+#define ENTRY_HEADER_SIZE        12
+#define ENTRY_ALIGNMENT          8
+#define MAX_AID_SIZE             16
+
+const size_t ResponseDatabase::MAX_KEY_SIZE;
+
+static uint32_t get32(const unsigned char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static void put32(string &data, uint32_t value) {
+  data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+shared_ptr<const ResponseDatabase> ResponseDatabase::open(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    ::close(fd);
+    throw runtime_error("can't stat '" + path + "'");
+  }
+  size_t database_lg = static_cast<size_t>(status.st_size);
+  if (database_lg < sizeof(ResponseDbHeader)) {
+    ::close(fd);
+    throw invalid_argument("'" + path + "' is not a response database");
+  }
+
+  void *mapping = mmap(nullptr, database_lg, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    ::close(fd);
+    throw runtime_error("can't map '" + path + "'");
+  }
+
+  // The database owns the descriptor and the mapping from here on
+  shared_ptr<ResponseDatabase> database(
+    new ResponseDatabase(fd, static_cast<const unsigned char *>(mapping), database_lg));
+  database->validate();
+  return database;
+}
+
+ResponseDatabase::ResponseDatabase(int fd, const unsigned char *base, size_t databaseLg) :
+  fd(fd), base(base), databaseLg(databaseLg), buckets(nullptr), data(nullptr) {
+}
+
+ResponseDatabase::~ResponseDatabase() {
+  munmap(const_cast<unsigned char *>(base), databaseLg);
+  ::close(fd);
+}
+
+void ResponseDatabase::validate() {
+  const ResponseDbHeader &database_header = header();
+  if (memcmp(database_header.magic, RESPONSE_DB_MAGIC, sizeof(database_header.magic)) != 0) {
+    throw invalid_argument("invalid magic of the response database");
+  }
+  uint64_t bucket_count = database_header.bucketCount;
+  if ((bucket_count == 0) || ((bucket_count & (bucket_count - 1)) != 0) ||
+      (bucket_count > (databaseLg - sizeof(ResponseDbHeader)) / sizeof(ResponseDbBucket)) ||
+      (database_header.entryCount > bucket_count / 2)) {
+    throw invalid_argument("invalid number of buckets in the response database");
+  }
+  if ((database_header.bucketsOffset < sizeof(ResponseDbHeader)) ||
+      (database_header.bucketsOffset % ENTRY_ALIGNMENT != 0) ||
+      (database_header.bucketsOffset + bucket_count * sizeof(ResponseDbBucket) > databaseLg) ||
+      (database_header.dataOffset % ENTRY_ALIGNMENT != 0) || (database_header.dataOffset > databaseLg) ||
+      (database_header.dataLg > databaseLg - database_header.dataOffset)) {
+    throw invalid_argument("the buckets or the data are outside the response database");
+  }
+  buckets = reinterpret_cast<const ResponseDbBucket *>(base + database_header.bucketsOffset);
+  data = base + database_header.dataOffset;
+}
+
+size_t ResponseDatabase::makeKey(uint32_t flags, const ApduView &apdu, const unsigned char *aid, size_t aid_lg,
+                                 unsigned char *key) {
+  size_t key_lg = 0;
+  if (flags & RESPONSE_DB_KEY_CHANNEL) {
+    key[key_lg++] = apdu.channel;
+  }
+  if (flags & RESPONSE_DB_KEY_AID) {
+    if (aid == nullptr) {
+      aid_lg = 0;
+    }
+    key[key_lg++] = static_cast<unsigned char>(aid_lg);
+    if (aid_lg > 0) {
+      memcpy(key + key_lg, aid, aid_lg);
+      key_lg += aid_lg;
+    }
+  }
+  key[key_lg++] = apdu.cla;
+  memcpy(key + key_lg, apdu.raw + 1, apdu.rawLg - 1);
+  return key_lg + apdu.rawLg - 1;
+}
+
+uint64_t ResponseDatabase::hashOf(const unsigned char *key, size_t key_lg) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < key_lg; i++) {
+    hash = (hash ^ key[i]) * FNV_PRIME;
+  }
+  // 0 is an empty bucket
+  return (hash == 0) ? 1 : hash;
+}
+
+bool ResponseDatabase::selectsAid(const ApduView &apdu, const unsigned char *response, size_t response_lg) {
+  if ((apdu.ins != INS_SELECT) || (apdu.p1 != SELECT_NAME) || ((apdu.cla & CLA_PROPRIETARY) != 0) ||
+      (apdu.lc == 0) || (apdu.lc > MAX_AID_SIZE) || (response_lg < 2)) {
+    return false;
+  }
+  unsigned char sw1 = response[response_lg - 2];
+  return (sw1 == 0x90) || (sw1 == 0x61) || (sw1 == 0x62) || (sw1 == 0x63);
+}
+
+const unsigned char *ResponseDatabase::find(const unsigned char *key, size_t key_lg) const {
+  uint64_t hash = hashOf(key, key_lg);
+  uint64_t mask = header().bucketCount - 1;
+  uint64_t data_lg = header().dataLg;
+  for (uint64_t probe = 0, bucket = hash & mask; probe <= mask; probe++, bucket = (bucket + 1) & mask) {
+    const ResponseDbBucket &current = buckets[bucket];
+    if (current.hash == 0) {
+      return nullptr;
+    }
+    if ((current.hash == hash) && (current.offset + ENTRY_HEADER_SIZE + key_lg <= data_lg)) {
+      const unsigned char *entry = data + current.offset;
+      if ((get32(entry) == key_lg) && (memcmp(entry + ENTRY_HEADER_SIZE, key, key_lg) == 0)) {
+        return entry;
+      }
+    }
+  }
+  return nullptr;
+}
+
+size_t ResponseDatabase::responseCount(const unsigned char *entry) {
+  return get32(entry + 4);
+}
+
+uint32_t ResponseDatabase::cycle(const unsigned char *entry) {
+  return get32(entry + 8);
+}
+
+const unsigned char *ResponseDatabase::response(const unsigned char *entry, size_t index, size_t *response_lg) {
+  const unsigned char *current = entry + ENTRY_HEADER_SIZE + get32(entry);
+  for (size_t i = 0; i < index; i++) {
+    current += 4 + get32(current);
+  }
+  *response_lg = get32(current);
+  return current + 4;
+}
+
+void ResponseDatabaseBuilder::addTrace(const string &path) {
+  ifstream in(path, ios::binary);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  vector<unsigned char> trace((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  // AIDs selected on the channels of the card handles, an empty AID when none is selected
+  unordered_map<uint64_t, vector<vector<unsigned char>>> selected;
+  uint64_t start;
+  if (!ApduTrace::decodeHeader(trace.data(), trace.size(), &start)) {
+    throw invalid_argument("'" + path + "' doesn't start with a session header");
+  }
+  size_t offset = ApduTrace::HEADER_SIZE;
+  while (offset < trace.size()) {
+    if (ApduTrace::decodeHeader(trace.data() + offset, trace.size() - offset, &start)) {
+      // The handles of another session are other cards
+      selected.clear();
+      offset += ApduTrace::HEADER_SIZE;
+      continue;
+    }
+    TraceRecord record;
+    size_t record_lg;
+    if (!ApduTrace::decodeRecord(trace.data() + offset, trace.size() - offset, &record, &record_lg)) {
+      throw invalid_argument("invalid record at offset " + to_string(offset) + " of '" + path + "'");
+    }
+    offset += record_lg;
+    if ((record.function != static_cast<uint16_t>(TraceFunction::Transmit)) || (record.result != SCARD_S_SUCCESS) ||
+        (record.outputLg < 2)) {
+      continue;
+    }
+    ApduView apdu(record.input, record.inputLg);
+    if (!apdu.valid) {
+      continue;
+    }
+
+    vector<vector<unsigned char>> &channels = selected[record.handle];
+    if (channels.empty()) {
+      channels.resize(SmartCard::MAX_CHANNELS);
+    }
+    const unsigned char *sw = record.output + record.outputLg - 2;
+    if ((apdu.ins == INS_MANAGE_CHANNEL) && ((apdu.cla & CLA_PROPRIETARY) == 0)) {
+      // Handled by the card, the channel which is opened or closed starts without selected AID
+      unsigned int channel = SmartCard::MAX_CHANNELS;
+      if (apdu.p1 == CHANNEL_CLOSE) {
+        channel = (apdu.p2 == 0) ? apdu.channel : apdu.p2;
+      }
+      else if (apdu.p2 != 0) {
+        channel = apdu.p2;
+      }
+      else if (record.outputLg == 3) {
+        channel = record.output[0];
+      }
+      if ((sw[0] == 0x90) && (sw[1] == 0x00) && (channel < SmartCard::MAX_CHANNELS)) {
+        channels[channel].clear();
+      }
+      continue;
+    }
+
+    vector<unsigned char> &aid = channels[apdu.channel];
+    add(apdu, aid.data(), aid.size(), record.output, record.outputLg);
+    if (ResponseDatabase::selectsAid(apdu, record.output, record.outputLg)) {
+      aid.assign(apdu.data, apdu.data + apdu.lc);
+    }
+  }
+}
+
+void ResponseDatabaseBuilder::add(const ApduView &apdu, const unsigned char *aid, size_t aid_lg,
+                                  const unsigned char *response, size_t response_lg) {
+  unsigned char key[ResponseDatabase::MAX_KEY_SIZE];
+  size_t key_lg = ResponseDatabase::makeKey(flags, apdu, (aid_lg == 0) ? nullptr : aid, aid_lg, key);
+  string keyBytes(reinterpret_cast<const char *>(key), key_lg);
+  auto position = positions.find(keyBytes);
+  if (position == positions.end()) {
+    position = positions.emplace(keyBytes, entries.size()).first;
+    entries.push_back(Entry{ std::move(keyBytes), {} });
+  }
+  entries[position->second].responses.emplace_back(reinterpret_cast<const char *>(response), response_lg);
+}
+
+void ResponseDatabaseBuilder::write(const string &path) const {
+  uint64_t bucket_count = 2;
+  while (bucket_count < 2 * entries.size()) {
+    bucket_count <<= 1;
+  }
+  vector<ResponseDbBucket> buckets(bucket_count, ResponseDbBucket{ 0, 0 });
+  string data;
+  uint32_t cycles = 0;
+  for (const Entry &entry : entries) {
+    uint64_t offset = data.size();
+    uint64_t hash = ResponseDatabase::hashOf(reinterpret_cast<const unsigned char *>(entry.key.data()),
+                                             entry.key.size());
+    uint64_t bucket = hash & (bucket_count - 1);
+    while (buckets[bucket].hash != 0) {
+      bucket = (bucket + 1) & (bucket_count - 1);
+    }
+    buckets[bucket] = ResponseDbBucket{ hash, offset };
+
+    put32(data, static_cast<uint32_t>(entry.key.size()));
+    put32(data, static_cast<uint32_t>(entry.responses.size()));
+    put32(data, (entry.responses.size() > 1) ? cycles++ : RESPONSE_DB_NO_CYCLE);
+    data += entry.key;
+    for (const string &response : entry.responses) {
+      put32(data, static_cast<uint32_t>(response.size()));
+      data += response;
+    }
+    data.append((ENTRY_ALIGNMENT - data.size() % ENTRY_ALIGNMENT) % ENTRY_ALIGNMENT, '\0');
+  }
+
+  ResponseDbHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RESPONSE_DB_MAGIC, sizeof(header.magic));
+  header.flags = flags;
+  header.bucketCount = bucket_count;
+  header.entryCount = entries.size();
+  header.cycleCount = cycles;
+  header.bucketsOffset = sizeof(ResponseDbHeader);
+  header.dataOffset = header.bucketsOffset + bucket_count * sizeof(ResponseDbBucket);
+  header.dataLg = data.size();
+
+  ofstream out(path, ios::binary | ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(buckets.data()),
+            static_cast<streamsize>(buckets.size() * sizeof(ResponseDbBucket)));
+  out.write(data.data(), static_cast<streamsize>(data.size()));
+  if (!out) {
+    throw runtime_error("can't write '" + path + "'");
+  }
+}
@@ -0,0 +1,420 @@
+/**
+ * Implementation of the compiled APDU response table
+ */
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "response_table.h"
+
+using namespace std;
+
+bool ResponseTableView::match(const unsigned char *command, size_t command_lg, const unsigned char **response, size_t *response_lg) const {
+  int32_t found = -1;
+
+  // Walk the trie, remember the longest prefix on the way
+  uint32_t node = 0;
+  size_t index = 0;
+  for (;;) {
+    if (nodes[node].prefix >= 0) {
+      found = nodes[node].prefix;
+    }
+    if (index == command_lg) {
+      if (nodes[node].exact >= 0) {
+        found = nodes[node].exact;
+      }
+      break;
+    }
+    const unsigned char *first = edgeBytes + nodes[node].firstEdge;
+    const unsigned char *last = first + nodes[node].edgeCount;
+    const unsigned char *edge = lower_bound(first, last, command[index]);
+    if ((edge == last) || (*edge != command[index])) {
+      break;
+    }
+    node = edgeChildren[edge - edgeBytes];
+    index++;
+  }
+
+  // Header patterns, the groups are sorted from the most to the least specific mask
+  if ((found < 0) && (command_lg >= 4)) {
+    uint32_t header = (static_cast<uint32_t>(command[0]) << 24) | (static_cast<uint32_t>(command[1]) << 16) |
+                      (static_cast<uint32_t>(command[2]) << 8) | static_cast<uint32_t>(command[3]);
+    for (uint32_t i = 0; (i < groupCount) && (found < 0); i++) {
+      const HeaderGroup &group = groups[i];
+      uint32_t value = header & group.mask;
+      uint32_t slot = slotOf(value, group.slotCount);
+      for (;;) {
+        const HeaderSlot &candidate = slots[group.firstSlot + slot];
+        if (candidate.response < 0) {
+          break;
+        }
+        if (candidate.value == value) {
+          found = candidate.response;
+          break;
+        }
+        slot = (slot + 1) & (group.slotCount - 1);
+      }
+    }
+  }
+
+  if (found < 0) {
+    found = defaultResponse;
+  }
+  if (found < 0) {
+    return false;
+  }
+
+  *response = responses + entries[found].offset;
+  *response_lg = entries[found].length;
+  return true;
+}
+
+ResponseTable::ResponseTable() : children(1), patterns(0), defaultResponse(-1), compiled() {
+  nodes.push_back(TrieNode{0, 0, -1, -1});
+  compile();
+}
+
+vector<unsigned char> ResponseTable::parseHex(const string &hex) {
+  vector<unsigned char> bytes;
+  int high = -1;
+
+  for (char c : hex) {
+    int digit;
+    if ((c >= '0') && (c <= '9')) {
+      digit = c - '0';
+    }
+    else if ((c >= 'a') && (c <= 'f')) {
+      digit = c - 'a' + 10;
+    }
+    else if ((c >= 'A') && (c <= 'F')) {
+      digit = c - 'A' + 10;
+    }
+    else if ((c == ' ') || (c == '\t') || (c == '\r')) {
+      continue;
+    }
+    else {
+      throw invalid_argument("invalid hex digit in '" + hex + "'");
+    }
+    if (high < 0) {
+      high = digit;
+    }
+    else {
+      bytes.push_back(static_cast<unsigned char>((high << 4) | digit));
+      high = -1;
+    }
+  }
+  if (high >= 0) {
+    throw invalid_argument("odd number of hex digits in '" + hex + "'");
+  }
+
+  return bytes;
+}
+
+int32_t ResponseTable::addResponse(const vector<unsigned char> &response) {
+  string key(response.begin(), response.end());
+  auto unique_it = uniqueResponses.find(key);
+  if (unique_it != uniqueResponses.end()) {
+    return unique_it->second;
+  }
+
+  auto index = static_cast<int32_t>(entries.size());
+  entries.push_back(ResponseEntry{static_cast<uint32_t>(responses.size()), static_cast<uint32_t>(response.size())});
+  responses.insert(responses.end(), response.begin(), response.end());
+  uniqueResponses[key] = index;
+  return index;
+}
+
+uint32_t ResponseTable::insert(const vector<unsigned char> &command) {
+  uint32_t node = 0;
+  for (auto c : command) {
+    auto child_it = children[node].find(c);
+    if (child_it != children[node].end()) {
+      node = child_it->second;
+      continue;
+    }
+    auto child = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(TrieNode{0, 0, -1, -1});
+    children.emplace_back();
+    children[node][c] = child;
+    node = child;
+  }
+  return node;
+}
+
+void ResponseTable::addExact(const vector<unsigned char> &command, const vector<unsigned char> &response) {
+  uint32_t node = insert(command);
+  if (nodes[node].exact < 0) {
+    patterns++;
+  }
+  nodes[node].exact = addResponse(response);
+}
+
+void ResponseTable::addPrefix(const vector<unsigned char> &prefix, const vector<unsigned char> &response) {
+  uint32_t node = insert(prefix);
+  if (nodes[node].prefix < 0) {
+    patterns++;
+  }
+  nodes[node].prefix = addResponse(response);
+}
+
+void ResponseTable::addHeader(uint32_t header, uint32_t mask, const vector<unsigned char> &response) {
+  auto &group = headers[mask];
+  if (group.find(header & mask) == group.end()) {
+    patterns++;
+  }
+  group[header & mask] = addResponse(response);
+}
+
+void ResponseTable::setDefault(const vector<unsigned char> &response) {
+  defaultResponse = addResponse(response);
+}
+
+void ResponseTable::addLine(const string &line) {
+  size_t separator = line.find("=>");
+  if (separator == string::npos) {
+    throw invalid_argument("missing '=>' in '" + line + "'");
+  }
+  string pattern = line.substr(0, separator);
+  vector<unsigned char> response = parseHex(line.substr(separator + 2));
+  if (response.size() < 2) {
+    throw invalid_argument("response without status word in '" + line + "'");
+  }
+
+  pattern.erase(remove_if(pattern.begin(), pattern.end(), [](char c) { return (c == ' ') || (c == '\t'); }), pattern.end());
+
+  if (pattern == "DEFAULT") {
+    setDefault(response);
+    return;
+  }
+
+  size_t slash = pattern.find('/');
+  if (slash != string::npos) {
+    vector<unsigned char> header = parseHex(pattern.substr(0, slash));
+    vector<unsigned char> mask = parseHex(pattern.substr(slash + 1));
+    if ((header.size() != 4) || (mask.size() != 4)) {
+      throw invalid_argument("header pattern needs 4 bytes and a 4 byte mask in '" + line + "'");
+    }
+    auto word = [](const vector<unsigned char> &b) {
+      return (static_cast<uint32_t>(b[0]) << 24) | (static_cast<uint32_t>(b[1]) << 16) |
+             (static_cast<uint32_t>(b[2]) << 8) | static_cast<uint32_t>(b[3]);
+    };
+    addHeader(word(header), word(mask), response);
+    return;
+  }
+
+  if (!pattern.empty() && (pattern.back() == '*')) {
+    addPrefix(parseHex(pattern.substr(0, pattern.size() - 1)), response);
+    return;
+  }
+
+  vector<unsigned char> command = parseHex(pattern);
+  if (command.empty()) {
+    throw invalid_argument("empty command in '" + line + "'");
+  }
+  addExact(command, response);
+}
+
+void ResponseTable::compile() {
+  // Trie: the edges of each node are stored contiguously, std::map keeps them sorted
+  edgeBytes.clear();
+  edgeChildren.clear();
+  for (size_t node = 0; node < nodes.size(); node++) {
+    nodes[node].firstEdge = static_cast<uint32_t>(edgeBytes.size());
+    nodes[node].edgeCount = static_cast<uint32_t>(children[node].size());
+    for (auto &edge : children[node]) {
+      edgeBytes.push_back(edge.first);
+      edgeChildren.push_back(edge.second);
+    }
+  }
+
+  // Header groups, most specific mask first
+  vector<uint32_t> masks;
+  for (auto &group : headers) {
+    masks.push_back(group.first);
+  }
+  stable_sort(masks.begin(), masks.end(), [](uint32_t a, uint32_t b) {
+    return __builtin_popcount(a) > __builtin_popcount(b);
+  });
+  groups.clear();
+  slots.clear();
+  for (auto mask : masks) {
+    auto &values = headers[mask];
+    uint32_t slotCount = 1;
+    while (slotCount < 2 * values.size()) {
+      slotCount <<= 1;
+    }
+    HeaderGroup group{mask, static_cast<uint32_t>(slots.size()), slotCount};
+    slots.resize(slots.size() + slotCount, HeaderSlot{0, -1});
+    for (auto &value : values) {
+      uint32_t slot = ResponseTableView::slotOf(value.first, slotCount);
+      while (slots[group.firstSlot + slot].response >= 0) {
+        slot = (slot + 1) & (slotCount - 1);
+      }
+      slots[group.firstSlot + slot] = HeaderSlot{value.first, value.second};
+    }
+    groups.push_back(group);
+  }
+
+  compiled = ResponseTableView{nodes.data(), edgeBytes.data(), edgeChildren.data(),
+                               groups.data(), static_cast<uint32_t>(groups.size()), slots.data(),
+                               entries.data(), responses.data(), defaultResponse};
+}
+
+/**
+ * Write a constexpr array, empty arrays are not allowed in C++ so they are referenced as nullptr
+ */
+template <typename T, typename F>
+static string generateArray(ostream &out, const string &type, const string &name, const vector<T> &items, F format) {
+  if (items.empty()) {
+    return "nullptr";
+  }
+  out << "static constexpr " << type << " " << name << "[] = {";
+  for (size_t i = 0; i < items.size(); i++) {
+    out << ((i % 8 == 0) ? "\n  " : " ") << format(items[i]) << ",";
+  }
+  out << "\n};\n";
+  return name;
+}
+
+static string hexOf(uint32_t value) {
+  ostringstream hex;
+  hex << "0x" << std::hex << value;
+  return hex.str();
+}
+
+void ResponseTable::generate(ostream &out, const string &identifier) const {
+  string nodesName = generateArray(out, "TrieNode", identifier + "_nodes", nodes, [](const TrieNode &node) {
+    return "{" + to_string(node.firstEdge) + ", " + to_string(node.edgeCount) + ", " +
+           to_string(node.exact) + ", " + to_string(node.prefix) + "}";
+  });
+  string edgeBytesName = generateArray(out, "unsigned char", identifier + "_edge_bytes", edgeBytes, [](unsigned char byte) {
+    return hexOf(byte);
+  });
+  string edgeChildrenName = generateArray(out, "uint32_t", identifier + "_edge_children", edgeChildren, [](uint32_t child) {
+    return to_string(child);
+  });
+  string groupsName = generateArray(out, "HeaderGroup", identifier + "_groups", groups, [](const HeaderGroup &group) {
+    return "{" + hexOf(group.mask) + ", " + to_string(group.firstSlot) + ", " + to_string(group.slotCount) + "}";
+  });
+  string slotsName = generateArray(out, "HeaderSlot", identifier + "_slots", slots, [](const HeaderSlot &slot) {
+    return "{" + hexOf(slot.value) + ", " + to_string(slot.response) + "}";
+  });
+  string entriesName = generateArray(out, "ResponseEntry", identifier + "_entries", entries, [](const ResponseEntry &entry) {
+    return "{" + to_string(entry.offset) + ", " + to_string(entry.length) + "}";
+  });
+  string responsesName = generateArray(out, "unsigned char", identifier + "_data", responses, [](unsigned char byte) {
+    return hexOf(byte);
+  });
+
+  out << "static constexpr ResponseTableView " << identifier << " = {\n  "
+      << nodesName << ", " << edgeBytesName << ", " << edgeChildrenName << ",\n  "
+      << groupsName << ", " << groups.size() << ", " << slotsName << ",\n  "
+      << entriesName << ", " << responsesName << ", " << defaultResponse << "\n};\n";
+}
+
+InstructionCostEntry CardTable::parseCost(const string &fields) {
+  istringstream in(fields);
+  string ins;
+  InstructionCostEntry entry = { 0, { 0, 0, 0 } };
+
+  if (!(in >> ins)) {
+    throw invalid_argument("missing instruction in COST");
+  }
+  if (ins == "DEFAULT") {
+    entry.ins = COST_DEFAULT_INS;
+  }
+  else {
+    vector<unsigned char> bytes = ResponseTable::parseHex(ins);
+    if (bytes.size() != 1) {
+      throw invalid_argument("invalid instruction '" + ins + "' in COST");
+    }
+    entry.ins = bytes[0];
+  }
+
+  if (!(in >> entry.cost.fixedMicroseconds)) {
+    throw invalid_argument("missing fixed cost in COST");
+  }
+  if ((in >> entry.cost.perByteNanoseconds) && (in >> entry.cost.jitterMicroseconds)) {
+    string extra;
+    if (in >> extra) {
+      throw invalid_argument("unexpected '" + extra + "' in COST");
+    }
+  }
+  if (in.fail() && !in.eof()) {
+    throw invalid_argument("invalid cost in COST");
+  }
+  return entry;
+}
+
+DWORD CardTable::parseProtocols(const string &fields) {
+  istringstream protocols(fields);
+  string protocol;
+  DWORD mask = 0;
+  while (protocols >> protocol) {
+    if (protocol == "T0") {
+      mask |= SCARD_PROTOCOL_T0;
+    }
+    else if (protocol == "T1") {
+      mask |= SCARD_PROTOCOL_T1;
+    }
+    else {
+      throw invalid_argument("unknown protocol '" + protocol + "'");
+    }
+  }
+  return mask;
+}
+
+shared_ptr<CardTable> CardTable::load(istream &in) {
+  auto definition = make_shared<CardTable>();
+  definition->protocols = SCARD_PROTOCOL_T0;
+
+  string line;
+  unsigned int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if ((start == string::npos) || (line[start] == '#')) {
+      continue;
+    }
+    line = line.substr(start);
+
+    try {
+      if (line.compare(0, 4, "ATR ") == 0) {
+        definition->atr = ResponseTable::parseHex(line.substr(4));
+        if (definition->atr.empty() || (definition->atr.size() > MAX_ATR_SIZE)) {
+          throw invalid_argument("invalid ATR length");
+        }
+      }
+      else if (line.compare(0, 9, "PROTOCOL ") == 0) {
+        definition->protocols = parseProtocols(line.substr(9));
+      }
+      else if (line.compare(0, 5, "COST ") == 0) {
+        definition->costs.push_back(parseCost(line.substr(5)));
+      }
+      else {
+        definition->responses.addLine(line);
+      }
+    }
+    catch (invalid_argument &e) {
+      throw invalid_argument("line " + to_string(lineNumber) + ": " + e.what());
+    }
+  }
+
+  if (definition->atr.empty()) {
+    throw invalid_argument("missing ATR");
+  }
+  if (definition->protocols == 0) {
+    throw invalid_argument("missing PROTOCOL");
+  }
+
+  definition->responses.compile();
+  return definition;
+}
+
+shared_ptr<CardTable> CardTable::loadFile(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    throw runtime_error("can't open '" + path + "'");
+  }
+  return load(in);
+}
@@ -0,0 +1,127 @@
+/**
+ * Implementation of the RSA private key
+ */
+#include <stdexcept>
+#include "rsa_key.h"
+
+using namespace std;
+
+/**
+ * Number without its leading zero bytes
+ */
+static size_t significantStart(const vector<unsigned char> &number) {
+  size_t start = 0;
+  while ((start < number.size()) && (number[start] == 0)) {
+    start++;
+  }
+  return start;
+}
+
+/**
+ * Component of the key which must be smaller than the modulus
+ */
+static void component(uint64_t *r, const Montgomery &modulus, const vector<unsigned char> &number, const char *name) {
+  size_t start = significantStart(number);
+  if (number.size() - start > modulus.limbs() * 8) {
+    throw invalid_argument(string("invalid RSA ") + name);
+  }
+  Montgomery::fromBytes(r, modulus.limbs(), number.data() + start, number.size() - start);
+  if (Montgomery::compare(r, modulus.modulus(), modulus.limbs()) >= 0) {
+    throw invalid_argument(string("invalid RSA ") + name);
+  }
+}
+
+RsaPrivateKey::RsaPrivateKey(const vector<unsigned char> &modulus, const vector<unsigned char> &publicExponent,
+                             const vector<unsigned char> &p, const vector<unsigned char> &q,
+                             const vector<unsigned char> &dp, const vector<unsigned char> &dq,
+                             const vector<unsigned char> &qInverse) :
+  modulusLg(0), modulusBits(0), n(), e(), nWords(), p(p), q(q), dp(), dq(), qInverse() {
+  size_t limbs = this->p.limbs();
+  if (this->q.limbs() != limbs) {
+    throw invalid_argument("the RSA primes must have the same size");
+  }
+
+  size_t start = significantStart(modulus);
+  modulusLg = modulus.size() - start;
+  if ((modulusLg == 0) || (modulusLg > 2 * limbs * 8)) {
+    throw invalid_argument("invalid RSA modulus");
+  }
+  modulusBits = modulusLg * 8;
+  for (unsigned char first = modulus[start]; (first & 0x80) == 0; first <<= 1) {
+    modulusBits--;
+  }
+  n.assign(modulus.begin() + start, modulus.end());
+  Montgomery::fromBytes(nWords, 2 * limbs, n.data(), modulusLg);
+  uint64_t product[2 * Montgomery::MAX_LIMBS];
+  Montgomery::multiplyWide(product, this->p.modulus(), limbs, this->q.modulus(), limbs);
+  if (Montgomery::compare(nWords, product, 2 * limbs) != 0) {
+    throw invalid_argument("the RSA modulus isn't the product of the primes");
+  }
+
+  component(this->dp, this->p, dp, "exponent dP");
+  component(this->dq, this->q, dq, "exponent dQ");
+  component(this->qInverse, this->p, qInverse, "coefficient");
+
+  // qInv * q = 1 mod p
+  uint64_t check[Montgomery::MAX_LIMBS];
+  const uint64_t one[Montgomery::MAX_LIMBS] = { 1 };
+  this->p.reduce(check, this->q.modulus(), limbs);
+  this->p.multiplyModular(check, check, this->qInverse);
+  if (Montgomery::compare(check, one, limbs) != 0) {
+    throw invalid_argument("invalid RSA coefficient");
+  }
+
+  // (2^dP)^e = 2 mod p and (2^dQ)^e = 2 mod q
+  start = significantStart(publicExponent);
+  if ((publicExponent.size() == start) || (publicExponent.size() - start > limbs * 8)) {
+    throw invalid_argument("invalid RSA public exponent");
+  }
+  e.assign(publicExponent.begin() + start, publicExponent.end());
+  uint64_t exponent[Montgomery::MAX_LIMBS];
+  Montgomery::fromBytes(exponent, limbs, e.data(), e.size());
+  const uint64_t two[Montgomery::MAX_LIMBS] = { 2 };
+  this->p.exponentiate(check, two, this->dp, limbs);
+  this->p.exponentiate(check, check, exponent, limbs);
+  if (Montgomery::compare(check, two, limbs) != 0) {
+    throw invalid_argument("the RSA exponent dP doesn't match the public exponent");
+  }
+  this->q.exponentiate(check, two, this->dq, limbs);
+  this->q.exponentiate(check, check, exponent, limbs);
+  if (Montgomery::compare(check, two, limbs) != 0) {
+    throw invalid_argument("the RSA exponent dQ doesn't match the public exponent");
+  }
+}
+
+bool RsaPrivateKey::privateOperation(const unsigned char *in, unsigned char *out) const {
+  size_t limbs = p.limbs();
+  uint64_t c[2 * Montgomery::MAX_LIMBS];
+  Montgomery::fromBytes(c, 2 * limbs, in, modulusLg);
+  if (Montgomery::compare(c, nWords, 2 * limbs) >= 0) {
+    return false;
+  }
+
+  uint64_t m1[Montgomery::MAX_LIMBS];
+  uint64_t m2[Montgomery::MAX_LIMBS];
+  uint64_t h[Montgomery::MAX_LIMBS];
+  p.reduce(m1, c, 2 * limbs);
+  p.exponentiate(m1, m1, dp, limbs);
+  q.reduce(m2, c, 2 * limbs);
+  q.exponentiate(m2, m2, dq, limbs);
+
+  // Garner: m = m2 + q * (qInv * (m1 - m2) mod p)
+  p.reduce(h, m2, limbs);
+  p.subtract(h, m1, h);
+  p.multiplyModular(h, h, qInverse);
+  uint64_t m[2 * Montgomery::MAX_LIMBS];
+  Montgomery::multiplyWide(m, h, limbs, q.modulus(), limbs);
+  uint64_t carry = 0;
+  for (size_t i = 0; i < 2 * limbs; i++) {
+    uint64_t word = (i < limbs) ? m2[i] : 0;
+    uint64_t sum = m[i] + word + carry;
+    carry = ((sum < m[i]) || ((carry != 0) && (sum == m[i]))) ? 1 : 0;
+    m[i] = sum;
+  }
+
+  Montgomery::toBytes(out, modulusLg, m, 2 * limbs);
+  return true;
+}
@@ -0,0 +1,265 @@
+/**
+ * Implementation of the card side of SCP03
+ */
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "scp03_channel.h"
+
+using namespace std;
+
+#define CLA_SECURE_MESSAGING     0x04
+
+#define SW_SUCCESS               0x9000
+#define SW_AUTHENTICATION_FAILED 0x6300
+#define SW_WRONG_LENGTH          0x6700
+#define SW_SECURITY_STATUS_NOT_SATISFIED 0x6982
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+#define SW_WRONG_P1P2            0x6A86
+#define SW_REFERENCE_NOT_FOUND   0x6A88
+
+// Derivation constants of the KDF
+#define DERIVE_CARD_CRYPTOGRAM   0x00
+#define DERIVE_HOST_CRYPTOGRAM   0x01
+#define DERIVE_CARD_CHALLENGE    0x02
+#define DERIVE_S_ENC             0x04
+#define DERIVE_S_MAC             0x06
+#define DERIVE_S_RMAC            0x07
+
+#define SCP03                    0x03
+#define SCP03_I_PARAMETER        0x70   // pseudo-random card challenge, R-MAC and R-ENCRYPTION
+#define HALF_BLOCK               8      // length of the challenges, of the cryptograms and of the MACs
+
+const unsigned char Scp03Channel::C_MAC;
+const unsigned char Scp03Channel::C_DECRYPTION;
+const unsigned char Scp03Channel::R_MAC;
+const unsigned char Scp03Channel::R_ENCRYPTION;
+
+Scp03Keys::Scp03Keys(unsigned char version, const vector<unsigned char> &enc, const vector<unsigned char> &mac) :
+  version(version),
+  keyLength(enc.size()),
+  enc(enc.data(), enc.size()),
+  mac(mac.data(), mac.size()) {
+  if (mac.size() != enc.size()) {
+    throw invalid_argument("K-ENC and K-MAC must have the same length");
+  }
+}
+
+/**
+ * SCP03 key derivation, NIST SP 800-108 in counter mode with AES-CMAC: the label is 11 zero bytes and the derivation
+ * constant, followed by a separator, L in bits, the counter and the context
+ */
+static void derive(const Aes &key, unsigned char constant, const unsigned char *context, size_t context_lg,
+                   size_t length, unsigned char *out) {
+  unsigned char prefix[Aes::BLOCK_SIZE] = { 0 };
+  prefix[11] = constant;
+  prefix[13] = static_cast<unsigned char>((length * 8) >> 8);
+  prefix[14] = static_cast<unsigned char>(length * 8);
+  unsigned char block[Aes::BLOCK_SIZE];
+  for (size_t produced = 0; produced < length; produced += Aes::BLOCK_SIZE) {
+    prefix[15]++;
+    key.cmac(prefix, sizeof(prefix), context, context_lg, block);
+    memcpy(out + produced, block, min(Aes::BLOCK_SIZE, length - produced));
+  }
+}
+
+/**
+ * Constant time comparison of the cryptograms and of the MACs
+ */
+static bool equalBytes(const unsigned char *a, const unsigned char *b, size_t lg) {
+  unsigned char difference = 0;
+  for (size_t i = 0; i < lg; i++) {
+    difference |= a[i] ^ b[i];
+  }
+  return difference == 0;
+}
+
+Scp03Channel::Scp03Channel() :
+  state(State::CLOSED),
+  context(),
+  chaining(),
+  counter(),
+  securityLevel(0) {
+}
+
+uint16_t Scp03Channel::initializeUpdate(const Scp03Keys &keys, const vector<unsigned char> &aid,
+                                        uint32_t &sequenceCounter, const ApduView &apdu, ApduResponse &response) {
+  close();
+  if (apdu.p2 != 0x00) {
+    return SW_WRONG_P1P2;
+  }
+  if ((apdu.p1 != 0x00) && (apdu.p1 != keys.version)) {
+    return SW_REFERENCE_NOT_FOUND;
+  }
+  if (apdu.lc != HALF_BLOCK) {
+    return SW_WRONG_LENGTH;
+  }
+
+  // The card challenge is derived from the sequence counter of the sessions and from the AID
+  sequenceCounter = (sequenceCounter + 1) & 0xFFFFFF;
+  unsigned char challengeContext[3 + 16];
+  challengeContext[0] = static_cast<unsigned char>(sequenceCounter >> 16);
+  challengeContext[1] = static_cast<unsigned char>(sequenceCounter >> 8);
+  challengeContext[2] = static_cast<unsigned char>(sequenceCounter);
+  size_t aid_lg = min(aid.size(), sizeof(challengeContext) - 3);
+  memcpy(challengeContext + 3, aid.data(), aid_lg);
+  memcpy(context, apdu.data, HALF_BLOCK);
+  derive(keys.enc, DERIVE_CARD_CHALLENGE, challengeContext, 3 + aid_lg, HALF_BLOCK, context + HALF_BLOCK);
+
+  unsigned char sessionKey[32];
+  derive(keys.enc, DERIVE_S_ENC, context, sizeof(context), keys.keyLength, sessionKey);
+  sessionEnc = make_unique<Aes>(sessionKey, keys.keyLength);
+  derive(keys.mac, DERIVE_S_MAC, context, sizeof(context), keys.keyLength, sessionKey);
+  sessionMac = make_unique<Aes>(sessionKey, keys.keyLength);
+  derive(keys.mac, DERIVE_S_RMAC, context, sizeof(context), keys.keyLength, sessionKey);
+  sessionRmac = make_unique<Aes>(sessionKey, keys.keyLength);
+
+  // Key diversification data, key information, card challenge, card cryptogram, sequence counter
+  unsigned char data[10 + 3 + HALF_BLOCK + HALF_BLOCK + 3] = { 0 };
+  data[10] = keys.version;
+  data[11] = SCP03;
+  data[12] = SCP03_I_PARAMETER;
+  memcpy(data + 13, context + HALF_BLOCK, HALF_BLOCK);
+  derive(*sessionMac, DERIVE_CARD_CRYPTOGRAM, context, sizeof(context), HALF_BLOCK, data + 13 + HALF_BLOCK);
+  memcpy(data + 13 + 2 * HALF_BLOCK, challengeContext, 3);
+  response.append(data, sizeof(data));
+
+  state = State::INITIALIZED;
+  return SW_SUCCESS;
+}
+
+uint16_t Scp03Channel::externalAuthenticate(const ApduView &apdu) {
+  if (state != State::INITIALIZED) {
+    close();
+    return SW_CONDITIONS_NOT_SATISFIED;
+  }
+  if (((apdu.cla & CLA_SECURE_MESSAGING) == 0) || (apdu.lc != 2 * HALF_BLOCK) || !verifyMac(apdu)) {
+    close();
+    return SW_SECURITY_STATUS_NOT_SATISFIED;
+  }
+  unsigned char hostCryptogram[HALF_BLOCK];
+  derive(*sessionMac, DERIVE_HOST_CRYPTOGRAM, context, sizeof(context), HALF_BLOCK, hostCryptogram);
+  if (!equalBytes(hostCryptogram, apdu.data, HALF_BLOCK)) {
+    close();
+    return SW_AUTHENTICATION_FAILED;
+  }
+  // C-MAC is mandatory, C-DECRYPTION and R-MAC need it, R-ENCRYPTION needs them
+  unsigned char level = apdu.p1;
+  if (((level & ~(C_MAC | C_DECRYPTION | R_MAC | R_ENCRYPTION)) != 0) || ((level & C_MAC) == 0) ||
+      (((level & R_ENCRYPTION) != 0) && (((level & R_MAC) == 0) || ((level & C_DECRYPTION) == 0)))) {
+    close();
+    return SW_WRONG_P1P2;
+  }
+
+  securityLevel = level;
+  memset(counter, 0, sizeof(counter));
+  state = State::OPEN;
+  return SW_SUCCESS;
+}
+
+bool Scp03Channel::verifyMac(const ApduView &apdu) {
+  // The MAC covers the header and the data with Lc including the MAC, which are the raw bytes before the MAC
+  unsigned char mac[Aes::BLOCK_SIZE];
+  const unsigned char *received = apdu.data + apdu.lc - HALF_BLOCK;
+  sessionMac->cmac(chaining, sizeof(chaining), apdu.raw, static_cast<size_t>(received - apdu.raw), mac);
+  if (!equalBytes(mac, received, HALF_BLOCK)) {
+    return false;
+  }
+  memcpy(chaining, mac, sizeof(chaining));
+  return true;
+}
+
+void Scp03Channel::initialVector(bool response, unsigned char *iv) const {
+  memcpy(iv, counter, Aes::BLOCK_SIZE);
+  if (response) {
+    iv[0] = 0x80;
+  }
+  sessionEnc->encrypt(iv, iv);
+}
+
+uint16_t Scp03Channel::unwrap(const ApduView &apdu, ApduView &plain) {
+  if ((state != State::OPEN) || ((apdu.cla & CLA_SECURE_MESSAGING) == 0) || (apdu.lc < HALF_BLOCK) ||
+      !verifyMac(apdu)) {
+    close();
+    return SW_SECURITY_STATUS_NOT_SATISFIED;
+  }
+  plain = apdu;
+  plain.cla = static_cast<unsigned char>(apdu.cla & ~CLA_SECURE_MESSAGING);
+  plain.lc = apdu.lc - HALF_BLOCK;
+  if ((securityLevel & C_DECRYPTION) == 0) {
+    return SW_SUCCESS;
+  }
+
+  // The counter is incremented for every command, with or without data
+  for (size_t i = sizeof(counter); (i > 0) && (++counter[i - 1] == 0); i--) {
+  }
+  if (plain.lc == 0) {
+    return SW_SUCCESS;
+  }
+  if (plain.lc % Aes::BLOCK_SIZE != 0) {
+    close();
+    return SW_SECURITY_STATUS_NOT_SATISFIED;
+  }
+  if (plainData.size() < plain.lc) {
+    plainData.resize(plain.lc);
+  }
+  unsigned char iv[Aes::BLOCK_SIZE];
+  initialVector(false, iv);
+  sessionEnc->decryptCbc(iv, apdu.data, plainData.data(), plain.lc / Aes::BLOCK_SIZE);
+
+  // Padding 80 00 ... 00
+  size_t length = plain.lc;
+  while ((length > 0) && (plainData[length - 1] == 0x00)) {
+    length--;
+  }
+  if ((length == 0) || (plainData[length - 1] != 0x80) || (plain.lc - length >= Aes::BLOCK_SIZE)) {
+    close();
+    return SW_SECURITY_STATUS_NOT_SATISFIED;
+  }
+  plain.data = plainData.data();
+  plain.lc = length - 1;
+  return SW_SUCCESS;
+}
+
+void Scp03Channel::wrap(ApduResponse &response) {
+  if ((state != State::OPEN) || ((securityLevel & R_MAC) == 0) || (response.length() < 2)) {
+    return;
+  }
+  const unsigned char *data = response.data();
+  size_t data_lg = response.length() - 2;
+  size_t encrypted_lg = data_lg;
+  if (((securityLevel & R_ENCRYPTION) != 0) && (data_lg > 0)) {
+    encrypted_lg = (data_lg / Aes::BLOCK_SIZE + 1) * Aes::BLOCK_SIZE;
+  }
+  if (wrapped.size() < encrypted_lg + HALF_BLOCK + 2) {
+    wrapped.resize(encrypted_lg + HALF_BLOCK + 2);
+  }
+
+  unsigned char *out = wrapped.data();
+  memcpy(out, data, data_lg);
+  if (encrypted_lg != data_lg) {
+    out[data_lg] = 0x80;
+    memset(out + data_lg + 1, 0, encrypted_lg - data_lg - 1);
+    unsigned char iv[Aes::BLOCK_SIZE];
+    initialVector(true, iv);
+    sessionEnc->encryptCbc(iv, out, out, encrypted_lg / Aes::BLOCK_SIZE);
+  }
+
+  // The R-MAC covers the data and the status word, it is inserted before the status word
+  unsigned char sw1 = data[data_lg];
+  unsigned char sw2 = data[data_lg + 1];
+  out[encrypted_lg] = sw1;
+  out[encrypted_lg + 1] = sw2;
+  unsigned char mac[Aes::BLOCK_SIZE];
+  sessionRmac->cmac(chaining, sizeof(chaining), out, encrypted_lg + 2, mac);
+  memcpy(out + encrypted_lg, mac, HALF_BLOCK);
+  out[encrypted_lg + HALF_BLOCK] = sw1;
+  out[encrypted_lg + HALF_BLOCK + 1] = sw2;
+  response.reference(out, encrypted_lg + HALF_BLOCK + 2);
+}
+
+void Scp03Channel::close() {
+  state = State::CLOSED;
+  securityLevel = 0;
+  memset(chaining, 0, sizeof(chaining));
+}
@@ -0,0 +1,396 @@
+/**
+ * Implementation of the smartcard simulator base class and the factory of the supported smartcards
+ */
+#include <algorithm>
+#include <unordered_map>
+#include <mutex>
+#include "smartcard.h"
+#include "table_smartcard.h"
+#include "file_system_smartcard.h"
+#include "piv_smartcard.h"
+#include "emv_smartcard.h"
+#include "global_platform_smartcard.h"
+#include "multi_application_smartcard.h"
+#include "replay_smartcard.h"
+#include "card_profiles.h"
+#include "usdt_probes.h"
+
+using namespace std;
+
+#define SW_SUCCESS          0x9000
+#define SW_WRONG_LENGTH     0x6700
+#define SW_WRONG_LE         0x6C00
+#define SW_BYTES_REMAINING  0x6100
+#define SW_CHANNEL_NOT_SUPPORTED 0x6881
+#define SW_CONDITIONS_NOT_SATISFIED 0x6985
+#define SW_NO_MORE_CHANNELS 0x6A81
+#define SW_WRONG_P1P2       0x6A86
+#define INS_GET_RESPONSE    0xC0
+#define INS_MANAGE_CHANNEL  0x70
+
+#define CLA_PROPRIETARY     0x80
+#define CLA_FURTHER         0x40   // further interindustry class, channels 4 to 19
+#define CLA_FURTHER_SM      0x20
+#define CLA_CHAINING        0x10
+#define CLA_SM_PROPRIETARY  0x04
+#define CLA_SM              0x08
+#define MANAGE_CHANNEL_CLOSE 0x80
+
+// Largest response: 65536 data bytes and the status word
+#define CHAIN_BUFFER_SIZE   (65536 + 2)
+
+ApduView::ApduView(const unsigned char *command, size_t command_lg) :
+  raw(command), rawLg(command_lg), cla(0), ins(0), p1(0), p2(0), channel(0), data(nullptr), lc(0), ne(0),
+  hasLe(false), extended(false), valid(false) {
+
+  if (command_lg < 4) {
+    return;
+  }
+  cla = command[0];
+  if ((cla & CLA_FURTHER) == 0) {
+    channel = cla & 0x03;
+    cla &= ~0x03;
+  }
+  else {
+    // The proprietary classes follow the coding of GlobalPlatform, where the secure messaging bit is b3
+    channel = static_cast<unsigned char>(4 + (cla & 0x0F));
+    unsigned char sm = ((cla & CLA_PROPRIETARY) != 0) ? CLA_SM_PROPRIETARY : CLA_SM;
+    cla = static_cast<unsigned char>((cla & (CLA_PROPRIETARY | CLA_CHAINING)) |
+                                     (((cla & CLA_FURTHER_SM) != 0) ? sm : 0));
+  }
+  ins = command[1];
+  p1 = command[2];
+  p2 = command[3];
+
+  // Case 1
+  if (command_lg == 4) {
+    valid = true;
+    return;
+  }
+
+  // Case 2 short
+  if (command_lg == 5) {
+    hasLe = true;
+    ne = (command[4] == 0) ? 256 : command[4];
+    valid = true;
+    return;
+  }
+
+  // Case 3 and 4 short
+  if (command[4] != 0) {
+    lc = command[4];
+    data = command + 5;
+    if (command_lg == 5 + lc) {
+      valid = true;
+    }
+    else if (command_lg == 6 + lc) {
+      hasLe = true;
+      ne = (command[5 + lc] == 0) ? 256 : command[5 + lc];
+      valid = true;
+    }
+    return;
+  }
+
+  // Extended length
+  if (command_lg < 7) {
+    return;
+  }
+  extended = true;
+  size_t field = (static_cast<size_t>(command[5]) << 8) | command[6];
+  if (command_lg == 7) {
+    hasLe = true;
+    ne = (field == 0) ? 65536 : field;
+    valid = true;
+    return;
+  }
+  lc = field;
+  data = command + 7;
+  if ((lc != 0) && (command_lg == 7 + lc)) {
+    valid = true;
+  }
+  else if ((lc != 0) && (command_lg == 9 + lc)) {
+    size_t le = (static_cast<size_t>(command[7 + lc]) << 8) | command[8 + lc];
+    hasLe = true;
+    ne = (le == 0) ? 65536 : le;
+    valid = true;
+  }
+}
+
+/**
+ * Scratch buffer of the cards followed by the reply of the response chaining. It is allocated once per thread for the
+ * largest response and shared by all the cards, so a card doesn't need a buffer of its own.
+ */
+static unsigned char *threadScratch() {
+  static thread_local vector<unsigned char> scratch(2 * CHAIN_BUFFER_SIZE);
+  return scratch.data();
+}
+
+void SmartCard::replyPending(SmartCardContext &context, size_t count, ApduResponse &response) {
+  unsigned char *reply = threadScratch() + CHAIN_BUFFER_SIZE;
+
+  count = min(count, context.pendingLg);
+  memcpy(reply, context.pending.get() + context.pendingOffset, count);
+  context.pendingOffset += count;
+  context.pendingLg -= count;
+
+  uint16_t sw = context.pendingSW;
+  if (context.pendingLg > 0) {
+    sw = static_cast<uint16_t>(SW_BYTES_REMAINING | (min(context.pendingLg, static_cast<size_t>(256)) & 0xFF));
+  }
+  reply[count] = static_cast<unsigned char>(sw >> 8);
+  reply[count + 1] = static_cast<unsigned char>(sw);
+  response.reference(reply, count + 2);
+}
+
+const unsigned int SmartCard::MAX_CHANNELS;
+const size_t SmartCard::MAX_PENDING_SIZE;
+
+void SmartCard::manageChannel(const ApduView &apdu, ApduResponse &response) {
+  if ((apdu.lc != 0) || ((apdu.p1 & ~MANAGE_CHANNEL_CLOSE) != 0)) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+  unsigned int channel = apdu.p2;
+  if (apdu.p1 == MANAGE_CHANNEL_CLOSE) {
+    if (channel == 0) {
+      channel = apdu.channel;
+    }
+    if ((channel == 0) || !isChannelOpen(channel)) {
+      response.status(SW_WRONG_P1P2);
+      return;
+    }
+    openChannels &= ~(1U << channel);
+    resetChannel(channel);
+    response.status(SW_SUCCESS);
+    return;
+  }
+
+  // The card assigns the lowest closed channel, which is returned in the response data
+  if (channel == 0) {
+    uint32_t closed = ~openChannels & ((1U << MAX_CHANNELS) - 1);
+    if (closed == 0) {
+      response.status(SW_NO_MORE_CHANNELS);
+      return;
+    }
+    while (((closed >> channel) & 1) == 0) {
+      channel++;
+    }
+  }
+  else if (channel >= MAX_CHANNELS) {
+    response.status(SW_WRONG_P1P2);
+    return;
+  }
+  else if (isChannelOpen(channel)) {
+    response.status(SW_CONDITIONS_NOT_SATISFIED);
+    return;
+  }
+  openChannels |= 1U << channel;
+  resetChannel(channel);
+  if (apdu.p2 == 0) {
+    const unsigned char number = static_cast<unsigned char>(channel);
+    response.append(&number, 1);
+  }
+  response.status(SW_SUCCESS);
+}
+
+DWORD SmartCard::executeProbed(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  USDT_CARD_EXECUTE_ENTRY(handle, apdu.ins, apdu.lc);
+  DWORD ret = execute(handle, apdu, response);
+  USDT_CARD_EXECUTE_RETURN(handle, apdu.ins, response.length(), ret);
+  return ret;
+}
+
+DWORD SmartCard::transmit(SCARDHANDLE handle, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response) {
+  lock_guard<mutex> lock(cardMutex);
+  auto context_it = scardHandles.find(handle);
+  if (context_it == scardHandles.end()) {
+    return static_cast<DWORD>(SCARD_E_INVALID_HANDLE);
+  }
+  SmartCardContext &context = *context_it->second;
+  processingTime = chrono::nanoseconds(0);
+
+  ApduView apdu(in_apdu, in_apdu_lg);
+  if (!apdu.valid || (apdu.extended && (context.protocol == SCARD_PROTOCOL_T0))) {
+    context.pendingLg = 0;
+    response.status(SW_WRONG_LENGTH);
+    return SCARD_S_SUCCESS;
+  }
+
+  if (!isChannelOpen(apdu.channel)) {
+    context.pendingLg = 0;
+    response.status(SW_CHANNEL_NOT_SUPPORTED);
+    return SCARD_S_SUCCESS;
+  }
+
+  if ((apdu.ins == INS_GET_RESPONSE) && (context.pendingLg > 0)) {
+    replyPending(context, apdu.hasLe ? apdu.ne : 256, response);
+    return SCARD_S_SUCCESS;
+  }
+  context.pendingLg = 0;
+
+  ApduResponse cardResponse(threadScratch(), CHAIN_BUFFER_SIZE);
+  if ((apdu.ins == INS_MANAGE_CHANNEL) && ((apdu.cla & CLA_PROPRIETARY) == 0)) {
+    manageChannel(apdu, cardResponse);
+    stateChanged();
+  }
+  else if (!isCacheable(apdu)) {
+    DWORD ret = executeProbed(handle, apdu, cardResponse);
+    stateChanged();
+    if (ret != SCARD_S_SUCCESS) {
+      return ret;
+    }
+  }
+  else {
+    const unsigned char *cached = nullptr;
+    size_t cached_lg = 0;
+    if (responseCache) {
+      cached = responseCache->find(in_apdu, in_apdu_lg, stateEpoch, &cached_lg);
+    }
+    if (cached != nullptr) {
+      // The entry can be replaced by the command of another thread once the card is unlocked
+      cardResponse.append(cached, cached_lg);
+    }
+    else {
+      uint64_t epoch = stateEpoch;
+      DWORD ret = executeProbed(handle, apdu, cardResponse);
+      if (ret != SCARD_S_SUCCESS) {
+        return ret;
+      }
+      if (responseCache && (stateEpoch == epoch) && !cardResponse.overflow()) {
+        responseCache->insert(in_apdu, in_apdu_lg, epoch, cardResponse.data(), cardResponse.length());
+      }
+    }
+  }
+  if (cardResponse.overflow()) {
+    return static_cast<DWORD>(SCARD_E_INSUFFICIENT_BUFFER);
+  }
+
+  size_t data_lg = (cardResponse.length() >= 2) ? cardResponse.length() - 2 : 0;
+  const shared_ptr<const CardCostModel> &costModel = cardTemplate->costs;
+  if (costModel) {
+    jitterState ^= jitterState << 13;
+    jitterState ^= jitterState >> 17;
+    jitterState ^= jitterState << 5;
+    processingTime = costModel->cost(apdu.ins, apdu.lc + data_lg, jitterState);
+  }
+  // T=0 can't return data in the same exchange as the command data (case 4)
+  bool dataAllowed = apdu.hasLe && !((context.protocol == SCARD_PROTOCOL_T0) && (apdu.lc > 0));
+
+  if ((data_lg == 0) || (dataAllowed && (data_lg <= apdu.ne))) {
+    response.reference(cardResponse.data(), cardResponse.length());
+    return SCARD_S_SUCCESS;
+  }
+
+  if (dataAllowed && (apdu.lc == 0) && !apdu.extended && (data_lg <= 256)) {
+    response.status(static_cast<uint16_t>(SW_WRONG_LE | (data_lg & 0xFF)));
+    return SCARD_S_SUCCESS;
+  }
+
+  // Keep the data for GET RESPONSE
+  memcpy(context.pending.get(), cardResponse.data(), data_lg);
+  context.pendingOffset = 0;
+  context.pendingLg = data_lg;
+  context.pendingSW = static_cast<uint16_t>((cardResponse.data()[data_lg] << 8) | cardResponse.data()[data_lg + 1]);
+  replyPending(context, dataAllowed ? apdu.ne : 0, response);
+
+  return SCARD_S_SUCCESS;
+}
+
+/**
+ * Smartcards registered at runtime
+ */
+static mutex g_registry_mutex;
+
+static unordered_map<string, shared_ptr<const CardTemplate>> &registry() {
+  static unordered_map<string, shared_ptr<const CardTemplate>> templates;
+  return templates;
+}
+
+/**
+ * Templates of the built-in profiles, in the order of g_builtin_profiles. They are created once, at first use.
+ */
+static const vector<shared_ptr<const CardTemplate>> &builtinTemplates() {
+  static const vector<shared_ptr<const CardTemplate>> templates = []() {
+    vector<shared_ptr<const CardTemplate>> profiles;
+    for (const CardProfile &profile : g_builtin_profiles) {
+      profiles.push_back(make_shared<TableCardTemplate>(profile));
+    }
+    return profiles;
+  }();
+  return templates;
+}
+
+shared_ptr<const CardTemplate> SmartCard::template_of(const string &impl) {
+  // Built-in profiles, compiled in the library
+  const CardProfile *profile = findCardProfile(g_builtin_profiles, impl.c_str());
+  if (profile != nullptr) {
+    return builtinTemplates()[static_cast<size_t>(profile - g_builtin_profiles)];
+  }
+
+  lock_guard<mutex> lock_registry(g_registry_mutex);
+  auto registered = registry().find(impl);
+  if (registered != registry().end()) {
+    return registered->second;
+  }
+
+  return nullptr;
+}
+
+unique_ptr<SmartCard> SmartCard::instance_of(const string &impl) {
+  shared_ptr<const CardTemplate> cardTemplate = template_of(impl);
+  if (cardTemplate == nullptr) {
+    return nullptr;
+  }
+  return cardTemplate->instantiate();
+}
+
+void SmartCard::register_implementation(const string &card, shared_ptr<const CardTemplate> cardTemplate) {
+  lock_guard<mutex> lock_registry(g_registry_mutex);
+  registry()[card] = std::move(cardTemplate);
+}
+
+shared_ptr<const CardTemplate> SmartCard::load_template(const string &type, const string &source) {
+  if (type == "table") {
+    return make_shared<TableCardTemplate>(CardTable::loadFile(source));
+  }
+  if (type == "fs") {
+    return make_shared<FileSystemCardTemplate>(FileSystemImage::open(source));
+  }
+  if (type == "piv") {
+    return PivCardTemplate::loadFile(source);
+  }
+  if (type == "emv") {
+    return EmvCardTemplate::loadFile(source);
+  }
+  if (type == "gp") {
+    return GlobalPlatformCardTemplate::loadFile(source);
+  }
+  if (type == "multi") {
+    return MultiApplicationCardTemplate::loadFile(source);
+  }
+  if (type == "replay") {
+    return ReplayCardTemplate::loadFile(source);
+  }
+  return nullptr;
+}
+
+DWORD SmartCard::register_implementation(const string &card, const string &type, const string &source) {
+  if (card.empty() || (findCardProfile(g_builtin_profiles, card.c_str()) != nullptr)) {
+    return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
+  }
+
+  try {
+    shared_ptr<const CardTemplate> cardTemplate = load_template(type, source);
+    if (cardTemplate == nullptr) {
+      return static_cast<DWORD>(SCARD_E_CARD_UNSUPPORTED);
+    }
+    register_implementation(card, std::move(cardTemplate));
+    return SCARD_S_SUCCESS;
+  }
+  catch (invalid_argument &e) {
+    return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
+  }
+  catch (runtime_error &e) {
+    return static_cast<DWORD>(SCARD_E_FILE_NOT_FOUND);
+  }
+}
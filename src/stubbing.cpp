@@ -1,13 +1,24 @@
 //
 // Created by david on 6/10/17.
 //
+#include <atomic>
 #include <map>
 #include <cstring>
 #include <memory>
+#include <string>
 #include "stubbing.h"
 
 using namespace std;
 
+/**
+ * Key of a lookup by the calling thread. The key is reused by the lookups, which don't allocate once it has grown to
+ * the longest name.
+ */
+static const string &lookupKey(string &key, const char *name) {
+  key.assign(name);
+  return key;
+}
+
 /**
  * The stubbing interface to be implemented for different ways of stubbing
  */
@@ -138,7 +149,8 @@ public:
   }
 
   long get_return_code_for(const char *function, long default_ret) override {
-    map<string, long>::const_iterator return_codes_it = return_codes.find(function);
+    static thread_local string key;
+    map<string, long>::const_iterator return_codes_it = return_codes.find(lookupKey(key, function));
     if ( return_codes_it!=return_codes.end() ) {
       return return_codes_it->second;
     }
@@ -159,10 +171,13 @@ public:
   }
 
   long get_out_parameter_for(const char *function, const char *parameter, const unsigned char **data, unsigned long *data_lg) override {
-    map<string, map<string, MemBuffer*>>::const_iterator out_parameters_it = out_parameters.find(function);
+    static thread_local string functionKey;
+    static thread_local string parameterKey;
+    map<string, map<string, MemBuffer*>>::const_iterator out_parameters_it
+      = out_parameters.find(lookupKey(functionKey, function));
     if ( out_parameters_it!=out_parameters.end() ) {
-      map<string, MemBuffer*> params = out_parameters_it->second;
-      auto out_params_it = params.find(parameter);
+      const map<string, MemBuffer*> &params = out_parameters_it->second;
+      auto out_params_it = params.find(lookupKey(parameterKey, parameter));
       if (out_params_it!=params.end()) {
         *data = (*out_params_it).second->getBuffer();
         *data_lg = (*out_params_it).second->getBufferLg();
@@ -224,6 +239,7 @@ unique_ptr<Stubbing> Stubbing::instance_of(string &impl) {
 auto stubbing_impl = string("memory");
 map<string, unique_ptr<Stubbing>> g_modules;
 bool g_active = true;
+atomic<unsigned long long> g_injected_return_codes(0);
 
 #ifdef __cplusplus
 extern "C" {
@@ -248,12 +264,17 @@ void set_return_code_for(const char *module, const char *function, long ret) {
 }
 
 long get_return_code_for(const char *module, const char *function, long default_ret) {
-  try {
-    return g_modules.at(module)->get_return_code_for(function, default_ret);
-  }
-  catch (out_of_range &e) {
+  // Called by every stubbed function: the lookup neither throws nor allocates
+  static thread_local string key;
+  auto module_it = g_modules.find(lookupKey(key, module));
+  if (module_it == g_modules.end()) {
     return default_ret;
   }
+  long ret = module_it->second->get_return_code_for(function, default_ret);
+  if (ret != default_ret) {
+    g_injected_return_codes.fetch_add(1, memory_order_relaxed);
+  }
+  return ret;
 }
 
 void set_out_parameter_for(const char *module, const char *function, const char *parameter, const unsigned char *data, size_t data_lg) {
@@ -267,12 +288,12 @@ void set_out_parameter_for(const char *module, const char *function, const char
 }
 
 long get_out_parameter_for(const char *module, const char *function, const char *parameter, const unsigned char **data, size_t *data_lg) {
-  try {
-    return g_modules.at(module)->get_out_parameter_for(function, parameter, data, data_lg);
-  }
-  catch (out_of_range &e) {
+  static thread_local string key;
+  auto module_it = g_modules.find(lookupKey(key, module));
+  if (module_it == g_modules.end()) {
     return 0;
   }
+  return module_it->second->get_out_parameter_for(function, parameter, data, data_lg);
 }
 
 void clear_return_codes(const char *module) {
@@ -324,6 +345,10 @@ void clear_modules() {
   g_modules.clear();
 }
 
+unsigned long long get_injected_return_codes() {
+  return g_injected_return_codes.load(memory_order_relaxed);
+}
+
 #ifdef __cplusplus
 };
 #endif
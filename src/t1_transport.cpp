@@ -0,0 +1,184 @@
+/**
+ * Implementation of the T=1 block level transport simulation
+ */
+#include <algorithm>
+#include <initializer_list>
+#include "t1_transport.h"
+
+using namespace std;
+
+#define T1_NAD                0x00
+#define T1_PROLOGUE_LG        3
+#define T1_EPILOGUE_LG        1
+
+// PCB coding of ISO 7816-3
+#define PCB_R_BLOCK           0x80
+#define PCB_BLOCK_TYPE        0xC0
+#define PCB_I_SEQUENCE        0x40
+#define PCB_I_MORE            0x20
+#define PCB_R_SEQUENCE        0x10
+#define PCB_S_IFS_REQUEST     0xC1
+#define PCB_S_IFS_RESPONSE    0xE1
+#define PCB_S_WTX_REQUEST     0xC3
+#define PCB_S_WTX_RESPONSE    0xE3
+#define MAX_WTX_MULTIPLIER    255
+
+// Largest command: extended case 4 with 65535 data bytes, largest response: 65536 data bytes and the status word
+#define MAX_COMMAND_LG        (65535 + 9)
+#define MAX_RESPONSE_LG       (65536 + 2)
+
+constexpr chrono::milliseconds T1Transport::DEFAULT_BWT;
+
+static bool isIBlock(unsigned char pcb) {
+  return (pcb & 0x80) == 0;
+}
+
+static bool isRBlock(unsigned char pcb) {
+  return (pcb & PCB_BLOCK_TYPE) == PCB_R_BLOCK;
+}
+
+T1Transport::T1Transport(size_t ifsc, size_t ifsd) :
+  ifsc(ifsc), ifsd(ifsd), ifsdNegotiated(false), readerSequence(0), cardSequence(0), blockWaitingTime(DEFAULT_BWT),
+  last(), totals(),
+  wire(T1_PROLOGUE_LG + MAX_IFS + T1_EPILOGUE_LG), command(MAX_COMMAND_LG), cardScratch(MAX_RESPONSE_LG),
+  reply(MAX_RESPONSE_LG) {
+
+  if ((ifsc == 0) || (ifsc > MAX_IFS) || (ifsd == 0) || (ifsd > MAX_IFS)) {
+    throw invalid_argument("IFSC and IFSD must be between 1 and 254");
+  }
+}
+
+void T1Transport::reset() {
+  ifsdNegotiated = false;
+  readerSequence = 0;
+  cardSequence = 0;
+}
+
+size_t T1Transport::encodeBlock(unsigned char pcb, const unsigned char *inf, size_t inf_lg) {
+  wire[0] = T1_NAD;
+  wire[1] = pcb;
+  wire[2] = static_cast<unsigned char>(inf_lg);
+  if (inf_lg > 0) {
+    memcpy(wire.data() + T1_PROLOGUE_LG, inf, inf_lg);
+  }
+
+  unsigned char lrc = 0;
+  for (size_t i = 0; i < T1_PROLOGUE_LG + inf_lg; i++) {
+    lrc ^= wire[i];
+  }
+  wire[T1_PROLOGUE_LG + inf_lg] = lrc;
+
+  return T1_PROLOGUE_LG + inf_lg + T1_EPILOGUE_LG;
+}
+
+void T1Transport::sendBlock(size_t block_lg, bool toCard) {
+  unsigned char pcb = wire[1];
+
+  for (T1BlockCounters *counters : { &last, &totals }) {
+    if (isIBlock(pcb)) {
+      counters->iBlocks++;
+    }
+    else if (isRBlock(pcb)) {
+      counters->rBlocks++;
+    }
+    else {
+      counters->sBlocks++;
+    }
+    if (toCard) {
+      counters->bytesToCard += block_lg;
+    }
+    else {
+      counters->bytesFromCard += block_lg;
+    }
+  }
+}
+
+void T1Transport::negotiateIFSD() {
+  // Reader announces its IFSD, the card confirms with the same value
+  unsigned char size = static_cast<unsigned char>(ifsd);
+  sendBlock(encodeBlock(PCB_S_IFS_REQUEST, &size, 1), true);
+  sendBlock(encodeBlock(PCB_S_IFS_RESPONSE, &size, 1), false);
+  ifsdNegotiated = true;
+}
+
+void T1Transport::extendWaitingTime(chrono::nanoseconds processing) {
+  // The first BWT is granted by the reader, every S(WTX) request extends the next one by BWT * multiplier
+  chrono::nanoseconds remaining = processing - blockWaitingTime;
+  while (remaining.count() > 0) {
+    int64_t blocks = (remaining.count() + blockWaitingTime.count() - 1) / blockWaitingTime.count();
+    unsigned char multiplier = static_cast<unsigned char>(min<int64_t>(blocks, MAX_WTX_MULTIPLIER));
+
+    sendBlock(encodeBlock(PCB_S_WTX_REQUEST, &multiplier, 1), false);
+    sendBlock(encodeBlock(PCB_S_WTX_RESPONSE, &multiplier, 1), true);
+    last.waitingTimeExtensions++;
+    totals.waitingTimeExtensions++;
+    remaining -= blockWaitingTime * multiplier;
+  }
+}
+
+DWORD T1Transport::transceive(SmartCard &card, SCARDHANDLE handle, const unsigned char *in_apdu, size_t in_apdu_lg,
+                              ApduResponse &response) {
+  if (in_apdu_lg > command.size()) {
+    return static_cast<DWORD>(SCARD_E_INVALID_PARAMETER);
+  }
+
+  last = T1BlockCounters();
+  last.apdus = 1;
+  totals.apdus++;
+
+  if (!ifsdNegotiated) {
+    negotiateIFSD();
+  }
+
+  // Command: I-blocks of at most IFSC bytes from the reader, chained blocks acknowledged by the card which
+  // reassembles the command from the information fields
+  size_t offset = 0;
+  bool more = false;
+  do {
+    size_t chunk = min(ifsc, in_apdu_lg - offset);
+    more = (offset + chunk) < in_apdu_lg;
+    unsigned char pcb = static_cast<unsigned char>((readerSequence ? PCB_I_SEQUENCE : 0) | (more ? PCB_I_MORE : 0));
+    sendBlock(encodeBlock(pcb, in_apdu + offset, chunk), true);
+    memcpy(command.data() + offset, wire.data() + T1_PROLOGUE_LG, chunk);
+    offset += chunk;
+    readerSequence ^= 1;
+
+    if (more) {
+      pcb = static_cast<unsigned char>(PCB_R_BLOCK | (readerSequence ? PCB_R_SEQUENCE : 0));
+      sendBlock(encodeBlock(pcb, nullptr, 0), false);
+    }
+  } while (more);
+
+  ApduResponse cardResponse(cardScratch.data(), cardScratch.size());
+  DWORD ret = card.transmit(handle, command.data(), in_apdu_lg, cardResponse);
+  if (ret != SCARD_S_SUCCESS) {
+    return ret;
+  }
+  if (cardResponse.overflow()) {
+    return static_cast<DWORD>(SCARD_E_INSUFFICIENT_BUFFER);
+  }
+  extendWaitingTime(card.getProcessingTime());
+
+  // Response: I-blocks of at most IFSD bytes from the card, chained blocks acknowledged by the reader which
+  // reassembles the response
+  const unsigned char *card_data = cardResponse.data();
+  size_t card_data_lg = cardResponse.length();
+  offset = 0;
+  do {
+    size_t chunk = min(ifsd, card_data_lg - offset);
+    more = (offset + chunk) < card_data_lg;
+    unsigned char pcb = static_cast<unsigned char>((cardSequence ? PCB_I_SEQUENCE : 0) | (more ? PCB_I_MORE : 0));
+    sendBlock(encodeBlock(pcb, card_data + offset, chunk), false);
+    memcpy(reply.data() + offset, wire.data() + T1_PROLOGUE_LG, chunk);
+    offset += chunk;
+    cardSequence ^= 1;
+
+    if (more) {
+      pcb = static_cast<unsigned char>(PCB_R_BLOCK | (cardSequence ? PCB_R_SEQUENCE : 0));
+      sendBlock(encodeBlock(pcb, nullptr, 0), true);
+    }
+  } while (more);
+
+  response.reference(reply.data(), card_data_lg);
+  return SCARD_S_SUCCESS;
+}
@@ -0,0 +1,26 @@
+/**
+ * Implementation of the table driven smartcard
+ */
+#include "table_smartcard.h"
+
+using namespace std;
+
+#define SW_INS_NOT_SUPPORTED     0x6D00
+
+unique_ptr<SmartCard> TableCardTemplate::instantiate() const {
+  return make_unique<TableSmartCard>(static_pointer_cast<const TableCardTemplate>(shared_from_this()));
+}
+
+DWORD TableSmartCard::execute(SCARDHANDLE handle, const ApduView &apdu, ApduResponse &response) {
+  (void)handle;
+  const unsigned char *data = nullptr;
+  size_t data_lg = 0;
+
+  if (responses->match(apdu.raw, apdu.rawLg, &data, &data_lg)) {
+    response.reference(data, data_lg);
+  }
+  else {
+    response.status(SW_INS_NOT_SUPPORTED);
+  }
+  return SCARD_S_SUCCESS;
+}
@@ -12,6 +12,16 @@
 #include "stubbing.h"
 #include "winscard_stub.h"
 #include "missing_stl.h"
+#include "smartcard.h"
+#include "t1_transport.h"
+#include "latency_model.h"
+#include "global_platform_smartcard.h"
+#include "apdu_trace.h"
+#include "pcapng_export.h"
+#include "prometheus_export.h"
+#include "call_stats.h"
+#include "metrics_page.h"
+#include "usdt_probes.h"
 
 #ifndef __FUNCTION_NAME__
   #ifdef WIN32   //WINDOWS
@@ -28,153 +38,21 @@ using namespace std;
 
 class WinsCardEvent {
 public:
-  virtual DWORD getReaderState(SCARD_READERSTATE readerState[], DWORD cReaders) = 0;
-};
-
-/**
- * Smartcard virtual simulator base class. The specific implemenations wlll have to override the execute
- * function
- */
-class SmartCard {
-public:
-  /**
-   * Constructor which will define the behavior of sharing mode and the supported protocols
-   * Must be called by the derived class
-   * @param dwSharingMode
-   * @param dwProtocol
-   */
-  explicit SmartCard(const vector<unsigned  char> &atr, DWORD dwSharingMode = SCARD_SHARE_SHARED, DWORD dwProtocol = SCARD_PROTOCOL_T0) :
-    allowedSharingModes(dwSharingMode),
-    allowedProtocol (dwProtocol),
-    disposition(SCARD_LEAVE_CARD),
-    ATR(atr) {
-  };
-
-  /**
-   * Connect to the smartcard, which will verify the supported sharingMode and protocols. The connect function returns
-   * a handle to the smartcard and the active protocol.
-   *
-   * @param dwShareMode
-   * @param dwPreferredProtocols
-   * @param phCard
-   * @param pdwActiveProtocol
-   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE
-   */
-  DWORD connect(DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol) {
-
-    if (dwShareMode != allowedSharingModes) {
-      return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
-    }
-    if ((dwPreferredProtocols & allowedProtocol) != allowedProtocol) {
-      return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
-    }
-
-    scardHandles[++scardHandleIndex] = make_unique<struct SmartCardContext>(dwShareMode, allowedProtocol, false);
-    *phCard = scardHandleIndex;
-    *pdwActiveProtocol = allowedProtocol;
-
-    return SCARD_S_SUCCESS;
-  };
-
-  /**
-   * Disconnect from the smartcard with extra action to take for the card during the disconnect
-   *
-   * @param handle The handle of the Smartcard to disconnect
-   * @param disposition action to take of the smartcard
-   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_HANDLE
-   */
-  DWORD disconnect(SCARDHANDLE handle, DWORD dwDisposition) {
-    if (scardHandles.erase(handle) == 0) {
-      return static_cast<DWORD>(SCARD_E_INVALID_HANDLE);
-    }
-    disposition = dwDisposition;
-    return SCARD_S_SUCCESS;
-  }
-
   /**
-   * Begin multiple calls to the Smartcard
-   * @param handle The handle to the smartcard
-   * @return SCARD_S_SUCCESS, SCARD_E_SHARING_VIOLATION, SCARD_E_INVALID_HANDLE
+   * @param raised WakeupStats::now() when the event happened
    */
-  DWORD beginTransaction(SCARDHANDLE handle) {
-    try {
-      if (scardHandles.at(handle)->transaction)
-        return SCARD_E_SHARING_VIOLATION;
+  explicit WinsCardEvent(uint64_t raised) : raised(raised) {}
 
-      scardHandles.at(handle)->transaction = true;
-      return SCARD_S_SUCCESS;
-    }
-    catch (out_of_range &oor) {
-      return SCARD_E_INVALID_HANDLE;
-    }
-  }
+  virtual ~WinsCardEvent() = default;
 
-  /**
-   * End multiple calls to the Smartcard
-   * @param handle The handle to the smartcard
-   * @return SCARD_S_SUCCESS, SCARD_E_SHARING_VIOLATION, SCARD_E_INVALID_HANDLE
-   */
-  DWORD endTransaction(SCARDHANDLE handle, DWORD dwDisposition) {
-    try {
-      if (!scardHandles.at(handle)->transaction)
-        return SCARD_E_NOT_TRANSACTED;
-
-      scardHandles.at(handle)->transaction = false;
-      disposition = dwDisposition;
-
-      if (disposition == SCARD_RESET_CARD)
-        return SCARD_W_RESET_CARD;
-
-      return SCARD_S_SUCCESS;
-    }
-    catch (out_of_range &oor) {
-      return SCARD_E_INVALID_HANDLE;
-    }
-  }
-
-  /**
-   * Function to override by the specific implemented Smartcard.
-   *
-   * @param scardhandle handle to the smartcard
-   * @param in_apdu APDU command
-   * @param in_apdu_lg length of the APDU command
-   * @param out_apdu APDU result
-   * @param out_apd_lg length of the APDU result
-   * @return SCARD_S_SUCCESS
-   */
-  virtual DWORD execute(SCARDHANDLE handle, const char *in_apdu, size_t in_apdu_lg, char **out_apdu, size_t *out_apd_lg) = 0;
+  virtual DWORD getReaderState(SCARD_READERSTATE readerState[], DWORD cReaders) = 0;
 
-  DWORD getPreferredProtocol() {
-    return allowedProtocol;
+  uint64_t getRaised() const {
+    return raised;
   }
-  /**
-   * Function to override which returns the ATR pointer
-   */
-  const vector<unsigned char> getATR() {
-    return ATR;
-  };
-
-  /**
-   * Static member function for the factory method to instantiate the supported Smartcards.
-   * @param impl
-   * @return smart pointer to the SmartCard object
-   */
-  static unique_ptr<SmartCard> instance_of(const string &impl);
 
 private:
-
-  struct SmartCardContext {
-    DWORD sharingMode;
-    DWORD protocol;
-    bool  transaction;
-  };
-
-  SCARDHANDLE scardHandleIndex{0};
-  unordered_map<SCARDHANDLE, unique_ptr<SmartCardContext>> scardHandles;
-  DWORD allowedSharingModes;
-  DWORD allowedProtocol;
-  DWORD disposition;
-  vector<unsigned char> ATR;
+  uint64_t raised;
 };
 
 /**
@@ -195,14 +73,19 @@ public:
 
   SmartCardReader &operator=(SmartCardReader &&other) = delete;
 
-  ~SmartCardReader() = default;
+  ~SmartCardReader() {
+    if (smartCard != nullptr) {
+      MetricsPage::cards.fetch_sub(1, memory_order_relaxed);
+    }
+  }
 
   /**
    * Constructor of Smartcard to be called by the derived class
    *
    * @param readerName
    */
-  explicit SmartCardReader(string readerName): name(std::move(readerName)), smartCard(nullptr), events(0), id(0) {
+  explicit SmartCardReader(string readerName):
+    name(std::move(readerName)), smartCard(nullptr), responseCacheCapacity(0), events(0), id(0) {
 
   };
 
@@ -265,7 +148,16 @@ public:
     if (nullptr == smartCard) {
       return static_cast<DWORD>(SCARD_E_CARD_UNSUPPORTED);
     }
+    if (t1) {
+      t1->reset();
+    }
+    if (latency) {
+      latency->setATR(smartCard->getATR());
+    }
+    smartCard->setResponseCache(responseCacheCapacity);
     events++;
+    MetricsPage::cards.fetch_add(1, memory_order_relaxed);
+    MetricsPage::events.fetch_add(1, memory_order_relaxed);
     return SCARD_S_SUCCESS;
   }
 
@@ -281,6 +173,8 @@ public:
     }
     smartCard.reset(nullptr);
     events++;
+    MetricsPage::cards.fetch_sub(1, memory_order_relaxed);
+    MetricsPage::events.fetch_add(1, memory_order_relaxed);
     return SCARD_S_SUCCESS;
   }
 
@@ -356,11 +250,10 @@ public:
    * @param scardhandle handle to the smartcard
    * @param in_apdu APDU command
    * @param in_apdu_lg length of the APDU command
-   * @param out_apdu APDU result
-   * @param out_apd_lg length of the APDU result
+   * @param response APDU result
    * @return SCARD_S_SUCCESS,
    */
-  virtual DWORD execute(SCARDHANDLE scardhandle, const char *in_apdu, size_t in_apdu_lg, char **out_apdu, size_t *out_apd_lg) = 0;
+  virtual DWORD execute(SCARDHANDLE scardhandle, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response) = 0;
 
   /**
    * Function to instantiate a supported reader ("Non Pinpad Reader", "Pinpad Reader")
@@ -377,12 +270,143 @@ public:
   void setId(unsigned int nbr) {
     id = nbr;
     readerId = name + " " + to_string(nbr);
+    stats.setName(readerId);
   }
 
   const string &getReaderIdentifier() {
     return readerId;
   }
 
+  /**
+   * Simulate the T=1 blocks for the handles connected with T=1, an IFSC or IFSD of 0 disables the simulation
+   *
+   * @param ifsc maximum information field size of the card (0-254)
+   * @param ifsd maximum information field size of the reader (0-254)
+   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE
+   */
+  DWORD configureT1(size_t ifsc, size_t ifsd) {
+    if ((ifsc == 0) || (ifsd == 0)) {
+      t1.reset(nullptr);
+      return SCARD_S_SUCCESS;
+    }
+    try {
+      t1 = make_unique<T1Transport>(ifsc, ifsd);
+      return SCARD_S_SUCCESS;
+    }
+    catch (invalid_argument &e) {
+      return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
+    }
+  }
+
+  /**
+   * Block counters of the T=1 simulation
+   *
+   * @return SCARD_S_SUCCESS, SCARD_E_UNSUPPORTED_FEATURE when the simulation is disabled
+   */
+  DWORD getT1Counters(T1BlockCounters *lastApdu, T1BlockCounters *total) {
+    if (!t1) {
+      return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
+    }
+    *lastApdu = t1->lastApdu();
+    *total = t1->total();
+    return SCARD_S_SUCCESS;
+  }
+
+  /**
+   * Apply the latency of the model to every APDU exchange, nullptr removes the latency
+   */
+  void setLatencyModel(unique_ptr<LatencyModel> model) {
+    latency = std::move(model);
+    if (latency && smartCard) {
+      latency->setATR(smartCard->getATR());
+    }
+  }
+
+  /**
+   * Time spent in the APDU exchanges according to the latency model
+   *
+   * @return SCARD_S_SUCCESS, SCARD_E_UNSUPPORTED_FEATURE when the reader has no latency model
+   */
+  DWORD getElapsedTime(chrono::nanoseconds *elapsed) {
+    if (!latency) {
+      return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
+    }
+    *elapsed = latency->elapsed();
+    return SCARD_S_SUCCESS;
+  }
+
+  /**
+   * Phase counters of the inserted GlobalPlatform card
+   *
+   * @return SCARD_S_SUCCESS, SCARD_E_NO_SMARTCARD, SCARD_E_UNSUPPORTED_FEATURE when the card isn't a GlobalPlatform card
+   */
+  DWORD getGlobalPlatformCounters(GlobalPlatformCounters *counters) {
+    if (smartCard == nullptr) {
+      return static_cast<DWORD>(SCARD_E_NO_SMARTCARD);
+    }
+    auto card = dynamic_cast<GlobalPlatformSmartCard *>(smartCard.get());
+    if (card == nullptr) {
+      return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
+    }
+    *counters = card->getCounters();
+    return SCARD_S_SUCCESS;
+  }
+
+  /**
+   * Memoize the responses of the deterministic commands of the inserted cards, 0 disables the cache. The cache of the
+   * inserted card starts empty.
+   *
+   * @param capacity number of responses of the cache
+   * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE
+   */
+  DWORD configureResponseCache(size_t capacity) {
+    try {
+      if (smartCard) {
+        smartCard->setResponseCache(capacity);
+      }
+      responseCacheCapacity = capacity;
+      return SCARD_S_SUCCESS;
+    }
+    catch (invalid_argument &e) {
+      return static_cast<DWORD>(SCARD_E_INVALID_VALUE);
+    }
+  }
+
+  /**
+   * Counters of the response cache of the inserted card
+   *
+   * @return SCARD_S_SUCCESS, SCARD_E_NO_SMARTCARD, SCARD_E_UNSUPPORTED_FEATURE when the cache is disabled
+   */
+  DWORD getResponseCacheCounters(ResponseCacheCounters *counters) {
+    if (smartCard == nullptr) {
+      return static_cast<DWORD>(SCARD_E_NO_SMARTCARD);
+    }
+    const ResponseCacheCounters *cache = smartCard->getResponseCacheCounters();
+    if (cache == nullptr) {
+      return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
+    }
+    *counters = *cache;
+    return SCARD_S_SUCCESS;
+  }
+
+  /**
+   * Counters of the APDUs transmitted to the cards of the reader, since the reader was attached
+   *
+   * @return SCARD_S_SUCCESS
+   */
+  DWORD getStats(ReaderStats::Counters *counters) {
+    stats.snapshot(counters);
+    return SCARD_S_SUCCESS;
+  }
+
+  /**
+   * State of the card as in the reader states of SCardGetStatusChange
+   * @return SCARD_STATE_PRESENT, SCARD_STATE_EMPTY
+   */
+  DWORD getCardState() const {
+    return smartCard ? static_cast<DWORD>(SCARD_STATE_PRESENT) : static_cast<DWORD>(SCARD_STATE_EMPTY);
+  }
+
   void getEventInfo(LPSCARD_READERSTATE readerState) {
     if (smartCard) {
       readerState->dwEventState = SCARD_STATE_PRESENT;
@@ -399,6 +423,39 @@ public:
 protected:
   const string name;
 
+  /**
+   * Proxy the APDU command to the smartcard
+   *
+   * @return SCARD_S_SUCCESS, SCARD_W_REMOVED_CARD + errors of Smartcard
+   */
+  DWORD transmitToSmartCard(SCARDHANDLE scardhandle, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response) {
+    if (smartCard == nullptr) {
+      stats.record(in_apdu_lg, 0, -1, true);
+      return static_cast<DWORD>(SCARD_W_REMOVED_CARD);
+    }
+    DWORD protocol = smartCard->getActiveProtocol(scardhandle);
+    bool blocks = t1 && (protocol == SCARD_PROTOCOL_T1);
+    DWORD ret = blocks ? t1->transceive(*smartCard, scardhandle, in_apdu, in_apdu_lg, response)
+                       : smartCard->transmit(scardhandle, in_apdu, in_apdu_lg, response);
+    if (ret != SCARD_S_SUCCESS) {
+      stats.record(in_apdu_lg, 0, -1, true);
+      return ret;
+    }
+    stats.record(in_apdu_lg, response.requiredLength(),
+                 (!response.overflow() && (response.length() >= 2)) ? response.data()[response.length() - 2] : -1, false);
+    // Processing time of the card, followed by the transfers
+    chrono::nanoseconds duration = smartCard->getProcessingTime();
+    if (latency) {
+      duration += blocks ? latency->exchangeTime(t1->lastApdu())
+                         : latency->exchangeTime(protocol, in_apdu_lg, response.requiredLength());
+      latency->apply(duration);
+    }
+    else if (duration.count() > 0) {
+      preciseSleep(duration);
+    }
+    return ret;
+  }
+
 private:
 
   DWORD getState() {
@@ -417,6 +474,14 @@ private:
 
   unique_ptr<SmartCard> smartCard;
 
+  unique_ptr<T1Transport> t1;
+
+  unique_ptr<LatencyModel> latency;
+
+  size_t responseCacheCapacity;   // 0 without response cache
+
+  ReaderStats stats;
+
   unsigned int events;
 
   unsigned int id;
@@ -444,12 +509,11 @@ public:
    * @param scardhandle handle to the smartcard
    * @param in_apdu APDU command
    * @param in_apdu_lg length of the APDU command
-   * @param out_apdu APDU result
-   * @param out_apd_lg length of the APDU result
-   * @return SCARD_S_SUCCESS
+   * @param response APDU result
+   * @return SCARD_S_SUCCESS, SCARD_W_REMOVED_CARD + errors of Smartcard
    */
-  DWORD execute(SCARDHANDLE scardhandle, const char *in_apdu, size_t in_apdu_lg, char **out_apdu, size_t *out_apd_lg) override {
-    return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
+  DWORD execute(SCARDHANDLE scardhandle, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response) override {
+    return transmitToSmartCard(scardhandle, in_apdu, in_apdu_lg, response);
   }
 
 private:
@@ -474,12 +538,11 @@ public:
    * @param scardhandle handle to the smartcard
    * @param in_apdu APDU command
    * @param in_apdu_lg length of the APDU command
-   * @param out_apdu APDU result
-   * @param out_apd_lg length of the APDU result
-   * @return SCARD_S_SUCCESS
+   * @param response APDU result
+   * @return SCARD_S_SUCCESS, SCARD_W_REMOVED_CARD + errors of Smartcard
    */
-  DWORD execute(SCARDHANDLE scardhandle, const char *in_apdu, size_t in_apdu_lg, char **out_apdu, size_t *out_apd_lg) override {
-    return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
+  DWORD execute(SCARDHANDLE scardhandle, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response) override {
+    return transmitToSmartCard(scardhandle, in_apdu, in_apdu_lg, response);
   }
 
 };
@@ -498,7 +561,7 @@ shared_ptr<SmartCardReader> SmartCardReader::instance_of(const string &impl) {
 
 class ReaderEvent : public WinsCardEvent {
 public:
-  ReaderEvent(shared_ptr<SmartCardReader> &reader) : new_reader(reader) {};
+  ReaderEvent(shared_ptr<SmartCardReader> &reader, uint64_t raised) : WinsCardEvent(raised), new_reader(reader) {};
 
   DWORD getReaderState(SCARD_READERSTATE readerState[], DWORD cReaders) override {
     for (unsigned int i=0; i<cReaders; i++) {
@@ -515,32 +578,9 @@ private:
   shared_ptr<SmartCardReader> new_reader;
 };
 
-/**
- * Implementation of a test smartcard
- */
-class TestSmartCard : public SmartCard {
-public:
-  TestSmartCard() : SmartCard( vector<unsigned char>({ 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16 }) ) {
-
-  };
-
-  DWORD execute(SCARDHANDLE handle, const char *in_apdu, size_t in_apdu_lg, char **out_apdu, size_t *out_apd_lg) override {
-    return static_cast<DWORD>(SCARD_E_UNSUPPORTED_FEATURE);
-  }
-
-};
-
-unique_ptr<SmartCard> SmartCard::instance_of(const string &impl) {
-  if (impl == "test") {
-    return make_unique<TestSmartCard>();
-  }
-
-  return nullptr;
-}
-
 class SmartCardEvent : public WinsCardEvent {
 public:
-  SmartCardEvent(shared_ptr<SmartCardReader> &reader) : readerOfCard(reader) {};
+  SmartCardEvent(shared_ptr<SmartCardReader> &reader, uint64_t raised) : WinsCardEvent(raised), readerOfCard(reader) {};
 
   DWORD getReaderState(SCARD_READERSTATE readerState[], DWORD cReaders) override {
     for (int i=0; i<cReaders; i++) {
@@ -594,7 +634,7 @@ public:
     *mszReaders = readerNames;
   }
 
-  DWORD attachReader(string new_reader) {
+  DWORD attachReader(string new_reader, unique_ptr<LatencyModel> latency = nullptr) {
     unsigned int next = 0;
 
     auto new_reader_impl = SmartCardReader::instance_of(new_reader);
@@ -602,6 +642,10 @@ public:
     if (new_reader_impl == nullptr)
       return SCARD_E_UNKNOWN_READER;
 
+    new_reader_impl->setLatencyModel(std::move(latency));
+
+    // The readers change under the lock of the events, like the scan of SCardGetStatusChange
+    lock_guard<mutex> lock_events(events_mutex);
     for (auto reader : readers) {
       if (reader.second->getName() == new_reader_impl->getName()) {
         next++;
@@ -609,15 +653,15 @@ public:
     }
     new_reader_impl->setId(next);
     readers[new_reader_impl->getReaderIdentifier()] = new_reader_impl;
-
-    {
-      lock_guard<mutex> lock_events(events_mutex);
-      if (events){
-        // TODO: Don't like the solution (evaluate a condition variable to simplify?)
-        for (unsigned int i=0; i<numberOfToScanReaders; i++) {
-          if (string(toScanReaders[i].szReader) == "\\\\?PnP?\\Notification") {
-            events->set_value(make_unique<ReaderEvent>(new_reader_impl));
-          }
+    MetricsPage::events.fetch_add(1, memory_order_relaxed);
+    uint64_t raised = WakeupStats::now();
+
+    if (events){
+      // TODO: Don't like the solution (evaluate a condition variable to simplify?)
+      for (unsigned int i=0; i<numberOfToScanReaders; i++) {
+        if (string(toScanReaders[i].szReader) == "\\\\?PnP?\\Notification") {
+          raise(make_unique<ReaderEvent>(new_reader_impl, raised));
+          break;
         }
       }
     }
@@ -629,14 +673,16 @@ public:
 
   DWORD insertSmartCardIn(const string &reader, const string &card) {
     try {
+      lock_guard<mutex> lock_events(events_mutex);
       DWORD ret = readers.at(reader)->insertCard(card);
+      uint64_t raised = WakeupStats::now();
 
-      lock_guard<mutex> lock_events(events_mutex);
       if (events){
         for (unsigned int i=0; i<numberOfToScanReaders; i++) {
           // TODO: Don't like the solution (evaluate a condition variable to simplify?)
           if (toScanReaders[i].szReader == reader) {
-            events->set_value(make_unique<SmartCardEvent>(readers.at(reader)));
+            raise(make_unique<SmartCardEvent>(readers.at(reader), raised));
+            break;
           }
         }
       }
@@ -650,14 +696,16 @@ public:
 
   DWORD removeSmartCardFrom(const string &reader) {
     try {
+      lock_guard<mutex> lock_events(events_mutex);
       DWORD ret = readers.at(reader)->ejectCard();
+      uint64_t raised = WakeupStats::now();
 
-      lock_guard<mutex> lock_events(events_mutex);
       if (events) {
         // TODO: Don't like the solution (evaluate a condition variable to simplify?)
         for (unsigned int i=0; i<numberOfToScanReaders; i++) {
           if (toScanReaders[i].szReader == reader) {
-            events->set_value(make_unique<SmartCardEvent>(readers.at(reader)));
+            raise(make_unique<SmartCardEvent>(readers.at(reader), raised));
+            break;
           }
         }
       }
@@ -730,21 +778,121 @@ public:
     }
   }
 
+  DWORD transmitToSmartCard(SCARDHANDLE hCard, const unsigned char *in_apdu, size_t in_apdu_lg, ApduResponse &response) {
+    try {
+      return smartcards_ctx.at(hCard)->reader->execute(smartcards_ctx.at(hCard)->scardhandle, in_apdu, in_apdu_lg, response);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_INVALID_HANDLE);
+    }
+  }
+
+  DWORD configureReaderT1(const string &reader, size_t ifsc, size_t ifsd) {
+    try {
+      return readers.at(reader)->configureT1(ifsc, ifsd);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD getReaderT1Counters(const string &reader, T1BlockCounters *lastApdu, T1BlockCounters *total) {
+    try {
+      return readers.at(reader)->getT1Counters(lastApdu, total);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD configureReaderLatency(const string &reader, unique_ptr<LatencyModel> latency) {
+    try {
+      readers.at(reader)->setLatencyModel(std::move(latency));
+      return SCARD_S_SUCCESS;
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD getReaderElapsedTime(const string &reader, chrono::nanoseconds *elapsed) {
+    try {
+      return readers.at(reader)->getElapsedTime(elapsed);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD getReaderGlobalPlatformCounters(const string &reader, GlobalPlatformCounters *counters) {
+    try {
+      return readers.at(reader)->getGlobalPlatformCounters(counters);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD getReaderStats(const string &reader, ReaderStats::Counters *counters) {
+    try {
+      return readers.at(reader)->getStats(counters);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD configureReaderResponseCache(const string &reader, size_t capacity) {
+    try {
+      return readers.at(reader)->configureResponseCache(capacity);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
+  DWORD getReaderResponseCacheCounters(const string &reader, ResponseCacheCounters *counters) {
+    try {
+      return readers.at(reader)->getResponseCacheCounters(counters);
+    }
+    catch (out_of_range &oor) {
+      return static_cast<DWORD>(SCARD_E_READER_UNAVAILABLE);
+    }
+  }
+
   // TODO: No support for multithreaded SCardGetStatusChange! Need a vector of promises or condition variables
   DWORD contextGetStatusChange(DWORD dwTimeout, SCARD_READERSTATE *rgReaderStates, DWORD cReaders) {
+    future<unique_ptr<WinsCardEvent>> event;
     {
+      // The scan and the installation of the waiter see the same state of the readers, the readers and their cards
+      // change under this lock
       lock_guard<mutex> lock_events(events_mutex);
+      if (reportChangedReaders(rgReaderStates, cReaders)) {
+        return SCARD_S_SUCCESS;
+      }
       events = make_unique<promise<unique_ptr<WinsCardEvent>>>();
       toScanReaders = rgReaderStates;
       numberOfToScanReaders = cReaders;
+      event = events->get_future();
     }
-    future<unique_ptr<WinsCardEvent>> event = events->get_future();
     future_status status = event.wait_for(chrono::seconds(dwTimeout));
+    // The reader states of the caller are only scanned during the call
+    lock_guard<mutex> lock_events(events_mutex);
+    if (status == future_status::timeout) {
+      // An event raised between the timeout and the lock is reported, not lost with the promise
+      status = event.wait_for(chrono::seconds(0));
+    }
+    events.reset();
+    toScanReaders = nullptr;
+    numberOfToScanReaders = 0;
     if (status == future_status::timeout) {
       return SCARD_E_TIMEOUT;
     }
     if (status == future_status::ready) {
-      return event.get()->getReaderState(rgReaderStates, cReaders);
+      unique_ptr<WinsCardEvent> raised = event.get();
+      DWORD ret = raised->getReaderState(rgReaderStates, cReaders);
+      WakeupStats::record(raised->getRaised());
+      return ret;
     }
 
     return SCARD_E_UNEXPECTED;
@@ -786,10 +934,47 @@ private:
     }
   }
 
+  /**
+   * Report the readers whose card state already differs from the state known by the caller, without waiting. The
+   * readers of the caller in SCARD_STATE_UNAWARE wait for the next event. Called under events_mutex.
+   * @return true when a reader has changed
+   */
+  bool reportChangedReaders(SCARD_READERSTATE *rgReaderStates, DWORD cReaders) {
+    bool changed = false;
+    for (DWORD i = 0; i < cReaders; i++) {
+      SCARD_READERSTATE &readerState = rgReaderStates[i];
+      DWORD known = readerState.dwCurrentState & (SCARD_STATE_PRESENT | SCARD_STATE_EMPTY);
+      if ((readerState.szReader == nullptr) || (known == 0)
+          || ((readerState.dwCurrentState & SCARD_STATE_IGNORE) != 0)) {
+        continue;
+      }
+      // The readers are few, a scan compares the names without building a key
+      for (auto &reader : readers) {
+        if ((reader.first == readerState.szReader) && (reader.second->getCardState() != known)) {
+          reader.second->getEventInfo(&readerState);
+          readerState.dwEventState |= SCARD_STATE_CHANGED;
+          changed = true;
+          break;
+        }
+      }
+    }
+    return changed;
+  }
+
+  /**
+   * Wake the waiter of SCardGetStatusChange, which is then gone for the next events. Called under events_mutex.
+   */
+  void raise(unique_ptr<WinsCardEvent> event) {
+    events->set_value(std::move(event));
+    events.reset();
+    toScanReaders = nullptr;
+    numberOfToScanReaders = 0;
+  }
+
   mutex events_mutex;
   unique_ptr<promise<unique_ptr<WinsCardEvent>>> events;
-  SCARD_READERSTATE *toScanReaders;
-  DWORD             numberOfToScanReaders;
+  SCARD_READERSTATE *toScanReaders = nullptr;
+  DWORD             numberOfToScanReaders = 0;
 };
 
 /**
@@ -811,143 +996,598 @@ struct g_card_handle {
 };
 unordered_map<SCARDHANDLE, unique_ptr<struct g_card_handle>> g_cardhandles;
 
+/**
+ * Call of the PC/SC API, counted in the call statistics when it returns, recorded in the trace, and for SCardTransmit
+ * and SCardControl in the pcapng capture. The calls which started before the recording aren't recorded.
+ */
+class TracedCall {
+public:
+  TracedCall(TraceFunction function, uint64_t handle) :
+    function(function),
+    handle(handle),
+    ticks(CallStats::ticks()),
+    start(ApduTrace::recording() ? ApduTrace::now() : 0),
+    captureStart((((function == TraceFunction::Transmit) || (function == TraceFunction::Control))
+                  && PcapngExport::capturing()) ? PcapngExport::now() : 0) {
+    USDT_CALL_ENTRY(function, handle);
+  }
+
+  /**
+   * Handle created by the call
+   */
+  void setHandle(uint64_t created) {
+    handle = created;
+  }
+
+  LONG end(LONG ret, const unsigned char *input = nullptr, size_t input_lg = 0, const unsigned char *output = nullptr,
+           size_t output_lg = 0) {
+    CallStats::record(function, ticks, ret != SCARD_S_SUCCESS);
+    USDT_CALL_RETURN(function, handle, input_lg, output_lg, ret);
+    if (start != 0) {
+      ApduTrace::record(function, start, handle, ret, input, input_lg, output, output_lg);
+    }
+    if (captureStart != 0) {
+      PcapngExport::exchange(function == TraceFunction::Control, captureStart, handle, ret == SCARD_S_SUCCESS,
+                             input, input_lg, output, output_lg);
+    }
+    return ret;
+  }
+
+private:
+  TraceFunction function;
+  uint64_t handle;
+  uint64_t ticks;
+  uint64_t start;
+  uint64_t captureStart;
+};
+
 PCSC_API LONG SCardAttachReader(SCARDCONTEXT hContext, LPCSTR szReader)
 {
+  TracedCall call(TraceFunction::AttachReader, hContext);
+  try {
+    return call.end(g_contexts.at(hContext)->attachReader(szReader));
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+/**
+ * Create the latency model of the C definition
+ * @return SCARD_S_SUCCESS, SCARD_E_INVALID_VALUE
+ */
+static DWORD latencyModelOf(const SCARD_LATENCY_MODEL *pModel, unique_ptr<LatencyModel> *latency) {
+  if ((pModel->dwMode != SCARD_LATENCY_SLEEP) && (pModel->dwMode != SCARD_LATENCY_VIRTUAL_CLOCK)) {
+    return SCARD_E_INVALID_VALUE;
+  }
+  LatencyMode mode = (pModel->dwMode == SCARD_LATENCY_SLEEP) ? LatencyMode::Sleep : LatencyMode::VirtualClock;
+  uint32_t frequency = (pModel->dwClockFrequency == 0) ? LatencyModel::DEFAULT_CLOCK_FREQUENCY
+                                                       : static_cast<uint32_t>(pModel->dwClockFrequency);
+  *latency = make_unique<LatencyModel>(mode, frequency, chrono::microseconds(pModel->dwOverheadMicroseconds));
+  return SCARD_S_SUCCESS;
+}
+
+PCSC_API LONG SCardAttachReaderWithLatency(SCARDCONTEXT hContext, LPCSTR szReader, const SCARD_LATENCY_MODEL *pModel)
+{
+  TracedCall call(TraceFunction::AttachReaderWithLatency, hContext);
+  if ((szReader == nullptr) || (pModel == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  unique_ptr<LatencyModel> latency;
+  DWORD ret = latencyModelOf(pModel, &latency);
+  if (ret != SCARD_S_SUCCESS) {
+    return call.end(ret);
+  }
+  try {
+    return call.end(g_contexts.at(hContext)->attachReader(szReader, std::move(latency)));
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+PCSC_API LONG SCardConfigureReaderLatency(SCARDCONTEXT hContext, LPCSTR szReader, const SCARD_LATENCY_MODEL *pModel)
+{
+  TracedCall call(TraceFunction::ConfigureReaderLatency, hContext);
+  if (szReader == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  unique_ptr<LatencyModel> latency;
+  if (pModel != nullptr) {
+    DWORD ret = latencyModelOf(pModel, &latency);
+    if (ret != SCARD_S_SUCCESS) {
+      return call.end(ret);
+    }
+  }
+  try {
+    return call.end(g_contexts.at(hContext)->configureReaderLatency(szReader, std::move(latency)));
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+PCSC_API LONG SCardGetReaderElapsedTime(SCARDCONTEXT hContext, LPCSTR szReader, uint64_t *pullNanoseconds)
+{
+  TracedCall call(TraceFunction::GetReaderElapsedTime, hContext);
+  if ((szReader == nullptr) || (pullNanoseconds == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
   try {
-    return g_contexts.at(hContext)->attachReader(szReader);
+    chrono::nanoseconds elapsed(0);
+    DWORD ret = g_contexts.at(hContext)->getReaderElapsedTime(szReader, &elapsed);
+    if (ret == SCARD_S_SUCCESS) {
+      *pullNanoseconds = static_cast<uint64_t>(elapsed.count());
+    }
+    return call.end(ret);
   }
   catch (out_of_range &oor) {
-    return SCARD_E_INVALID_HANDLE;
+    return call.end(SCARD_E_INVALID_HANDLE);
   }
 }
 
 PCSC_API LONG SCardInsertSmartCardInReader(SCARDCONTEXT hContext, LPCSTR szReader, LPCSTR szCard)
 {
+  TracedCall call(TraceFunction::InsertSmartCardInReader, hContext);
   try {
-    return g_contexts.at(hContext)->insertSmartCardIn(szReader, szCard);
+    return call.end(g_contexts.at(hContext)->insertSmartCardIn(szReader, szCard));
   }
   catch (out_of_range &oor) {
-    return SCARD_E_INVALID_HANDLE;
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+PCSC_API LONG SCardRegisterSmartCard(LPCSTR szCard, LPCSTR szType, LPCSTR szSource)
+{
+  TracedCall call(TraceFunction::RegisterSmartCard, 0);
+  if ((szCard == nullptr) || (szType == nullptr) || (szSource == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
   }
+  return call.end(SmartCard::register_implementation(szCard, szType, szSource));
 }
 
-PCSC_API LONG SCardRemoveSmartCardFromReader(SCARDCONTEXT hContext, LPCSTR szReader) {
+PCSC_API LONG SCardConfigureReaderT1(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwIFSC, DWORD dwIFSD)
+{
+  TracedCall call(TraceFunction::ConfigureReaderT1, hContext);
+  if (szReader == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
   try {
-    return g_contexts.at(hContext)->removeSmartCardFrom(szReader);
+    return call.end(g_contexts.at(hContext)->configureReaderT1(szReader, dwIFSC, dwIFSD));
   }
   catch (out_of_range &oor) {
-    return SCARD_E_INVALID_HANDLE;
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+static void copyT1Counters(const T1BlockCounters &counters, SCARD_T1_COUNTERS *pCounters) {
+  pCounters->dwApdus = counters.apdus;
+  pCounters->dwIBlocks = counters.iBlocks;
+  pCounters->dwRBlocks = counters.rBlocks;
+  pCounters->dwSBlocks = counters.sBlocks;
+  pCounters->dwBytesToCard = counters.bytesToCard;
+  pCounters->dwBytesFromCard = counters.bytesFromCard;
+  pCounters->dwWaitingTimeExtensions = counters.waitingTimeExtensions;
+}
+
+PCSC_API LONG SCardGetReaderT1Counters(SCARDCONTEXT hContext, LPCSTR szReader, SCARD_T1_COUNTERS *pLastApdu,
+                                       SCARD_T1_COUNTERS *pTotal)
+{
+  TracedCall call(TraceFunction::GetReaderT1Counters, hContext);
+  if ((szReader == nullptr) || (pLastApdu == nullptr) || (pTotal == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    T1BlockCounters lastApdu;
+    T1BlockCounters total;
+    DWORD ret = g_contexts.at(hContext)->getReaderT1Counters(szReader, &lastApdu, &total);
+    if (ret == SCARD_S_SUCCESS) {
+      copyT1Counters(lastApdu, pLastApdu);
+      copyT1Counters(total, pTotal);
+    }
+    return call.end(ret);
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+static_assert(SCARD_GP_PHASES == static_cast<size_t>(GlobalPlatformPhase::COUNT), "phases of the C API");
+
+PCSC_API LONG SCardGetCardManagerCounters(SCARDCONTEXT hContext, LPCSTR szReader, SCARD_GP_COUNTERS *pCounters)
+{
+  TracedCall call(TraceFunction::GetCardManagerCounters, hContext);
+  if ((szReader == nullptr) || (pCounters == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    GlobalPlatformCounters counters;
+    DWORD ret = g_contexts.at(hContext)->getReaderGlobalPlatformCounters(szReader, &counters);
+    if (ret == SCARD_S_SUCCESS) {
+      for (size_t i = 0; i < SCARD_GP_PHASES; i++) {
+        const GlobalPlatformPhaseCounters &phase = counters.phases[i];
+        pCounters->rgPhases[i].dwCommands = static_cast<DWORD>(phase.commands);
+        pCounters->rgPhases[i].ullBytes = phase.bytes;
+        pCounters->rgPhases[i].ullProcessingNanoseconds = static_cast<uint64_t>(phase.processing.count());
+        pCounters->rgPhases[i].ullElapsedNanoseconds = static_cast<uint64_t>(phase.elapsed.count());
+      }
+      pCounters->dwLoadFiles = static_cast<DWORD>(counters.loadFiles);
+      pCounters->dwApplets = static_cast<DWORD>(counters.applets);
+    }
+    return call.end(ret);
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+PCSC_API LONG SCardConfigureResponseCache(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwEntries)
+{
+  TracedCall call(TraceFunction::ConfigureResponseCache, hContext);
+  if (szReader == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    return call.end(g_contexts.at(hContext)->configureReaderResponseCache(szReader, dwEntries));
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+PCSC_API LONG SCardGetResponseCacheCounters(SCARDCONTEXT hContext, LPCSTR szReader,
+                                            SCARD_RESPONSE_CACHE_COUNTERS *pCounters)
+{
+  TracedCall call(TraceFunction::GetResponseCacheCounters, hContext);
+  if ((szReader == nullptr) || (pCounters == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    ResponseCacheCounters counters;
+    DWORD ret = g_contexts.at(hContext)->getReaderResponseCacheCounters(szReader, &counters);
+    if (ret == SCARD_S_SUCCESS) {
+      pCounters->ullHits = counters.hits;
+      pCounters->ullMisses = counters.misses;
+      pCounters->ullEvictions = counters.evictions;
+    }
+    return call.end(ret);
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+static_assert(SCARD_STATS_FUNCTIONS == CallStats::FUNCTIONS, "functions of the C API");
+static_assert(SCARD_STATS_LATENCY_BUCKETS == CallStats::BUCKETS, "latency buckets of the C API");
+static_assert(SCARD_STATS_TRANSMIT == static_cast<size_t>(TraceFunction::Transmit) - 1, "functions of the C API");
+static_assert(SCARD_STATS_STOP_CAPTURE == static_cast<size_t>(TraceFunction::StopCapture) - 1,
+              "functions of the C API");
+static_assert(CallStats::FUNCTIONS == static_cast<size_t>(TraceFunction::StopCapture), "functions of the statistics");
+
+PCSC_API LONG SCardGetStats(SCARD_STATS *pStats)
+{
+  TracedCall call(TraceFunction::GetStats, 0);
+  if (pStats == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  vector<CallStats::FunctionStats> stats(CallStats::FUNCTIONS);
+  CallStats::snapshot(stats.data());
+  for (size_t i = 0; i < CallStats::FUNCTIONS; i++) {
+    SCARD_CALL_STATS &calls = pStats->rgCalls[i];
+    calls.ullCalls = stats[i].calls;
+    calls.ullErrors = stats[i].errors;
+    calls.ullTotalNanoseconds = stats[i].totalNanoseconds;
+    calls.ullMaxNanoseconds = stats[i].maxNanoseconds;
+    memcpy(calls.rgullLatency, stats[i].latency, sizeof(calls.rgullLatency));
+  }
+  WakeupStats::Counters wakeups;
+  WakeupStats::snapshot(&wakeups);
+  pStats->sWakeups.ullWakeups = wakeups.wakeups;
+  pStats->sWakeups.ullTotalNanoseconds = wakeups.totalNanoseconds;
+  pStats->sWakeups.ullMaxNanoseconds = wakeups.maxNanoseconds;
+  memcpy(pStats->sWakeups.rgullLatency, wakeups.latency, sizeof(pStats->sWakeups.rgullLatency));
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardGetStatsBucketBound(DWORD dwBucket, uint64_t *pullNanoseconds)
+{
+  TracedCall call(TraceFunction::GetStatsBucketBound, 0);
+  if (pullNanoseconds == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  if (dwBucket >= SCARD_STATS_LATENCY_BUCKETS) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  *pullNanoseconds = CallStats::bucketLowerBound(dwBucket);
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardGetReaderStats(SCARDCONTEXT hContext, LPCSTR szReader, SCARD_READER_STATS *pStats)
+{
+  TracedCall call(TraceFunction::GetReaderStats, hContext);
+  if ((szReader == nullptr) || (pStats == nullptr)) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    ReaderStats::Counters counters;
+    DWORD ret = g_contexts.at(hContext)->getReaderStats(szReader, &counters);
+    if (ret == SCARD_S_SUCCESS) {
+      pStats->ullApdus = counters.apdus;
+      pStats->ullErrors = counters.errors;
+      pStats->ullBytesIn = counters.bytesIn;
+      pStats->ullBytesOut = counters.bytesOut;
+      memcpy(pStats->rgullSw1, counters.sw1, sizeof(pStats->rgullSw1));
+    }
+    return call.end(ret);
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
+  }
+}
+
+PCSC_API LONG SCardStartMetricsPage(LPCSTR szName, DWORD dwPeriod)
+{
+  TracedCall call(TraceFunction::StartMetricsPage, 0);
+  if (szName == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    MetricsPage::start(szName, chrono::milliseconds(dwPeriod));
+  }
+  catch (invalid_argument &e) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  catch (logic_error &e) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  catch (runtime_error &e) {
+    return call.end(SCARD_E_NO_ACCESS);
+  }
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStopMetricsPage()
+{
+  TracedCall call(TraceFunction::StopMetricsPage, 0);
+  MetricsPage::stop();
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardDumpMetrics(LPCSTR szDestination)
+{
+  TracedCall call(TraceFunction::DumpMetrics, 0);
+  if (szDestination == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    PrometheusExport::dump(szDestination);
+  }
+  catch (logic_error &e) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  catch (runtime_error &e) {
+    return call.end(SCARD_E_NO_ACCESS);
+  }
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStartMetricsDumpOnSignal(LPCSTR szDestination)
+{
+  TracedCall call(TraceFunction::StartMetricsDumpOnSignal, 0);
+  if (szDestination == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    PrometheusExport::startSignalDumps(szDestination);
+  }
+  catch (logic_error &e) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  catch (runtime_error &e) {
+    return call.end(SCARD_E_NO_ACCESS);
+  }
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStopMetricsDumpOnSignal()
+{
+  TracedCall call(TraceFunction::StopMetricsDumpOnSignal, 0);
+  PrometheusExport::stopSignalDumps();
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStartTrace(LPCSTR szPath)
+{
+  TracedCall call(TraceFunction::StartTrace, 0);
+  if (szPath == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    ApduTrace::start(szPath);
+  }
+  catch (logic_error &e) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  catch (runtime_error &e) {
+    return call.end(SCARD_E_NO_ACCESS);
+  }
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStopTrace()
+{
+  TracedCall call(TraceFunction::StopTrace, 0);
+  ApduTrace::stop();
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStartCapture(LPCSTR szPath)
+{
+  TracedCall call(TraceFunction::StartCapture, 0);
+  if (szPath == nullptr) {
+    return call.end(SCARD_E_INVALID_PARAMETER);
+  }
+  try {
+    PcapngExport::start(szPath);
+  }
+  catch (logic_error &e) {
+    return call.end(SCARD_E_INVALID_VALUE);
+  }
+  catch (runtime_error &e) {
+    return call.end(SCARD_E_NO_ACCESS);
+  }
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardStopCapture()
+{
+  TracedCall call(TraceFunction::StopCapture, 0);
+  PcapngExport::stop();
+  return call.end(SCARD_S_SUCCESS);
+}
+
+PCSC_API LONG SCardRemoveSmartCardFromReader(SCARDCONTEXT hContext, LPCSTR szReader)
+{
+  TracedCall call(TraceFunction::RemoveSmartCardFromReader, hContext);
+  try {
+    return call.end(g_contexts.at(hContext)->removeSmartCardFrom(szReader));
+  }
+  catch (out_of_range &oor) {
+    return call.end(SCARD_E_INVALID_HANDLE);
   }
 }
 
 
 PCSC_API LONG SCardEstablishContext(DWORD dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2, LPSCARDCONTEXT phContext)
 {
+  TracedCall call(TraceFunction::EstablishContext, 0);
   (void *)pvReserved1;
   (void *)pvReserved2;
 
   if (phContext == nullptr) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_PARAMETER);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_PARAMETER));
   }
   if ((dwScope != SCARD_SCOPE_USER)
       && (dwScope != SCARD_SCOPE_TERMINAL)
          && (dwScope != SCARD_SCOPE_SYSTEM)) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_VALUE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_VALUE));
   }
   // Default behavior
   *phContext = g_context_index;
+  call.setHandle(g_context_index);
   g_contexts[g_context_index] = make_shared<WinscardContext>();
   g_context_index++;
+  MetricsPage::contexts.fetch_add(1, memory_order_relaxed);
 
   // Stubbed behavior
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardReleaseContext(SCARDCONTEXT hContext)
 {
+  TracedCall call(TraceFunction::ReleaseContext, hContext);
   if (g_contexts.erase(hContext) == 0) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
+  MetricsPage::contexts.fetch_sub(1, memory_order_relaxed);
 
   // Stubbed behavior
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardIsValidContext(SCARDCONTEXT hContext)
 {
+  TracedCall call(TraceFunction::IsValidContext, hContext);
 
   if (g_contexts.find(hContext) == g_contexts.end()) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol)
 {
+  TracedCall call(TraceFunction::Connect, hContext);
   DWORD default_return = 0;
   SCARDHANDLE hCard = 0;
 
   try {
     default_return = g_contexts.at(hContext)->connectToSmartCard(szReader, dwShareMode, dwPreferredProtocols, &hCard, pdwActiveProtocol);
     *phCard = g_handle_index;
+    call.setHandle(g_handle_index);
     g_cardhandles[g_handle_index] = make_unique<struct g_card_handle>(shared_ptr<WinscardContext>(g_contexts[hContext]), hCard);
     g_handle_index++;
+    if (default_return == SCARD_S_SUCCESS) {
+      MetricsPage::handles.fetch_add(1, memory_order_relaxed);
+    }
   }
   catch (out_of_range &oor) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ , default_return);
+  size_t reader_lg = (szReader == nullptr) ? 0 : strlen(szReader);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return),
+                  reinterpret_cast<const unsigned char *>(szReader), reader_lg);
 }
 
 PCSC_API LONG SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization, LPDWORD pdwActiveProtocol)
 {
+  TracedCall call(TraceFunction::Reconnect, hCard);
   // TODO: Implementation necessary
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 {
+  TracedCall call(TraceFunction::Disconnect, hCard);
   DWORD default_return = 0;
   try {
     default_return = g_cardhandles.at(hCard)->winscard_ctx->disconnectFromSmartCard(g_cardhandles.at(hCard)->local_cardhandle, dwDisposition);
   }
   catch (out_of_range &oor) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
+  }
+  if (default_return != SCARD_E_INVALID_HANDLE) {
+    // The context released the handle, the handle no longer keeps the context and its readers alive
+    g_cardhandles.erase(hCard);
+    MetricsPage::handles.fetch_sub(1, memory_order_relaxed);
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ , default_return);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return));
 }
 
 PCSC_API LONG SCardBeginTransaction(SCARDHANDLE hCard)
 {
+  TracedCall call(TraceFunction::BeginTransaction, hCard);
   DWORD default_return = 0;
   try {
     default_return = g_cardhandles.at(hCard)->winscard_ctx->beginTransactionOnSmartcard(g_cardhandles.at(hCard)->local_cardhandle);
   }
   catch (out_of_range &oor) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ , default_return);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return));
 }
 
 PCSC_API LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 {
+  TracedCall call(TraceFunction::EndTransaction, hCard);
   DWORD default_return = 0;
   try {
     default_return = g_cardhandles.at(hCard)->winscard_ctx->endTransactionOnSmartcard(g_cardhandles.at(hCard)->local_cardhandle, dwDisposition);
   }
   catch (out_of_range &oor) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ , default_return);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return));
 }
 
 PCSC_API LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName, LPDWORD pcchReaderLen, LPDWORD pdwState, LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen)
 {
+  TracedCall call(TraceFunction::Status, hCard);
   DWORD default_return = 0;
   try {
     default_return = g_cardhandles.at(hCard)
@@ -957,47 +1597,84 @@ PCSC_API LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName, LPDWORD pcchRe
                         pbAtr, pcbAtrLen);
   }
   catch (out_of_range &oor) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
-  return get_return_code_for("winscard", __FUNCTION_NAME__ , default_return);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return));
 }
 
 PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, SCARD_READERSTATE *rgReaderStates, DWORD cReaders)
 {
+  TracedCall call(TraceFunction::GetStatusChange, hContext);
   DWORD default_return = 0;
   try {
     default_return = g_contexts.at(hContext)->contextGetStatusChange(dwTimeout, rgReaderStates, cReaders);
   }
   catch (out_of_range &oor) {
-    return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ , default_return);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return));
 }
 
 PCSC_API LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer, DWORD cbSendLength, LPVOID pbRecvBuffer, DWORD cbRecvLength, LPDWORD lpBytesReturned)
 {
+  TracedCall call(TraceFunction::Control, hCard);
   // TODO: Implementation necessary
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS),
+                  static_cast<const unsigned char *>(pbSendBuffer), (pbSendBuffer == nullptr) ? 0 : cbSendLength);
 }
 
 PCSC_API LONG SCardTransmit(SCARDHANDLE hCard, const SCARD_IO_REQUEST *pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, SCARD_IO_REQUEST *pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
 {
-  // TODO: Implementation necessary
+  TracedCall call(TraceFunction::Transmit, hCard);
+  (void)pioSendPci;
+  (void)pioRecvPci;
+  DWORD default_return = 0;
+
+  if ((pbSendBuffer == nullptr) || (cbSendLength == 0) || (pcbRecvLength == nullptr)) {
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_PARAMETER));
+  }
+
+  // The smartcard writes its response directly in the receive buffer or references its own storage
+  ApduResponse response(pbRecvBuffer, (pbRecvBuffer == nullptr) ? 0 : *pcbRecvLength);
+  try {
+    default_return = g_cardhandles.at(hCard)
+      ->winscard_ctx
+      ->transmitToSmartCard(g_cardhandles.at(hCard)->local_cardhandle, pbSendBuffer, cbSendLength, response);
+  }
+  catch (out_of_range &oor) {
+    return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
+  }
+
+  if (default_return == SCARD_S_SUCCESS) {
+    if ((pbRecvBuffer == nullptr) || (response.requiredLength() > *pcbRecvLength)) {
+      default_return = static_cast<DWORD>(SCARD_E_INSUFFICIENT_BUFFER);
+    }
+    else if (response.data() != pbRecvBuffer) {
+      memcpy(pbRecvBuffer, response.data(), response.length());
+    }
+    *pcbRecvLength = static_cast<DWORD>(response.requiredLength());
+  }
+  else if (default_return == SCARD_E_INSUFFICIENT_BUFFER) {
+    *pcbRecvLength = static_cast<DWORD>(response.requiredLength());
+  }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ , default_return), pbSendBuffer, cbSendLength,
+                  pbRecvBuffer, (default_return == SCARD_S_SUCCESS) ? *pcbRecvLength : 0);
 }
 
 PCSC_API LONG SCardListReaderGroups(SCARDCONTEXT hContext, LPSTR mszGroups, LPDWORD pcchGroups)
 {
+  TracedCall call(TraceFunction::ListReaderGroups, hContext);
   // TODO: Implementation necessary
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, LPDWORD pcchReaders)
 {
+  TracedCall call(TraceFunction::ListReaders, hContext);
   const unsigned char *data = nullptr;
   unsigned long data_lg = 0;
 
@@ -1014,7 +1691,7 @@ PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR ms
         if (pcchReaders != nullptr) {
           *pcchReaders = 0;
         }
-        return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_NO_READERS_AVAILABLE);
+        return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_NO_READERS_AVAILABLE));
       }
     }
     catch (out_of_range &oor) {
@@ -1025,7 +1702,7 @@ PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR ms
       if (pcchReaders != nullptr) {
         *pcchReaders = 0;
       }
-      return get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE);
+      return call.end(get_return_code_for("winscard", __FUNCTION_NAME__, SCARD_E_INVALID_HANDLE));
     }
   }
 
@@ -1038,33 +1715,37 @@ PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR ms
     *pcchReaders = data_lg;
   }
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardFreeMemory(SCARDCONTEXT hContext, LPCVOID pvMem)
 {
+  TracedCall call(TraceFunction::FreeMemory, hContext);
   // TODO: Implementation necessary
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardCancel(SCARDCONTEXT hContext)
 {
+  TracedCall call(TraceFunction::Cancel, hContext);
   // TODO: Implementation necessary
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardGetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPBYTE pbAttr, LPDWORD pcbAttrLen)
 {
+  TracedCall call(TraceFunction::GetAttrib, hCard);
   // TODO: Implementation necessary
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
 
 PCSC_API LONG SCardSetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPCBYTE pbAttr, DWORD cbAttrLen)
 {
+  TracedCall call(TraceFunction::SetAttrib, hCard);
   // TODO: Implementation necessary
 
-  return get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS);
+  return call.end(get_return_code_for("winscard", __FUNCTION_NAME__ ,SCARD_S_SUCCESS));
 }
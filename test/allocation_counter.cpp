@@ -0,0 +1,119 @@
+//
+// Replacement of the allocation functions, counting the allocations of each thread
+//
+
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include "allocation_counter.h"
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *memory, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *memory);
+}
+
+// Trivial thread locals of the executable, which are reached without allocation
+static thread_local uint64_t threadAllocations = 0;
+static thread_local uint64_t threadBytes = 0;
+
+static inline void count(size_t size) {
+  threadAllocations++;
+  threadBytes += size;
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+  count(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count_of, size_t size) {
+  count(count_of * size);
+  return __libc_calloc(count_of, size);
+}
+
+void *realloc(void *memory, size_t size) {
+  count(size);
+  return __libc_realloc(memory, size);
+}
+
+void free(void *memory) {
+  __libc_free(memory);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  count(size);
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  count(size);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memory, size_t alignment, size_t size) {
+  if ((alignment < sizeof(void *)) || ((alignment & (alignment - 1)) != 0)) {
+    return EINVAL;
+  }
+  count(size);
+  void *allocated = __libc_memalign(alignment, size);
+  if (allocated == nullptr) {
+    return ENOMEM;
+  }
+  *memory = allocated;
+  return 0;
+}
+
+}
+
+// The operators go through malloc, where they are counted once
+
+void *operator new(size_t size) {
+  void *memory = malloc((size == 0) ? 1 : size);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return malloc((size == 0) ? 1 : size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return malloc((size == 0) ? 1 : size);
+}
+
+void operator delete(void *memory) noexcept {
+  free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept {
+  free(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept {
+  free(memory);
+}
+
+AllocationScope::AllocationScope() : startAllocations(threadAllocations), startBytes(threadBytes) {}
+
+uint64_t AllocationScope::allocations() const {
+  return threadAllocations - startAllocations;
+}
+
+uint64_t AllocationScope::bytes() const {
+  return threadBytes - startBytes;
+}
@@ -0,0 +1,40 @@
+//
+// Accounting of the heap allocations of the tests
+//
+
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Allocations made by the calling thread during the life of the scope. allocation_counter.cpp replaces malloc, calloc,
+ * realloc, the aligned allocations and the global operators new and delete of the executable which links it (glibc
+ * only), so that the allocations of the library, of the C++ library and of the exceptions are all counted. Each thread
+ * counts its own allocations, the scopes can be nested.
+ */
+class AllocationScope {
+public:
+  AllocationScope();
+
+  AllocationScope(const AllocationScope &other) = delete;
+
+  AllocationScope &operator=(const AllocationScope &other) = delete;
+
+  /**
+   * Allocations and reallocations since the beginning of the scope
+   */
+  uint64_t allocations() const;
+
+  /**
+   * Bytes requested by the allocations since the beginning of the scope
+   */
+  uint64_t bytes() const;
+
+private:
+  uint64_t startAllocations;
+  uint64_t startBytes;
+};
+
+#endif //ALLOCATION_COUNTER_H
@@ -0,0 +1,50 @@
+//
+// Connection to a smartcard shared by the tests of the smartcards
+//
+
+#ifndef CARD_SESSION_H
+#define CARD_SESSION_H
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "response_table.h"
+#include "smartcard.h"
+
+inline std::vector<unsigned char> hex(const std::string &digits) {
+  return ResponseTable::parseHex(digits);
+}
+
+/**
+ * Smartcard connected with the given protocol, which exchanges the APDUs as vectors
+ *
+ * @tparam Card smartcard built from its template (image, card template, trace...)
+ */
+template <class Card>
+class CardSession {
+public:
+  template <class Template>
+  explicit CardSession(Template &&cardTemplate, DWORD protocol = SCARD_PROTOCOL_T1) :
+    card(std::forward<Template>(cardTemplate)), handle(0) {
+    DWORD active = 0;
+    card.connect(SCARD_SHARE_SHARED, protocol, &handle, &active);
+  }
+
+  CardSession(const CardSession &other) = delete;
+
+  CardSession &operator=(const CardSession &other) = delete;
+
+  std::vector<unsigned char> transmit(const std::vector<unsigned char> &command) {
+    ApduResponse response(scratch, sizeof(scratch));
+    card.transmit(handle, command.data(), command.size(), response);
+    return std::vector<unsigned char>(response.data(), response.data() + response.length());
+  }
+
+  Card card;
+
+private:
+  SCARDHANDLE handle;
+  unsigned char scratch[65538];
+};
+
+#endif //CARD_SESSION_H
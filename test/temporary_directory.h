@@ -0,0 +1,65 @@
+//
+// Directory of the files written by a test
+//
+
+#ifndef TEMPORARY_DIRECTORY_H
+#define TEMPORARY_DIRECTORY_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Directory created under $TMPDIR (or /tmp), removed with its files at the end of the test
+ */
+class TemporaryDirectory {
+public:
+  TemporaryDirectory() {
+    const char *parent = getenv("TMPDIR");
+    std::string pattern = std::string((parent != NULL) && (*parent != '\0') ? parent : "/tmp") + "/winscard_test.XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    if (mkdtemp(name.data()) == NULL) {
+      throw std::runtime_error("Can't create a directory from " + pattern);
+    }
+    directory = name.data();
+  }
+
+  TemporaryDirectory(const TemporaryDirectory &other) = delete;
+
+  TemporaryDirectory &operator=(const TemporaryDirectory &other) = delete;
+
+  ~TemporaryDirectory() {
+    DIR *entries = opendir(directory.c_str());
+    if (entries != NULL) {
+      for (struct dirent *entry = readdir(entries); entry != NULL; entry = readdir(entries)) {
+        std::string file(entry->d_name);
+        if ((file != ".") && (file != "..")) {
+          std::remove(path(file).c_str());
+        }
+      }
+      closedir(entries);
+    }
+    rmdir(directory.c_str());
+  }
+
+  const std::string &path() const {
+    return directory;
+  }
+
+  /**
+   * Path of the file in the directory
+   */
+  std::string path(const std::string &file) const {
+    return directory + "/" + file;
+  }
+
+private:
+  std::string directory;
+};
+
+#endif //TEMPORARY_DIRECTORY_H
@@ -0,0 +1,155 @@
+//
+// Tests of the heap allocations of the hot paths, in their own executable which counts the allocations
+//
+
+#define CATCH_CONFIG_MAIN
+#include <winscard.h>
+#include <fstream>
+#include <string>
+#include <pcsclite.h>
+#include "catch.hpp"
+#include "allocation_counter.h"
+#include "stubbing.h"
+#include "winscard_stub.h"
+
+#define WARM_UP_CALLS     16
+#define MEASURED_CALLS    1000
+#define CHAINED_DATA_SIZE 8192
+
+TEST_CASE( "AllocationScope counting", "[Allocations]") {
+  // The assertions allocate, the counts are taken before them
+  AllocationScope outer;
+  AllocationScope inner;
+  void *memory = malloc(100);
+  int *value = new int(1);
+  uint64_t innerAllocations = inner.allocations();
+  uint64_t innerBytes = inner.bytes();
+  std::string text(100, 'a');
+  uint64_t outerAllocations = outer.allocations();
+  AllocationScope empty;
+  uint64_t emptyAllocations = empty.allocations();
+  delete value;
+  free(memory);
+  REQUIRE( innerAllocations == 2 );
+  REQUIRE( innerBytes == 100 + sizeof(int) );
+  REQUIRE( outerAllocations == 3 );
+  REQUIRE( emptyAllocations == 0 );
+}
+
+TEST_CASE( "Hot paths without allocation", "[Allocations]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  {
+    std::ofstream table("allocation_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "00B0000000 => " << std::string(2 * CHAINED_DATA_SIZE, 'A') << "9000\n"
+             "DEFAULT => 9000\n";
+  }
+  REQUIRE( SCardRegisterSmartCard("allocation card", "table", "allocation_card.txt") == SCARD_S_SUCCESS );
+  REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+  REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+  REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "allocation card") == SCARD_S_SUCCESS );
+  REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                        &dwActiveProtocol) == SCARD_S_SUCCESS );
+
+  SECTION("SCardStatus") {
+    char reader[64];
+    unsigned char atr[MAX_ATR_SIZE];
+    DWORD state;
+    DWORD protocol;
+    for (int i = 0; i < WARM_UP_CALLS + MEASURED_CALLS; i++) {
+      DWORD readerLg = sizeof(reader);
+      DWORD atrLg = sizeof(atr);
+      AllocationScope scope;
+      LONG ret = SCardStatus(hCard, reader, &readerLg, &state, &protocol, atr, &atrLg);
+      uint64_t allocations = scope.allocations();
+      REQUIRE( ret == SCARD_S_SUCCESS );
+      if (i >= WARM_UP_CALLS) {
+        REQUIRE( allocations == 0 );
+      }
+    }
+  }
+
+  SECTION("SCardTransmit") {
+    unsigned char command[] = { 0x00, 0xCA, 0x00, 0x00, 0x00 };
+    unsigned char response[258];
+    for (int i = 0; i < WARM_UP_CALLS + MEASURED_CALLS; i++) {
+      DWORD responseLg = sizeof(response);
+      AllocationScope scope;
+      LONG ret = SCardTransmit(hCard, NULL, command, sizeof(command), NULL, response, &responseLg);
+      uint64_t allocations = scope.allocations();
+      REQUIRE( ret == SCARD_S_SUCCESS );
+      if (i >= WARM_UP_CALLS) {
+        REQUIRE( allocations == 0 );
+      }
+    }
+  }
+
+  SECTION("SCardTransmit with response chaining") {
+    unsigned char read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+    unsigned char getResponse[] = { 0x00, 0xC0, 0x00, 0x00, 0x00 };
+    unsigned char response[258];
+    for (int i = 0; i < WARM_UP_CALLS + MEASURED_CALLS; i++) {
+      // The buffer of the response chaining is allocated by the connection, not by the first chained response
+      SCARDHANDLE hChained { 0 };
+      REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hChained,
+                            &dwActiveProtocol) == SCARD_S_SUCCESS );
+      size_t dataLg = 0;
+      DWORD responseLg = sizeof(response);
+      AllocationScope scope;
+      LONG ret = SCardTransmit(hChained, NULL, read, sizeof(read), NULL, response, &responseLg);
+      while ((ret == SCARD_S_SUCCESS) && (responseLg == 258) && (response[256] == 0x61)) {
+        dataLg += 256;
+        getResponse[4] = response[257];
+        responseLg = sizeof(response);
+        ret = SCardTransmit(hChained, NULL, getResponse, sizeof(getResponse), NULL, response, &responseLg);
+      }
+      uint64_t allocations = scope.allocations();
+      REQUIRE( SCardDisconnect(hChained, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+      REQUIRE( ret == SCARD_S_SUCCESS );
+      REQUIRE( dataLg + responseLg - 2 == CHAINED_DATA_SIZE );
+      REQUIRE( response[responseLg - 2] == 0x90 );
+      if (i >= WARM_UP_CALLS) {
+        REQUIRE( allocations == 0 );
+      }
+    }
+  }
+
+  SECTION("SCardGetStatusChange with a state already changed") {
+    SCARD_READERSTATE readerStates[1] {};
+    for (int i = 0; i < WARM_UP_CALLS + MEASURED_CALLS; i++) {
+      readerStates[0].szReader = "Non Pinpad Reader 0";
+      readerStates[0].dwCurrentState = SCARD_STATE_EMPTY;
+      AllocationScope scope;
+      LONG ret = SCardGetStatusChange(hContext, 10, readerStates, 1);
+      uint64_t allocations = scope.allocations();
+      REQUIRE( ret == SCARD_S_SUCCESS );
+      if (i >= WARM_UP_CALLS) {
+        REQUIRE( allocations == 0 );
+      }
+      REQUIRE( (readerStates[0].dwEventState & SCARD_STATE_PRESENT) != 0 );
+      REQUIRE( (readerStates[0].dwEventState & SCARD_STATE_CHANGED) != 0 );
+    }
+  }
+
+  SECTION("get_return_code_for") {
+    SetReturnCodeFor fault("winscard", "SCardGetStatusChange", SCARD_E_NO_SERVICE);
+    for (int i = 0; i < WARM_UP_CALLS + MEASURED_CALLS; i++) {
+      AllocationScope scope;
+      long stubbed = get_return_code_for("winscard", "SCardGetStatusChange", SCARD_S_SUCCESS);
+      long notStubbed = get_return_code_for("winscard", "SCardEstablishContext", SCARD_S_SUCCESS);
+      long unknown = get_return_code_for("unknown module of the stubbing", "SCardEstablishContext", 1);
+      uint64_t allocations = scope.allocations();
+      REQUIRE( stubbed == SCARD_E_NO_SERVICE );
+      REQUIRE( notStubbed == SCARD_S_SUCCESS );
+      REQUIRE( unknown == 1 );
+      if (i >= WARM_UP_CALLS) {
+        REQUIRE( allocations == 0 );
+      }
+    }
+  }
+
+  REQUIRE( SCardDisconnect(hCard, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+  REQUIRE( SCardReleaseContext(hContext) == SCARD_S_SUCCESS );
+}
@@ -0,0 +1,104 @@
+//
+// Tests of the binary trace of the PC/SC calls
+//
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+#include "apdu_trace.h"
+
+static std::vector<unsigned char> readTrace(const char *path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::vector<unsigned char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+TEST_CASE( "ApduTrace recording", "[ApduTrace]") {
+  const unsigned char command[] = { 0x00, 0xB0, 0x00, 0x00, 0x02 };
+  const unsigned char response[] = { 0x01, 0x02, 0x90, 0x00 };
+  std::remove("apdu_trace.bin");
+
+  REQUIRE_FALSE( ApduTrace::recording() );
+  ApduTrace::record(TraceFunction::Cancel, ApduTrace::now(), 1, 0);
+  ApduTrace::start("apdu_trace.bin");
+  REQUIRE( ApduTrace::recording() );
+  REQUIRE_THROWS_AS( ApduTrace::start("apdu_trace.bin"), const std::logic_error & );
+
+  ApduTrace::record(TraceFunction::Transmit, ApduTrace::now(), 7, 0, command, sizeof(command), response,
+                    sizeof(response));
+  std::thread other([] {
+    for (int i = 0; i < 1000; i++) {
+      ApduTrace::record(TraceFunction::BeginTransaction, ApduTrace::now(), 8, i);
+    }
+  });
+  other.join();
+  ApduTrace::record(TraceFunction::Disconnect, ApduTrace::now(), 7, 0x80100069);
+  ApduTrace::stop();
+  REQUIRE_FALSE( ApduTrace::recording() );
+  ApduTrace::record(TraceFunction::Cancel, ApduTrace::now(), 1, 0);
+
+  std::vector<unsigned char> trace = readTrace("apdu_trace.bin");
+  uint64_t start = 0;
+  REQUIRE( ApduTrace::decodeHeader(trace.data(), trace.size(), &start) );
+  REQUIRE( start > 0 );
+
+  std::vector<TraceRecord> records;
+  size_t offset = ApduTrace::HEADER_SIZE;
+  while (offset < trace.size()) {
+    TraceRecord record;
+    size_t record_lg = 0;
+    REQUIRE( ApduTrace::decodeRecord(trace.data() + offset, trace.size() - offset, &record, &record_lg) );
+    records.push_back(record);
+    offset += record_lg;
+  }
+  REQUIRE( offset == trace.size() );
+  REQUIRE( records.size() == 1002 );
+
+  // The records of a thread are in order, the threads are flushed one after the other
+  unsigned int transactions = 0;
+  for (const TraceRecord &record : records) {
+    if (record.function == static_cast<uint16_t>(TraceFunction::BeginTransaction)) {
+      REQUIRE( record.handle == 8 );
+      REQUIRE( record.result == transactions );
+      transactions++;
+    }
+    else if (record.function == static_cast<uint16_t>(TraceFunction::Transmit)) {
+      REQUIRE( record.handle == 7 );
+      REQUIRE( std::vector<unsigned char>(record.input, record.input + record.inputLg) ==
+               std::vector<unsigned char>(command, command + sizeof(command)) );
+      REQUIRE( std::vector<unsigned char>(record.output, record.output + record.outputLg) ==
+               std::vector<unsigned char>(response, response + sizeof(response)) );
+    }
+    else {
+      REQUIRE( record.function == static_cast<uint16_t>(TraceFunction::Disconnect) );
+      REQUIRE( record.result == 0x80100069 );
+      REQUIRE( record.inputLg == 0 );
+      REQUIRE( record.outputLg == 0 );
+    }
+  }
+  REQUIRE( transactions == 1000 );
+
+  SECTION("Append a session") {
+    ApduTrace::start("apdu_trace.bin");
+    ApduTrace::record(TraceFunction::Cancel, ApduTrace::now(), 1, 0);
+    ApduTrace::stop();
+    std::vector<unsigned char> appended = readTrace("apdu_trace.bin");
+    REQUIRE( appended.size() == trace.size() + ApduTrace::HEADER_SIZE + ApduTrace::RECORD_HEADER_SIZE );
+    REQUIRE( ApduTrace::decodeHeader(appended.data() + trace.size(), appended.size() - trace.size(), &start) );
+  }
+
+  SECTION("Truncated record") {
+    TraceRecord record;
+    size_t record_lg = 0;
+    REQUIRE_FALSE( ApduTrace::decodeRecord(trace.data() + ApduTrace::HEADER_SIZE, ApduTrace::RECORD_HEADER_SIZE - 1,
+                                           &record, &record_lg) );
+    REQUIRE_FALSE( ApduTrace::decodeHeader(trace.data() + 1, trace.size() - 1, &start) );
+  }
+
+  SECTION("Unwritable file") {
+    REQUIRE_THROWS_AS( ApduTrace::start("missing_directory/apdu_trace.bin"), const std::runtime_error & );
+    REQUIRE_FALSE( ApduTrace::recording() );
+  }
+}
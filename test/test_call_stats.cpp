@@ -0,0 +1,106 @@
+//
+// Tests of the counters of the PC/SC calls and of the APDUs of the readers
+//
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+#include "call_stats.h"
+
+TEST_CASE( "CallStats buckets", "[CallStats]") {
+  REQUIRE( CallStats::bucketOf(0) == 0 );
+  REQUIRE( CallStats::bucketOf(15) == 15 );
+  REQUIRE( CallStats::bucketOf(16) == 16 );
+  REQUIRE( CallStats::bucketOf(31) == 31 );
+  REQUIRE( CallStats::bucketOf(32) == 32 );
+  REQUIRE( CallStats::bucketOf(33) == 32 );
+  REQUIRE( CallStats::bucketOf(34) == 33 );
+  REQUIRE( CallStats::bucketOf(UINT64_MAX) == CallStats::BUCKETS - 1 );
+  REQUIRE( CallStats::bucketOf((uint64_t(1) << 37) - 1) == CallStats::BUCKETS - 1 );
+
+  // The lower bound of each bucket falls in the bucket, and the bounds increase by at most 1/16
+  for (size_t bucket = 0; bucket < CallStats::BUCKETS; bucket++) {
+    uint64_t bound = CallStats::bucketLowerBound(bucket);
+    REQUIRE( CallStats::bucketOf(bound) == bucket );
+    if (bucket > 0) {
+      REQUIRE( CallStats::bucketOf(bound - 1) == bucket - 1 );
+    }
+    if (bucket >= CallStats::SUB_BUCKETS) {
+      REQUIRE( (CallStats::bucketLowerBound(bucket + 1) - bound) * CallStats::SUB_BUCKETS <= bound );
+    }
+  }
+}
+
+TEST_CASE( "CallStats recording", "[CallStats]") {
+  std::vector<CallStats::FunctionStats> before(CallStats::FUNCTIONS);
+  CallStats::snapshot(before.data());
+  size_t cancel = static_cast<size_t>(TraceFunction::Cancel) - 1;
+
+  CallStats::record(TraceFunction::Cancel, CallStats::ticks(), false);
+  std::thread other([] {
+    for (int i = 0; i < 1000; i++) {
+      CallStats::record(TraceFunction::Cancel, CallStats::ticks(), (i % 4) == 0);
+    }
+  });
+  other.join();
+
+  std::vector<CallStats::FunctionStats> after(CallStats::FUNCTIONS);
+  CallStats::snapshot(after.data());
+  REQUIRE( after[cancel].calls - before[cancel].calls == 1001 );
+  REQUIRE( after[cancel].errors - before[cancel].errors == 250 );
+  REQUIRE( after[cancel].maxNanoseconds >= before[cancel].maxNanoseconds );
+  uint64_t histogram = 0;
+  for (size_t bucket = 0; bucket < CallStats::BUCKETS; bucket++) {
+    histogram += after[cancel].latency[bucket] - before[cancel].latency[bucket];
+  }
+  REQUIRE( histogram == 1001 );
+  // A call of 20 microseconds is measured within the error of the calibration of the clock
+  uint64_t start = CallStats::ticks();
+  std::this_thread::sleep_for(std::chrono::microseconds(20));
+  CallStats::record(TraceFunction::Cancel, start, false);
+  CallStats::snapshot(after.data());
+  REQUIRE( after[cancel].maxNanoseconds >= 15000 );
+}
+
+TEST_CASE( "ReaderStats recording", "[CallStats]") {
+  ReaderStats stats;
+  ReaderStats::Counters counters;
+  stats.record(5, 4, 0x90, false);
+  stats.record(5, 2, 0x6A, false);
+  stats.record(5, 2, 0x90, false);
+  stats.record(260, 0, -1, false);
+  stats.record(5, 0, -1, true);
+  stats.snapshot(&counters);
+  REQUIRE( counters.apdus == 5 );
+  REQUIRE( counters.errors == 1 );
+  REQUIRE( counters.bytesIn == 275 );
+  REQUIRE( counters.bytesOut == 8 );
+  REQUIRE( counters.sw1[0x90] == 2 );
+  REQUIRE( counters.sw1[0x6A] == 1 );
+  REQUIRE( counters.sw1[0x61] == 0 );
+}
+
+TEST_CASE( "WakeupStats recording", "[CallStats]") {
+  std::unique_ptr<WakeupStats::Counters> before(new WakeupStats::Counters);
+  std::unique_ptr<WakeupStats::Counters> after(new WakeupStats::Counters);
+  WakeupStats::snapshot(before.get());
+  uint64_t raised = WakeupStats::now();
+  std::thread waiter([raised] {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    WakeupStats::record(raised);
+  });
+  waiter.join();
+  // An event raised after the wakeup is counted as an immediate wakeup
+  WakeupStats::record(WakeupStats::now() + 1000000);
+  WakeupStats::snapshot(after.get());
+  REQUIRE( after->wakeups - before->wakeups == 2 );
+  REQUIRE( after->totalNanoseconds - before->totalNanoseconds >= 200000 );
+  REQUIRE( after->maxNanoseconds >= 200000 );
+  REQUIRE( after->latency[0] - before->latency[0] == 1 );
+  uint64_t histogram = 0;
+  for (size_t bucket = 0; bucket < CallStats::BUCKETS; bucket++) {
+    histogram += after->latency[bucket] - before->latency[bucket];
+  }
+  REQUIRE( histogram == 2 );
+}
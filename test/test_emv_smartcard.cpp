@@ -0,0 +1,222 @@
+//
+// Tests of the EMV smartcard and of AES
+//
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "catch.hpp"
+#include "card_session.h"
+#include "emv_smartcard.h"
+
+static const char EMV_CARD[] =
+  "# EMV test card\n"
+  "ATR 3B 6E 00 00 80 31 80 66 B0 84 0C 01 6E 01 83 00 90 00\n"
+  "APPLICATION A0000000041010 DEBIT MASTERCARD\n"
+  "PRIORITY 1\n"
+  "PDOL 9F3501\n"
+  "AIP 1980\n"
+  "AFL 08010100 10010200\n"
+  "RECORD 1 1 5A0854133300896000135F24032512318C069F02069F37048D058A029F3704\n"
+  "RECORD 2 1 8E0A00000000000000001F03\n"
+  "RECORD 2 2 9F0702FF00\n"
+  "KEY 2B7E151628AED2A6ABF7158809CF4F3C\n"
+  "IAD 0110A00003220000\n"
+  "ATC 0010\n"
+  "\n"
+  "APPLICATION A0000000043060 MAESTRO\n"
+  "PRIORITY 2\n"
+  "AIP 1980\n"
+  "AFL 08010100\n"
+  "RECORD 1 1 8C039F3704\n"
+  "KEY 000102030405060708090A0B0C0D0E0F\n";
+
+TEST_CASE( "AES", "[EMV]") {
+  unsigned char block[Aes::BLOCK_SIZE];
+  std::vector<unsigned char> plain = hex("00112233445566778899AABBCCDDEEFF");
+
+  SECTION("FIPS 197 encryption") {
+    std::vector<unsigned char> key = hex("000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F");
+    Aes(key.data(), 16).encrypt(plain.data(), block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("69C4E0D86A7B0430D8CDB78070B4C55A") );
+    Aes(key.data(), 24).encrypt(plain.data(), block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("DDA97CA4864CDFE06EAF70A0EC0D7191") );
+    Aes(key.data(), 32).encrypt(plain.data(), block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("8EA2B7CA516745BFEAFC49904B496089") );
+    REQUIRE_THROWS_AS( Aes(key.data(), 8), const std::invalid_argument & );
+  }
+
+  SECTION("RFC 4493 CMAC") {
+    std::vector<unsigned char> key = hex("2B7E151628AED2A6ABF7158809CF4F3C");
+    std::vector<unsigned char> message = hex("6BC1BEE22E409F96E93D7E117393172AAE2D8A571E03AC9C9EB76FAC45AF8E51"
+                                             "30C81C46A35CE411E5FBC1191A0A52EFF69F2445DF4F9B17AD2B417BE66C3710");
+    Aes aes(key.data(), key.size());
+    aes.cmac(message.data(), 0, block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("BB1D6929E95937287FA37D129B756746") );
+    aes.cmac(message.data(), 16, block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("070A16B46B4D4144F79BDD9DD04A287C") );
+    aes.cmac(message.data(), 40, block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("DFA66747DE9AE63030CA32611497C827") );
+    aes.cmac(message.data(), 64, block);
+    REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex("51F0BEBF7E3B9D92FC49741779363CFE") );
+
+    unsigned char split[Aes::BLOCK_SIZE];
+    for (size_t prefix_lg = 0; prefix_lg <= 40; prefix_lg += 5) {
+      aes.cmac(message.data(), prefix_lg, message.data() + prefix_lg, 40 - prefix_lg, split);
+      REQUIRE( std::vector<unsigned char>(split, split + sizeof(split)) == hex("DFA66747DE9AE63030CA32611497C827") );
+    }
+  }
+
+  SECTION("Software and AES-NI implementations") {
+    std::vector<unsigned char> key = hex("000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F");
+    const char *ciphers[] = { "69C4E0D86A7B0430D8CDB78070B4C55A", "DDA97CA4864CDFE06EAF70A0EC0D7191",
+                              "8EA2B7CA516745BFEAFC49904B496089" };
+    for (int hardware = 0; hardware < 2; hardware++) {
+      for (size_t i = 0; i < 3; i++) {
+        Aes aes(key.data(), 16 + 8 * i, hardware != 0);
+        REQUIRE( aes.isHardware() == ((hardware != 0) && Aes::hardwareSupported()) );
+        aes.encrypt(plain.data(), block);
+        REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == hex(ciphers[i]) );
+        aes.decrypt(block, block);
+        REQUIRE( std::vector<unsigned char>(block, block + sizeof(block)) == plain );
+      }
+    }
+  }
+
+  SECTION("SP 800-38A CBC") {
+    std::vector<unsigned char> key = hex("2B7E151628AED2A6ABF7158809CF4F3C");
+    std::vector<unsigned char> message = hex("6BC1BEE22E409F96E93D7E117393172AAE2D8A571E03AC9C9EB76FAC45AF8E51"
+                                             "30C81C46A35CE411E5FBC1191A0A52EFF69F2445DF4F9B17AD2B417BE66C3710");
+    std::vector<unsigned char> expected = hex("7649ABAC8119B246CEE98E9B12E9197D5086CB9B507219EE95DB113A917678B2"
+                                              "73BED6B8E3C1743B7116E69E222295163FF1CAA1681FAC09120ECA307586E1A7");
+    for (int hardware = 0; hardware < 2; hardware++) {
+      Aes aes(key.data(), key.size(), hardware != 0);
+      std::vector<unsigned char> iv = hex("000102030405060708090A0B0C0D0E0F");
+      std::vector<unsigned char> data(message);
+      aes.encryptCbc(iv.data(), data.data(), data.data(), 4);
+      REQUIRE( data == expected );
+      REQUIRE( iv == hex("3FF1CAA1681FAC09120ECA307586E1A7") );
+
+      // 5 blocks, the last one after the blocks decrypted in parallel
+      iv = hex("000102030405060708090A0B0C0D0E0F");
+      data.insert(data.begin(), iv.begin(), iv.end());
+      std::vector<unsigned char> zero(Aes::BLOCK_SIZE, 0x00);
+      aes.decryptCbc(zero.data(), data.data(), data.data(), 5);
+      REQUIRE( std::vector<unsigned char>(data.begin() + Aes::BLOCK_SIZE, data.end()) == message );
+      REQUIRE( zero == hex("3FF1CAA1681FAC09120ECA307586E1A7") );
+    }
+  }
+}
+
+TEST_CASE( "EmvSmartCard transaction", "[EMV]") {
+  std::istringstream definition(EMV_CARD);
+  auto emv = EmvCardTemplate::load(definition);
+  CardSession<EmvSmartCard> session(emv);
+
+  SECTION("Payment system environment") {
+    REQUIRE( session.transmit(hex("00A404000E315041592E5359532E444446303100")) ==
+             hex("6F15 840E315041592E5359532E4444463031 A503880101 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) ==
+             hex("7020 611E 4F07A0000000041010 50104445424954204D415354455243415244 870101 9000") );
+    REQUIRE( session.transmit(hex("00B2020C00")) == hex("7017 6115 4F07A0000000043060 50074D41455354524F 870102 9000") );
+    REQUIRE( session.transmit(hex("00B2030C00")) == hex("6A83") );
+    REQUIRE( session.transmit(hex("00B2011400")) == hex("6A83") );
+
+    REQUIRE( session.transmit(hex("00A404000E325041592E5359532E444446303100")) ==
+             hex("6F4C 840E325041592E5359532E4444463031 A53A BF0C37"
+                 "611E 4F07A0000000041010 50104445424954204D415354455243415244 870101"
+                 "6115 4F07A0000000043060 50074D41455354524F 870102 9000") );
+  }
+
+  SECTION("Transaction with an online authorisation") {
+    REQUIRE( session.transmit(hex("80A8000002830000")) == hex("6985") );
+    REQUIRE( session.transmit(hex("00A4040007A000000004101000")) ==
+             hex("6F26 8407A0000000041010 A51B 50104445424954204D415354455243415244 870101 9F38039F3501 9000") );
+    REQUIRE( session.transmit(hex("80AE80000A0000000010001122334400")) == hex("6985") );
+    REQUIRE( session.transmit(hex("80A8000002830000")) == hex("6700") );
+    REQUIRE( session.transmit(hex("80A800000383012200")) == hex("800A 1980 0801010010010200 9000") );
+    REQUIRE( session.transmit(hex("80CA9F3600")) == hex("9F36020011 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) ==
+             hex("701F 5A085413330089600013 5F2403251231 8C069F02069F3704 8D058A029F3704 9000") );
+    REQUIRE( session.transmit(hex("00B2011400")) == hex("700C 8E0A00000000000000001F03 9000") );
+    REQUIRE( session.transmit(hex("00B2031400")) == hex("6A83") );
+
+    REQUIRE( session.transmit(hex("80AE80000900000000100011223300")) == hex("6700") );
+    REQUIRE( session.transmit(hex("80AE80000A0000000010001122334400")) ==
+             hex("8013 80 0011 238C1530E7C2C6BB 0110A00003220000 9000") );
+    REQUIRE( session.transmit(hex("80AE40000630301122334400")) ==
+             hex("8013 40 0011 A88A9D1126260CC4 0110A00003220000 9000") );
+    REQUIRE( session.transmit(hex("80AE40000630301122334400")) == hex("6985") );
+
+    // The next transaction increments the ATC
+    REQUIRE( session.transmit(hex("00A4040007A000000004101000")).size() == 42 );
+    REQUIRE( session.transmit(hex("80A800000383012200")) == hex("800A 1980 0801010010010200 9000") );
+    REQUIRE( session.transmit(hex("80CA9F3600")) == hex("9F36020012 9000") );
+  }
+
+  SECTION("Selection of the applications") {
+    REQUIRE( session.transmit(hex("00A4040005A00000000400")).size() == 42 );
+    REQUIRE( session.transmit(hex("00A4040205A00000000400")) ==
+             hex("6F17 8407A0000000043060 A50C 50074D41455354524F 870102 9000") );
+    REQUIRE( session.transmit(hex("00A4040205A00000000400")) == hex("6A82") );
+    REQUIRE( session.transmit(hex("00A4040007A000000004999900")) == hex("6A82") );
+    REQUIRE( session.transmit(hex("00A4000007A000000004101000")) == hex("6A86") );
+    REQUIRE( session.transmit(hex("80A4040007A000000004101000")) == hex("6E00") );
+    REQUIRE( session.transmit(hex("0084000008")) == hex("6D00") );
+  }
+
+  SECTION("Transactions on two logical channels") {
+    REQUIRE( session.transmit(hex("0070000001")) == hex("01 9000") );
+    REQUIRE( session.transmit(hex("00A4040007A000000004101000")).size() == 42 );
+    REQUIRE( session.transmit(hex("01A4040007A000000004306000")).size() == 27 );
+    REQUIRE( session.transmit(hex("80A800000383012200")) == hex("800A 1980 0801010010010200 9000") );
+    REQUIRE( session.transmit(hex("81A8000002830000")) == hex("8006 1980 08010100 9000") );
+    REQUIRE( session.transmit(hex("01B2010C00")) == hex("7005 8C039F3704 9000") );
+
+    // Closing the channel resets its selection
+    REQUIRE( session.transmit(hex("0070800100")) == hex("9000") );
+    REQUIRE( session.transmit(hex("0070000100")) == hex("9000") );
+    REQUIRE( session.transmit(hex("01B2010C00")) == hex("6985") );
+    REQUIRE( session.transmit(hex("80CA9F3600")) == hex("9F36020011 9000") );
+  }
+
+  SECTION("Cards of the same template have their own ATC") {
+    CardSession<EmvSmartCard> other(emv);
+    other.transmit(hex("00A4040007A000000004101000"));
+    other.transmit(hex("80A800000383012200"));
+    REQUIRE( other.transmit(hex("80CA9F3600")) == hex("9F36020011 9000") );
+    session.transmit(hex("00A4040007A000000004101000"));
+    REQUIRE( session.transmit(hex("80CA9F3600")) == hex("9F36020010 9000") );
+  }
+}
+
+TEST_CASE( "EmvCardTemplate loading", "[EMV]") {
+
+  SECTION("Registration") {
+    {
+      std::ofstream out("emv_card.txt");
+      out << EMV_CARD;
+    }
+    REQUIRE( SmartCard::register_implementation("emv test card", "emv", "emv_card.txt") == SCARD_S_SUCCESS );
+    std::unique_ptr<SmartCard> card = SmartCard::instance_of("emv test card");
+    REQUIRE( card != nullptr );
+    REQUIRE( card->getATR().size() == 18 );
+    REQUIRE( card->getPreferredProtocol() == (SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1) );
+    REQUIRE( SmartCard::register_implementation("emv test card", "emv", "missing_emv_card.txt") == SCARD_E_FILE_NOT_FOUND );
+  }
+
+  SECTION("Malformed definitions") {
+    std::istringstream noApplication("ATR 3B00\n");
+    REQUIRE_THROWS_AS( EmvCardTemplate::load(noApplication), const std::invalid_argument & );
+    std::istringstream outside("ATR 3B00\nAIP 1980\n");
+    REQUIRE_THROWS_AS( EmvCardTemplate::load(outside), const std::invalid_argument & );
+    std::istringstream missingRecord("ATR 3B00\nAPPLICATION A0000000041010\nAFL 08010200\nRECORD 1 1 8C039F3704\n"
+                                     "KEY 000102030405060708090A0B0C0D0E0F\n");
+    REQUIRE_THROWS_AS( EmvCardTemplate::load(missingRecord), const std::invalid_argument & );
+    std::istringstream noCdol("ATR 3B00\nAPPLICATION A0000000041010\nAFL 08010100\nRECORD 1 1 5A0854133300896000\n"
+                              "KEY 000102030405060708090A0B0C0D0E0F\n");
+    REQUIRE_THROWS_AS( EmvCardTemplate::load(noCdol), const std::invalid_argument & );
+    std::istringstream badKey("ATR 3B00\nAPPLICATION A0000000041010\nAFL 08010100\nRECORD 1 1 8C039F3704\nKEY 0001\n");
+    REQUIRE_THROWS_AS( EmvCardTemplate::load(badKey), const std::invalid_argument & );
+  }
+}
@@ -0,0 +1,176 @@
+//
+// Tests of the file system image and the file system smartcard
+//
+
+#include <fstream>
+#include "catch.hpp"
+#include "card_session.h"
+#include "file_system_smartcard.h"
+#include "temporary_directory.h"
+
+static std::vector<unsigned char> sequence(size_t lg) {
+  std::vector<unsigned char> data(lg);
+  for (size_t i = 0; i < lg; i++) {
+    data[i] = static_cast<unsigned char>(i);
+  }
+  return data;
+}
+
+static uint16_t sw(const std::vector<unsigned char> &response) {
+  return static_cast<uint16_t>((response[response.size() - 2] << 8) | response[response.size() - 1]);
+}
+
+static void writeImage(const std::string &path) {
+  FileSystemImageBuilder builder({ 0x3B, 0x02, 0x14, 0x50 }, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1);
+
+  builder.addTransparentEF(FileSystemImageBuilder::MF, 0x2F00, sequence(600), 1);
+  size_t df = builder.addDF(FileSystemImageBuilder::MF, 0x7F10, { 0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01 });
+  builder.addTransparentEF(df, 0x5FC1, sequence(3000), 2);
+  builder.addRecordEF(df, 0x5031, { { 0x01, 0x01 }, { 0x02, 0x02, 0x02 }, { 0x03 } }, 3);
+  builder.write(path);
+}
+
+TEST_CASE( "FileSystemImage loading", "[FileSystemSmartCard]") {
+  TemporaryDirectory directory;
+  writeImage(directory.path("fs_test.img"));
+
+  SECTION("Success") {
+    auto image = FileSystemImage::open(directory.path("fs_test.img"));
+
+    REQUIRE( image->fileCount() == 5 );
+    REQUIRE( image->header().atrLg == 4 );
+    REQUIRE( image->findChild(0, 0x7F10) == 2 );
+    REQUIRE( image->findChild(2, 0x2F00) == FileSystemImage::NOT_FOUND );
+    REQUIRE( image->findShortIdentifier(2, 3) == 4 );
+    REQUIRE( image->findName(std::vector<unsigned char>({ 0xA0, 0x00, 0x00, 0x03, 0x08 }).data(), 5) == 2 );
+  }
+
+  SECTION("Fail with missing image") {
+    REQUIRE_THROWS_AS( FileSystemImage::open(directory.path("missing.img")), const std::runtime_error & );
+  }
+
+  SECTION("Fail with malformed image") {
+    {
+      std::ofstream out(directory.path("fs_malformed.img"), std::ios::binary);
+      out << std::string(200, 'x');
+    }
+    REQUIRE_THROWS_AS( FileSystemImage::open(directory.path("fs_malformed.img")), const std::invalid_argument & );
+  }
+}
+
+TEST_CASE( "FileSystemSmartCard commands", "[FileSystemSmartCard]") {
+  TemporaryDirectory directory;
+  writeImage(directory.path("fs_test.img"));
+  auto image = FileSystemImage::open(directory.path("fs_test.img"));
+  CardSession<FileSystemSmartCard> session(image);
+
+  SECTION("SELECT MF and EF by FID") {
+    auto response = session.transmit({ 0x00, 0xA4, 0x00, 0x04, 0x02, 0x3F, 0x00, 0x00 });
+
+    REQUIRE( sw(response) == 0x9000 );
+    REQUIRE( response[0] == 0x62 );
+    REQUIRE( response[1] == response.size() - 4 );
+    REQUIRE( response[4] == 0x38 );
+
+    response = session.transmit({ 0x00, 0xA4, 0x00, 0x04, 0x02, 0x2F, 0x00, 0x00 });
+    REQUIRE( sw(response) == 0x9000 );
+    REQUIRE( response[4] == 0x01 );
+    // 80 04 00 00 02 58: size of 600 bytes
+    REQUIRE( response[9] == 0x80 );
+    REQUIRE( response[14] == 0x58 );
+  }
+
+  SECTION("SELECT by DF name and path") {
+    auto response = session.transmit({ 0x00, 0xA4, 0x04, 0x0C, 0x05, 0xA0, 0x00, 0x00, 0x03, 0x08 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x90, 0x00 }) );
+
+    response = session.transmit({ 0x00, 0xA4, 0x08, 0x0C, 0x04, 0x7F, 0x10, 0x5F, 0xC1 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x90, 0x00 }) );
+
+    response = session.transmit({ 0x00, 0xA4, 0x09, 0x0C, 0x02, 0x7F, 0x10 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x6A, 0x82 }) );
+  }
+
+  SECTION("READ BINARY of the current EF and by short identifier") {
+    session.transmit({ 0x00, 0xA4, 0x08, 0x0C, 0x06, 0x3F, 0x00, 0x7F, 0x10, 0x5F, 0xC1 });
+
+    auto response = session.transmit({ 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x00 });
+    REQUIRE( response.size() == 3002 );
+    REQUIRE( response[2999] == static_cast<unsigned char>(2999) );
+    REQUIRE( sw(response) == 0x9000 );
+
+    response = session.transmit({ 0x00, 0xB0, 0x0B, 0xB0, 0x10 });
+    REQUIRE( response.size() == 10 );
+    REQUIRE( sw(response) == 0x6282 );
+
+    response = session.transmit({ 0x00, 0xB0, 0x0B, 0xB9, 0x10 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x6B, 0x00 }) );
+
+    session.transmit({ 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x3F, 0x00 });
+    response = session.transmit({ 0x00, 0xB0, 0x81, 0x10, 0x04 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x10, 0x11, 0x12, 0x13, 0x90, 0x00 }) );
+  }
+
+  SECTION("UPDATE BINARY is private to the card") {
+    session.transmit({ 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x2F, 0x00 });
+
+    auto response = session.transmit({ 0x00, 0xD6, 0x00, 0x02, 0x02, 0xCA, 0xFE });
+    REQUIRE( response == std::vector<unsigned char>({ 0x90, 0x00 }) );
+    response = session.transmit({ 0x00, 0xB0, 0x00, 0x00, 0x04 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x00, 0x01, 0xCA, 0xFE, 0x90, 0x00 }) );
+
+    CardSession<FileSystemSmartCard> other(image);
+    response = other.transmit({ 0x00, 0xB0, 0x81, 0x00, 0x04 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x00, 0x01, 0x02, 0x03, 0x90, 0x00 }) );
+
+    response = session.transmit({ 0x00, 0xD6, 0x02, 0x57, 0x02, 0xCA, 0xFE });
+    REQUIRE( response == std::vector<unsigned char>({ 0x67, 0x00 }) );
+  }
+
+  SECTION("Responses of the cache") {
+    session.card.setResponseCache(8);
+    const std::vector<unsigned char> select = { 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x2F, 0x00 };
+    const std::vector<unsigned char> read = { 0x00, 0xB0, 0x00, 0x00, 0x04 };
+    REQUIRE( session.transmit(select) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+    REQUIRE( session.transmit(select) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+    REQUIRE( session.transmit(read) == std::vector<unsigned char>({ 0x00, 0x01, 0x02, 0x03, 0x90, 0x00 }) );
+    REQUIRE( session.transmit(read) == std::vector<unsigned char>({ 0x00, 0x01, 0x02, 0x03, 0x90, 0x00 }) );
+    REQUIRE( session.transmit(select) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+    REQUIRE( session.card.getResponseCacheCounters()->hits == 2 );
+    REQUIRE( session.card.getResponseCacheCounters()->misses == 3 );
+
+    // UPDATE BINARY starts a new state, the next READ BINARY has the new contents
+    session.transmit({ 0x00, 0xD6, 0x00, 0x02, 0x02, 0xCA, 0xFE });
+    REQUIRE( session.transmit(read) == std::vector<unsigned char>({ 0x00, 0x01, 0xCA, 0xFE, 0x90, 0x00 }) );
+    REQUIRE( session.transmit(read) == std::vector<unsigned char>({ 0x00, 0x01, 0xCA, 0xFE, 0x90, 0x00 }) );
+    REQUIRE( session.card.getResponseCacheCounters()->hits == 3 );
+
+    // The current EF is part of the state: SELECT of another EF isn't answered by the cache
+    session.transmit({ 0x00, 0xA4, 0x08, 0x0C, 0x04, 0x7F, 0x10, 0x5F, 0xC1 });
+    REQUIRE( session.transmit(read) == std::vector<unsigned char>({ 0x00, 0x01, 0x02, 0x03, 0x90, 0x00 }) );
+    REQUIRE( session.transmit(select) == std::vector<unsigned char>({ 0x6A, 0x82 }) );
+    REQUIRE( session.card.getResponseCacheCounters()->hits == 3 );
+  }
+
+  SECTION("READ RECORD") {
+    session.transmit({ 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x7F, 0x10 });
+
+    auto response = session.transmit({ 0x00, 0xB2, 0x02, 0x1C, 0x00 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x02, 0x02, 0x02, 0x90, 0x00 }) );
+
+    response = session.transmit({ 0x00, 0xB2, 0x03, 0x04, 0x00 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x03, 0xFF, 0xFF, 0x90, 0x00 }) );
+
+    response = session.transmit({ 0x00, 0xB2, 0x04, 0x04, 0x00 });
+    REQUIRE( response == std::vector<unsigned char>({ 0x6A, 0x83 }) );
+  }
+
+  SECTION("Errors") {
+    REQUIRE( session.transmit({ 0x00, 0xB0, 0x00, 0x00, 0x10 }) == std::vector<unsigned char>({ 0x69, 0x86 }) );
+    REQUIRE( session.transmit({ 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x12, 0x34 }) == std::vector<unsigned char>({ 0x6A, 0x82 }) );
+    REQUIRE( session.transmit({ 0x00, 0xB0, 0x83, 0x00, 0x10 }) == std::vector<unsigned char>({ 0x6A, 0x82 }) );
+    session.transmit({ 0x00, 0xA4, 0x08, 0x0C, 0x04, 0x7F, 0x10, 0x50, 0x31 });
+    REQUIRE( session.transmit({ 0x00, 0xB0, 0x00, 0x00, 0x10 }) == std::vector<unsigned char>({ 0x69, 0x81 }) );
+    REQUIRE( session.transmit({ 0x00, 0xCA, 0x00, 0x00, 0x10 }) == std::vector<unsigned char>({ 0x6D, 0x00 }) );
+  }
+}
@@ -0,0 +1,364 @@
+//
+// Tests of the GlobalPlatform card manager
+//
+
+#include <sstream>
+#include "catch.hpp"
+#include "aes.h"
+#include "card_session.h"
+#include "global_platform_smartcard.h"
+
+/**
+ * Session which also sends the LOAD blocks of a load file
+ */
+class GlobalPlatformSession : public CardSession<GlobalPlatformSmartCard> {
+public:
+  using CardSession::CardSession;
+
+  /**
+   * LOAD block of the load file
+   */
+  std::vector<unsigned char> load(const std::vector<unsigned char> &file, size_t offset, size_t length,
+                                  unsigned char block, bool last) {
+    std::vector<unsigned char> command = { 0x80, 0xE8, static_cast<unsigned char>(last ? 0x80 : 0x00), block,
+                                           static_cast<unsigned char>(length) };
+    command.insert(command.end(), file.begin() + offset, file.begin() + offset + length);
+    command.push_back(0x00);
+    return transmit(command);
+  }
+};
+
+/**
+ * Load file C4 { contents } of 304 bytes
+ */
+static std::vector<unsigned char> loadFile() {
+  std::vector<unsigned char> file = hex("C482012C");
+  for (unsigned int i = 0; i < 300; i++) {
+    file.push_back(static_cast<unsigned char>(i));
+  }
+  return file;
+}
+
+TEST_CASE( "AppendOnlyStore", "[GP]") {
+  AppendOnlyStore store;
+  std::vector<unsigned char> block(255);
+  std::vector<unsigned char> expected;
+  for (unsigned int i = 0; i < 1000; i++) {
+    for (size_t j = 0; j < block.size(); j++) {
+      block[j] = static_cast<unsigned char>(i + j);
+    }
+    store.append(block.data(), block.size());
+    expected.insert(expected.end(), block.begin(), block.end());
+  }
+  REQUIRE( store.size() == 255000 );
+
+  std::vector<unsigned char> contents(expected.size());
+  REQUIRE( store.read(0, contents.data(), contents.size()) );
+  REQUIRE( contents == expected );
+  REQUIRE( store.read(AppendOnlyStore::CHUNK_SIZE - 10, contents.data(), 20) );
+  REQUIRE( std::equal(contents.begin(), contents.begin() + 20, expected.begin() + AppendOnlyStore::CHUNK_SIZE - 10) );
+  REQUIRE_FALSE( store.read(254990, contents.data(), 20) );
+
+  store.truncate(100);
+  REQUIRE( store.size() == 100 );
+  store.append(block.data(), 10);
+  REQUIRE( store.read(100, contents.data(), 10) );
+  REQUIRE( std::equal(contents.begin(), contents.begin() + 10, block.begin()) );
+}
+
+TEST_CASE( "GlobalPlatformSmartCard provisioning", "[GP]") {
+  std::istringstream definition("ATR 3B 8F 80 01 80 4F 0C A0 00 00 03 06 03 00 03 00 00 00 00 68\nMEMORY 1000\n");
+  auto gp = GlobalPlatformCardTemplate::load(definition);
+  GlobalPlatformSession session(gp);
+  const std::vector<unsigned char> success = hex("00 9000");
+  const std::vector<unsigned char> installForLoad = hex("80E6020012 05D276000085 08A000000151000000 00 00 00 00");
+  const std::vector<unsigned char> installForInstall = hex("80E60C001B 05D276000085 06D27600008501 07D2760000850101"
+                                                           "0100 02C900 00 00");
+  std::vector<unsigned char> file = loadFile();
+
+  REQUIRE( session.transmit(installForLoad) == hex("6D00") );
+  REQUIRE( session.transmit(hex("00A4040008A00000015100000000")) == hex("6F10 8408A000000151000000 A5049F6501FF 9000") );
+
+  SECTION("Load and install") {
+    REQUIRE( session.transmit(installForLoad) == success );
+    REQUIRE( session.load(file, 0, 200, 0, false) == success );
+    REQUIRE( session.load(file, 200, 104, 1, true) == success );
+    std::vector<unsigned char> contents;
+    REQUIRE( session.card.getLoadFile(hex("D276000085"), contents) );
+    REQUIRE( contents == file );
+
+    REQUIRE( session.transmit(installForInstall) == success );
+    REQUIRE( session.card.isInstalled(hex("D2760000850101")) );
+    REQUIRE( session.transmit(installForInstall) == hex("6985") );
+    REQUIRE( session.transmit(installForLoad) == hex("6985") );
+
+    REQUIRE( session.transmit(hex("00A4040007D276000085010100")) == hex("9000") );
+    REQUIRE( session.transmit(installForLoad) == hex("6D00") );
+    REQUIRE( session.transmit(hex("00A4040000")).size() == 20 );
+
+    const GlobalPlatformCounters &counters = session.card.getCounters();
+    const GlobalPlatformPhaseCounters &load = counters.phases[static_cast<size_t>(GlobalPlatformPhase::LOAD)];
+    REQUIRE( load.commands == 2 );
+    REQUIRE( load.bytes == 304 );
+    REQUIRE( load.elapsed >= load.processing );
+    REQUIRE( counters.phases[static_cast<size_t>(GlobalPlatformPhase::SELECT)].commands == 3 );
+    REQUIRE( counters.phases[static_cast<size_t>(GlobalPlatformPhase::INSTALL_FOR_LOAD)].commands == 2 );
+    REQUIRE( counters.phases[static_cast<size_t>(GlobalPlatformPhase::INSTALL_FOR_INSTALL)].commands == 2 );
+    REQUIRE( counters.loadFiles == 1 );
+    REQUIRE( counters.applets == 1 );
+  }
+
+  SECTION("Delete") {
+    session.transmit(installForLoad);
+    session.load(file, 0, 200, 0, false);
+    session.load(file, 200, 104, 1, true);
+    session.transmit(installForInstall);
+
+    REQUIRE( session.transmit(hex("80E4000007 4F05D276000085 00")) == hex("6985") );
+    REQUIRE( session.transmit(hex("80E4008007 4F05D276000085 00")) == success );
+    REQUIRE_FALSE( session.card.isInstalled(hex("D2760000850101")) );
+    REQUIRE( session.transmit(hex("80E4000007 4F05D276000085 00")) == hex("6A88") );
+
+    // The load file can be loaded again
+    REQUIRE( session.transmit(installForLoad) == success );
+    REQUIRE( session.load(file, 0, 200, 0, false) == success );
+    REQUIRE( session.load(file, 200, 104, 1, true) == success );
+  }
+
+  SECTION("Load sequence errors") {
+    REQUIRE( session.load(file, 0, 200, 0, false) == hex("6985") );
+
+    REQUIRE( session.transmit(installForLoad) == success );
+    REQUIRE( session.load(file, 0, 200, 0, false) == success );
+    REQUIRE( session.load(file, 200, 104, 2, true) == hex("6A86") );
+    REQUIRE( session.load(file, 200, 104, 1, true) == hex("6985") );
+
+    REQUIRE( session.transmit(installForLoad) == success );
+    REQUIRE( session.load(file, 0, 200, 0, true) == hex("6A80") );
+
+    // An other command aborts the load sequence
+    REQUIRE( session.transmit(installForLoad) == success );
+    REQUIRE( session.load(file, 0, 200, 0, false) == success );
+    REQUIRE( session.transmit(hex("00A4040008A00000015100000000")).size() == 20 );
+    REQUIRE( session.load(file, 200, 104, 1, true) == hex("6985") );
+
+    REQUIRE( session.transmit(installForInstall) == hex("6A88") );
+    REQUIRE( session.transmit(hex("80E602000B 05D276000085 08A0000001")) == hex("6A80") );
+    std::vector<unsigned char> contents;
+    REQUIRE_FALSE( session.card.getLoadFile(hex("D276000085"), contents) );
+  }
+
+  SECTION("Not enough memory") {
+    std::vector<unsigned char> large = hex("C48203E8");
+    large.resize(1004, 0xAA);
+    REQUIRE( session.transmit(installForLoad) == success );
+    for (unsigned char block = 0; block < 3; block++) {
+      REQUIRE( session.load(large, block * 250U, 250, block, false) == success );
+    }
+    REQUIRE( session.load(large, 750, 254, 3, true) == hex("6A84") );
+  }
+}
+
+/**
+ * Off-card entity of an SCP03 session
+ */
+class Scp03Host {
+public:
+  explicit Scp03Host(const std::vector<unsigned char> &key) : key(key), level(0), chaining(16), counter(16) {
+  }
+
+  static std::vector<unsigned char> derive(const Aes &aes, unsigned char constant, const std::vector<unsigned char> &context,
+                                           size_t length) {
+    std::vector<unsigned char> data(16, 0x00);
+    data[11] = constant;
+    data[13] = static_cast<unsigned char>((length * 8) >> 8);
+    data[14] = static_cast<unsigned char>(length * 8);
+    data[15] = 0x01;
+    data.insert(data.end(), context.begin(), context.end());
+    unsigned char mac[Aes::BLOCK_SIZE];
+    aes.cmac(data.data(), data.size(), mac);
+    return std::vector<unsigned char>(mac, mac + length);
+  }
+
+  /**
+   * Check the card cryptogram of the INITIALIZE UPDATE response and derive the session keys
+   */
+  bool initialize(const std::vector<unsigned char> &hostChallenge, const std::vector<unsigned char> &response) {
+    context = hostChallenge;
+    context.insert(context.end(), response.begin() + 13, response.begin() + 21);
+    Aes staticKey(key.data(), key.size());
+    sessionEnc = derive(staticKey, 0x04, context, 16);
+    sessionMac = derive(staticKey, 0x06, context, 16);
+    sessionRmac = derive(staticKey, 0x07, context, 16);
+    std::fill(chaining.begin(), chaining.end(), 0x00);
+    std::fill(counter.begin(), counter.end(), 0x00);
+    Aes mac(sessionMac.data(), sessionMac.size());
+    return derive(mac, 0x00, context, 8) == std::vector<unsigned char>(response.begin() + 21, response.begin() + 29);
+  }
+
+  std::vector<unsigned char> externalAuthenticate(unsigned char securityLevel) {
+    Aes mac(sessionMac.data(), sessionMac.size());
+    std::vector<unsigned char> command = wrap({ 0x80, 0x82, securityLevel, 0x00 }, derive(mac, 0x01, context, 8));
+    level = securityLevel;
+    return command;
+  }
+
+  /**
+   * Encrypt the data according to the security level and add the C-MAC
+   */
+  std::vector<unsigned char> wrap(std::vector<unsigned char> header, std::vector<unsigned char> data) {
+    if ((level & 0x02) != 0) {
+      for (size_t i = counter.size(); (i > 0) && (++counter[i - 1] == 0); i--) {
+      }
+      if (!data.empty()) {
+        data.push_back(0x80);
+        data.resize((data.size() + 15) / 16 * 16, 0x00);
+        Aes enc(sessionEnc.data(), sessionEnc.size());
+        std::vector<unsigned char> iv(16);
+        enc.encrypt(counter.data(), iv.data());
+        enc.encryptCbc(iv.data(), data.data(), data.data(), data.size() / 16);
+      }
+    }
+    header[0] |= 0x04;
+    std::vector<unsigned char> command(header);
+    command.push_back(static_cast<unsigned char>(data.size() + 8));
+    command.insert(command.end(), data.begin(), data.end());
+    std::vector<unsigned char> macData(chaining);
+    macData.insert(macData.end(), command.begin(), command.end());
+    Aes(sessionMac.data(), sessionMac.size()).cmac(macData.data(), macData.size(), chaining.data());
+    command.insert(command.end(), chaining.begin(), chaining.begin() + 8);
+    command.push_back(0x00);
+    return command;
+  }
+
+  /**
+   * Check the R-MAC and decrypt the response data
+   */
+  bool unwrap(const std::vector<unsigned char> &response, std::vector<unsigned char> &plain) {
+    if (response.size() < 10) {
+      return false;
+    }
+    std::vector<unsigned char> macData(chaining);
+    macData.insert(macData.end(), response.begin(), response.end() - 10);
+    macData.insert(macData.end(), response.end() - 2, response.end());
+    unsigned char mac[Aes::BLOCK_SIZE];
+    Aes(sessionRmac.data(), sessionRmac.size()).cmac(macData.data(), macData.size(), mac);
+    if (!std::equal(mac, mac + 8, response.end() - 10)) {
+      return false;
+    }
+    plain.assign(response.begin(), response.end() - 10);
+    if (((level & 0x20) != 0) && !plain.empty()) {
+      Aes enc(sessionEnc.data(), sessionEnc.size());
+      std::vector<unsigned char> iv(counter);
+      iv[0] = 0x80;
+      enc.encrypt(iv.data(), iv.data());
+      enc.decryptCbc(iv.data(), plain.data(), plain.data(), plain.size() / 16);
+      while (plain.back() == 0x00) {
+        plain.pop_back();
+      }
+      plain.pop_back();
+    }
+    plain.insert(plain.end(), response.end() - 2, response.end());
+    return true;
+  }
+
+private:
+  std::vector<unsigned char> key;
+  unsigned char level;
+  std::vector<unsigned char> context;
+  std::vector<unsigned char> sessionEnc;
+  std::vector<unsigned char> sessionMac;
+  std::vector<unsigned char> sessionRmac;
+  std::vector<unsigned char> chaining;
+  std::vector<unsigned char> counter;
+};
+
+TEST_CASE( "GlobalPlatformSmartCard SCP03", "[GP]") {
+  std::istringstream definition("ATR 3B 8F 80 01 80 4F 0C A0 00 00 03 06 03 00 03 00 00 00 00 68\n"
+                                "SCP03 30 404142434445464748494A4B4C4D4E4F 404142434445464748494A4B4C4D4E4F\n");
+  auto gp = GlobalPlatformCardTemplate::load(definition);
+  GlobalPlatformSession session(gp);
+  Scp03Host host(hex("404142434445464748494A4B4C4D4E4F"));
+  const std::vector<unsigned char> hostChallenge = hex("0001020304050607");
+  const std::vector<unsigned char> installForLoad = hex("05D276000085 08A000000151000000 00 00 00");
+  std::vector<unsigned char> file = loadFile();
+  std::vector<unsigned char> plain;
+
+  session.transmit(hex("00A4040000"));
+  REQUIRE( session.transmit(hex("80E6020013 05D276000085 08A000000151000000 00 00 00 00")) == hex("6982") );
+  std::vector<unsigned char> response = session.transmit(hex("8050000008 0001020304050607 00"));
+  REQUIRE( response.size() == 34 );
+  REQUIRE( std::vector<unsigned char>(response.begin() + 10, response.begin() + 13) == hex("300370") );
+  // Card challenge and card cryptogram of the KDF of SCP03 with the sequence counter 000001
+  REQUIRE( std::vector<unsigned char>(response.begin() + 13, response.end()) ==
+           hex("86C8BD65FA1044EE 7CED45F4C595BC4B 000001 9000") );
+  REQUIRE( host.initialize(hostChallenge, response) );
+
+  SECTION("C-MAC, C-DECRYPTION, R-MAC and R-ENCRYPTION") {
+    std::vector<unsigned char> authenticate = host.externalAuthenticate(0x33);
+    REQUIRE( std::vector<unsigned char>(authenticate.begin() + 5, authenticate.begin() + 13) == hex("DD233EF86835D803") );
+    REQUIRE( session.transmit(authenticate) == hex("9000") );
+
+    REQUIRE( host.unwrap(session.transmit(host.wrap(hex("80E60200"), installForLoad)), plain) );
+    REQUIRE( plain == hex("00 9000") );
+    std::vector<unsigned char> block(file.begin(), file.begin() + 200);
+    REQUIRE( host.unwrap(session.transmit(host.wrap(hex("80E80000"), block)), plain) );
+    REQUIRE( plain == hex("00 9000") );
+    block.assign(file.begin() + 200, file.end());
+    REQUIRE( host.unwrap(session.transmit(host.wrap(hex("80E88001"), block)), plain) );
+    REQUIRE( plain == hex("00 9000") );
+    std::vector<unsigned char> contents;
+    REQUIRE( session.card.getLoadFile(hex("D276000085"), contents) );
+    REQUIRE( contents == file );
+
+    // The errors are returned with an R-MAC
+    REQUIRE( host.unwrap(session.transmit(host.wrap(hex("80E40000"), hex("4F05D276000099"))), plain) );
+    REQUIRE( plain == hex("6A88") );
+
+    const GlobalPlatformCounters &counters = session.card.getCounters();
+    REQUIRE( counters.phases[static_cast<size_t>(GlobalPlatformPhase::AUTHENTICATE)].commands == 2 );
+    REQUIRE( counters.phases[static_cast<size_t>(GlobalPlatformPhase::LOAD)].bytes == 2 * 8 + 208 + 112 );
+  }
+
+  SECTION("C-MAC") {
+    REQUIRE( session.transmit(host.externalAuthenticate(0x01)) == hex("9000") );
+    REQUIRE( session.transmit(host.wrap(hex("80E60200"), installForLoad)) == hex("00 9000") );
+
+    // A command without the C-MAC or with a wrong one closes the session
+    std::vector<unsigned char> block(file.begin(), file.begin() + 200);
+    std::vector<unsigned char> load = host.wrap(hex("80E80000"), block);
+    load[load.size() - 2] ^= 0x01;
+    REQUIRE( session.transmit(load) == hex("6982") );
+    REQUIRE( session.transmit(host.wrap(hex("80E80000"), block)) == hex("6982") );
+  }
+
+  SECTION("Authentication failures") {
+    std::vector<unsigned char> authenticate = host.externalAuthenticate(0x01);
+    authenticate[5] ^= 0x01;
+    REQUIRE( session.transmit(authenticate) == hex("6982") );
+    REQUIRE( session.transmit(host.externalAuthenticate(0x01)) == hex("6985") );
+
+    response = session.transmit(hex("8050300008 0001020304050607 00"));
+    REQUIRE( std::vector<unsigned char>(response.end() - 5, response.end()) == hex("000002 9000") );
+    REQUIRE( host.initialize(hostChallenge, response) );
+    REQUIRE( session.transmit(host.externalAuthenticate(0x21)) == hex("6A86") );
+    REQUIRE( session.transmit(hex("8050310008 0001020304050607 00")) == hex("6A88") );
+    REQUIRE( session.transmit(hex("8050000004 00010203 00")) == hex("6700") );
+  }
+}
+
+TEST_CASE( "GlobalPlatformCardTemplate loading", "[GP]") {
+  std::istringstream missingAtr("ISD A000000151000000\n");
+  REQUIRE_THROWS_AS( GlobalPlatformCardTemplate::load(missingAtr), const std::invalid_argument & );
+  std::istringstream shortIsd("ATR 3B00\nISD A000\n");
+  REQUIRE_THROWS_AS( GlobalPlatformCardTemplate::load(shortIsd), const std::invalid_argument & );
+  std::istringstream unknown("ATR 3B00\nKEY 00\n");
+  REQUIRE_THROWS_AS( GlobalPlatformCardTemplate::load(unknown), const std::invalid_argument & );
+  std::istringstream keyLength("ATR 3B00\nSCP03 30 404142434445464748494A4B4C4D4E4F 4041424344454647\n");
+  REQUIRE_THROWS_AS( GlobalPlatformCardTemplate::load(keyLength), const std::invalid_argument & );
+  std::istringstream clear("ATR 3B00\n");
+  GlobalPlatformSession session(GlobalPlatformCardTemplate::load(clear));
+  session.transmit(hex("00A4040000"));
+  REQUIRE( session.transmit(hex("8050000008 0001020304050607 00")) == hex("6D00") );
+  REQUIRE( SmartCard::register_implementation("gp test card", "gp", "missing_gp_card.txt") == SCARD_E_FILE_NOT_FOUND );
+}
@@ -0,0 +1,73 @@
+//
+// Tests of the transport latency model of a reader
+//
+
+#include "catch.hpp"
+#include "latency_model.h"
+
+TEST_CASE( "LatencyModel exchange time", "[LatencyModel]") {
+  LatencyModel model(LatencyMode::VirtualClock, LatencyModel::DEFAULT_CLOCK_FREQUENCY, std::chrono::microseconds(0));
+
+  SECTION("Default baud rate without TA1") {
+    model.setATR({ 0x3B, 0x02, 0x14, 0x50 });
+
+    REQUIRE( model.getBaudRate() == 9600 );
+    // 8 characters of 12 etu at 9600 baud
+    REQUIRE( model.exchangeTime(SCARD_PROTOCOL_T0, 5, 2) == std::chrono::milliseconds(10) );
+  }
+
+  SECTION("Baud rate of TA1") {
+    model.setATR({ 0x3B, 0x10, 0x96 });
+
+    REQUIRE( model.getBaudRate() == 223200 );
+    REQUIRE( model.exchangeTime(SCARD_PROTOCOL_T0, 5, 2) < std::chrono::microseconds(500) );
+
+    model.setATR({ 0x3B, 0x02, 0x14, 0x50 });
+    REQUIRE( model.getBaudRate() == 9600 );
+  }
+
+  SECTION("T=1 estimate matches the simulated blocks") {
+    T1BlockCounters blocks = T1BlockCounters();
+    blocks.iBlocks = 2;
+    blocks.bytesToCard = 5 + 4;
+    blocks.bytesFromCard = 15 + 4;
+
+    REQUIRE( model.exchangeTime(SCARD_PROTOCOL_T1, 5, 15) == model.exchangeTime(blocks) );
+    REQUIRE( model.exchangeTime(SCARD_PROTOCOL_T1, 5, 3002) > model.exchangeTime(SCARD_PROTOCOL_T1, 5, 254) );
+  }
+
+  SECTION("Fixed overhead") {
+    LatencyModel ccid(LatencyMode::VirtualClock, LatencyModel::DEFAULT_CLOCK_FREQUENCY, std::chrono::microseconds(1000));
+
+    REQUIRE( ccid.exchangeTime(SCARD_PROTOCOL_T0, 5, 2) == std::chrono::milliseconds(11) );
+  }
+
+  SECTION("Invalid clock frequency") {
+    REQUIRE_THROWS_AS( LatencyModel(LatencyMode::Sleep, 0, std::chrono::microseconds(0)),
+                       const std::invalid_argument & );
+  }
+}
+
+TEST_CASE( "LatencyModel apply", "[LatencyModel]") {
+
+  SECTION("Virtual clock") {
+    LatencyModel model(LatencyMode::VirtualClock, LatencyModel::DEFAULT_CLOCK_FREQUENCY, std::chrono::microseconds(0));
+    auto start = std::chrono::steady_clock::now();
+
+    model.apply(std::chrono::seconds(10));
+    model.apply(std::chrono::seconds(5));
+
+    REQUIRE( model.elapsed() == std::chrono::seconds(15) );
+    REQUIRE( std::chrono::steady_clock::now() - start < std::chrono::seconds(1) );
+  }
+
+  SECTION("Sleep") {
+    LatencyModel model(LatencyMode::Sleep, LatencyModel::DEFAULT_CLOCK_FREQUENCY, std::chrono::microseconds(0));
+    auto start = std::chrono::steady_clock::now();
+
+    model.apply(std::chrono::milliseconds(5));
+
+    REQUIRE( std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(5) );
+    REQUIRE( model.elapsed() == std::chrono::milliseconds(5) );
+  }
+}
@@ -0,0 +1,69 @@
+//
+// Tests of the shared memory page of the metrics
+//
+
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include "catch.hpp"
+#include "metrics_page.h"
+
+TEST_CASE( "MetricsPage publication", "[MetricsPage]") {
+  const char *name = "/winscard_stub_test_metrics";
+  MetricsSnapshot snapshot;
+
+  REQUIRE_FALSE( MetricsPage::publishing() );
+  REQUIRE_THROWS_AS( MetricsPage::start("winscard_stub_test_metrics", std::chrono::milliseconds(10)),
+                     const std::invalid_argument & );
+  REQUIRE_THROWS_AS( MetricsPage::start("/winscard/stub", std::chrono::milliseconds(10)),
+                     const std::invalid_argument & );
+  REQUIRE_THROWS_AS( MetricsPage::start(name, std::chrono::milliseconds(0)), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( MetricsPageReader(name), const std::runtime_error & );
+
+  MetricsPage::start(name, std::chrono::milliseconds(1));
+  REQUIRE( MetricsPage::publishing() );
+  REQUIRE_THROWS_AS( MetricsPage::start(name, std::chrono::milliseconds(1)), const std::logic_error & );
+
+  SECTION("Read") {
+    MetricsPageReader page(name);
+    REQUIRE( page.read(&snapshot) );
+    REQUIRE( snapshot.pid == static_cast<uint64_t>(getpid()) );
+    REQUIRE( snapshot.publications >= 1 );
+    REQUIRE( snapshot.timestamp > 0 );
+
+    MetricsPage::events++;
+    CallStats::record(TraceFunction::Cancel, CallStats::ticks(), true);
+    uint64_t events = MetricsPage::events.load();
+    uint64_t publications = snapshot.publications;
+    while (snapshot.publications < publications + 2) {
+      REQUIRE( page.read(&snapshot) );
+    }
+    REQUIRE( snapshot.events == events );
+    REQUIRE( snapshot.calls[static_cast<size_t>(TraceFunction::Cancel) - 1] >= 1 );
+    REQUIRE( snapshot.errors[static_cast<size_t>(TraceFunction::Cancel) - 1] >= 1 );
+  }
+
+  SECTION("Consistent reads while publishing") {
+    // The publications are consistent: the timestamps and the publications only move forward
+    MetricsPageReader page(name);
+    uint64_t publications = 0;
+    uint64_t timestamp = 0;
+    for (int i = 0; i < 20000; i++) {
+      REQUIRE( page.read(&snapshot) );
+      REQUIRE( snapshot.publications >= publications );
+      REQUIRE( snapshot.timestamp >= timestamp );
+      publications = snapshot.publications;
+      timestamp = snapshot.timestamp;
+    }
+  }
+
+  SECTION("Not a metrics page") {
+    unsigned char data[MetricsPage::HEADER_SIZE + MetricsPage::WORDS * 8] = { 0 };
+    REQUIRE_FALSE( MetricsPage::read(data, sizeof(data), &snapshot) );
+    REQUIRE_FALSE( MetricsPage::read(data, 8, &snapshot) );
+  }
+
+  MetricsPage::stop();
+  REQUIRE_FALSE( MetricsPage::publishing() );
+  REQUIRE_THROWS_AS( MetricsPageReader(name), const std::runtime_error & );
+}
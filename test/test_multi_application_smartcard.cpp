@@ -0,0 +1,136 @@
+//
+// Tests of the multi-application smartcard
+//
+
+#include <fstream>
+#include <sstream>
+#include "catch.hpp"
+#include "card_session.h"
+#include "multi_application_smartcard.h"
+#include "global_platform_smartcard.h"
+#include "table_smartcard.h"
+
+/**
+ * Application answering SELECT with its name and INS 01 with its name
+ */
+static std::shared_ptr<const CardTemplate> tableApplication(const std::string &name) {
+  std::istringstream in("ATR 3B00\n"
+                        "00A40000/00FF0000 => 6F03 8401" + name + " 9000\n"
+                        "00010000/00FF0000 => " + name + " 9000\n"
+                        "DEFAULT => 6D00\n");
+  return std::make_shared<TableCardTemplate>(CardTable::load(in));
+}
+
+TEST_CASE( "MultiApplicationCardTemplate index", "[MultiApplication]") {
+  MultiApplicationCardTemplate multi({ 0x3B, 0x00 }, SCARD_PROTOCOL_T1);
+  multi.addApplication(hex("A000000002 01"), tableApplication("0C"));
+  multi.addApplication(hex("A000000001 02"), tableApplication("0B"));
+  multi.addApplication(hex("A000000001 01"), tableApplication("0A"));
+  multi.addApplication(hex("A000000001"), tableApplication("09"));
+
+  REQUIRE( multi.applications().size() == 4 );
+  REQUIRE( multi.applications()[0].aid == hex("A000000001") );
+  REQUIRE( multi.applications()[1].aid == hex("A000000001 01") );
+  REQUIRE( multi.applications()[3].aid == hex("A000000002 01") );
+  REQUIRE_THROWS_AS( multi.addApplication(hex("A000000001 02"), tableApplication("0D")),
+                     const std::invalid_argument & );
+  REQUIRE_THROWS_AS( multi.addApplication(hex("A0000001"), tableApplication("0D")), const std::invalid_argument & );
+
+  const std::vector<unsigned char> partial = hex("A000000001");
+  const std::vector<unsigned char> other = hex("A0000000 02");
+  const std::vector<unsigned char> unknown = hex("A0000000 03");
+  REQUIRE( multi.first(partial.data(), partial.size()) == 0 );
+  REQUIRE( multi.last(partial.data(), partial.size()) == 2 );
+  REQUIRE( multi.next(0, partial.data(), partial.size()) == 1 );
+  REQUIRE( multi.next(2, partial.data(), partial.size()) == MultiApplicationCardTemplate::NOT_FOUND );
+  REQUIRE( multi.next(3, partial.data(), partial.size()) == 0 );
+  REQUIRE( multi.previous(1, partial.data(), partial.size()) == 0 );
+  REQUIRE( multi.previous(0, partial.data(), partial.size()) == MultiApplicationCardTemplate::NOT_FOUND );
+  REQUIRE( multi.previous(MultiApplicationCardTemplate::NOT_FOUND, partial.data(), partial.size()) == 2 );
+  REQUIRE( multi.first(other.data(), other.size()) == 3 );
+  REQUIRE( multi.first(unknown.data(), unknown.size()) == MultiApplicationCardTemplate::NOT_FOUND );
+  REQUIRE( multi.last(unknown.data(), unknown.size()) == MultiApplicationCardTemplate::NOT_FOUND );
+}
+
+TEST_CASE( "MultiApplicationSmartCard commands", "[MultiApplication]") {
+  auto multi = std::make_shared<MultiApplicationCardTemplate>(std::vector<unsigned char>({ 0x3B, 0x00 }),
+                                                              SCARD_PROTOCOL_T1);
+  multi->addApplication(hex("A000000001 01"), tableApplication("0A"));
+  multi->addApplication(hex("A000000001 02"), tableApplication("0B"));
+  multi->addApplication(hex("A000000002 01"), tableApplication("0C"));
+  std::istringstream gp("ATR 3B00\n");
+  multi->addApplication(hex("A000000151000000"), GlobalPlatformCardTemplate::load(gp));
+  CardSession<MultiApplicationSmartCard> session(multi);
+
+  REQUIRE( session.transmit(hex("0001000000")) == hex("6D00") );
+  REQUIRE( session.transmit(hex("00A4040005A00000000300")) == hex("6A82") );
+  REQUIRE( session.card.getSelected(0) == nullptr );
+
+  SECTION("Selection by AID") {
+    REQUIRE( session.transmit(hex("00A4040006A0000000010200")) == hex("6F0384010B 9000") );
+    REQUIRE( *session.card.getSelected(0) == hex("A000000001 02") );
+    REQUIRE( session.transmit(hex("0001000000")) == hex("0B 9000") );
+    // A name which isn't an application is selected by the application
+    REQUIRE( session.transmit(hex("00A4040007A000000001020300")) == hex("6F0384010B 9000") );
+    REQUIRE( session.transmit(hex("0001000000")) == hex("0B 9000") );
+
+    REQUIRE( session.transmit(hex("00A4040008A00000015100000000")) == hex("6F10 8408A000000151000000 A5049F6501FF 9000") );
+    REQUIRE( session.transmit(hex("0001000000")) == hex("6E00") );
+    REQUIRE( session.transmit(hex("80E4000000")) == hex("6A80") );
+  }
+
+  SECTION("Partial AID and occurrences") {
+    REQUIRE( session.transmit(hex("00A4040005A00000000100")) == hex("6F0384010A 9000") );
+    REQUIRE( session.transmit(hex("00A4040205A00000000100")) == hex("6F0384010B 9000") );
+    REQUIRE( session.transmit(hex("00A4040205A00000000100")) == hex("6A82") );
+    REQUIRE( *session.card.getSelected(0) == hex("A000000001 02") );
+    REQUIRE( session.transmit(hex("00A4040305A00000000100")) == hex("6F0384010A 9000") );
+    REQUIRE( session.transmit(hex("00A4040105A00000000100")) == hex("6F0384010B 9000") );
+    REQUIRE( session.transmit(hex("00A4040204A000000000")) == hex("6F0384010C 9000") );
+    REQUIRE( session.transmit(hex("0001000000")) == hex("0C 9000") );
+  }
+
+  SECTION("Applications of the logical channels") {
+    REQUIRE( session.transmit(hex("00A4040006A0000000010100")) == hex("6F0384010A 9000") );
+    REQUIRE( session.transmit(hex("0070000001")) == hex("01 9000") );
+    REQUIRE( session.transmit(hex("0101000000")) == hex("6D00") );
+    REQUIRE( session.transmit(hex("01A4040005A00000000200")) == hex("6F0384010C 9000") );
+    REQUIRE( session.transmit(hex("0101000000")) == hex("0C 9000") );
+    REQUIRE( session.transmit(hex("0001000000")) == hex("0A 9000") );
+
+    REQUIRE( session.transmit(hex("0070800100")) == hex("9000") );
+    REQUIRE( session.card.getSelected(1) == nullptr );
+    REQUIRE( *session.card.getSelected(0) == hex("A000000001 01") );
+  }
+}
+
+TEST_CASE( "MultiApplicationCardTemplate loading", "[MultiApplication]") {
+  {
+    std::ofstream table("multi_application.table");
+    table << "ATR 3B00\n00A4* => 6F03840101 9000\nDEFAULT => 6D00\n";
+    std::ofstream card("multi_card.txt");
+    card << "# two applications\n"
+            "ATR 3B 02 14 50\n"
+            "PROTOCOL T1\n"
+            "APPLICATION A00000000101 table multi_application.table\n"
+            "APPLICATION A00000000102 table multi_application.table\n"
+            "COST A4 1000\n";
+  }
+  auto multi = MultiApplicationCardTemplate::loadFile("multi_card.txt");
+  REQUIRE( multi->atr == hex("3B021450") );
+  REQUIRE( multi->protocols == SCARD_PROTOCOL_T1 );
+  REQUIRE( multi->applications().size() == 2 );
+  REQUIRE( multi->costs != nullptr );
+  REQUIRE( SmartCard::register_implementation("multi card", "multi", "multi_card.txt") == SCARD_S_SUCCESS );
+  REQUIRE( SmartCard::instance_of("multi card") != nullptr );
+
+  std::istringstream unknownType("ATR 3B00\nAPPLICATION A00000000101 java applet.cap\n");
+  REQUIRE_THROWS_AS( MultiApplicationCardTemplate::load(unknownType, ""), const std::invalid_argument & );
+  std::istringstream missingFile("ATR 3B00\nAPPLICATION A00000000101 table missing.table\n");
+  REQUIRE_THROWS_AS( MultiApplicationCardTemplate::load(missingFile, ""), const std::runtime_error & );
+  std::istringstream shortAid("ATR 3B00\nAPPLICATION A000000001 table multi_application.table\n"
+                              "APPLICATION A0000001 table multi_application.table\n");
+  REQUIRE_THROWS_AS( MultiApplicationCardTemplate::load(shortAid, ""), const std::invalid_argument & );
+  std::istringstream missingAtr("APPLICATION A00000000101 table multi_application.table\n");
+  REQUIRE_THROWS_AS( MultiApplicationCardTemplate::load(missingAtr, ""), const std::invalid_argument & );
+}
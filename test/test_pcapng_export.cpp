@@ -0,0 +1,130 @@
+//
+// Tests of the pcapng capture of the APDU traffic
+//
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+#include "pcapng_export.h"
+
+static std::vector<unsigned char> readCapture(const char *path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::vector<unsigned char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+static uint32_t le32(const unsigned char *data) {
+  return static_cast<uint32_t>(data[0] | (data[1] << 8) | (data[2] << 16)) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+struct Block {
+  uint32_t type;
+  const unsigned char *body;
+  size_t length;
+};
+
+static std::vector<Block> readBlocks(const std::vector<unsigned char> &capture) {
+  std::vector<Block> blocks;
+  size_t offset = 0;
+  while (offset + 12 <= capture.size()) {
+    uint32_t length = le32(capture.data() + offset + 4);
+    REQUIRE( length % 4 == 0 );
+    REQUIRE( offset + length <= capture.size() );
+    REQUIRE( le32(capture.data() + offset + length - 4) == length );
+    blocks.push_back({ le32(capture.data() + offset), capture.data() + offset + 8, length - 12 });
+    offset += length;
+  }
+  REQUIRE( offset == capture.size() );
+  return blocks;
+}
+
+TEST_CASE( "PcapngExport capture", "[PcapngExport]") {
+  const unsigned char command[] = { 0x00, 0xB0, 0x00, 0x00, 0x02 };
+  const unsigned char response[] = { 0x01, 0x02, 0x90, 0x00 };
+  const unsigned char escape[] = { 0x42, 0x00, 0x01 };
+  std::remove("capture.pcapng");
+
+  REQUIRE_FALSE( PcapngExport::capturing() );
+  PcapngExport::exchange(false, PcapngExport::now(), 7, true, command, sizeof(command), response, sizeof(response));
+  PcapngExport::start("capture.pcapng");
+  REQUIRE( PcapngExport::capturing() );
+  REQUIRE_THROWS_AS( PcapngExport::start("capture.pcapng"), const std::logic_error & );
+
+  uint64_t start = PcapngExport::now();
+  PcapngExport::exchange(false, start, 7, true, command, sizeof(command), response, sizeof(response));
+  PcapngExport::exchange(true, start, 7, true, escape, sizeof(escape), nullptr, 0);
+  std::thread other([&] {
+    for (int i = 0; i < 500; i++) {
+      PcapngExport::exchange(false, PcapngExport::now(), 8, false, command, sizeof(command), response,
+                             sizeof(response));
+    }
+  });
+  other.join();
+  PcapngExport::stop();
+  REQUIRE_FALSE( PcapngExport::capturing() );
+
+  std::vector<unsigned char> capture = readCapture("capture.pcapng");
+  std::vector<Block> blocks = readBlocks(capture);
+  REQUIRE( blocks.size() == 2 + 2 * 502 );
+  REQUIRE( blocks[0].type == 0x0A0D0D0A );
+  REQUIRE( le32(blocks[0].body) == 0x1A2B3C4D );
+  REQUIRE( blocks[1].type == 1 );
+  REQUIRE( (blocks[1].body[0] | (blocks[1].body[1] << 8)) == PcapngExport::LINKTYPE_USB_LINUX_MMAPPED );
+
+  SECTION("Transmit") {
+    const unsigned char *packet = blocks[2].body + 20;
+    REQUIRE( blocks[2].type == 6 );
+    REQUIRE( le32(blocks[2].body + 12) ==
+             PcapngExport::USBMON_HEADER_SIZE + PcapngExport::CCID_HEADER_SIZE + sizeof(command) );
+    REQUIRE( ((static_cast<uint64_t>(le32(blocks[2].body + 4)) << 32) | le32(blocks[2].body + 8)) == start );
+    REQUIRE( packet[8] == 'S' );
+    REQUIRE( packet[10] == 0x02 );
+    const unsigned char *message = packet + PcapngExport::USBMON_HEADER_SIZE;
+    REQUIRE( message[0] == 0x6F );
+    REQUIRE( le32(message + 1) == sizeof(command) );
+    REQUIRE( std::vector<unsigned char>(message + 10, message + 10 + sizeof(command)) ==
+             std::vector<unsigned char>(command, command + sizeof(command)) );
+
+    packet = blocks[3].body + 20;
+    REQUIRE( packet[8] == 'C' );
+    REQUIRE( packet[10] == 0x82 );
+    REQUIRE( packet[11] == blocks[2].body[20 + 11] );
+    message = packet + PcapngExport::USBMON_HEADER_SIZE;
+    REQUIRE( message[0] == 0x80 );
+    REQUIRE( message[6] == blocks[2].body[20 + PcapngExport::USBMON_HEADER_SIZE + 6] );
+    REQUIRE( message[7] == 0x00 );
+    REQUIRE( le32(message + 1) == sizeof(response) );
+    REQUIRE( message[10 + sizeof(response) - 2] == 0x90 );
+  }
+
+  SECTION("Control") {
+    REQUIRE( blocks[4].body[20 + PcapngExport::USBMON_HEADER_SIZE] == 0x6B );
+    REQUIRE( le32(blocks[4].body + 20 + PcapngExport::USBMON_HEADER_SIZE + 1) == sizeof(escape) );
+    REQUIRE( blocks[5].body[20 + PcapngExport::USBMON_HEADER_SIZE] == 0x83 );
+    REQUIRE( le32(blocks[5].body + 20 + PcapngExport::USBMON_HEADER_SIZE + 1) == 0 );
+  }
+
+  SECTION("Failed exchange") {
+    const unsigned char *message = blocks[7].body + 20 + PcapngExport::USBMON_HEADER_SIZE;
+    REQUIRE( message[0] == 0x80 );
+    REQUIRE( le32(message + 1) == 0 );
+    REQUIRE( message[7] == 0x40 );
+    REQUIRE( message[8] == 0xFE );
+    REQUIRE( blocks[7].body[20 + 11] != blocks[2].body[20 + 11] );
+  }
+
+  SECTION("Sections are appended") {
+    PcapngExport::start("capture.pcapng");
+    PcapngExport::stop();
+    std::vector<Block> appended = readBlocks(readCapture("capture.pcapng"));
+    REQUIRE( appended.size() == blocks.size() + 2 );
+    REQUIRE( appended[blocks.size()].type == 0x0A0D0D0A );
+  }
+
+  SECTION("Fail to open") {
+    REQUIRE_THROWS_AS( PcapngExport::start("missing_directory/capture.pcapng"), const std::runtime_error & );
+    REQUIRE_FALSE( PcapngExport::capturing() );
+  }
+}
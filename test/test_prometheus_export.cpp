@@ -0,0 +1,169 @@
+//
+// Tests of the Prometheus dump of the metrics
+//
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "catch.hpp"
+#include "call_stats.h"
+#include "prometheus_export.h"
+
+/**
+ * Value of a sample of the dump, -1 when the dump doesn't have it
+ */
+static double sampleOf(const std::string &text, const std::string &series) {
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if ((line.compare(0, series.size(), series) == 0) && (line.size() > series.size())
+        && (line[series.size()] == ' ')) {
+      return std::stod(line.substr(series.size() + 1));
+    }
+  }
+  return -1;
+}
+
+static std::string readFile(const char *path) {
+  std::ifstream file(path);
+  std::stringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
+
+TEST_CASE( "PrometheusExport rendering", "[PrometheusExport]") {
+  CallStats::record(TraceFunction::Status, CallStats::ticks(), false);
+  CallStats::record(TraceFunction::Status, CallStats::ticks(), true);
+  ReaderStats reader;
+  reader.setName("Test \"Reader\" 0");
+  reader.record(5, 2, 0x90, false);
+  reader.record(5, 2, 0x6A, false);
+  reader.record(5, 0, -1, true);
+
+  std::string text = PrometheusExport::render();
+
+  SECTION("Calls") {
+    REQUIRE( text.find("# TYPE winscard_stub_calls_total counter\n") != std::string::npos );
+    REQUIRE( text.find("# TYPE winscard_stub_call_duration_seconds histogram\n") != std::string::npos );
+    double calls = sampleOf(text, "winscard_stub_calls_total{function=\"SCardStatus\"}");
+    REQUIRE( calls >= 2 );
+    REQUIRE( sampleOf(text, "winscard_stub_call_errors_total{function=\"SCardStatus\"}") >= 1 );
+    REQUIRE( sampleOf(text, "winscard_stub_call_duration_seconds_count{function=\"SCardStatus\"}") == calls );
+    REQUIRE( sampleOf(text, "winscard_stub_call_duration_seconds_bucket{function=\"SCardStatus\",le=\"+Inf\"}")
+             == calls );
+    REQUIRE( sampleOf(text, "winscard_stub_call_duration_seconds_sum{function=\"SCardStatus\"}") >= 0 );
+  }
+
+  SECTION("Cumulative buckets") {
+    double previous = 0;
+    for (unsigned int magnitude = PrometheusExport::HISTOGRAM_FIRST_MAGNITUDE;
+         magnitude <= PrometheusExport::HISTOGRAM_LAST_MAGNITUDE; magnitude += 2) {
+      char bound[32];
+      snprintf(bound, sizeof(bound), "%.9g", static_cast<double>(1ULL << magnitude) / 1e9);
+      double count = sampleOf(text, std::string("winscard_stub_call_duration_seconds_bucket{function=\"SCardStatus\","
+                                                "le=\"") + bound + "\"}");
+      REQUIRE( count >= previous );
+      previous = count;
+    }
+    REQUIRE( sampleOf(text, "winscard_stub_call_duration_seconds_bucket{function=\"SCardStatus\",le=\"+Inf\"}")
+             >= previous );
+  }
+
+  SECTION("Readers") {
+    std::string label = "{reader=\"Test \\\"Reader\\\" 0\"";
+    REQUIRE( sampleOf(text, "winscard_stub_reader_apdus_total" + label + "}") == 3 );
+    REQUIRE( sampleOf(text, "winscard_stub_reader_errors_total" + label + "}") == 1 );
+    REQUIRE( sampleOf(text, "winscard_stub_reader_bytes_in_total" + label + "}") == 10 );
+    REQUIRE( sampleOf(text, "winscard_stub_reader_bytes_out_total" + label + "}") == 4 );
+    REQUIRE( sampleOf(text, "winscard_stub_reader_responses_total" + label + ",sw1=\"90\"}") == 1 );
+    REQUIRE( sampleOf(text, "winscard_stub_reader_responses_total" + label + ",sw1=\"6A\"}") == 1 );
+    REQUIRE( sampleOf(text, "winscard_stub_reader_responses_total" + label + ",sw1=\"61\"}") == -1 );
+  }
+
+  SECTION("Wakeups") {
+    double wakeups = sampleOf(text, "winscard_stub_event_wakeup_seconds_count");
+    REQUIRE( wakeups >= 0 );
+    REQUIRE( sampleOf(text, "winscard_stub_event_wakeup_seconds_bucket{le=\"+Inf\"}") == wakeups );
+  }
+
+  SECTION("Gauges") {
+    REQUIRE( sampleOf(text, "winscard_stub_contexts") >= 0 );
+    REQUIRE( sampleOf(text, "winscard_stub_injected_faults_total") >= 0 );
+  }
+
+  SECTION("Same readers summed") {
+    ReaderStats other;
+    other.setName("Test \"Reader\" 0");
+    other.record(1, 2, 0x90, false);
+    text = PrometheusExport::render();
+    REQUIRE( sampleOf(text, "winscard_stub_reader_apdus_total{reader=\"Test \\\"Reader\\\" 0\"}") == 4 );
+  }
+}
+
+TEST_CASE( "PrometheusExport dumps", "[PrometheusExport]") {
+  SECTION("File") {
+    remove("metrics.prom");
+    PrometheusExport::dump("metrics.prom");
+    std::string text = readFile("metrics.prom");
+    REQUIRE( text.find("# TYPE winscard_stub_events_total counter\n") != std::string::npos );
+    REQUIRE( access("metrics.prom.tmp", F_OK) != 0 );
+    REQUIRE_THROWS_AS( PrometheusExport::dump("no_such_directory/metrics.prom"), const std::runtime_error & );
+    REQUIRE_THROWS_AS( PrometheusExport::dump(""), const std::invalid_argument & );
+  }
+
+  SECTION("Socket") {
+    const char *path = "metrics.sock";
+    unlink(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    REQUIRE( bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 );
+    REQUIRE( listen(listener, 1) == 0 );
+    std::string received;
+    std::thread collector([listener, &received] {
+      int fd = accept(listener, nullptr, nullptr);
+      char data[4096];
+      ssize_t lg;
+      while ((lg = read(fd, data, sizeof(data))) > 0) {
+        received.append(data, static_cast<size_t>(lg));
+      }
+      close(fd);
+    });
+    PrometheusExport::dump(std::string(PrometheusExport::SOCKET_PREFIX) + path);
+    collector.join();
+    close(listener);
+    unlink(path);
+    REQUIRE( received.find("# TYPE winscard_stub_calls_total counter\n") != std::string::npos );
+    REQUIRE( received.back() == '\n' );
+
+    REQUIRE_THROWS_AS( PrometheusExport::dump("unix:metrics.sock"), const std::runtime_error & );
+    REQUIRE_THROWS_AS( PrometheusExport::dump("unix:" + std::string(200, 'a')), const std::invalid_argument & );
+  }
+
+  SECTION("Signal") {
+    remove("signal.prom");
+    REQUIRE_FALSE( PrometheusExport::dumpingOnSignal() );
+    REQUIRE_THROWS_AS( PrometheusExport::startSignalDumps(""), const std::invalid_argument & );
+    PrometheusExport::startSignalDumps("signal.prom");
+    REQUIRE( PrometheusExport::dumpingOnSignal() );
+    REQUIRE_THROWS_AS( PrometheusExport::startSignalDumps("signal.prom"), const std::logic_error & );
+
+    REQUIRE( raise(SIGUSR1) == 0 );
+    for (int i = 0; (i < 5000) && (access("signal.prom", F_OK) != 0); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    PrometheusExport::stopSignalDumps();
+    REQUIRE_FALSE( PrometheusExport::dumpingOnSignal() );
+    REQUIRE( readFile("signal.prom").find("winscard_stub_calls_total") != std::string::npos );
+    PrometheusExport::stopSignalDumps();
+  }
+}
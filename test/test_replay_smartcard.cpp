@@ -0,0 +1,248 @@
+//
+// Tests of the replay smartcard
+//
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include "catch.hpp"
+#include "apdu_trace.h"
+#include "card_session.h"
+#include "replay_smartcard.h"
+#include "response_database.h"
+#include "temporary_directory.h"
+
+static void recordTransmit(uint64_t handle, const std::string &command, const std::string &response,
+                           long result = SCARD_S_SUCCESS) {
+  std::vector<unsigned char> commandBytes = hex(command);
+  std::vector<unsigned char> responseBytes = hex(response);
+  ApduTrace::record(TraceFunction::Transmit, ApduTrace::now(), handle, result, commandBytes.data(),
+                    commandBytes.size(), responseBytes.data(), responseBytes.size());
+}
+
+/**
+ * Session of two cards, the second one reads the same record twice with different responses
+ */
+static void writeTrace(const std::string &path) {
+  std::remove(path.c_str());
+  ApduTrace::start(path);
+  recordTransmit(1, "00A4040007A000000003101000", "6F03840100 9000");
+  recordTransmit(2, "00A4040007A000000004101000", "6F03840101 9000");
+  recordTransmit(1, "00B2010C00", "7003010203 9000");
+  recordTransmit(1, "0070000001", "01 9000");
+  recordTransmit(1, "0084000008", "", SCARD_E_INSUFFICIENT_BUFFER);
+  recordTransmit(1, "00B2010C00", "7003040506 9000");
+  recordTransmit(1, "80CA9F1700", "9F170103 9000");
+  ApduTrace::record(TraceFunction::Disconnect, ApduTrace::now(), 1, SCARD_S_SUCCESS);
+  ApduTrace::stop();
+}
+
+TEST_CASE( "ReplayTrace index", "[Replay]") {
+  TemporaryDirectory directory;
+  writeTrace(directory.path("replay.trace"));
+
+  auto trace = ReplayTrace::open(directory.path("replay.trace"));
+  REQUIRE( trace->size() == 5 );
+  REQUIRE( std::vector<unsigned char>(trace->exchange(1).response,
+                                      trace->exchange(1).response + trace->exchange(1).responseLg) ==
+           hex("6F03840101 9000") );
+  size_t first = 0;
+  const std::vector<unsigned char> read = hex("00B2010C00");
+  REQUIRE( trace->find(read.data(), read.size(), &first) == 2 );
+  REQUIRE( trace->indexed(first) == 2 );
+  REQUIRE( trace->indexed(first + 1) == 3 );
+  const std::vector<unsigned char> unknown = hex("00B2020C00");
+  REQUIRE( trace->find(unknown.data(), unknown.size(), &first) == 0 );
+
+  auto card = ReplayTrace::open(directory.path("replay.trace"), 2);
+  REQUIRE( card->size() == 1 );
+
+  REQUIRE_THROWS_AS( ReplayTrace::open(directory.path("missing.trace")), const std::runtime_error & );
+  {
+    std::ofstream corrupted(directory.path("corrupted.trace"), std::ios::binary);
+    corrupted << "WSTRACE1" << std::string(8, '\0') << std::string(40, 'x');
+  }
+  REQUIRE_THROWS_AS( ReplayTrace::open(directory.path("corrupted.trace")), const std::invalid_argument & );
+}
+
+TEST_CASE( "ReplaySmartCard modes", "[Replay]") {
+  TemporaryDirectory directory;
+  writeTrace(directory.path("replay.trace"));
+  auto trace = ReplayTrace::open(directory.path("replay.trace"), 1);
+
+  SECTION("Strict") {
+    CardSession<ReplaySmartCard> session(std::make_shared<ReplayCardTemplate>(hex("3B00"), SCARD_PROTOCOL_T1, trace,
+                                                                              ReplayMode::Strict));
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("6F00") );
+    REQUIRE( session.card.getMismatches() == 1 );
+    REQUIRE( session.transmit(hex("00A4040007A000000003101000")) == hex("6F03840100 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("7003010203 9000") );
+    REQUIRE( session.transmit(hex("0070000001")) == hex("01 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("7003040506 9000") );
+    REQUIRE( session.transmit(hex("80CA9F1700")) == hex("9F170103 9000") );
+    REQUIRE( session.card.getPosition() == 4 );
+    REQUIRE( session.transmit(hex("80CA9F1700")) == hex("6F00") );
+    REQUIRE( session.card.getMismatches() == 2 );
+  }
+
+  SECTION("Lenient") {
+    CardSession<ReplaySmartCard> session(std::make_shared<ReplayCardTemplate>(hex("3B00"), SCARD_PROTOCOL_T1, trace,
+                                                                              ReplayMode::Lenient));
+    REQUIRE( session.transmit(hex("80CA9F1700")) == hex("9F170103 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("7003010203 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("7003040506 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("7003010203 9000") );
+    REQUIRE( session.transmit(hex("00A4040007A000000004101000")) == hex("6F00") );
+    REQUIRE( session.card.getMismatches() == 1 );
+  }
+}
+
+TEST_CASE( "ReplayCardTemplate loading", "[Replay]") {
+  TemporaryDirectory directory;
+  writeTrace(directory.path("replay.trace"));
+  {
+    std::ofstream card(directory.path("replay_card.txt"));
+    card << "# replay of the second card\n"
+            "ATR 3B 02 14 50\n"
+            "PROTOCOL T1\n"
+            "TRACE replay.trace\n"
+            "MODE lenient\n"
+            "HANDLE 2\n"
+            "COST A4 1000\n";
+  }
+  auto replay = ReplayCardTemplate::loadFile(directory.path("replay_card.txt"));
+  REQUIRE( replay->atr == hex("3B021450") );
+  REQUIRE( replay->protocols == SCARD_PROTOCOL_T1 );
+  REQUIRE( replay->mode == ReplayMode::Lenient );
+  REQUIRE( replay->trace->size() == 1 );
+  REQUIRE( replay->costs != nullptr );
+  REQUIRE( SmartCard::register_implementation("replay card", "replay", directory.path("replay_card.txt")) ==
+           SCARD_S_SUCCESS );
+  REQUIRE( SmartCard::instance_of("replay card") != nullptr );
+
+  std::istringstream missingTrace("ATR 3B00\n");
+  REQUIRE_THROWS_AS( ReplayCardTemplate::load(missingTrace, ""), const std::invalid_argument & );
+  std::istringstream unknownMode("ATR 3B00\nTRACE replay.trace\nMODE random\n");
+  REQUIRE_THROWS_AS( ReplayCardTemplate::load(unknownMode, directory.path()), const std::invalid_argument & );
+  std::istringstream invalidHandle("ATR 3B00\nTRACE replay.trace\nHANDLE 0\n");
+  REQUIRE_THROWS_AS( ReplayCardTemplate::load(invalidHandle, directory.path()), const std::invalid_argument & );
+  std::istringstream missingFile("ATR 3B00\nTRACE missing.trace\n");
+  REQUIRE_THROWS_AS( ReplayCardTemplate::load(missingFile, directory.path()), const std::runtime_error & );
+}
+
+/**
+ * Session of a card with two applications which answer the same READ RECORD, on the basic channel and on channel 1
+ */
+static void writeApplicationsTrace(const std::string &path) {
+  std::remove(path.c_str());
+  ApduTrace::start(path);
+  recordTransmit(1, "00A4040005A00000000100", "6F0784050102030405 9000");
+  recordTransmit(1, "00B2010C00", "700101 9000");
+  recordTransmit(1, "0070000001", "01 9000");
+  recordTransmit(1, "01A4040005A00000000200", "6F0784050102030406 9000");
+  recordTransmit(1, "01B2010C00", "700102 9000");
+  recordTransmit(1, "0084000008", "0102030405060708 9000");
+  recordTransmit(1, "0084000008", "1112131415161718 9000");
+  ApduTrace::stop();
+}
+
+TEST_CASE( "ResponseDatabase lookups", "[Replay]") {
+  TemporaryDirectory directory;
+  writeApplicationsTrace(directory.path("applications.trace"));
+  ResponseDatabaseBuilder builder(RESPONSE_DB_KEY_AID);
+  builder.addTrace(directory.path("applications.trace"));
+  REQUIRE( builder.size() == 5 );
+  builder.write(directory.path("applications.db"));
+
+  auto database = ResponseDatabase::open(directory.path("applications.db"));
+  REQUIRE( database->header().entryCount == 5 );
+  REQUIRE( database->header().cycleCount == 1 );
+  REQUIRE( (database->header().bucketCount & (database->header().bucketCount - 1)) == 0 );
+
+  unsigned char key[ResponseDatabase::MAX_KEY_SIZE];
+  std::vector<unsigned char> aid = hex("A000000002");
+  std::vector<unsigned char> read = hex("01B2010C00");
+  size_t key_lg = ResponseDatabase::makeKey(RESPONSE_DB_KEY_AID, ApduView(read.data(), read.size()), aid.data(),
+                                            aid.size(), key);
+  REQUIRE( std::vector<unsigned char>(key, key + key_lg) == hex("05A000000002 00B2010C00") );
+  const unsigned char *entry = database->find(key, key_lg);
+  REQUIRE( entry != nullptr );
+  REQUIRE( ResponseDatabase::responseCount(entry) == 1 );
+  REQUIRE( ResponseDatabase::cycle(entry) == RESPONSE_DB_NO_CYCLE );
+  size_t response_lg = 0;
+  const unsigned char *response = ResponseDatabase::response(entry, 0, &response_lg);
+  REQUIRE( std::vector<unsigned char>(response, response + response_lg) == hex("700102 9000") );
+  key_lg = ResponseDatabase::makeKey(RESPONSE_DB_KEY_AID, ApduView(read.data(), read.size()), nullptr, 0, key);
+  REQUIRE( database->find(key, key_lg) == nullptr );
+
+  {
+    std::ofstream truncated(directory.path("truncated.db"), std::ios::binary);
+    std::ifstream in(directory.path("applications.db"), std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    truncated << bytes.substr(0, 80);
+  }
+  REQUIRE_THROWS_AS( ResponseDatabase::open(directory.path("truncated.db")), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( ResponseDatabase::open(directory.path("applications.trace")), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( ResponseDatabase::open(directory.path("missing.db")), const std::runtime_error & );
+}
+
+TEST_CASE( "ReplaySmartCard database", "[Replay]") {
+  TemporaryDirectory directory;
+  writeApplicationsTrace(directory.path("applications.trace"));
+
+  SECTION("Keys with the selected AID") {
+    ResponseDatabaseBuilder builder(RESPONSE_DB_KEY_AID);
+    builder.addTrace(directory.path("applications.trace"));
+    builder.write(directory.path("applications.db"));
+    {
+      std::ofstream card(directory.path("database_card.txt"));
+      card << "ATR 3B 02 14 50\n"
+              "DATABASE applications.db\n";
+    }
+    auto replay = ReplayCardTemplate::loadFile(directory.path("database_card.txt"));
+    REQUIRE( replay->database != nullptr );
+    REQUIRE( replay->trace == nullptr );
+    CardSession<ReplaySmartCard> session(replay);
+
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("6F00") );
+    REQUIRE( session.transmit(hex("00A4040005A00000000300")) == hex("6F00") );
+    REQUIRE( session.transmit(hex("00A4040005A00000000100")) == hex("6F0784050102030405 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("700101 9000") );
+    REQUIRE( session.transmit(hex("0070000001")) == hex("01 9000") );
+    REQUIRE( session.transmit(hex("01A4040005A00000000200")) == hex("6F0784050102030406 9000") );
+    REQUIRE( session.transmit(hex("01B2010C00")) == hex("700102 9000") );
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("700101 9000") );
+    // The responses of a command cycle
+    REQUIRE( session.transmit(hex("0084000008")) == hex("0102030405060708 9000") );
+    REQUIRE( session.transmit(hex("0084000008")) == hex("1112131415161718 9000") );
+    REQUIRE( session.transmit(hex("0084000008")) == hex("0102030405060708 9000") );
+    // A new channel doesn't have a selected AID
+    REQUIRE( session.transmit(hex("0070800100")) == hex("9000") );
+    REQUIRE( session.transmit(hex("0070000001")) == hex("01 9000") );
+    REQUIRE( session.transmit(hex("01B2010C00")) == hex("6F00") );
+    REQUIRE( session.card.getMismatches() == 3 );
+  }
+
+  SECTION("Keys with the channel") {
+    ResponseDatabaseBuilder builder(RESPONSE_DB_KEY_CHANNEL);
+    builder.addTrace(directory.path("applications.trace"));
+    REQUIRE( builder.size() == 5 );
+    builder.write(directory.path("channels.db"));
+    auto database = ResponseDatabase::open(directory.path("channels.db"));
+    CardSession<ReplaySmartCard> session(std::make_shared<ReplayCardTemplate>(hex("3B00"), SCARD_PROTOCOL_T1, database));
+    REQUIRE( session.transmit(hex("00B2010C00")) == hex("700101 9000") );
+    REQUIRE( session.transmit(hex("0070000001")) == hex("01 9000") );
+    REQUIRE( session.transmit(hex("01B2010C00")) == hex("700102 9000") );
+    REQUIRE( session.transmit(hex("0184000008")) == hex("6F00") );
+  }
+
+  SECTION("Invalid definitions") {
+    ResponseDatabaseBuilder builder(0);
+    builder.write(directory.path("empty.db"));
+    REQUIRE( ResponseDatabase::open(directory.path("empty.db"))->header().entryCount == 0 );
+    std::istringstream both("ATR 3B00\nTRACE applications.trace\nDATABASE empty.db\n");
+    REQUIRE_THROWS_AS( ReplayCardTemplate::load(both, directory.path()), const std::invalid_argument & );
+    std::istringstream strict("ATR 3B00\nDATABASE empty.db\nMODE strict\n");
+    REQUIRE_THROWS_AS( ReplayCardTemplate::load(strict, directory.path()), const std::invalid_argument & );
+  }
+}
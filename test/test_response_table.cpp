@@ -0,0 +1,182 @@
+//
+// Tests of the compiled APDU response table and the table smartcard definition
+//
+
+#include <cstring>
+#include <sstream>
+#include "catch.hpp"
+#include "response_table.h"
+#include "table_smartcard.h"
+#include "card_profiles.h"
+
+static bool matches(const ResponseTable &table, const std::vector<unsigned char> &command, const std::vector<unsigned char> &expected) {
+  const unsigned char *response = nullptr;
+  size_t response_lg = 0;
+
+  if (!table.match(command.data(), command.size(), &response, &response_lg)) {
+    return false;
+  }
+  return std::vector<unsigned char>(response, response + response_lg) == expected;
+}
+
+TEST_CASE( "ResponseTable matching", "[ResponseTable]") {
+  ResponseTable table;
+
+  table.addLine("00A4040007A0000000031010 => 6F0A 9000");
+  table.addLine("00 A4 04 00 07 A0 00 00 00 03 10 20 => 6A82");
+  table.addLine("00B0* => 0102039000");
+  table.addLine("00B00010* => 0405069000");
+  table.addLine("80CA0000/FFFF0000 => 6A88");
+  table.addLine("80CA9F7F/FFFFFFFF => 9F7F019000");
+  table.addLine("00200080/FFFF00FF => 63C3");
+  table.compile();
+
+  REQUIRE( table.size() == 7 );
+
+  SECTION("Exact command") {
+    REQUIRE( matches(table, { 0x00, 0xA4, 0x04, 0x00, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10 }, { 0x6F, 0x0A, 0x90, 0x00 }) );
+    REQUIRE( matches(table, { 0x00, 0xA4, 0x04, 0x00, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x20 }, { 0x6A, 0x82 }) );
+  }
+
+  SECTION("Longest prefix") {
+    REQUIRE( matches(table, { 0x00, 0xB0, 0x00, 0x00, 0x10 }, { 0x01, 0x02, 0x03, 0x90, 0x00 }) );
+    REQUIRE( matches(table, { 0x00, 0xB0, 0x00, 0x10, 0x10 }, { 0x04, 0x05, 0x06, 0x90, 0x00 }) );
+  }
+
+  SECTION("Header patterns, most specific mask first") {
+    REQUIRE( matches(table, { 0x80, 0xCA, 0x9F, 0x7F, 0x00 }, { 0x9F, 0x7F, 0x01, 0x90, 0x00 }) );
+    REQUIRE( matches(table, { 0x80, 0xCA, 0x9F, 0x13, 0x00 }, { 0x6A, 0x88 }) );
+    REQUIRE( matches(table, { 0x00, 0x20, 0x01, 0x80, 0x08, 0x31, 0x32, 0x33, 0x34, 0xFF, 0xFF, 0xFF, 0xFF }, { 0x63, 0xC3 }) );
+  }
+
+  SECTION("No match without default") {
+    const unsigned char command[] = { 0x00, 0xA4, 0x04, 0x00 };
+    const unsigned char *response = nullptr;
+    size_t response_lg = 0;
+
+    REQUIRE_FALSE( table.match(command, sizeof(command), &response, &response_lg) );
+  }
+
+  SECTION("Default response") {
+    table.addLine("DEFAULT => 6D00");
+    table.compile();
+
+    REQUIRE( matches(table, { 0x00, 0xA4, 0x04, 0x00 }, { 0x6D, 0x00 }) );
+    REQUIRE( matches(table, { 0x01 }, { 0x6D, 0x00 }) );
+  }
+}
+
+TEST_CASE( "ResponseTable with many responses", "[ResponseTable]") {
+  ResponseTable table;
+
+  for (unsigned int i = 0; i < 20000; i++) {
+    std::vector<unsigned char> command = { 0x00, 0xB2, static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i), 0x00 };
+    std::vector<unsigned char> response = { static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i), 0x90, 0x00 };
+    table.addExact(command, response);
+  }
+  table.compile();
+
+  REQUIRE( table.size() == 20000 );
+  for (unsigned int i = 0; i < 20000; i += 997) {
+    REQUIRE( matches(table,
+                     { 0x00, 0xB2, static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i), 0x00 },
+                     { static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i), 0x90, 0x00 }) );
+  }
+}
+
+TEST_CASE( "ResponseTable malformed lines", "[ResponseTable]") {
+  ResponseTable table;
+
+  REQUIRE_THROWS_AS( table.addLine("00A40400"), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( table.addLine("00A4040 => 9000"), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( table.addLine("00A40400 => 90"), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( table.addLine("00A4/FFFF => 9000"), const std::invalid_argument & );
+  REQUIRE_THROWS_AS( table.addLine("00G4 => 9000"), const std::invalid_argument & );
+}
+
+TEST_CASE( "CardTable loading", "[ResponseTable]") {
+
+  SECTION("Success") {
+    std::istringstream in("# card\n"
+                          "ATR 3B 02 14 50\n"
+                          "PROTOCOL T0 T1\n"
+                          "\n"
+                          "00A4040000 => 9000\n");
+
+    auto definition = CardTable::load(in);
+
+    REQUIRE( definition->atr == std::vector<unsigned char>({ 0x3B, 0x02, 0x14, 0x50 }) );
+    REQUIRE( definition->protocols == (SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1) );
+    REQUIRE( definition->responses.size() == 1 );
+  }
+
+  SECTION("Fail without ATR") {
+    std::istringstream in("PROTOCOL T0\n00A4040000 => 9000\n");
+
+    REQUIRE_THROWS_AS( CardTable::load(in), const std::invalid_argument & );
+  }
+
+  SECTION("Fail with unknown protocol") {
+    std::istringstream in("ATR 3B00\nPROTOCOL T2\n");
+
+    REQUIRE_THROWS_AS( CardTable::load(in), const std::invalid_argument & );
+  }
+
+  SECTION("Success with costs") {
+    std::istringstream in("ATR 3B00\nPROTOCOL T0\nCOST 2A 150000 0 20000\nCOST DEFAULT 2000\n");
+
+    auto definition = CardTable::load(in);
+
+    REQUIRE( definition->costs.size() == 2 );
+    REQUIRE( definition->costs[0].ins == 0x2A );
+    REQUIRE( definition->costs[0].cost.fixedMicroseconds == 150000 );
+    REQUIRE( definition->costs[0].cost.jitterMicroseconds == 20000 );
+    REQUIRE( definition->costs[1].ins == COST_DEFAULT_INS );
+    REQUIRE( definition->costs[1].cost.perByteNanoseconds == 0 );
+  }
+
+  SECTION("Fail with malformed costs") {
+    std::istringstream wrongIns("ATR 3B00\nPROTOCOL T0\nCOST 2A2A 100\n");
+    std::istringstream missingCost("ATR 3B00\nPROTOCOL T0\nCOST 2A\n");
+    std::istringstream wrongCost("ATR 3B00\nPROTOCOL T0\nCOST 2A 100 fast\n");
+
+    REQUIRE_THROWS_AS( CardTable::load(wrongIns), const std::invalid_argument & );
+    REQUIRE_THROWS_AS( CardTable::load(missingCost), const std::invalid_argument & );
+    REQUIRE_THROWS_AS( CardTable::load(wrongCost), const std::invalid_argument & );
+  }
+}
+
+TEST_CASE( "Built-in card profiles", "[ResponseTable]") {
+
+  SECTION("Find profile") {
+    const CardProfile *profile = findCardProfile(g_builtin_profiles, "test_t1");
+
+    REQUIRE( profile != nullptr );
+    REQUIRE( profile->protocols == SCARD_PROTOCOL_T1 );
+    REQUIRE( profile->atrLg == 15 );
+    REQUIRE( profile->costCount == 1 );
+    REQUIRE( profile->costs[0].ins == 0xA4 );
+  }
+
+  SECTION("Unknown profile") {
+    REQUIRE( findCardProfile(g_builtin_profiles, "unknown") == nullptr );
+    REQUIRE( findCardProfile(g_builtin_profiles, "") == nullptr );
+  }
+
+  SECTION("Compiled responses") {
+    const CardProfile *profile = findCardProfile(g_builtin_profiles, "test_t1");
+    const unsigned char get_data[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+    const unsigned char get_other_data[] = { 0x80, 0xCA, 0x00, 0x66, 0x00 };
+    const unsigned char select_other[] = { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00 };
+    const unsigned char *response = nullptr;
+    size_t response_lg = 0;
+
+    REQUIRE( profile->responses.match(get_data, sizeof(get_data), &response, &response_lg) );
+    REQUIRE( response_lg == 15 );
+    REQUIRE( profile->responses.match(get_other_data, sizeof(get_other_data), &response, &response_lg) );
+    REQUIRE( response_lg == 2 );
+    REQUIRE( response[1] == 0x88 );
+    REQUIRE( profile->responses.match(select_other, sizeof(select_other), &response, &response_lg) );
+    REQUIRE( response[1] == 0x82 );
+  }
+}
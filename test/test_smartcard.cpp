@@ -0,0 +1,313 @@
+//
+// Tests of the smartcard simulator base class helpers
+//
+
+#include <sstream>
+#include <thread>
+#include "catch.hpp"
+#include "smartcard.h"
+#include "table_smartcard.h"
+
+TEST_CASE( "ApduView decoding", "[SmartCard]") {
+
+  SECTION("Case 1") {
+    const unsigned char command[] = { 0x00, 0x70, 0x00, 0x00 };
+    ApduView apdu(command, sizeof(command));
+
+    REQUIRE( apdu.valid );
+    REQUIRE( apdu.ins == 0x70 );
+    REQUIRE( apdu.lc == 0 );
+    REQUIRE_FALSE( apdu.hasLe );
+  }
+
+  SECTION("Case 2 short with Le 00") {
+    const unsigned char command[] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+    ApduView apdu(command, sizeof(command));
+
+    REQUIRE( apdu.valid );
+    REQUIRE( apdu.hasLe );
+    REQUIRE( apdu.ne == 256 );
+    REQUIRE_FALSE( apdu.extended );
+  }
+
+  SECTION("Case 3 and 4 short") {
+    const unsigned char case3[] = { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00 };
+    const unsigned char case4[] = { 0x00, 0xA4, 0x04, 0x00, 0x02, 0x3F, 0x00, 0x10 };
+    ApduView apdu3(case3, sizeof(case3));
+    ApduView apdu4(case4, sizeof(case4));
+
+    REQUIRE( apdu3.valid );
+    REQUIRE( apdu3.lc == 2 );
+    REQUIRE( apdu3.data[0] == 0x3F );
+    REQUIRE_FALSE( apdu3.hasLe );
+    REQUIRE( apdu4.valid );
+    REQUIRE( apdu4.ne == 16 );
+  }
+
+  SECTION("Case 2 and 4 extended") {
+    const unsigned char case2[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x10, 0x00 };
+    const unsigned char case4[] = { 0x00, 0x2A, 0x9E, 0x9A, 0x00, 0x00, 0x02, 0x01, 0x02, 0x00, 0x00 };
+    ApduView apdu2(case2, sizeof(case2));
+    ApduView apdu4(case4, sizeof(case4));
+
+    REQUIRE( apdu2.valid );
+    REQUIRE( apdu2.extended );
+    REQUIRE( apdu2.ne == 4096 );
+    REQUIRE( apdu4.valid );
+    REQUIRE( apdu4.lc == 2 );
+    REQUIRE( apdu4.ne == 65536 );
+  }
+
+  SECTION("Logical channels") {
+    const unsigned char basic[] = { 0x0C, 0xA4, 0x04, 0x00 };
+    const unsigned char first[] = { 0x83, 0xA4, 0x04, 0x00 };
+    const unsigned char further[] = { 0x5F, 0xA4, 0x04, 0x00 };
+    const unsigned char furtherSm[] = { 0x71, 0xA4, 0x04, 0x00 };
+    const unsigned char furtherProprietary[] = { 0xE2, 0xA4, 0x04, 0x00 };
+
+    REQUIRE( ApduView(basic, sizeof(basic)).channel == 0 );
+    REQUIRE( ApduView(basic, sizeof(basic)).cla == 0x0C );
+    REQUIRE( ApduView(first, sizeof(first)).channel == 3 );
+    REQUIRE( ApduView(first, sizeof(first)).cla == 0x80 );
+    REQUIRE( ApduView(further, sizeof(further)).channel == 19 );
+    REQUIRE( ApduView(further, sizeof(further)).cla == 0x10 );
+    REQUIRE( ApduView(furtherSm, sizeof(furtherSm)).channel == 5 );
+    REQUIRE( ApduView(furtherSm, sizeof(furtherSm)).cla == 0x18 );
+    REQUIRE( ApduView(furtherProprietary, sizeof(furtherProprietary)).channel == 6 );
+    REQUIRE( ApduView(furtherProprietary, sizeof(furtherProprietary)).cla == 0x84 );
+    REQUIRE( ApduView(furtherProprietary, sizeof(furtherProprietary)).raw[0] == 0xE2 );
+  }
+
+  SECTION("Invalid lengths") {
+    const unsigned char tooShort[] = { 0x00, 0xA4, 0x04 };
+    const unsigned char wrongLc[] = { 0x00, 0xA4, 0x04, 0x00, 0x05, 0x3F, 0x00 };
+    const unsigned char wrongExtended[] = { 0x00, 0xA4, 0x04, 0x00, 0x00, 0x3F };
+
+    REQUIRE_FALSE( ApduView(tooShort, sizeof(tooShort)).valid );
+    REQUIRE_FALSE( ApduView(wrongLc, sizeof(wrongLc)).valid );
+    REQUIRE_FALSE( ApduView(wrongExtended, sizeof(wrongExtended)).valid );
+  }
+}
+
+TEST_CASE( "CardCostModel processing time", "[SmartCard]") {
+  const InstructionCostEntry entries[] = {
+    { 0x2A, { 150000, 0, 0 } },
+    { 0xD6, { 1000, 5000, 0 } },
+    { 0x84, { 100, 0, 50 } },
+    { COST_DEFAULT_INS, { 20, 0, 0 } },
+  };
+  CardCostModel model(entries, sizeof(entries) / sizeof(entries[0]));
+
+  SECTION("Fixed and per byte cost") {
+    REQUIRE( model.cost(0x2A, 256, 0) == std::chrono::milliseconds(150) );
+    REQUIRE( model.cost(0xD6, 200, 0) == std::chrono::milliseconds(2) );
+    REQUIRE( model.cost(0xB0, 200, 0) == std::chrono::microseconds(20) );
+  }
+
+  SECTION("Jitter") {
+    REQUIRE( model.cost(0x84, 8, 50000) == std::chrono::microseconds(150) );
+    REQUIRE( model.cost(0x84, 8, 50001) == std::chrono::microseconds(100) );
+    REQUIRE( model.cost(0x84, 8, 0xFFFFFFFF) <= std::chrono::microseconds(150) );
+  }
+
+  SECTION("Processing time of a card") {
+    std::istringstream in("ATR 3B00\nPROTOCOL T0\n00D6* => 9000\nDEFAULT => 6D00\nCOST D6 1000 5000\n");
+    TableSmartCard card(CardTable::load(in));
+    SCARDHANDLE handle = 0;
+    DWORD protocol = 0;
+    unsigned char scratch[258];
+    ApduResponse response(scratch, sizeof(scratch));
+    const unsigned char update[] = { 0x00, 0xD6, 0x00, 0x00, 0x02, 0x01, 0x02 };
+    const unsigned char read[] = { 0x00, 0xB0, 0x00, 0x00, 0x02 };
+
+    card.connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &handle, &protocol);
+
+    REQUIRE( card.transmit(handle, update, sizeof(update), response) == SCARD_S_SUCCESS );
+    REQUIRE( card.getProcessingTime() == std::chrono::microseconds(1010) );
+    REQUIRE( card.transmit(handle, read, sizeof(read), response) == SCARD_S_SUCCESS );
+    REQUIRE( card.getProcessingTime() == std::chrono::nanoseconds(0) );
+  }
+}
+
+TEST_CASE( "SmartCard logical channels", "[SmartCard]") {
+  std::istringstream in("ATR 3B00\nPROTOCOL T1\nDEFAULT => 9000\n");
+  TableSmartCard card(CardTable::load(in));
+  SCARDHANDLE handle = 0;
+  DWORD protocol = 0;
+  unsigned char scratch[258];
+  card.connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &handle, &protocol);
+  auto transmit = [&](std::vector<unsigned char> command) {
+    ApduResponse response(scratch, sizeof(scratch));
+    card.transmit(handle, command.data(), command.size(), response);
+    return std::vector<unsigned char>(response.data(), response.data() + response.length());
+  };
+
+  REQUIRE( transmit({ 0x01, 0xB0, 0x00, 0x00 }) == std::vector<unsigned char>({ 0x68, 0x81 }) );
+  REQUIRE( transmit({ 0x00, 0x70, 0x00, 0x00, 0x01 }) == std::vector<unsigned char>({ 0x01, 0x90, 0x00 }) );
+  REQUIRE( card.isChannelOpen(1) );
+  REQUIRE( transmit({ 0x01, 0xB0, 0x00, 0x00 }) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+  REQUIRE( transmit({ 0x00, 0x70, 0x00, 0x13 }) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+  REQUIRE( transmit({ 0x4F, 0xB0, 0x00, 0x00 }) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+  REQUIRE( transmit({ 0x00, 0x70, 0x00, 0x13 }) == std::vector<unsigned char>({ 0x69, 0x85 }) );
+  REQUIRE( transmit({ 0x00, 0x70, 0x00, 0x14 }) == std::vector<unsigned char>({ 0x6A, 0x86 }) );
+
+  // The channel of the command is closed with P2 00
+  REQUIRE( transmit({ 0x4F, 0x70, 0x80, 0x00 }) == std::vector<unsigned char>({ 0x90, 0x00 }) );
+  REQUIRE_FALSE( card.isChannelOpen(19) );
+  REQUIRE( transmit({ 0x00, 0x70, 0x80, 0x00 }) == std::vector<unsigned char>({ 0x6A, 0x86 }) );
+  REQUIRE( transmit({ 0x00, 0x70, 0x80, 0x02 }) == std::vector<unsigned char>({ 0x6A, 0x86 }) );
+
+  for (unsigned char channel = 2; channel < SmartCard::MAX_CHANNELS; channel++) {
+    REQUIRE( transmit({ 0x00, 0x70, 0x00, 0x00, 0x01 }) == std::vector<unsigned char>({ channel, 0x90, 0x00 }) );
+  }
+  REQUIRE( transmit({ 0x00, 0x70, 0x00, 0x00, 0x01 }) == std::vector<unsigned char>({ 0x6A, 0x81 }) );
+}
+
+/**
+ * Table card of which the READ BINARY responses are memoized
+ */
+class CachedTableSmartCard : public TableSmartCard {
+public:
+  using TableSmartCard::TableSmartCard;
+
+protected:
+  bool isCacheable(const ApduView &apdu) const override {
+    return apdu.ins == 0xB0;
+  }
+};
+
+TEST_CASE( "SmartCard shared by two threads", "[SmartCard]") {
+  const int exchanges = 2000;
+  std::istringstream in("ATR 3B00\nPROTOCOL T1\nDEFAULT => 0102 9000\nCOST DEFAULT 10 0 5\n");
+  CachedTableSmartCard card(CardTable::load(in));
+  card.setResponseCache(4);
+
+  // Each thread opens a logical channel on its own handle, reads on it and closes it
+  auto session = [&card](int *failures) {
+    SCARDHANDLE handle = 0;
+    DWORD protocol = 0;
+    unsigned char scratch[258];
+    card.connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &handle, &protocol);
+    for (int i = 0; i < exchanges; i++) {
+      const unsigned char open[] = { 0x00, 0x70, 0x00, 0x00, 0x01 };
+      ApduResponse response(scratch, sizeof(scratch));
+      card.transmit(handle, open, sizeof(open), response);
+      if ((response.length() != 3) || (response.data()[1] != 0x90)) {
+        (*failures)++;
+        continue;
+      }
+      unsigned char channel = response.data()[0];
+      unsigned char cla = (channel < 4) ? channel : static_cast<unsigned char>(0x40 | (channel - 4));
+      const unsigned char read[] = { cla, 0xB0, 0x00, 0x00, 0x02 };
+      card.transmit(handle, read, sizeof(read), response);
+      if ((response.length() != 4) || (response.data()[0] != 0x01) || (response.data()[2] != 0x90)) {
+        (*failures)++;
+      }
+      const unsigned char close[] = { cla, 0x70, 0x80, 0x00 };
+      card.transmit(handle, close, sizeof(close), response);
+      if ((response.length() != 2) || (response.data()[0] != 0x90)) {
+        (*failures)++;
+      }
+    }
+    card.disconnect(handle, SCARD_LEAVE_CARD);
+  };
+  int firstFailures = 0;
+  int secondFailures = 0;
+  std::thread first(session, &firstFailures);
+  std::thread second(session, &secondFailures);
+  first.join();
+  second.join();
+
+  REQUIRE( firstFailures == 0 );
+  REQUIRE( secondFailures == 0 );
+  // No update of the state of the card is lost
+  REQUIRE( card.getStateEpoch() == 2 * 2 * exchanges );
+  REQUIRE( card.getResponseCacheCounters()->hits + card.getResponseCacheCounters()->misses == 2 * exchanges );
+  for (unsigned int channel = 1; channel < SmartCard::MAX_CHANNELS; channel++) {
+    REQUIRE_FALSE( card.isChannelOpen(channel) );
+  }
+}
+
+TEST_CASE( "ResponseCache", "[SmartCard]") {
+  ResponseCache cache(3);
+  const unsigned char commands[][5] = {
+    { 0x00, 0xB0, 0x00, 0x00, 0x01 }, { 0x00, 0xB0, 0x00, 0x01, 0x01 }, { 0x00, 0xB0, 0x00, 0x02, 0x01 },
+    { 0x00, 0xB0, 0x00, 0x03, 0x01 }
+  };
+  const unsigned char responses[][3] = { { 0x00, 0x90, 0x00 }, { 0x01, 0x90, 0x00 }, { 0x02, 0x90, 0x00 },
+                                         { 0x03, 0x90, 0x00 } };
+  size_t response_lg = 0;
+
+  REQUIRE_THROWS_AS( ResponseCache(0), const std::invalid_argument & );
+  REQUIRE( cache.find(commands[0], 5, 0, &response_lg) == nullptr );
+  for (size_t i = 0; i < 3; i++) {
+    cache.insert(commands[i], 5, 0, responses[i], 3);
+  }
+  REQUIRE( cache.size() == 3 );
+  const unsigned char *found = cache.find(commands[0], 5, 0, &response_lg);
+  REQUIRE( found != nullptr );
+  REQUIRE( response_lg == 3 );
+  REQUIRE( found[0] == 0x00 );
+
+  // The state epoch is part of the key
+  REQUIRE( cache.find(commands[0], 5, 1, &response_lg) == nullptr );
+  REQUIRE( cache.find(commands[0], 4, 0, &response_lg) == nullptr );
+
+  // The least recently used command is replaced
+  cache.insert(commands[3], 5, 0, responses[3], 3);
+  REQUIRE( cache.size() == 3 );
+  REQUIRE( cache.find(commands[1], 5, 0, &response_lg) == nullptr );
+  REQUIRE( cache.find(commands[0], 5, 0, &response_lg) != nullptr );
+  REQUIRE( cache.find(commands[2], 5, 0, &response_lg) != nullptr );
+  found = cache.find(commands[3], 5, 0, &response_lg);
+  REQUIRE( found != nullptr );
+  REQUIRE( found[0] == 0x03 );
+  REQUIRE( cache.getCounters().hits == 4 );
+  REQUIRE( cache.getCounters().misses == 4 );
+  REQUIRE( cache.getCounters().evictions == 1 );
+
+  // Many replacements keep the index consistent
+  for (unsigned int i = 0; i < 1000; i++) {
+    const unsigned char command[] = { 0x00, 0xB0, static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i) };
+    const unsigned char response[] = { static_cast<unsigned char>(i), 0x90, 0x00 };
+    cache.insert(command, sizeof(command), i % 7, response, sizeof(response));
+    found = cache.find(command, sizeof(command), i % 7, &response_lg);
+    REQUIRE( found != nullptr );
+    REQUIRE( found[0] == static_cast<unsigned char>(i) );
+  }
+  REQUIRE( cache.size() == 3 );
+
+  cache.clear();
+  REQUIRE( cache.size() == 0 );
+  REQUIRE( cache.find(commands[3], 5, 0, &response_lg) == nullptr );
+}
+
+TEST_CASE( "CardTemplate sharing", "[SmartCard]") {
+
+  SECTION("Cards of a built-in profile share the template") {
+    std::shared_ptr<const CardTemplate> cardTemplate = SmartCard::template_of("test_t1");
+    std::unique_ptr<SmartCard> first = SmartCard::instance_of("test_t1");
+    std::unique_ptr<SmartCard> second = SmartCard::instance_of("test_t1");
+
+    REQUIRE( cardTemplate != nullptr );
+    REQUIRE( SmartCard::template_of("test_t1") == cardTemplate );
+    REQUIRE( first->getTemplate() == cardTemplate );
+    REQUIRE( &first->getATR() == &second->getATR() );
+    REQUIRE( first->getPreferredProtocol() == cardTemplate->protocols );
+  }
+
+  SECTION("Cards of a registered template share the template") {
+    std::istringstream in("ATR 3B00\nPROTOCOL T0\nDEFAULT => 6D00\n");
+    auto cardTemplate = std::make_shared<TableCardTemplate>(CardTable::load(in));
+    SmartCard::register_implementation("test_template", cardTemplate);
+
+    std::unique_ptr<SmartCard> card = SmartCard::instance_of("test_template");
+    REQUIRE( card->getTemplate() == cardTemplate );
+    REQUIRE( &card->getATR() == &cardTemplate->atr );
+  }
+
+  SECTION("Unknown card") {
+    REQUIRE( SmartCard::template_of("unknown_card") == nullptr );
+    REQUIRE( SmartCard::instance_of("unknown_card") == nullptr );
+  }
+}
@@ -0,0 +1,125 @@
+//
+// Tests of the T=1 block level transport simulation
+//
+
+#include <sstream>
+#include "catch.hpp"
+#include "t1_transport.h"
+#include "table_smartcard.h"
+
+static std::unique_ptr<SmartCard> chainingCard() {
+  std::ostringstream definition;
+  definition << "ATR 3B 02 14 50\n"
+                "PROTOCOL T1\n"
+                "00DA* => 9000\n"
+                "00B00000000000 => ";
+  for (unsigned int i = 0; i < 3000; i++) {
+    definition << "0123456789ABCDEF"[(i >> 4) & 0x0F] << "0123456789ABCDEF"[i & 0x0F];
+  }
+  definition << "9000\n";
+
+  std::istringstream in(definition.str());
+  return std::make_unique<TableSmartCard>(CardTable::load(in));
+}
+
+TEST_CASE( "T1Transport block exchanges", "[T1Transport]") {
+  unsigned char scratch[258];
+  ApduResponse response(scratch, sizeof(scratch));
+  SCARDHANDLE handle = 0;
+  DWORD protocol = 0;
+
+  SECTION("Single block APDU with IFS negotiation") {
+    std::unique_ptr<SmartCard> card = SmartCard::instance_of("test_t1");
+    card->connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &handle, &protocol);
+    T1Transport t1(32, 32);
+    const unsigned char get_data[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+
+    REQUIRE( t1.transceive(*card, handle, get_data, sizeof(get_data), response) == SCARD_S_SUCCESS );
+    REQUIRE( response.length() == 15 );
+    REQUIRE( response.data()[0] == 0x9F );
+    REQUIRE( response.data()[13] == 0x90 );
+    REQUIRE( t1.lastApdu().sBlocks == 2 );
+    REQUIRE( t1.lastApdu().iBlocks == 2 );
+    REQUIRE( t1.lastApdu().rBlocks == 0 );
+    REQUIRE( t1.lastApdu().bytesToCard == 5 + 9 );
+    REQUIRE( t1.lastApdu().bytesFromCard == 5 + 19 );
+
+    REQUIRE( t1.transceive(*card, handle, get_data, sizeof(get_data), response) == SCARD_S_SUCCESS );
+    REQUIRE( t1.lastApdu().sBlocks == 0 );
+    REQUIRE( t1.lastApdu().iBlocks == 2 );
+    REQUIRE( t1.total().apdus == 2 );
+    REQUIRE( t1.total().sBlocks == 2 );
+    REQUIRE( t1.total().iBlocks == 4 );
+
+    t1.reset();
+    REQUIRE( t1.transceive(*card, handle, get_data, sizeof(get_data), response) == SCARD_S_SUCCESS );
+    REQUIRE( t1.lastApdu().sBlocks == 2 );
+  }
+
+  SECTION("Command chaining limited by IFSC") {
+    std::unique_ptr<SmartCard> card = chainingCard();
+    card->connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &handle, &protocol);
+    T1Transport t1(32, 254);
+    std::vector<unsigned char> update = { 0x00, 0xDA, 0x00, 0x00, 0x00, 0x02, 0x58 };
+    update.resize(update.size() + 600, 0x5A);
+
+    REQUIRE( t1.transceive(*card, handle, update.data(), update.size(), response) == SCARD_S_SUCCESS );
+    REQUIRE( response.length() == 2 );
+    REQUIRE( response.data()[0] == 0x90 );
+    REQUIRE( t1.lastApdu().iBlocks == 19 + 1 );
+    REQUIRE( t1.lastApdu().rBlocks == 18 );
+  }
+
+  SECTION("Response chaining limited by IFSD") {
+    std::unique_ptr<SmartCard> card = chainingCard();
+    card->connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &handle, &protocol);
+    const unsigned char read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    T1Transport large(254, 254);
+    REQUIRE( large.transceive(*card, handle, read, sizeof(read), response) == SCARD_S_SUCCESS );
+    REQUIRE( response.length() == 3002 );
+    for (unsigned int i = 0; i < 3000; i++) {
+      REQUIRE( response.data()[i] == static_cast<unsigned char>(i) );
+    }
+    REQUIRE( response.data()[3000] == 0x90 );
+    REQUIRE( large.lastApdu().iBlocks == 1 + 12 );
+    REQUIRE( large.lastApdu().rBlocks == 11 );
+
+    T1Transport small(254, 8);
+    REQUIRE( small.transceive(*card, handle, read, sizeof(read), response) == SCARD_S_SUCCESS );
+    REQUIRE( response.length() == 3002 );
+    REQUIRE( small.lastApdu().iBlocks == 1 + 376 );
+    REQUIRE( small.lastApdu().rBlocks == 375 );
+    REQUIRE( small.lastApdu().bytesFromCard > large.lastApdu().bytesFromCard );
+  }
+
+  SECTION("Waiting time extensions for long operations") {
+    std::istringstream in("ATR 3B00\nPROTOCOL T1\n002A* => 0102039000\nDEFAULT => 6D00\nCOST 2A 1000000\n");
+    TableSmartCard card(CardTable::load(in));
+    card.connect(SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &handle, &protocol);
+    const unsigned char sign[] = { 0x00, 0x2A, 0x9E, 0x9A, 0x01, 0x55, 0x00 };
+    const unsigned char other[] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+    T1Transport t1(254, 254);
+
+    REQUIRE( t1.transceive(card, handle, sign, sizeof(sign), response) == SCARD_S_SUCCESS );
+    REQUIRE( t1.lastApdu().waitingTimeExtensions == 0 );
+
+    t1.setBlockWaitingTime(std::chrono::milliseconds(100));
+    REQUIRE( t1.transceive(card, handle, sign, sizeof(sign), response) == SCARD_S_SUCCESS );
+    REQUIRE( response.length() == 5 );
+    REQUIRE( t1.lastApdu().waitingTimeExtensions == 1 );
+    REQUIRE( t1.lastApdu().sBlocks == 2 );
+
+    t1.setBlockWaitingTime(std::chrono::microseconds(1000));
+    REQUIRE( t1.transceive(card, handle, sign, sizeof(sign), response) == SCARD_S_SUCCESS );
+    REQUIRE( t1.lastApdu().waitingTimeExtensions == 4 );
+
+    REQUIRE( t1.transceive(card, handle, other, sizeof(other), response) == SCARD_S_SUCCESS );
+    REQUIRE( t1.lastApdu().waitingTimeExtensions == 0 );
+  }
+
+  SECTION("Invalid information field sizes") {
+    REQUIRE_THROWS_AS( T1Transport(0, 32), const std::invalid_argument & );
+    REQUIRE_THROWS_AS( T1Transport(32, 255), const std::invalid_argument & );
+  }
+}
@@ -4,10 +4,16 @@
 #define CATCH_CONFIG_MAIN
 #include <winscard.h>
 #include <thread>
+#include <fstream>
+#include <sstream>
 #include <pcsclite.h>
 #include "catch.hpp"
 #include "stubbing.h"
 #include "winscard_stub.h"
+#include "file_system_image.h"
+#include "apdu_trace.h"
+#include "pcapng_export.h"
+#include "metrics_page.h"
 
 TEST_CASE( "SCardEstablishContext() stubbing call", "[API]") {
   SCARDCONTEXT hContext = 0;
@@ -969,6 +975,10 @@ TEST_CASE( "SCardGetStatusChange() testing for default behaviour", "[API]") {
       REQUIRE(ret == SCARD_S_SUCCESS);
     });
 
+    std::unique_ptr<SCARD_STATS> before(new SCARD_STATS);
+    std::unique_ptr<SCARD_STATS> after(new SCARD_STATS);
+    REQUIRE( SCardGetStats(before.get()) == SCARD_S_SUCCESS );
+
     readerStates[0].szReader = "Non Pinpad Reader 0";
     readerStates[0].dwCurrentState = SCARD_STATE_UNAWARE;
     ret = SCardGetStatusChange(hContext, 10, readerStates, readerStatesLg);
@@ -978,6 +988,31 @@ TEST_CASE( "SCardGetStatusChange() testing for default behaviour", "[API]") {
     REQUIRE( readerStates[0].dwEventState == SCARD_STATE_PRESENT );
     REQUIRE( strcmp(readerStates[0].szReader,"Non Pinpad Reader 0") == 0 );
 
+    // The wakeup is counted, the next events have no waiter
+    REQUIRE( SCardGetStats(after.get()) == SCARD_S_SUCCESS );
+    REQUIRE( after->sWakeups.ullWakeups - before->sWakeups.ullWakeups == 1 );
+    REQUIRE( after->sWakeups.ullMaxNanoseconds > 0 );
+    REQUIRE( after->sWakeups.ullMaxNanoseconds < 10000000000ULL );
+    REQUIRE( SCardRemoveSmartCardFromReader(hContext, "Non Pinpad Reader 0") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "test") == SCARD_S_SUCCESS );
+
+  }
+
+  SECTION("Succes state already changed", "[API]") {
+    SCARD_READERSTATE readerStates[1] {};
+    DWORD             readerStatesLg {1};
+
+    ret = SCardAttachReader(hContext, "Non Pinpad Reader");
+    ret = SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "test");
+
+    // The caller knows the reader empty, the card is reported without waiting for an event
+    readerStates[0].szReader = "Non Pinpad Reader 0";
+    readerStates[0].dwCurrentState = SCARD_STATE_EMPTY;
+    ret = SCardGetStatusChange(hContext, 10, readerStates, readerStatesLg);
+
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( readerStates[0].dwEventState == (SCARD_STATE_PRESENT | SCARD_STATE_CHANGED) );
+    REQUIRE( readerStates[0].cbAtr > 0 );
   }
 
   SECTION("Failed timeout no event", "[API]") {
@@ -1013,4 +1048,767 @@ TEST_CASE( "SCardGetStatusChange() testing for default behaviour", "[API]") {
   }
 
   ret = SCardReleaseContext(hContext);
-}
\ No newline at end of file
+}
+
+TEST_CASE( "SCardRegisterSmartCard() testing for default behaviour", "[API]") {
+  {
+    std::ofstream table("table_card.txt");
+    table << "ATR 3B 02 14 50\nPROTOCOL T0\n00A4040000 => 9000\n";
+    std::ofstream malformed("malformed_card.txt");
+    malformed << "ATR 3B 02 14 50\nPROTOCOL T0\n00A4040000 => 9\n";
+  }
+
+  SECTION("Success") {
+    REQUIRE( SCardRegisterSmartCard("table card", "table", "table_card.txt") == SCARD_S_SUCCESS );
+  }
+
+  SECTION("Fail with unknown type") {
+    REQUIRE( SCardRegisterSmartCard("table card", "unknown", "table_card.txt") == SCARD_E_CARD_UNSUPPORTED );
+  }
+
+  SECTION("Fail with missing file") {
+    REQUIRE( SCardRegisterSmartCard("table card", "table", "missing_card.txt") == SCARD_E_FILE_NOT_FOUND );
+  }
+
+  SECTION("Fail with malformed table") {
+    REQUIRE( SCardRegisterSmartCard("table card", "table", "malformed_card.txt") == SCARD_E_INVALID_VALUE );
+  }
+
+  SECTION("Fail with built-in card name") {
+    REQUIRE( SCardRegisterSmartCard("test", "table", "table_card.txt") == SCARD_E_INVALID_VALUE );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    REQUIRE( SCardRegisterSmartCard(NULL, "table", "table_card.txt") == SCARD_E_INVALID_PARAMETER );
+  }
+}
+
+TEST_CASE( "SCardTransmit() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  LONG         ret { 0 };
+  {
+    std::ofstream table("transmit_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "PROTOCOL T0\n"
+             "00A4040007A0000000031010 => 6F03 840100 9000\n"
+             "00B0* => 6982\n"
+             "80CA9F7F00 => 9F7F03 010203 9000\n"
+             "DEFAULT => 6D00\n";
+  }
+
+  ret = SCardRegisterSmartCard("transmit card", "table", "transmit_card.txt");
+  ret = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+  ret = SCardAttachReader(hContext, "Non Pinpad Reader");
+  ret = SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "transmit card");
+  ret = SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard, &dwActiveProtocol);
+
+  SECTION("Success") {
+    BYTE  select[] = { 0x00, 0xA4, 0x04, 0x00, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10 };
+    BYTE  get_response[] = { 0x00, 0xC0, 0x00, 0x00, 0x05 };
+    BYTE  read[] = { 0x00, 0xB0, 0x00, 0x00, 0x10 };
+    BYTE  unknown[] = { 0x80, 0x10, 0x00, 0x00 };
+    BYTE  response[258] { 0x00 };
+    DWORD responseLg = sizeof(response);
+    BYTE  response_ref[] = { 0x6F, 0x03, 0x84, 0x01, 0x00, 0x90, 0x00 };
+
+    ret = SCardTransmit(hCard, NULL, select, sizeof(select), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 2 );
+    REQUIRE( response[0] == 0x61 );
+    REQUIRE( response[1] == 0x05 );
+
+    responseLg = sizeof(response);
+    ret = SCardTransmit(hCard, NULL, get_response, sizeof(get_response), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == sizeof(response_ref) );
+    REQUIRE( memcmp(response, response_ref, responseLg) == 0 );
+
+    responseLg = sizeof(response);
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 2 );
+    REQUIRE( response[0] == 0x69 );
+    REQUIRE( response[1] == 0x82 );
+
+    responseLg = sizeof(response);
+    ret = SCardTransmit(hCard, NULL, unknown, sizeof(unknown), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 2 );
+    REQUIRE( response[0] == 0x6D );
+  }
+
+  SECTION("Success with built-in profile") {
+    SCARDHANDLE hCardT1 { 0 };
+    BYTE  get_data[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+    BYTE  response[258] { 0x00 };
+    DWORD responseLg = sizeof(response);
+
+    ret = SCardAttachReader(hContext, "Pinpad Reader");
+    ret = SCardInsertSmartCardInReader(hContext, "Pinpad Reader 0", "test_t1");
+    ret = SCardConnect(hContext, "Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCardT1, &dwActiveProtocol);
+    REQUIRE( dwActiveProtocol == SCARD_PROTOCOL_T1 );
+
+    ret = SCardTransmit(hCardT1, NULL, get_data, sizeof(get_data), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 15 );
+    REQUIRE( response[13] == 0x90 );
+
+    ret = SCardDisconnect(hCardT1, SCARD_LEAVE_CARD);
+  }
+
+  SECTION("Fail with insufficient buffer") {
+    BYTE  get_data[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+    BYTE  response[4] { 0x00 };
+    DWORD responseLg = sizeof(response);
+
+    ret = SCardTransmit(hCard, NULL, get_data, sizeof(get_data), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_E_INSUFFICIENT_BUFFER );
+    REQUIRE( responseLg == 8 );
+  }
+
+  SECTION("Fail with invalid handle") {
+    BYTE  read[] = { 0x00, 0xB0, 0x00, 0x00, 0x10 };
+    BYTE  response[258] { 0x00 };
+    DWORD responseLg = sizeof(response);
+
+    ret = SCardTransmit(hCard + 100, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_E_INVALID_HANDLE );
+  }
+
+  SECTION("Fail with removed card") {
+    BYTE  read[] = { 0x00, 0xB0, 0x00, 0x00, 0x10 };
+    BYTE  response[258] { 0x00 };
+    DWORD responseLg = sizeof(response);
+
+    ret = SCardRemoveSmartCardFromReader(hContext, "Non Pinpad Reader 0");
+
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_W_REMOVED_CARD );
+  }
+
+  ret = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+  ret = SCardReleaseContext(hContext);
+}
+
+static std::string hexOfCertificate(unsigned int length) {
+  std::string hex;
+  const char digits[] = "0123456789ABCDEF";
+  for (unsigned int i = 0; i < length; i++) {
+    hex += digits[(i >> 4) & 0x0F];
+    hex += digits[i & 0x0F];
+  }
+  return hex;
+}
+
+TEST_CASE( "SCardTransmit() testing for response chaining", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  LONG         ret { 0 };
+  BYTE         response[65538] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  {
+    std::ofstream table("chaining_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "PROTOCOL T0 T1\n"
+             "00B0000000 => " << hexOfCertificate(3000) << "9000\n"
+             "00B00000000000 => " << hexOfCertificate(3000) << "9000\n"
+             "00B00001/FFFFFFFF => " << hexOfCertificate(32) << "9000\n";
+  }
+
+  ret = SCardRegisterSmartCard("chaining card", "table", "chaining_card.txt");
+  ret = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+  ret = SCardAttachReader(hContext, "Non Pinpad Reader");
+  ret = SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "chaining card");
+
+  SECTION("Success with GET RESPONSE on T=0") {
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+    BYTE get_response[] = { 0x00, 0xC0, 0x00, 0x00, 0x00 };
+    std::vector<BYTE> certificate;
+
+    ret = SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard, &dwActiveProtocol);
+    REQUIRE( dwActiveProtocol == SCARD_PROTOCOL_T0 );
+
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    while ((ret == SCARD_S_SUCCESS) && (responseLg == 258) && (response[256] == 0x61)) {
+      certificate.insert(certificate.end(), response, response + 256);
+      get_response[4] = response[257];
+      responseLg = sizeof(response);
+      ret = SCardTransmit(hCard, NULL, get_response, sizeof(get_response), NULL, response, &responseLg);
+    }
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( response[responseLg - 2] == 0x90 );
+    certificate.insert(certificate.end(), response, response + responseLg - 2);
+
+    REQUIRE( certificate.size() == 3000 );
+    for (unsigned int i = 0; i < certificate.size(); i++) {
+      REQUIRE( certificate[i] == static_cast<BYTE>(i) );
+    }
+  }
+
+  SECTION("Success with extended length on T=1") {
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    ret = SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &hCard, &dwActiveProtocol);
+    REQUIRE( dwActiveProtocol == SCARD_PROTOCOL_T1 );
+
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 3002 );
+    REQUIRE( response[2999] == static_cast<BYTE>(2999) );
+    REQUIRE( response[3000] == 0x90 );
+  }
+
+  SECTION("Success with T=1 block simulation") {
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    SCARD_T1_COUNTERS lastApdu;
+    SCARD_T1_COUNTERS total;
+
+    REQUIRE( SCardGetReaderT1Counters(hContext, "Non Pinpad Reader 0", &lastApdu, &total) == SCARD_E_UNSUPPORTED_FEATURE );
+    REQUIRE( SCardConfigureReaderT1(hContext, "Non Pinpad Reader 0", 32, 255) == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardConfigureReaderT1(hContext, "Unknown Reader 0", 32, 254) == SCARD_E_READER_UNAVAILABLE );
+    REQUIRE( SCardConfigureReaderT1(hContext, "Non Pinpad Reader 0", 32, 254) == SCARD_S_SUCCESS );
+
+    ret = SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &dwActiveProtocol);
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 3002 );
+    REQUIRE( response[2999] == static_cast<BYTE>(2999) );
+
+    REQUIRE( SCardGetReaderT1Counters(hContext, "Non Pinpad Reader 0", &lastApdu, &total) == SCARD_S_SUCCESS );
+    REQUIRE( lastApdu.dwApdus == 1 );
+    REQUIRE( lastApdu.dwIBlocks == 13 );
+    REQUIRE( lastApdu.dwRBlocks == 11 );
+    REQUIRE( lastApdu.dwSBlocks == 2 );
+    REQUIRE( total.dwBytesFromCard == lastApdu.dwBytesFromCard );
+  }
+
+  SECTION("Fail with extended length on T=0") {
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    ret = SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard, &dwActiveProtocol);
+
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 2 );
+    REQUIRE( response[0] == 0x67 );
+  }
+
+  SECTION("Fail with wrong Le") {
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x01, 0x08 };
+
+    ret = SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard, &dwActiveProtocol);
+
+    ret = SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg);
+    REQUIRE( ret == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 2 );
+    REQUIRE( response[0] == 0x6C );
+    REQUIRE( response[1] == 0x20 );
+  }
+
+  ret = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+  ret = SCardReleaseContext(hContext);
+}
+
+TEST_CASE( "SCardAttachReaderWithLatency() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  BYTE         command[] = { 0x00, 0xA4, 0x04, 0x00 };
+  BYTE         response[258] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  uint64_t     elapsed { 0 };
+  SCARD_LATENCY_MODEL model { SCARD_LATENCY_VIRTUAL_CLOCK, 0, 250 };
+
+  REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+
+  SECTION("Success with virtual clock") {
+    REQUIRE( SCardAttachReaderWithLatency(hContext, "Non Pinpad Reader", &model) == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "test") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardTransmit(hCard, NULL, command, sizeof(command), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetReaderElapsedTime(hContext, "Non Pinpad Reader 0", &elapsed) == SCARD_S_SUCCESS );
+    // 7 characters of 12 etu at 9600 baud and the CCID overhead
+    REQUIRE( elapsed == 9000000 );
+  }
+
+  SECTION("Success with processing time of the card") {
+    {
+      std::ofstream table("slow_card.txt");
+      table << "ATR 3B 02 14 50\nPROTOCOL T0\n002A* => 9000\nCOST 2A 150000\n";
+    }
+    BYTE sign[] = { 0x00, 0x2A, 0x9E, 0x9A };
+
+    REQUIRE( SCardRegisterSmartCard("slow card", "table", "slow_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardAttachReaderWithLatency(hContext, "Non Pinpad Reader", &model) == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "slow card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardTransmit(hCard, NULL, sign, sizeof(sign), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetReaderElapsedTime(hContext, "Non Pinpad Reader 0", &elapsed) == SCARD_S_SUCCESS );
+    REQUIRE( elapsed == 150000000 + 9000000 );
+  }
+
+  SECTION("Success with replaced latency model") {
+    REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetReaderElapsedTime(hContext, "Non Pinpad Reader 0", &elapsed) == SCARD_E_UNSUPPORTED_FEATURE );
+
+    REQUIRE( SCardConfigureReaderLatency(hContext, "Non Pinpad Reader 0", &model) == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetReaderElapsedTime(hContext, "Non Pinpad Reader 0", &elapsed) == SCARD_S_SUCCESS );
+    REQUIRE( elapsed == 0 );
+
+    REQUIRE( SCardConfigureReaderLatency(hContext, "Non Pinpad Reader 0", NULL) == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetReaderElapsedTime(hContext, "Non Pinpad Reader 0", &elapsed) == SCARD_E_UNSUPPORTED_FEATURE );
+  }
+
+  SECTION("Fail with invalid mode") {
+    model.dwMode = 0;
+    REQUIRE( SCardAttachReaderWithLatency(hContext, "Non Pinpad Reader", &model) == SCARD_E_INVALID_VALUE );
+  }
+
+  SECTION("Fail with unknown reader") {
+    REQUIRE( SCardConfigureReaderLatency(hContext, "Unknown Reader 0", &model) == SCARD_E_READER_UNAVAILABLE );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    REQUIRE( SCardAttachReaderWithLatency(hContext, "Non Pinpad Reader", NULL) == SCARD_E_INVALID_PARAMETER );
+  }
+
+  SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+  SCardReleaseContext(hContext);
+}
+
+TEST_CASE( "SCardTransmit() testing for file system card", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  BYTE         response[258] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  {
+    FileSystemImageBuilder builder({ 0x3B, 0x02, 0x14, 0x50 }, SCARD_PROTOCOL_T1);
+    builder.addTransparentEF(FileSystemImageBuilder::MF, 0x2F00, { 0x61, 0x04, 0x4F, 0x02, 0xA0, 0x00 });
+    builder.write("fs_card.img");
+  }
+
+  REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+  REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+
+  SECTION("Success") {
+    BYTE select[] = { 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x2F, 0x00 };
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+
+    REQUIRE( SCardRegisterSmartCard("fs card", "fs", "fs_card.img") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "fs card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardTransmit(hCard, NULL, select, sizeof(select), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 2 );
+    responseLg = sizeof(response);
+    REQUIRE( SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 8 );
+    REQUIRE( response[2] == 0x4F );
+    REQUIRE( response[6] == 0x90 );
+  }
+
+  SECTION("Success with the response cache") {
+    BYTE select[] = { 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x2F, 0x00 };
+    BYTE read[] = { 0x00, 0xB0, 0x00, 0x00, 0x00 };
+    SCARD_RESPONSE_CACHE_COUNTERS counters;
+
+    REQUIRE( SCardConfigureResponseCache(hContext, "Non Pinpad Reader 0", 16) == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetResponseCacheCounters(hContext, "Non Pinpad Reader 0", &counters) == SCARD_E_NO_SMARTCARD );
+    REQUIRE( SCardRegisterSmartCard("fs card", "fs", "fs_card.img") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "fs card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardTransmit(hCard, NULL, select, sizeof(select), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    for (int i = 0; i < 3; i++) {
+      responseLg = sizeof(response);
+      REQUIRE( SCardTransmit(hCard, NULL, read, sizeof(read), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+      REQUIRE( responseLg == 8 );
+      REQUIRE( response[2] == 0x4F );
+    }
+    REQUIRE( SCardGetResponseCacheCounters(hContext, "Non Pinpad Reader 0", &counters) == SCARD_S_SUCCESS );
+    REQUIRE( counters.ullHits == 2 );
+    REQUIRE( counters.ullMisses == 2 );
+    REQUIRE( counters.ullEvictions == 0 );
+
+    REQUIRE( SCardConfigureResponseCache(hContext, "Non Pinpad Reader 0", 0) == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetResponseCacheCounters(hContext, "Non Pinpad Reader 0", &counters) == SCARD_E_UNSUPPORTED_FEATURE );
+    REQUIRE( SCardConfigureResponseCache(hContext, "Unknown Reader", 16) == SCARD_E_READER_UNAVAILABLE );
+  }
+
+  SECTION("Fail with missing image") {
+    REQUIRE( SCardRegisterSmartCard("fs card", "fs", "missing_card.img") == SCARD_E_FILE_NOT_FOUND );
+  }
+
+  SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+  SCardReleaseContext(hContext);
+}
+
+TEST_CASE( "SCardGetCardManagerCounters() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  BYTE         response[258] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  SCARD_GP_COUNTERS counters;
+  {
+    std::ofstream out("gp_card.txt");
+    out << "ATR 3B 8F 80 01 80 4F 0C A0 00 00 03 06 03 00 03 00 00 00 00 68\n";
+  }
+
+  REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+  REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+
+  SECTION("Success") {
+    BYTE select[] = { 0x00, 0xA4, 0x04, 0x00, 0x00 };
+    BYTE installForLoad[] = { 0x80, 0xE6, 0x02, 0x00, 0x0A, 0x05, 0xD2, 0x76, 0x00, 0x00, 0x85, 0x00, 0x00, 0x00, 0x00 };
+    BYTE load[] = { 0x80, 0xE8, 0x80, 0x00, 0x04, 0xC4, 0x02, 0x01, 0x02, 0x00 };
+
+    REQUIRE( SCardRegisterSmartCard("gp card", "gp", "gp_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "gp card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardTransmit(hCard, NULL, select, sizeof(select), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    responseLg = sizeof(response);
+    REQUIRE( SCardTransmit(hCard, NULL, installForLoad, sizeof(installForLoad), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    responseLg = sizeof(response);
+    REQUIRE( SCardTransmit(hCard, NULL, load, sizeof(load), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( responseLg == 3 );
+    REQUIRE( response[1] == 0x90 );
+
+    REQUIRE( SCardGetCardManagerCounters(hContext, "Non Pinpad Reader 0", &counters) == SCARD_S_SUCCESS );
+    REQUIRE( counters.rgPhases[SCARD_GP_PHASE_SELECT].dwCommands == 1 );
+    REQUIRE( counters.rgPhases[SCARD_GP_PHASE_LOAD].dwCommands == 1 );
+    REQUIRE( counters.rgPhases[SCARD_GP_PHASE_LOAD].ullBytes == 4 );
+    REQUIRE( counters.dwLoadFiles == 1 );
+    REQUIRE( counters.dwApplets == 0 );
+  }
+
+  SECTION("Fail for another card") {
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "test") == SCARD_S_SUCCESS );
+    REQUIRE( SCardGetCardManagerCounters(hContext, "Non Pinpad Reader 0", &counters) == SCARD_E_UNSUPPORTED_FEATURE );
+  }
+
+  SECTION("Fail without card or reader") {
+    REQUIRE( SCardGetCardManagerCounters(hContext, "Non Pinpad Reader 0", &counters) == SCARD_E_NO_SMARTCARD );
+    REQUIRE( SCardGetCardManagerCounters(hContext, "Unknown Reader", &counters) == SCARD_E_READER_UNAVAILABLE );
+    REQUIRE( SCardGetCardManagerCounters(hContext, "Non Pinpad Reader 0", NULL) == SCARD_E_INVALID_PARAMETER );
+  }
+
+  SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+  SCardReleaseContext(hContext);
+}
+
+TEST_CASE( "SCardStartTrace() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  BYTE         command[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+  BYTE         response[258] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  {
+    std::ofstream table("trace_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "80CA9F7F00 => 9F7F03 010203 9000\n"
+             "DEFAULT => 6D00\n";
+  }
+  std::remove("api_trace.bin");
+
+  SECTION("Success") {
+    REQUIRE( SCardRegisterSmartCard("trace card", "table", "trace_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardStartTrace("api_trace.bin") == SCARD_S_SUCCESS );
+    REQUIRE( SCardStartTrace("api_trace.bin") == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "trace card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+    REQUIRE( SCardTransmit(hCard, NULL, command, sizeof(command), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( SCardDisconnect(hCard, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+    REQUIRE( SCardReleaseContext(hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardReleaseContext(hContext) == SCARD_E_INVALID_HANDLE );
+    REQUIRE( SCardStopTrace() == SCARD_S_SUCCESS );
+
+    std::ifstream in("api_trace.bin", std::ios::binary);
+    std::vector<unsigned char> trace((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<TraceRecord> records;
+    size_t offset = ApduTrace::HEADER_SIZE;
+    TraceRecord record;
+    size_t record_lg = 0;
+    while (ApduTrace::decodeRecord(trace.data() + offset, trace.size() - offset, &record, &record_lg)) {
+      records.push_back(record);
+      offset += record_lg;
+    }
+    REQUIRE( offset == trace.size() );
+    REQUIRE( records.size() == 9 );
+    REQUIRE( records[0].function == static_cast<uint16_t>(TraceFunction::StartTrace) );
+    REQUIRE( records[0].result == static_cast<uint32_t>(SCARD_E_INVALID_VALUE) );
+    REQUIRE( records[1].function == static_cast<uint16_t>(TraceFunction::EstablishContext) );
+    REQUIRE( records[1].handle == hContext );
+    REQUIRE( records[2].function == static_cast<uint16_t>(TraceFunction::AttachReader) );
+    REQUIRE( records[2].handle == hContext );
+    REQUIRE( records[3].function == static_cast<uint16_t>(TraceFunction::InsertSmartCardInReader) );
+    REQUIRE( records[4].function == static_cast<uint16_t>(TraceFunction::Connect) );
+    REQUIRE( records[4].handle == hCard );
+    REQUIRE( std::string(reinterpret_cast<const char *>(records[4].input), records[4].inputLg) == "Non Pinpad Reader 0" );
+    REQUIRE( records[5].function == static_cast<uint16_t>(TraceFunction::Transmit) );
+    REQUIRE( records[5].handle == hCard );
+    REQUIRE( records[5].inputLg == sizeof(command) );
+    REQUIRE( records[5].outputLg == 8 );
+    REQUIRE( records[5].output[0] == 0x9F );
+    REQUIRE( records[6].function == static_cast<uint16_t>(TraceFunction::Disconnect) );
+    REQUIRE( records[8].result == static_cast<uint32_t>(SCARD_E_INVALID_HANDLE) );
+    REQUIRE( records[8].timestamp >= records[1].timestamp );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    REQUIRE( SCardStartTrace(NULL) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardStartTrace("missing_directory/api_trace.bin") == SCARD_E_NO_ACCESS );
+    REQUIRE( SCardStopTrace() == SCARD_S_SUCCESS );
+  }
+}
+
+TEST_CASE( "SCardStartCapture() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  BYTE         command[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+  BYTE         response[258] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  {
+    std::ofstream table("capture_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "80CA9F7F00 => 9F7F03 010203 9000\n"
+             "DEFAULT => 6D00\n";
+  }
+  std::remove("api_capture.pcapng");
+
+  SECTION("Success") {
+    REQUIRE( SCardRegisterSmartCard("capture card", "table", "capture_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardStartCapture("api_capture.pcapng") == SCARD_S_SUCCESS );
+    REQUIRE( SCardStartCapture("api_capture.pcapng") == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "capture card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+    REQUIRE( SCardTransmit(hCard, NULL, command, sizeof(command), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( SCardControl(hCard, 0x42000001, command, 2, response, sizeof(response), &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( SCardDisconnect(hCard, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+    REQUIRE( SCardReleaseContext(hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardStopCapture() == SCARD_S_SUCCESS );
+
+    // Section header, interface, and a command and a response for SCardTransmit and SCardControl
+    std::ifstream in("api_capture.pcapng", std::ios::binary);
+    std::vector<unsigned char> capture((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<uint32_t> types;
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    while (offset + 8 <= capture.size()) {
+      types.push_back(capture[offset]);
+      offsets.push_back(offset);
+      offset += capture[offset + 4] | (capture[offset + 5] << 8);
+    }
+    REQUIRE( offset == capture.size() );
+    REQUIRE( types == std::vector<uint32_t>({ 0x0A, 1, 6, 6, 6, 6 }) );
+    size_t message = 28 + PcapngExport::USBMON_HEADER_SIZE;
+    REQUIRE( capture[offsets[2] + message] == 0x6F );
+    REQUIRE( capture[offsets[2] + message + 10] == 0x80 );
+    REQUIRE( capture[offsets[3] + message] == 0x80 );
+    REQUIRE( capture[offsets[3] + message + 1] == 8 );
+    REQUIRE( capture[offsets[3] + message + 10] == 0x9F );
+    REQUIRE( capture[offsets[4] + message] == 0x6B );
+    REQUIRE( capture[offsets[5] + message] == 0x83 );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    REQUIRE( SCardStartCapture(NULL) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardStartCapture("missing_directory/api_capture.pcapng") == SCARD_E_NO_ACCESS );
+    REQUIRE( SCardStopCapture() == SCARD_S_SUCCESS );
+  }
+}
+
+TEST_CASE( "SCardGetStats() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  BYTE         command[] = { 0x80, 0xCA, 0x9F, 0x7F, 0x00 };
+  BYTE         unknown[] = { 0x80, 0xCA, 0x00, 0x42, 0x00 };
+  BYTE         response[258] { 0x00 };
+  DWORD        responseLg = sizeof(response);
+  {
+    std::ofstream table("stats_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "80CA9F7F00 => 9F7F03 010203 9000\n"
+             "DEFAULT => 6D00\n";
+  }
+  std::unique_ptr<SCARD_STATS> before(new SCARD_STATS);
+  std::unique_ptr<SCARD_STATS> after(new SCARD_STATS);
+
+  SECTION("Success") {
+    REQUIRE( SCardGetStats(before.get()) == SCARD_S_SUCCESS );
+    REQUIRE( SCardRegisterSmartCard("stats card", "table", "stats_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "stats card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+    REQUIRE( SCardTransmit(hCard, NULL, command, sizeof(command), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    responseLg = sizeof(response);
+    REQUIRE( SCardTransmit(hCard, NULL, unknown, sizeof(unknown), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+    REQUIRE( SCardTransmit(hCard + 1000, NULL, command, sizeof(command), NULL, response, &responseLg) ==
+             SCARD_E_INVALID_HANDLE );
+
+    SCARD_READER_STATS stats;
+    REQUIRE( SCardGetReaderStats(hContext, "Non Pinpad Reader 0", &stats) == SCARD_S_SUCCESS );
+    REQUIRE( stats.ullApdus == 2 );
+    REQUIRE( stats.ullErrors == 0 );
+    REQUIRE( stats.ullBytesIn == 10 );
+    REQUIRE( stats.ullBytesOut == 10 );
+    REQUIRE( stats.rgullSw1[0x90] == 1 );
+    REQUIRE( stats.rgullSw1[0x6D] == 1 );
+    REQUIRE( SCardGetReaderStats(hContext, "Pinpad Reader 0", &stats) == SCARD_E_READER_UNAVAILABLE );
+    REQUIRE( SCardDisconnect(hCard, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+    REQUIRE( SCardReleaseContext(hContext) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardGetStats(after.get()) == SCARD_S_SUCCESS );
+    const SCARD_CALL_STATS &transmit = after->rgCalls[SCARD_STATS_TRANSMIT];
+    REQUIRE( transmit.ullCalls - before->rgCalls[SCARD_STATS_TRANSMIT].ullCalls == 3 );
+    REQUIRE( transmit.ullErrors - before->rgCalls[SCARD_STATS_TRANSMIT].ullErrors == 1 );
+    REQUIRE( after->rgCalls[SCARD_STATS_CONNECT].ullCalls - before->rgCalls[SCARD_STATS_CONNECT].ullCalls == 1 );
+    REQUIRE( after->rgCalls[SCARD_STATS_ATTACH_READER].ullCalls
+             - before->rgCalls[SCARD_STATS_ATTACH_READER].ullCalls == 1 );
+    REQUIRE( after->rgCalls[SCARD_STATS_GET_READER_STATS].ullCalls
+             - before->rgCalls[SCARD_STATS_GET_READER_STATS].ullCalls == 2 );
+    REQUIRE( after->rgCalls[SCARD_STATS_GET_READER_STATS].ullErrors
+             - before->rgCalls[SCARD_STATS_GET_READER_STATS].ullErrors == 1 );
+    REQUIRE( after->rgCalls[SCARD_STATS_GET_STATS].ullCalls - before->rgCalls[SCARD_STATS_GET_STATS].ullCalls == 1 );
+    uint64_t calls = 0;
+    for (size_t bucket = 0; bucket < SCARD_STATS_LATENCY_BUCKETS; bucket++) {
+      calls += transmit.rgullLatency[bucket];
+    }
+    REQUIRE( calls == transmit.ullCalls );
+
+    uint64_t bound = 0;
+    REQUIRE( SCardGetStatsBucketBound(40, &bound) == SCARD_S_SUCCESS );
+    REQUIRE( bound == 48 );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    uint64_t bound = 0;
+    REQUIRE( SCardGetStats(NULL) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardGetStatsBucketBound(0, NULL) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardGetStatsBucketBound(SCARD_STATS_LATENCY_BUCKETS, &bound) == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardGetReaderStats(hContext, NULL, NULL) == SCARD_E_INVALID_PARAMETER );
+  }
+}
+
+TEST_CASE( "SCardStartMetricsPage() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  {
+    std::ofstream table("metrics_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "DEFAULT => 6D00\n";
+  }
+
+  SECTION("Success") {
+    MetricsSnapshot before;
+    MetricsSnapshot after;
+    REQUIRE( SCardStartMetricsPage("/winscard_stub_test_api", 1000) == SCARD_S_SUCCESS );
+    REQUIRE( SCardStartMetricsPage("/winscard_stub_test_api", 1000) == SCARD_E_INVALID_VALUE );
+    MetricsPageReader page("/winscard_stub_test_api");
+    REQUIRE( page.read(&before) );
+
+    REQUIRE( SCardRegisterSmartCard("metrics card", "table", "metrics_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "metrics card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+    {
+      SetReturnCodeFor fault("winscard", "SCardIsValidContext", SCARD_E_NO_SERVICE);
+      REQUIRE( SCardIsValidContext(hContext) == SCARD_E_NO_SERVICE );
+    }
+    // The last values are published when the publication stops
+    REQUIRE( SCardStopMetricsPage() == SCARD_S_SUCCESS );
+    REQUIRE( page.read(&after) );
+    REQUIRE( after.contexts - before.contexts == 1 );
+    REQUIRE( after.handles - before.handles == 1 );
+    REQUIRE( after.cards - before.cards == 1 );
+    REQUIRE( after.events - before.events == 2 );
+    REQUIRE( after.faults - before.faults == 1 );
+    REQUIRE( after.calls[SCARD_STATS_CONNECT] - before.calls[SCARD_STATS_CONNECT] == 1 );
+
+    REQUIRE( SCardDisconnect(hCard, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+    REQUIRE( SCardReleaseContext(hContext) == SCARD_S_SUCCESS );
+    REQUIRE( MetricsPage::contexts.load() == before.contexts );
+    REQUIRE( MetricsPage::handles.load() == before.handles );
+    REQUIRE( MetricsPage::cards.load() == before.cards );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    REQUIRE( SCardStartMetricsPage(NULL, 1000) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardStartMetricsPage("no_slash", 1000) == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardStartMetricsPage("/winscard_stub_test_api", 0) == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardStopMetricsPage() == SCARD_S_SUCCESS );
+  }
+}
+
+TEST_CASE( "SCardDumpMetrics() testing for default behaviour", "[API]") {
+  SCARDCONTEXT hContext { 0 };
+  SCARDHANDLE  hCard { 0 };
+  DWORD        dwActiveProtocol { 0 };
+  {
+    std::ofstream table("dump_card.txt");
+    table << "ATR 3B 02 14 50\n"
+             "DEFAULT => 6D00\n";
+  }
+
+  SECTION("Success") {
+    unsigned char command[] = { 0x00, 0xCA, 0x00, 0x00, 0x00 };
+    unsigned char response[258];
+    DWORD responseLg = sizeof(response);
+    REQUIRE( SCardRegisterSmartCard("dump card", "table", "dump_card.txt") == SCARD_S_SUCCESS );
+    REQUIRE( SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext) == SCARD_S_SUCCESS );
+    REQUIRE( SCardAttachReader(hContext, "Non Pinpad Reader") == SCARD_S_SUCCESS );
+    REQUIRE( SCardInsertSmartCardInReader(hContext, "Non Pinpad Reader 0", "dump card") == SCARD_S_SUCCESS );
+    REQUIRE( SCardConnect(hContext, "Non Pinpad Reader 0", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard,
+                          &dwActiveProtocol) == SCARD_S_SUCCESS );
+    REQUIRE( SCardTransmit(hCard, NULL, command, sizeof(command), NULL, response, &responseLg) == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardDumpMetrics("dump.prom") == SCARD_S_SUCCESS );
+    std::ifstream file("dump.prom");
+    std::stringstream text;
+    text << file.rdbuf();
+    REQUIRE( text.str().find("winscard_stub_calls_total{function=\"SCardTransmit\"}") != std::string::npos );
+    REQUIRE( text.str().find("winscard_stub_reader_responses_total{reader=\"Non Pinpad Reader 0\",sw1=\"6D\"}")
+             != std::string::npos );
+
+    REQUIRE( SCardStartMetricsDumpOnSignal("dump.prom") == SCARD_S_SUCCESS );
+    REQUIRE( SCardStartMetricsDumpOnSignal("dump.prom") == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardStopMetricsDumpOnSignal() == SCARD_S_SUCCESS );
+
+    REQUIRE( SCardDisconnect(hCard, SCARD_LEAVE_CARD) == SCARD_S_SUCCESS );
+    REQUIRE( SCardReleaseContext(hContext) == SCARD_S_SUCCESS );
+  }
+
+  SECTION("Fail with invalid parameter") {
+    REQUIRE( SCardDumpMetrics(NULL) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardDumpMetrics("") == SCARD_E_INVALID_VALUE );
+    REQUIRE( SCardDumpMetrics("no_such_directory/dump.prom") == SCARD_E_NO_ACCESS );
+    REQUIRE( SCardStartMetricsDumpOnSignal(NULL) == SCARD_E_INVALID_PARAMETER );
+    REQUIRE( SCardStopMetricsDumpOnSignal() == SCARD_S_SUCCESS );
+  }
+}
@@ -0,0 +1,112 @@
+/**
+ * Build step which compiles the card tables of the profiles directory into a header with constexpr tables.
+ *
+ * Usage: card_profile_compiler <output header> <profile.card>...
+ * The name of a profile is the file name without the extension.
+ */
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "response_table.h"
+
+using namespace std;
+
+struct Profile {
+  string name;
+  string identifier;
+  shared_ptr<CardTable> table;
+};
+
+static string profileName(const string &path) {
+  size_t slash = path.find_last_of("/\\");
+  string name = (slash == string::npos) ? path : path.substr(slash + 1);
+  size_t dot = name.find_last_of('.');
+  return (dot == string::npos) ? name : name.substr(0, dot);
+}
+
+static string identifierOf(const string &name) {
+  string identifier = "profile_";
+  for (char c : name) {
+    identifier += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  return identifier;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    cerr << "usage: " << argv[0] << " <output header> <profile.card>..." << endl;
+    return 1;
+  }
+
+  vector<Profile> profiles;
+  for (int i = 2; i < argc; i++) {
+    try {
+      string name = profileName(argv[i]);
+      profiles.push_back(Profile{name, identifierOf(name), CardTable::loadFile(argv[i])});
+    }
+    catch (exception &e) {
+      cerr << argv[i] << ": " << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // The lookup in the library is a binary search with strcmp
+  sort(profiles.begin(), profiles.end(), [](const Profile &a, const Profile &b) {
+    return strcmp(a.name.c_str(), b.name.c_str()) < 0;
+  });
+  for (size_t i = 1; i < profiles.size(); i++) {
+    for (size_t j = 0; j < i; j++) {
+      if (profiles[j].identifier == profiles[i].identifier) {
+        cerr << "profiles '" << profiles[j].name << "' and '" << profiles[i].name << "' have the same identifier" << endl;
+        return 1;
+      }
+    }
+  }
+
+  ofstream out(argv[1]);
+  out << "// Generated by card_profile_compiler, do not edit\n"
+      << "#ifndef CARD_PROFILES_H\n"
+      << "#define CARD_PROFILES_H\n\n"
+      << "#include \"card_profile.h\"\n\n";
+
+  for (auto &profile : profiles) {
+    out << "// " << profile.name << "\n";
+    out << "static constexpr unsigned char " << profile.identifier << "_atr[] = {";
+    for (auto byte : profile.table->atr) {
+      out << " 0x" << hex << static_cast<unsigned int>(byte) << dec << ",";
+    }
+    out << " };\n";
+    profile.table->responses.generate(out, profile.identifier + "_responses");
+    if (!profile.table->costs.empty()) {
+      out << "static constexpr InstructionCostEntry " << profile.identifier << "_costs[] = {\n";
+      for (auto &entry : profile.table->costs) {
+        out << "  { 0x" << hex << entry.ins << dec << ", { " << entry.cost.fixedMicroseconds << ", "
+            << entry.cost.perByteNanoseconds << ", " << entry.cost.jitterMicroseconds << " } },\n";
+      }
+      out << "};\n";
+    }
+    out << "\n";
+  }
+
+  out << "static constexpr CardProfile g_builtin_profiles[] = {\n";
+  for (auto &profile : profiles) {
+    out << "  { \"" << profile.name << "\", " << profile.identifier << "_atr, sizeof(" << profile.identifier << "_atr), "
+        << profile.table->protocols << ", " << profile.identifier << "_responses, ";
+    if (profile.table->costs.empty()) {
+      out << "nullptr, 0 },\n";
+    }
+    else {
+      out << profile.identifier << "_costs, sizeof(" << profile.identifier << "_costs) / sizeof(InstructionCostEntry) },\n";
+    }
+  }
+  out << "};\n\n"
+      << "static_assert(cardProfilesSorted(g_builtin_profiles), \"the built-in card profiles must be sorted on name\");\n\n"
+      << "#endif //CARD_PROFILES_H\n";
+
+  if (!out) {
+    cerr << "can't write '" << argv[1] << "'" << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * Print the metrics page published by SCardStartMetricsPage in another process, once or every period.
+ *
+ * Usage: metrics_reader <shared memory name> [period in milliseconds]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include "metrics_page.h"
+
+using namespace std;
+
+static void printSnapshot(const MetricsSnapshot &snapshot) {
+  printf("# pid %llu, publication %llu at %llu.%09llu\n", static_cast<unsigned long long>(snapshot.pid),
+         static_cast<unsigned long long>(snapshot.publications),
+         static_cast<unsigned long long>(snapshot.timestamp / 1000000000ULL),
+         static_cast<unsigned long long>(snapshot.timestamp % 1000000000ULL));
+  printf("contexts %lld handles %lld cards %lld events %llu faults %llu\n",
+         static_cast<long long>(snapshot.contexts), static_cast<long long>(snapshot.handles),
+         static_cast<long long>(snapshot.cards), static_cast<unsigned long long>(snapshot.events),
+         static_cast<unsigned long long>(snapshot.faults));
+  for (size_t i = 0; i < CallStats::FUNCTIONS; i++) {
+    if (snapshot.calls[i] == 0) {
+      continue;
+    }
+    printf("%-22s %12llu calls %10llu errors %12.3fus mean\n", traceFunctionName(static_cast<uint16_t>(i + 1)),
+           static_cast<unsigned long long>(snapshot.calls[i]), static_cast<unsigned long long>(snapshot.errors[i]),
+           snapshot.totalNanoseconds[i] / 1e3 / snapshot.calls[i]);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  if ((argc != 2) && (argc != 3)) {
+    cerr << "usage: " << argv[0] << " <shared memory name> [period in milliseconds]" << endl;
+    return 1;
+  }
+  long period = (argc == 3) ? strtol(argv[2], nullptr, 10) : 0;
+  if (period < 0) {
+    cerr << argv[2] << ": invalid period" << endl;
+    return 1;
+  }
+  try {
+    MetricsPageReader page(argv[1]);
+    do {
+      MetricsSnapshot snapshot;
+      if (!page.read(&snapshot)) {
+        cerr << argv[1] << ": not a metrics page, or no consistent publication" << endl;
+        return 1;
+      }
+      printSnapshot(snapshot);
+      if (period > 0) {
+        this_thread::sleep_for(chrono::milliseconds(period));
+      }
+    } while (period > 0);
+  }
+  catch (runtime_error &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Compile traces recorded by SCardStartTrace into a response database of the replay cards (DATABASE of a "replay"
+ * card definition).
+ *
+ * Usage: response_db_builder [--channel] [--aid] <output database> <trace>...
+ * --channel adds the logical channel to the key of the commands, --aid the AID selected on the channel.
+ */
+#include <cstring>
+#include <iostream>
+#include "response_database.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  uint32_t flags = 0;
+  int first = 1;
+  for (; (first < argc) && (strncmp(argv[first], "--", 2) == 0); first++) {
+    if (strcmp(argv[first], "--channel") == 0) {
+      flags |= RESPONSE_DB_KEY_CHANNEL;
+    }
+    else if (strcmp(argv[first], "--aid") == 0) {
+      flags |= RESPONSE_DB_KEY_AID;
+    }
+    else {
+      cerr << argv[0] << ": unknown option " << argv[first] << endl;
+      return 1;
+    }
+  }
+  if (argc - first < 2) {
+    cerr << "usage: " << argv[0] << " [--channel] [--aid] <output database> <trace>..." << endl;
+    return 1;
+  }
+
+  ResponseDatabaseBuilder builder(flags);
+  for (int i = first + 1; i < argc; i++) {
+    try {
+      builder.addTrace(argv[i]);
+    }
+    catch (exception &e) {
+      cerr << argv[i] << ": " << e.what() << endl;
+      return 1;
+    }
+  }
+  try {
+    builder.write(argv[first]);
+  }
+  catch (exception &e) {
+    cerr << argv[first] << ": " << e.what() << endl;
+    return 1;
+  }
+  cout << argv[first] << ": " << builder.size() << " commands" << endl;
+  return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Print the binary trace of the PC/SC calls recorded by SCardStartTrace, one line per call.
+ *
+ * Usage: trace_decoder <trace file>
+ */
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include "apdu_trace.h"
+
+using namespace std;
+
+static void printHex(const unsigned char *data, size_t data_lg) {
+  for (size_t i = 0; i < data_lg; i++) {
+    printf("%02X", data[i]);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " <trace file>" << endl;
+    return 1;
+  }
+  ifstream in(argv[1], ios::binary);
+  if (!in) {
+    cerr << argv[1] << ": can't open the file" << endl;
+    return 1;
+  }
+  vector<unsigned char> trace((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  size_t offset = 0;
+  while (offset < trace.size()) {
+    uint64_t start;
+    TraceRecord record;
+    size_t record_lg;
+    if (ApduTrace::decodeHeader(trace.data() + offset, trace.size() - offset, &start)) {
+      printf("# session started at %llu.%09llu\n", static_cast<unsigned long long>(start / 1000000000ULL),
+             static_cast<unsigned long long>(start % 1000000000ULL));
+      offset += ApduTrace::HEADER_SIZE;
+      continue;
+    }
+    if (!ApduTrace::decodeRecord(trace.data() + offset, trace.size() - offset, &record, &record_lg)) {
+      cerr << argv[1] << ": truncated or corrupted record at offset " << offset << endl;
+      return 1;
+    }
+    printf("%12.6f %3u %-22s %08llX %08X %8.3fus", record.timestamp / 1e9, record.thread,
+           traceFunctionName(record.function), static_cast<unsigned long long>(record.handle), record.result,
+           record.duration / 1e3);
+    if (record.function == static_cast<uint16_t>(TraceFunction::Connect)) {
+      printf(" \"%.*s\"", static_cast<int>(record.inputLg), reinterpret_cast<const char *>(record.input));
+    }
+    else if (record.inputLg + record.outputLg > 0) {
+      printf(" > ");
+      printHex(record.input, record.inputLg);
+      printf(" < ");
+      printHex(record.output, record.outputLg);
+    }
+    printf("\n");
+    offset += record_lg;
+  }
+  return 0;
+}